@@ -6,8 +6,15 @@
 #include <nlohmann/json.hpp>
 #endif
 
+#include <concepts>
+#include <functional>
 #include <map>
+#include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 /// @file
@@ -15,6 +22,124 @@
 /// endpoints.
 
 namespace mtx {
+namespace common {
+/// @brief An optional value, that is stored out of line.
+///
+/// Behaves like a `std::optional<T>`, but only takes up the space of a pointer when empty. Used for
+/// large members, that are only rarely set, to keep the event variants small.
+template<class T>
+class BoxedOptional
+{
+public:
+    BoxedOptional() noexcept = default;
+    BoxedOptional(std::nullopt_t) noexcept {}
+    BoxedOptional(const T &value)
+      : ptr(std::make_unique<T>(value))
+    {}
+    BoxedOptional(T &&value)
+      : ptr(std::make_unique<T>(std::move(value)))
+    {}
+    BoxedOptional(const std::optional<T> &value)
+      : ptr(value ? std::make_unique<T>(*value) : nullptr)
+    {}
+    BoxedOptional(const BoxedOptional &other)
+      : ptr(other.ptr ? std::make_unique<T>(*other.ptr) : nullptr)
+    {}
+    BoxedOptional(BoxedOptional &&) noexcept = default;
+
+    BoxedOptional &operator=(const BoxedOptional &other)
+    {
+        if (this != &other)
+            ptr = other.ptr ? std::make_unique<T>(*other.ptr) : nullptr;
+        return *this;
+    }
+    BoxedOptional &operator=(BoxedOptional &&) noexcept = default;
+    BoxedOptional &operator=(std::nullopt_t) noexcept
+    {
+        ptr.reset();
+        return *this;
+    }
+
+    [[nodiscard]] bool has_value() const noexcept { return ptr != nullptr; }
+    explicit operator bool() const noexcept { return ptr != nullptr; }
+
+    T &value()
+    {
+        if (!ptr)
+            throw std::bad_optional_access();
+        return *ptr;
+    }
+    const T &value() const
+    {
+        if (!ptr)
+            throw std::bad_optional_access();
+        return *ptr;
+    }
+    template<class U>
+    T value_or(U &&default_value) const
+    {
+        return ptr ? *ptr : static_cast<T>(std::forward<U>(default_value));
+    }
+
+    T &operator*() noexcept { return *ptr; }
+    const T &operator*() const noexcept { return *ptr; }
+    T *operator->() noexcept { return ptr.get(); }
+    const T *operator->() const noexcept { return ptr.get(); }
+
+    template<class... Args>
+    T &emplace(Args &&...args)
+    {
+        ptr = std::make_unique<T>(std::forward<Args>(args)...);
+        return *ptr;
+    }
+    void reset() noexcept { ptr.reset(); }
+
+    operator std::optional<T>() const { return ptr ? std::optional<T>(*ptr) : std::nullopt; }
+
+    bool operator==(std::nullopt_t) const noexcept { return ptr == nullptr; }
+    //! Compares the values like `std::optional`. Two empty values are equal.
+    bool operator==(const BoxedOptional &other) const
+      requires std::equality_comparable<T>
+    {
+        return ptr && other.ptr ? *ptr == *other.ptr : ptr == other.ptr;
+    }
+    bool operator==(const T &other) const
+      requires std::equality_comparable<T>
+    {
+        return ptr && *ptr == other;
+    }
+
+private:
+    std::unique_ptr<T> ptr;
+};
+
+//! Hash for string keys, that allows lookups by `std::string_view` and `const char *`.
+struct StringHash
+{
+    using is_transparent = void;
+
+    std::size_t operator()(std::string_view str) const noexcept
+    {
+        return std::hash<std::string_view>{}(str);
+    }
+};
+
+/// @brief The map type used for large maps keyed by room ids, user ids or event types.
+///
+/// By default this is a `std::map`, so iteration is sorted and the types stay compatible with
+/// older versions. Building with `MTXCLIENT_HASHED_MAPS` (the `hashed_maps` build option) switches
+/// it to a hash map with heterogeneous lookup, which parses and looks up faster for accounts with
+/// thousands of rooms or rooms with large power level maps, but iterates in an unspecified order.
+/// The `Compare` argument is only used for the `std::map` variant.
+#ifdef MTXCLIENT_HASHED_MAPS
+template<class V, class Compare = std::less<std::string>>
+using StringMap = std::unordered_map<std::string, V, StringHash, std::equal_to<>>;
+#else
+template<class V, class Compare = std::less<std::string>>
+using StringMap = std::map<std::string, V, Compare>;
+#endif
+} // namespace common
+
 namespace crypto {
 
 using AlgorithmDevice = std::string;
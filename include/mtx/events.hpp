@@ -66,7 +66,7 @@ struct UnsignedData
     //! The event ID that redacted this event.
     std::string redacted_by;
     //! The event that redacted this event.
-    std::optional<Event<mtx::events::msg::Redaction>> redacted_because;
+    mtx::common::BoxedOptional<Event<mtx::events::msg::Redaction>> redacted_because;
 
     friend void from_json(const nlohmann::json &obj, UnsignedData &data);
     friend void to_json(nlohmann::json &obj, const UnsignedData &event);
@@ -227,6 +227,14 @@ struct TimelineEvents
     friend void to_json(nlohmann::json &obj, const TimelineEvents &e);
 };
 
+// Every element of a timeline is as large as the largest alternative, so keep an eye on the size
+// budget. Store large and rarely used members out of line (see common::BoxedOptional) instead of
+// raising it. On 64 bit targets the variant is 632 bytes with libstdc++ and smaller with libc++;
+// the budget leaves some room for standard libraries with larger strings. Without the boxing, the
+// media messages alone would exceed it by far.
+static_assert(sizeof(void *) != 8 || sizeof(TimelineEvents) <= 768,
+              "TimelineEvents exceeds its size budget of 768 bytes");
+
 struct EphemeralEvents
   : public std::variant<mtx::events::EphemeralEvent<mtx::events::ephemeral::Typing>,
                         mtx::events::EphemeralEvent<mtx::events::ephemeral::Receipt>,
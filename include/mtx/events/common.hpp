@@ -55,7 +55,7 @@ struct ImageInfo
     //! The mimetype of the image, `e.g. image/jpeg`.
     std::string mimetype;
     //! Encryption members. If present, they replace thumbnail_url.
-    std::optional<crypto::EncryptedFile> thumbnail_file;
+    BoxedOptional<crypto::EncryptedFile> thumbnail_file;
     //! experimental blurhash, see MSC2448
     std::string blurhash;
 
@@ -78,7 +78,7 @@ struct FileInfo
     //! The mimetype of the file e.g `application/pdf`.
     std::string mimetype;
     //! Encryption members. If present, they replace thumbnail_url.
-    std::optional<crypto::EncryptedFile> thumbnail_file;
+    BoxedOptional<crypto::EncryptedFile> thumbnail_file;
 
     //! Deserialization method needed by @p nlohmann::json.
     friend void from_json(const nlohmann::json &obj, FileInfo &info);
@@ -122,7 +122,7 @@ struct VideoInfo
     //! Metadata about the image referred to in @p thumbnail_url.
     ThumbnailInfo thumbnail_info;
     //! Encryption members. If present, they replace thumbnail_url.
-    std::optional<crypto::EncryptedFile> thumbnail_file;
+    BoxedOptional<crypto::EncryptedFile> thumbnail_file;
     //! experimental blurhash, see MSC2448
     std::string blurhash;
 
@@ -141,7 +141,7 @@ struct LocationInfo
     //! Metadata about the image referred to in @p thumbnail_url.
     ThumbnailInfo thumbnail_info;
     //! Encryption members. If present, they replace thumbnail_url.
-    std::optional<crypto::EncryptedFile> thumbnail_file;
+    BoxedOptional<crypto::EncryptedFile> thumbnail_file;
 
     //! Deserialization method needed by @p nlohmann::json.
     friend void from_json(const nlohmann::json &obj, LocationInfo &info);
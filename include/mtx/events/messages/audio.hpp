@@ -32,7 +32,7 @@ struct Audio
     //! Metadata for the audio clip referred to in url.
     mtx::common::AudioInfo info;
     //! Encryption members. If present, they replace url.
-    std::optional<crypto::EncryptedFile> file;
+    mtx::common::BoxedOptional<crypto::EncryptedFile> file;
     //! Relates to for rich replies
     mtx::common::Relations relations;
 
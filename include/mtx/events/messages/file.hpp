@@ -37,7 +37,7 @@ struct File
     //! Information about the file referred to in the url.
     mtx::common::FileInfo info;
     //! Encryption members. If present, they replace url.
-    std::optional<crypto::EncryptedFile> file;
+    mtx::common::BoxedOptional<crypto::EncryptedFile> file;
     //! Relates to for rich replies
     mtx::common::Relations relations;
 
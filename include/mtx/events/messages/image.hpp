@@ -33,7 +33,7 @@ struct Image
     //! Metadata about the image referred to in `url`.
     mtx::common::ImageInfo info;
     //! Encryption members. If present, they replace url.
-    std::optional<crypto::EncryptedFile> file;
+    mtx::common::BoxedOptional<crypto::EncryptedFile> file;
     //! Relates to for rich replies
     mtx::common::Relations relations;
 
@@ -56,7 +56,7 @@ struct StickerImage
     //! Metadata about the image referred to in `url`.
     mtx::common::ImageInfo info;
     //! Encryption members. If present, they replace url.
-    std::optional<crypto::EncryptedFile> file;
+    mtx::common::BoxedOptional<crypto::EncryptedFile> file;
     //! Relates to for rich replies
     mtx::common::Relations relations;
 
@@ -55,19 +55,19 @@ struct PowerLevels
     //! Returns the power_level for a given event type.
     [[nodiscard]] inline power_level_t event_level(const std::string &event_type) const
     {
-        if (events.find(event_type) == events.end())
-            return events_default;
+        if (auto it = events.find(event_type); it != events.end())
+            return it->second;
 
-        return events.at(event_type);
+        return events_default;
     }
 
     //! Returns the power_level for a given event type.
     [[nodiscard]] inline power_level_t state_level(const std::string &event_type) const
     {
-        if (events.find(event_type) == events.end())
-            return state_default;
+        if (auto it = events.find(event_type); it != events.end())
+            return it->second;
 
-        return events.at(event_type);
+        return state_default;
     }
 
     //! Returns the power_level for a given user id.
@@ -107,10 +107,10 @@ struct PowerLevels
     power_level_t state_default = Moderator;
     //! The level required to send specific event types.
     //! This is a mapping from event type to power level required.
-    std::map<std::string, power_level_t, std::less<>> events;
+    mtx::common::StringMap<power_level_t, std::less<>> events;
     //! The power levels for specific users.
     //! This is a mapping from user_id to power level for that user.
-    std::map<std::string, power_level_t, std::less<>> users;
+    mtx::common::StringMap<power_level_t, std::less<>> users;
     //! The power level requirements for specific notification types. This is a mapping from key
     //! to power level for that notifications key.
     std::map<std::string, power_level_t, std::less<>> notifications;
@@ -10,31 +10,91 @@
 #endif
 
 #include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <stdexcept>
+#include <string>
+#include <string_view>
 
 namespace mtx {
 namespace identifiers {
 
+//! Statistics about the identifier interning table.
+struct InternStats
+{
+    //! Number of unique identifiers in the table.
+    std::size_t entries = 0;
+    //! Number of parsed identifiers, that reused an existing entry.
+    std::size_t hits = 0;
+    //! Number of parsed identifiers, that were added to the table.
+    std::size_t misses = 0;
+};
+
+/// @brief Enable or disable interning of parsed identifiers.
+///
+/// When enabled, equal identifiers share their storage and compare by pointer. This is useful if
+/// you keep lots of user or room ids around, since the same few ids repeat a lot. Disabled by
+/// default. Identifiers parsed before enabling it are not affected.
+void
+set_interning_enabled(bool enabled);
+//! Returns if identifier interning is currently enabled.
+bool
+interning_enabled();
+//! Returns statistics about the interning table.
+InternStats
+intern_stats();
+//! Drop all entries from the interning table, that are not referenced by any identifier anymore.
+void
+purge_interned();
+
 //! Base class for all the identifiers.
 //
 //! Each identifier has the following format `(sigil)``(localpart)`:`(hostname)`.
+//!
+//! The whole identifier is stored in a single shared, immutable buffer. The localpart and hostname
+//! are views into that buffer, so copying an identifier never allocates.
 class ID
 {
 public:
     //! Returns the unique local part of the identifier.
-    [[nodiscard]] std::string localpart() const { return localpart_; }
+    [[nodiscard]] std::string localpart() const { return std::string(localpart_view()); }
     //! Returns the name of the originating homeserver.
-    [[nodiscard]] std::string hostname() const { return hostname_; }
+    [[nodiscard]] std::string hostname() const { return std::string(hostname_view()); }
+    //! Returns the unique local part of the identifier without copying it.
+    [[nodiscard]] std::string_view localpart_view() const noexcept
+    {
+        return separator_ ? view().substr(1, separator_ - 1) : std::string_view{};
+    }
+    //! Returns the name of the originating homeserver without copying it.
+    [[nodiscard]] std::string_view hostname_view() const noexcept
+    {
+        auto id = view();
+        return separator_ < id.size() ? id.substr(separator_ + 1) : std::string_view{};
+    }
     //! Returns the whole identifier (localpart + hostname).
-    [[nodiscard]] std::string to_string() const { return id_; }
+    [[nodiscard]] std::string to_string() const { return std::string(view()); }
+    //! Returns the whole identifier without copying it.
+    [[nodiscard]] std::string_view view() const noexcept
+    {
+        return id_ ? std::string_view(*id_) : std::string_view{};
+    }
 
 protected:
-    //! Local part of the identifier.
-    std::string localpart_;
-    //! The name of the originating homeserver.
-    std::string hostname_;
+    //! Store @p id, with the hostname separator at @p separator.
+    void assign(std::string_view id, std::size_t separator);
+
+    //! Compare the identifiers. Identifiers sharing the same storage compare by pointer.
+    [[nodiscard]] bool equals(const ID &other) const noexcept
+    {
+        return id_ == other.id_ || view() == other.view();
+    }
+
+private:
     //! The whole identifier.
-    std::string id_;
+    std::shared_ptr<const std::string> id_;
+    //! Offset of the ':' between localpart and hostname or the size of the id, if there is none.
+    std::uint32_t separator_ = 0;
 };
 
 //! An event id.
@@ -72,8 +132,11 @@ class User : public ID
 public:
     template<typename Identifier>
     friend Identifier parse(const std::string &id);
-    auto operator<=>(User const &other) const noexcept { return id_.compare(other.id_) <=> 0; };
-    bool operator==(User const &other) const noexcept { return id_ == other.id_; };
+    auto operator<=>(User const &other) const noexcept
+    {
+        return view().compare(other.view()) <=> 0;
+    };
+    bool operator==(User const &other) const noexcept { return equals(other); };
 
 private:
     static constexpr std::string_view sigil = "@";
@@ -97,7 +160,7 @@ parse(const std::string &id)
         return {};
     }
 
-    if (std::string(1, id.at(0)) != Identifier::sigil)
+    if (id.front() != Identifier::sigil.front())
         throw std::invalid_argument(id + ": missing sigil " + std::string(Identifier::sigil));
 
     const auto parts = id.find_first_of(':');
@@ -105,17 +168,13 @@ parse(const std::string &id)
     // Split into localpart and server.
     if (parts != std::string::npos) {
         Identifier identifier{};
-        identifier.localpart_ = id.substr(1, parts - 1);
-        identifier.hostname_  = id.substr(parts + 1);
-        identifier.id_        = id;
+        identifier.assign(id, parts);
         return identifier;
     } else if (Identifier::sigil == "$" || Identifier::sigil == "!") {
         // V3 event ids don't use ':' at all, don't parse them the same way.
         // V12 rooms don't use a server host in the id.
         Identifier identifier{};
-        identifier.localpart_ = id.substr(1);
-        identifier.hostname_  = "";
-        identifier.id_        = id;
+        identifier.assign(id, id.size());
         return identifier;
     } else {
         throw std::invalid_argument(id + ": invalid id");
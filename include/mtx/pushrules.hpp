@@ -10,11 +10,14 @@
 #endif
 
 #include <compare>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <variant>
 #include <vector>
 
 #include "mtx/events/common.hpp"
+#include "mtx/events/ephemeral/receipt.hpp"
 #include "mtx/events/power_levels.hpp"
 
 namespace mtx {
@@ -225,5 +228,90 @@ private:
     struct OptimizedRules;
     std::unique_ptr<OptimizedRules> rules;
 };
+
+//! Returns true, if @p actions would notify the user.
+bool
+notifies(const std::vector<actions::Action> &actions);
+//! Returns true, if @p actions would highlight the event.
+bool
+highlights(const std::vector<actions::Action> &actions);
+
+/// @brief Maintains local unread notification and highlight counts per room.
+///
+/// The server can't evaluate content rules in encrypted rooms, so the counts in
+/// `UnreadNotifications` are often wrong there. Feed the timeline events (decrypted if possible)
+/// and the read receipts from each sync into this class and it will keep the counts up to date
+/// incrementally. Queries are O(1), updates are O(new events) amortized.
+///
+/// Receipts for events, that were never processed, can't be ordered against the unread events, so
+/// they don't change the counts. Call reset_room(), when the events of a room are incomplete, i.e.
+/// the timeline of a sync is limited.
+class NotificationCounter
+{
+public:
+    //! The unread counts of a room.
+    struct Counts
+    {
+        //! The number of unread events, that notify the user.
+        std::uint64_t notification_count = 0;
+        //! The number of unread events, that have the highlight flag set.
+        std::uint64_t highlight_count = 0;
+
+        bool operator==(const Counts &) const noexcept = default;
+    };
+
+    //! Construct a new counter for the user with the id @p user_id.
+    NotificationCounter(std::string user_id);
+    ~NotificationCounter();
+
+    /// @brief Evaluate the pushrules for @p event and count it, if it notifies.
+    ///
+    /// Encrypted events are skipped, pass the decrypted event instead. Events are expected in
+    /// timeline order. Events already seen are ignored, as are recently read events, that are
+    /// delivered again. Events sent by the user are treated as an implicit read receipt.
+    /// \returns the actions of the event.
+    std::vector<actions::Action> process_event(
+      const std::string &room_id,
+      const mtx::events::collections::TimelineEvents &event,
+      const PushRuleEvaluator &evaluator,
+      const PushRuleEvaluator::RoomContext &ctx,
+      const std::vector<std::pair<mtx::common::Relation, mtx::events::collections::TimelineEvents>>
+        &relatedEvents = {});
+
+    //! Count an event, for which the actions have already been evaluated.
+    void process_event(const std::string &room_id,
+                      const mtx::events::collections::TimelineEvents &event,
+                      const std::vector<actions::Action> &actions);
+
+    //! Apply the receipts of a room. Only the receipts of the user are taken into account.
+    void process_receipts(const std::string &room_id,
+                          const mtx::events::ephemeral::Receipt &receipts);
+
+    /// @brief Mark everything up to and including @p event_id as read.
+    ///
+    /// \returns false, if the event is unknown and the counts were not changed.
+    bool mark_read(const std::string &room_id, const std::string &event_id);
+
+    //! The current counts of a room.
+    [[nodiscard]] Counts counts(const std::string &room_id) const;
+    //! The sum of the counts of all rooms.
+    [[nodiscard]] Counts total() const { return total_; }
+
+    /// @brief Replace the counts of a room, i.e. with the counts of the server after a limited
+    /// sync.
+    ///
+    /// The unread events processed so far are forgotten. The given counts are cleared by the first
+    /// receipt for an event processed afterwards. Pass empty counts to mark the room as read.
+    void reset_room(const std::string &room_id, Counts counts);
+
+    //! Stop tracking a room, i.e. after leaving it.
+    void remove_room(const std::string &room_id);
+
+private:
+    struct RoomCounters;
+    std::string user_id_;
+    Counts total_;
+    std::unique_ptr<RoomCounters> rooms;
+};
 }
 }
@@ -3,8 +3,12 @@
 /// @file
 /// @brief Structs for for requests to the Matrix API.
 
+#include <map>
+#include <optional>
 #include <string>
+#include <utility>
 #include <variant>
+#include <vector>
 
 #include <mtx/common.hpp>
 #include <mtx/events/collections.hpp>
@@ -439,5 +443,199 @@ struct SetPusher
 
     friend void to_json(nlohmann::json &obj, const SetPusher &req);
 };
+
+//! Selects events by type and sender. Used for presence and global account data.
+struct EventFilter
+{
+    //! The maximum number of events to return.
+    std::optional<uint64_t> limit;
+    //! Event types to include. `*` is a wildcard. Unset includes all types, empty includes none.
+    std::optional<std::vector<std::string>> types;
+    //! Event types to exclude. Takes precedence over types.
+    std::vector<std::string> not_types;
+    //! Senders to include. Unset includes all senders, empty includes none.
+    std::optional<std::vector<std::string>> senders;
+    //! Senders to exclude. Takes precedence over senders.
+    std::vector<std::string> not_senders;
+
+    friend void to_json(nlohmann::json &obj, const EventFilter &filter);
+};
+
+//! Selects events in rooms. Used for the timeline, state, ephemeral events and room account data.
+struct RoomEventFilter
+{
+    //! The maximum number of events to return. For the timeline this is the biggest lever on the
+    //! size of an initial sync.
+    std::optional<uint64_t> limit;
+    //! Event types to include. `*` is a wildcard. Unset includes all types, empty includes none.
+    std::optional<std::vector<std::string>> types;
+    //! Event types to exclude. Takes precedence over types.
+    std::vector<std::string> not_types;
+    //! Senders to include. Unset includes all senders, empty includes none.
+    std::optional<std::vector<std::string>> senders;
+    //! Senders to exclude. Takes precedence over senders.
+    std::vector<std::string> not_senders;
+    //! Rooms to include. Unset includes all rooms, empty includes none.
+    std::optional<std::vector<std::string>> rooms;
+    //! Rooms to exclude. Takes precedence over rooms.
+    std::vector<std::string> not_rooms;
+    //! Only events with or without a url in their content.
+    std::optional<bool> contains_url;
+    //! Only send the membership events of the senders of the returned events, instead of every
+    //! member of the room.
+    bool lazy_load_members = false;
+    //! With lazy loading, send membership events the client should already know again.
+    bool include_redundant_members = false;
+    //! Count unread notifications per thread in addition to the room.
+    bool unread_thread_notifications = false;
+
+    friend void to_json(nlohmann::json &obj, const RoomEventFilter &filter);
+};
+
+//! Selects the rooms and the room data returned by /sync.
+struct RoomFilter
+{
+    //! Rooms to include. Unset includes all rooms, empty includes none.
+    std::optional<std::vector<std::string>> rooms;
+    //! Rooms to exclude. Takes precedence over rooms.
+    std::vector<std::string> not_rooms;
+    //! Include the rooms the user has left.
+    bool include_leave = false;
+    //! The events in the timeline of each room.
+    std::optional<RoomEventFilter> timeline;
+    //! The state events of each room.
+    std::optional<RoomEventFilter> state;
+    //! Typing notifications and receipts.
+    std::optional<RoomEventFilter> ephemeral;
+    //! The account data of each room.
+    std::optional<RoomEventFilter> account_data;
+
+    friend void to_json(nlohmann::json &obj, const RoomFilter &filter);
+};
+
+//! Request payload for the `POST /_matrix/client/v3/user/{userId}/filter` endpoint.
+struct Filter
+{
+    //! Only return these fields of events, i.e. "content.body". Empty returns all fields.
+    std::vector<std::string> event_fields;
+    //! Either "client" or "federation". Empty for the default of the server.
+    std::string event_format;
+    //! The presence updates to include.
+    std::optional<EventFilter> presence;
+    //! The global account data to include.
+    std::optional<EventFilter> account_data;
+    //! The rooms and room data to include.
+    std::optional<RoomFilter> room;
+
+    friend void to_json(nlohmann::json &obj, const Filter &filter);
+};
+
+//! Parts of a sliding sync request.
+namespace sliding_sync {
+//! The state events to return per room as pairs of event type and state key. `*` matches any type
+//! or state key and `$LAZY` as the state key of `m.room.member` selects the senders of the
+//! returned timeline events.
+using RequiredState = std::vector<std::pair<std::string, std::string>>;
+
+//! Restricts the rooms of a list. Unset filters match every room.
+struct ListFilters
+{
+    //! Only direct chats or only other rooms.
+    std::optional<bool> is_dm;
+    //! Only encrypted or only unencrypted rooms.
+    std::optional<bool> is_encrypted;
+    //! Only invites or only rooms, that are not invites.
+    std::optional<bool> is_invite;
+    //! Only rooms of these types. Use an empty string for rooms without a type.
+    std::vector<std::string> room_types;
+    //! Exclude rooms of these types.
+    std::vector<std::string> not_room_types;
+
+    friend void to_json(nlohmann::json &obj, const ListFilters &filters);
+};
+
+//! A window into the rooms of the user, sorted by recent activity.
+struct List
+{
+    //! The inclusive ranges of room indices to return, i.e. {{0, 19}} for the 20 most recently
+    //! active rooms.
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    //! The state events to return for each room.
+    RequiredState required_state;
+    //! The maximum number of timeline events to return for each room.
+    uint64_t timeline_limit = 1;
+    //! Restricts the rooms of this list.
+    std::optional<ListFilters> filters;
+
+    friend void to_json(nlohmann::json &obj, const List &list);
+};
+
+//! Subscribe to specific rooms independent of their position in any list, i.e. the open room.
+struct RoomSubscription
+{
+    //! The state events to return for the room.
+    RequiredState required_state;
+    //! The maximum number of timeline events to return.
+    uint64_t timeline_limit = 1;
+
+    friend void to_json(nlohmann::json &obj, const RoomSubscription &subscription);
+};
+
+//! Receive send-to-device messages.
+struct ToDeviceExtension
+{
+    bool enabled = false;
+    //! The next_batch of the last to-device response. Messages before it are deleted.
+    std::string since;
+    //! The maximum number of messages to return.
+    std::optional<uint64_t> limit;
+
+    friend void to_json(nlohmann::json &obj, const ToDeviceExtension &ext);
+};
+
+//! An extension returning data per room, like receipts or typing notifications.
+struct RoomDataExtension
+{
+    bool enabled = false;
+    //! Only return data for rooms in these lists. Unset for all lists.
+    std::optional<std::vector<std::string>> lists;
+    //! Only return data for these room subscriptions. Unset for all subscriptions.
+    std::optional<std::vector<std::string>> rooms;
+
+    friend void to_json(nlohmann::json &obj, const RoomDataExtension &ext);
+};
+
+//! Data returned in addition to the rooms. Extensions, that are not enabled, are not sent.
+struct Extensions
+{
+    //! Send-to-device messages.
+    ToDeviceExtension to_device;
+    //! Device list changes and one time key counts.
+    bool e2ee = false;
+    //! Global and room account data.
+    RoomDataExtension account_data;
+    //! Read receipts.
+    RoomDataExtension receipts;
+    //! Typing notifications.
+    RoomDataExtension typing;
+
+    friend void to_json(nlohmann::json &obj, const Extensions &extensions);
+};
+} // namespace sliding_sync
+
+//! Request payload for the simplified sliding sync endpoint (MSC4186).
+struct SlidingSync
+{
+    //! Identifies the connection, if a client runs several sliding sync loops at once.
+    std::string conn_id;
+    //! The room lists by name. Lists can be added, changed or dropped between requests.
+    std::map<std::string, sliding_sync::List> lists;
+    //! Rooms to return regardless of the lists, by room id.
+    std::map<std::string, sliding_sync::RoomSubscription> room_subscriptions;
+    //! Additional data to return.
+    sliding_sync::Extensions extensions;
+
+    friend void to_json(nlohmann::json &obj, const SlidingSync &request);
+};
 } // namespace requests
 } // namespace mtx
@@ -18,6 +18,7 @@
 #include "responses/profile.hpp"
 #include "responses/public_rooms.hpp"
 #include "responses/register.hpp"
+#include "responses/sliding_sync.hpp"
 #include "responses/sync.hpp"
 #include "responses/turn_server.hpp"
 #include "responses/users.hpp"
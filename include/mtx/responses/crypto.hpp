@@ -27,7 +27,7 @@ struct UploadKeys
     friend void from_json(const nlohmann::json &obj, UploadKeys &response);
 };
 
-using DeviceToKeysMap = std::map<std::string, mtx::crypto::DeviceKeys>;
+using DeviceToKeysMap = mtx::common::StringMap<mtx::crypto::DeviceKeys>;
 
 //! Response from the `POST /_matrix/client/r0/keys/query` endpoint.
 struct QueryKeys
@@ -40,7 +40,7 @@ struct QueryKeys
     //! A map from user ID, to a map from device ID to device information.
     //! For each device, the information returned will be the same
     //! as uploaded via /keys/upload, with the addition of an unsigned property
-    std::map<std::string, DeviceToKeysMap> device_keys;
+    mtx::common::StringMap<DeviceToKeysMap> device_keys;
     //! A map from user ID, to information about master_keys.
     std::map<std::string, mtx::crypto::CrossSigningKeys> master_keys;
     //! A map from user ID, to information about user_signing_keys.
@@ -70,7 +70,7 @@ struct ClaimKeys
     std::map<std::string, std::string> failures;
     //! One-time keys for the queried devices. A map from user ID,
     //! to a map from <algorithm>:<key_id> to the key object.
-    std::map<std::string, std::map<std::string, nlohmann::json>> one_time_keys;
+    mtx::common::StringMap<mtx::common::StringMap<nlohmann::json>> one_time_keys;
 
     friend void from_json(const nlohmann::json &obj, ClaimKeys &response);
 };
@@ -0,0 +1,123 @@
+#pragma once
+
+/// @file
+/// @brief Response from the simplified sliding sync API (MSC4186).
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "mtx/common.hpp"
+#include "mtx/events/collections.hpp"
+#include "mtx/responses/sync.hpp"
+
+#if __has_include(<nlohmann/json_fwd.hpp>)
+#include <nlohmann/json_fwd.hpp>
+#else
+#include <nlohmann/json.hpp>
+#endif
+
+namespace mtx {
+namespace responses {
+//! Parts of a sliding sync response.
+namespace sliding_sync {
+//! A member used to name and draw rooms without a name or avatar.
+struct Hero
+{
+    std::string user_id;
+    std::string displayname;
+    std::string avatar_url;
+
+    friend void from_json(const nlohmann::json &obj, Hero &hero);
+};
+
+/// @brief Updates to a room in a list or room subscription.
+///
+/// Only the fields, that changed since the last response, are set, unless `initial` is true.
+struct Room
+{
+    //! The name of the room, if it has one.
+    std::string name;
+    //! The avatar of the room, if it has one.
+    std::string avatar;
+    //! Members to name the room after, if it has no name.
+    std::vector<Hero> heroes;
+    //! True, if this is the first time the room is sent on this connection.
+    bool initial = false;
+    //! True, if the room is a direct chat.
+    bool is_dm = false;
+    //! The state events requested with required_state.
+    std::vector<events::collections::StateEvents> required_state;
+    //! The latest events of the room, oldest first.
+    std::vector<events::collections::TimelineEvents> timeline;
+    //! A token to paginate backwards from the start of the timeline with /messages.
+    std::string prev_batch;
+    //! True, if there are more events before the timeline, than the timeline_limit allowed.
+    bool limited = false;
+    //! How many of the timeline events are new since the last response.
+    std::optional<uint64_t> num_live;
+    //! Increases with activity in the room. Used to sort the rooms.
+    std::optional<uint64_t> bump_stamp;
+    //! The number of joined members.
+    std::optional<uint64_t> joined_count;
+    //! The number of invited members.
+    std::optional<uint64_t> invited_count;
+    //! Counts of unread notifications for this room.
+    UnreadNotifications unread_notifications;
+    //! The stripped state of a room, that the user has been invited to. Sent as `stripped_state`.
+    std::vector<events::collections::StrippedEvents> invite_state;
+
+    friend void from_json(const nlohmann::json &obj, Room &room);
+};
+
+//! The state of a list.
+struct List
+{
+    //! The number of rooms matching the filters of the list.
+    uint64_t count = 0;
+
+    friend void from_json(const nlohmann::json &obj, List &list);
+};
+
+//! The data returned by the extensions, that were enabled in the request.
+struct Extensions
+{
+    //! The send-to-device messages for this device.
+    ToDevice to_device;
+    //! Pass as `since` to the to_device extension of the next request.
+    std::string to_device_next_batch;
+    //! Information on end-to-end device updates.
+    DeviceLists device_lists;
+    //! A mapping from algorithm to the number of one time keys the server has for this device.
+    std::map<std::string, uint16_t> device_one_time_keys_count;
+    //! The unused fallback key algorithms. Unset, if the server didn't send them.
+    std::optional<std::vector<std::string>> device_unused_fallback_key_types;
+    //! Global account data.
+    AccountData account_data;
+    //! Account data per room.
+    mtx::common::StringMap<AccountData> room_account_data;
+    //! Receipts and typing notifications per room.
+    mtx::common::StringMap<Ephemeral> ephemeral;
+
+    friend void from_json(const nlohmann::json &obj, Extensions &extensions);
+};
+} // namespace sliding_sync
+
+//! Response from the simplified sliding sync endpoint (MSC4186).
+struct SlidingSync
+{
+    //! The position to pass to the next request.
+    std::string pos;
+    //! The state of each list in the request.
+    std::map<std::string, sliding_sync::List> lists;
+    //! The rooms in the requested ranges and room subscriptions, that changed.
+    mtx::common::StringMap<sliding_sync::Room> rooms;
+    //! The data of the enabled extensions.
+    sliding_sync::Extensions extensions;
+
+    friend void from_json(const nlohmann::json &obj, SlidingSync &response);
+};
+}
+}
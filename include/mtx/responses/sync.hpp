@@ -140,14 +140,14 @@ struct KnockedRoom
 struct Rooms
 {
     //! The rooms that the user has joined.
-    std::map<std::string, JoinedRoom> join;
+    mtx::common::StringMap<JoinedRoom> join;
     //! The rooms that the user has left or been banned from.
-    std::map<std::string, LeftRoom> leave;
+    mtx::common::StringMap<LeftRoom> leave;
     //! The rooms that the user has been invited to.
-    std::map<std::string, InvitedRoom> invite;
+    mtx::common::StringMap<InvitedRoom> invite;
 
     //! The rooms that the user has knocked on.
-    std::map<std::string, KnockedRoom> knock;
+    mtx::common::StringMap<KnockedRoom> knock;
 
     friend void from_json(const nlohmann::json &obj, Rooms &rooms);
 };
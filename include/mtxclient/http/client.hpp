@@ -17,11 +17,15 @@
 #include "mtx/responses/empty.hpp" // for Empty, Logout, RoomInvite
 #include "mtx/secret_storage.hpp"
 #include "mtxclient/http/errors.hpp" // for ClientError
+#include "mtxclient/http/executor.hpp"
+#include "mtxclient/http/scheduler.hpp"
 #include "mtxclient/utils.hpp"       // for random_token, url_encode, des...
 // #include "mtx/common.hpp"
 
+#include <chrono>     // for milliseconds
 #include <cstdint>    // for uint16_t, uint64_t
 #include <functional> // for function
+#include <map>        // for map
 #include <memory>     // for allocator, shared_ptr, enable...
 #include <optional>   // for optional
 #include <string>     // for string, operator+, char_traits
@@ -40,6 +44,7 @@ namespace requests {
 struct ClaimKeys;
 struct CreateRoom;
 struct DeviceSigningUpload;
+struct Filter;
 struct IdentitySubmitToken;
 struct KeySignaturesUpload;
 struct Login;
@@ -51,6 +56,7 @@ struct RequestEmailToken;
 struct RequestMSISDNToken;
 struct SetPusher;
 struct SetPushers;
+struct SlidingSync;
 struct UploadKeys;
 }
 namespace responses {
@@ -82,6 +88,7 @@ struct Register;
 struct RegistrationTokenValidity;
 struct RequestToken;
 struct RoomId;
+struct SlidingSync;
 struct Success;
 struct Sync;
 struct StateEvents;
@@ -158,6 +165,176 @@ private:
     friend class Client;
 };
 
+/// @brief Connection settings of a Client.
+///
+/// HTTP/2 multiplexing, TCP keepalive and TCP_NODELAY are managed by coeurl and use the libcurl
+/// defaults, which multiplex requests over one HTTP/2 connection where the server supports it and
+/// disable Nagle's algorithm. They can't be changed through this struct.
+struct ConnectionOptions
+{
+    //! Verify the TLS certificate of the server.
+    bool verify_peer = true;
+    //! Seconds to wait for a connection to be established.
+    long connect_timeout = 60;
+    //! How many requests can be in flight at once. Further requests wait in a queue, until one
+    //! completes. Over HTTP/1.1 this bounds the number of connections to the homeserver. 0 means
+    //! unlimited.
+    std::size_t max_concurrent_requests = 0;
+    //! A path to cache alternate service lookups like the http/3 ports of a server. Empty to keep
+    //! the current setting.
+    std::string alt_svc_cache_path;
+    //! Ask the server to compress responses with gzip. They are decompressed before they are
+    //! parsed, which costs some CPU time, but JSON like sync responses often shrinks 10 fold.
+    bool compress_responses = false;
+    //! The maximum size of a compressed response after decompression. Larger responses fail with
+    //! CURLE_FILESIZE_EXCEEDED, so a small malicious response can't exhaust the memory.
+    std::size_t max_decompressed_size = 256 * 1024 * 1024;
+};
+
+//! Response sizes received for one class of endpoints, see endpoint_class().
+struct TransferCounters
+{
+    //! Responses received.
+    std::uint64_t responses = 0;
+    //! Responses, that were compressed by the server.
+    std::uint64_t compressed_responses = 0;
+    //! Bytes of the response bodies as received.
+    std::uint64_t wire_bytes = 0;
+    //! Bytes of the response bodies after decompression.
+    std::uint64_t decoded_bytes = 0;
+};
+
+//! Configuration of the response cache of a Client.
+struct ResponseCacheOpts
+{
+    //! How long successful GET responses are kept per endpoint class, see endpoint_class(). Only
+    //! GET requests to these classes are cached and coalesced.
+    std::map<std::string, std::chrono::milliseconds> ttl = {
+      {"versions", std::chrono::minutes(5)},
+      {"capabilities", std::chrono::minutes(5)},
+      {"profile", std::chrono::minutes(1)},
+      {"profile/displayname", std::chrono::minutes(1)},
+      {"profile/avatar_url", std::chrono::minutes(1)},
+      {"rooms/state", std::chrono::seconds(10)},
+      {"devices", std::chrono::seconds(30)},
+    };
+    //! How many responses are kept at most. The least recently stored ones are evicted first.
+    std::size_t max_entries = 1'000;
+};
+
+//! Statistics of the response cache.
+struct ResponseCacheStats
+{
+    //! Requests answered from the cache.
+    std::uint64_t hits = 0;
+    //! Requests, that were sent to the server.
+    std::uint64_t misses = 0;
+    //! Requests, that joined an identical request already in flight.
+    std::uint64_t coalesced = 0;
+    //! Expired responses, that the server confirmed as unchanged with a 304.
+    std::uint64_t revalidated = 0;
+    //! Responses dropped to stay within the size limit.
+    std::uint64_t evictions = 0;
+    //! Responses currently cached.
+    std::size_t entries = 0;
+
+    //! Returns the share of requests, that didn't need their own round trip.
+    [[nodiscard]] double hit_rate() const
+    {
+        auto total = hits + coalesced + misses;
+        return total ? static_cast<double>(hits + coalesced) / static_cast<double>(total) : 0.0;
+    }
+};
+
+//! Limits for splitting send_to_device() requests to many devices.
+struct ToDeviceLimits
+{
+    //! The maximum size of one request body in bytes. Homeservers reject larger bodies with a 413.
+    //! 0 means no limit.
+    std::size_t max_bytes = 256 * 1024;
+    //! The maximum number of messages in one request. 0 means no limit.
+    std::size_t max_messages = 250;
+    //! How many requests of one send_to_device() call are in flight at once.
+    std::size_t max_concurrent = 4;
+};
+
+//! Statistics of the requests started with a RequestHandle.
+struct RequestHandleStats
+{
+    //! Requests started with the handle.
+    std::uint64_t requests = 0;
+    //! Requests, that were cancelled or timed out, before they were sent. No bandwidth was spent on
+    //! them.
+    std::uint64_t not_sent = 0;
+    //! Requests cancelled while they were in flight or queued.
+    std::uint64_t cancelled = 0;
+    //! Requests, that didn't complete before the deadline.
+    std::uint64_t timed_out = 0;
+    //! Responses dropped, because they arrived after their request was cancelled or timed out.
+    std::uint64_t discarded_responses = 0;
+    //! Bytes of the dropped responses. They were neither copied nor parsed.
+    std::uint64_t discarded_bytes = 0;
+};
+
+/// @brief Cancel requests or limit how long they may take.
+///
+/// Requests are attached to a handle by starting them within a RequestScope. Copies of a handle
+/// refer to the same requests.
+///
+/// Cancelling drops the requests still waiting in the scheduler or the concurrency limit, so they
+/// are never sent. Requests already in flight complete in the background, but their responses are
+/// dropped without being parsed. The callbacks of cancelled requests are not called. A request,
+/// that misses its deadline, is cancelled the same way, except that its callback receives an error
+/// with the error code CURLE_OPERATION_TIMEDOUT.
+class RequestHandle
+{
+public:
+    struct State;
+
+    //! A handle without a deadline.
+    RequestHandle();
+    //! Every request started with this handle has to complete within the timeout. This is
+    //! independent of the connect timeout of the client.
+    explicit RequestHandle(std::chrono::milliseconds timeout);
+
+    //! Cancel all requests started with this handle and the ones started with it later.
+    void cancel();
+    //! Returns true, if cancel() was called.
+    [[nodiscard]] bool cancelled() const;
+
+    //! Returns the statistics of the requests started with this handle.
+    [[nodiscard]] RequestHandleStats stats() const;
+
+private:
+    friend class RequestScope;
+    std::shared_ptr<State> state;
+};
+
+/// @brief Attaches the requests, that the current thread starts, to a handle.
+///
+/// Scopes can be nested, the innermost one wins. Requests started later from callbacks are not
+/// attached, as they run on another thread.
+///
+///     RequestHandle thumbnail(5s);
+///     {
+///         RequestScope scope(thumbnail);
+///         client->get_thumbnail(opts, cb);
+///     }
+///     // The user scrolled away.
+///     thumbnail.cancel();
+class RequestScope
+{
+public:
+    explicit RequestScope(const RequestHandle &handle);
+    ~RequestScope();
+
+    RequestScope(const RequestScope &)            = delete;
+    RequestScope &operator=(const RequestScope &) = delete;
+
+private:
+    std::shared_ptr<RequestHandle::State> previous;
+};
+
 //! Sync configuration options.
 struct SyncOpts
 {
@@ -173,6 +350,17 @@ struct SyncOpts
     std::optional<mtx::presence::PresenceState> set_presence;
 };
 
+//! Sliding sync configuration options.
+struct SlidingSyncOpts
+{
+    //! The pos of the last response. Empty to start a new connection.
+    std::string pos;
+    //! The amount of msecs to wait for long polling.
+    uint16_t timeout = 30'000;
+    //! Explicitly set the presence of the user
+    std::optional<mtx::presence::PresenceState> set_presence;
+};
+
 //! Configuration for the /messages endpoint.
 struct MessagesOpts
 {
@@ -197,9 +385,15 @@ struct ThumbOpts
     std::string method = "crop";
     //! A mxc URI which points to the content.
     std::string mxc_url;
+    //! Download the full media at the same time and use whichever response arrives first. The
+    //! other request is cancelled. Trades bandwidth for latency, when thumbnails are often missing.
+    //! Ignored without `try_download`.
+    bool race_download = false;
 };
 
 struct ClientPrivate;
+struct ClientPoolPrivate;
+class MediaCache;
 struct Session;
 
 //! The main object that the user will interact.
@@ -209,12 +403,69 @@ public:
     Client(const std::string &server = "", uint16_t port = 443);
     ~Client();
 
-    //! Set a path to cache alternate service lookups like the http/3 ports of a server.
+    //! Set a path to cache alternate service lookups like the http/3 ports of a server. Ignored
+    //! for clients of a ClientPool.
     void alt_svc_cache_path(const std::string &path);
 
-    //! Wait for the client to close.
+    /// @brief Apply connection settings.
+    ///
+    /// The concurrency limit only affects requests started afterwards. For clients of a
+    /// ClientPool, certificate verification, the connect timeout, the alt-svc cache and the
+    /// concurrency limit belong to the pool and are ignored.
+    void set_connection_options(const ConnectionOptions &opts);
+    //! Returns the current connection settings.
+    ConnectionOptions connection_options() const;
+
+    /// @brief Pace requests and retry them, when they are rate limited.
+    ///
+    /// By default every request is sent immediately and a 429 is passed to the callback. With a
+    /// scheduler requests are queued per endpoint class, dispatched by priority and only the final
+    /// response is passed on.
+    /// Pass nullopt to disable it again, which drops all requests still waiting in the queue.
+    /// Their callbacks get the error code CURLE_ABORTED_BY_CALLBACK.
+    void set_scheduler(std::optional<SchedulerOpts> opts);
+    //! Returns the queue depths and rate limit statistics of the scheduler.
+    SchedulerStats scheduler_stats() const;
+    //! Returns the response sizes received per endpoint class, see endpoint_class().
+    std::map<std::string, TransferCounters> transfer_stats() const;
+    //! Reset the counters returned by transfer_stats().
+    void reset_transfer_stats();
+
+    /// @brief Cache GET responses of endpoints, that are requested over and over.
+    ///
+    /// Identical GET requests to the configured endpoint classes are coalesced, while one is in
+    /// flight, and successful responses are reused until their TTL expires. Expired responses with
+    /// an ETag are revalidated with If-None-Match. Any other request to the same path, a parent or
+    /// a sub path drops the cached responses, i.e. setting the display name drops the cached
+    /// profile.
+    /// Requests started within a RequestScope bypass the cache. Disabled by default, pass nullopt
+    /// to disable it again.
+    void set_response_cache(std::optional<ResponseCacheOpts> opts);
+    //! Returns the hit rate and size of the response cache.
+    ResponseCacheStats response_cache_stats() const;
+    //! Drop all cached responses. Happens automatically, when the access token changes.
+    void clear_response_cache();
+
+    //! Answer download() and get_thumbnail() from files cached on disk and store their responses
+    //! there. The files are read and written on the thread of the cache, see MediaCache::post().
+    //! The cache can be shared between clients. Pass nullptr to disable it again.
+    void set_media_cache(std::shared_ptr<MediaCache> cache);
+
+    //! Set how send_to_device() splits its messages into requests.
+    void set_to_device_limits(ToDeviceLimits limits);
+
+    /// @brief Set where responses are parsed and callbacks are called.
+    ///
+    /// By default this happens on the network thread, so parsing a large response delays every
+    /// other request. With an executor, i.e. ThreadPool::executor(), the network thread only copies
+    /// the response and hands it off. Callbacks can then run concurrently and out of order. Only
+    /// affects requests started afterwards. Pass an empty executor to disable it again.
+    void set_executor(Executor executor);
+
+    //! Wait for the client to close. Does nothing for clients of a ClientPool.
     void close(bool force = false);
-    //! Enable or disable certificate verification. On by default
+    //! Enable or disable certificate verification. On by default. Ignored for clients of a
+    //! ClientPool.
     void verify_certificates(bool enabled = true);
     //! Set the homeserver domain name.
     void set_user(const mtx::identifiers::User &user) { user_id_ = user; }
@@ -225,16 +476,13 @@ public:
     //! Retrieve the homeserver domain name.
     std::string server() { return server_; };
     //! Retrieve the full server url including protocol and ports
-    std::string server_url()
-    {
-        return protocol_ + "://" + server() + ":" + std::to_string(port());
-    };
+    std::string server_url();
     //! Set the homeserver port.
-    void set_port(uint16_t port) { port_ = port; };
+    void set_port(uint16_t port);
     //! Retrieve the homeserver port.
     uint16_t port() { return port_; };
     //! Add an access token.
-    void set_access_token(const std::string &token) { access_token_ = token; }
+    void set_access_token(const std::string &token);
     //! Retrieve the access token.
     std::string access_token() const { return access_token_; }
     //! Update the next batch token.
@@ -247,17 +495,12 @@ public:
     std::string device_id() const { return device_id_; }
     //! Generate a new transaction id.
     std::string generate_txn_id() { return client::utils::random_token(32, false); }
-    //! Abort all active pending requests.
+    //! Abort all active pending requests. For clients of a ClientPool only the requests still
+    //! queued in the scheduler or the concurrency limit are dropped. Dropped requests fail with the
+    //! error code CURLE_ABORTED_BY_CALLBACK.
     void shutdown();
     //! Remove all saved configuration.
-    void clear()
-    {
-        device_id_.clear();
-        access_token_.clear();
-        next_batch_token_.clear();
-        server_.clear();
-        port_ = 443;
-    }
+    void clear();
 
     //! Perfom login.
     void login(const std::string &username,
@@ -439,6 +682,17 @@ public:
 
     //! Perform sync.
     void sync(const SyncOpts &opts, Callback<mtx::responses::Sync> cb);
+    //! Perform sync, but pass the unparsed response body to the callback.
+    void sync_raw(const SyncOpts &opts, Callback<std::string> cb);
+    /// @brief Perform a simplified sliding sync (MSC4186).
+    ///
+    /// Only returns the rooms in the requested list ranges and room subscriptions, so the initial
+    /// sync doesn't grow with the number of rooms of the user. Pass the pos of the response in the
+    /// opts of the next request. If the server forgot the connection, it responds with
+    /// M_UNKNOWN_POS and the client has to start over without a pos.
+    void sliding_sync(const mtx::requests::SlidingSync &req,
+                      const SlidingSyncOpts &opts,
+                      Callback<mtx::responses::SlidingSync> cb);
 
     //! List members in a room.
     void members(const std::string &room_id,
@@ -477,6 +731,17 @@ public:
 
     //! Upload a filter
     void upload_filter(const nlohmann::json &j, Callback<mtx::responses::FilterId> cb);
+    /// @brief Upload a filter, unless the same filter was uploaded before.
+    ///
+    /// Filter ids are cached by a hash of the user id, the server and the canonical JSON of the
+    /// filter, so switching accounts never reuses the filter of another user. For a cached filter
+    /// the callback is called immediately without a request. Persist filter_ids() and restore
+    /// them with set_filter_ids() to skip the upload after a restart.
+    void upload_filter(const mtx::requests::Filter &filter, Callback<mtx::responses::FilterId> cb);
+    //! Returns the cached filter ids by the hash of user, server and filter.
+    std::map<std::string, std::string> filter_ids() const;
+    //! Replace the cached filter ids, i.e. with the ones of a previous run.
+    void set_filter_ids(std::map<std::string, std::string> ids);
 
     //! Upload data to the content repository.
     void upload(const std::string &data,
@@ -502,6 +767,10 @@ public:
     //! Retrieve a thumbnail from the given mxc url.
     //! If the thumbnail isn't found and `try_download` is `true` it will try
     //! to use the `/download` endpoint to retrieve the media.
+    //!
+    //! Media requests remember, whether the server supports the authenticated media endpoints, so
+    //! only the first one falls back to the legacy endpoints. Fallback requests are attached to the
+    //! same RequestHandle as the original one.
     void get_thumbnail(const ThumbOpts &opts, Callback<std::string> cb, bool try_download = true);
 
     //! Send typing notifications to the room.
@@ -580,6 +849,12 @@ public:
                            const std::string &txn_id,
                            const Payload &payload,
                            Callback<mtx::responses::EventId> cb);
+    //! Send a room message of any type by providing transaction id.
+    void send_room_message(const std::string &room_id,
+                           const std::string &txn_id,
+                           const std::string &event_type,
+                           const nlohmann::json &payload,
+                           Callback<mtx::responses::EventId> callback);
     //! Send a state event by providing the state key.
     void send_state_event(const std::string &room_id,
                           const std::string &event_type,
@@ -597,7 +872,12 @@ public:
                           const Payload &payload,
                           Callback<mtx::responses::EventId> cb);
 
-    //! Send send-to-device events to a set of client devices with a specified transaction id.
+    /// @brief Send send-to-device events to a set of devices with a specified transaction id.
+    ///
+    /// Messages exceeding the ToDeviceLimits are split into several requests, which are sent
+    /// concurrently. Their transaction ids are derived from `txid`, so retrying the call with the
+    /// same id doesn't deliver messages twice. The callback is called once all requests are done,
+    /// with the first error, if any of them failed.
     void send_to_device(const std::string &event_type,
                         const std::string &txid,
                         const nlohmann::json &body,
@@ -784,6 +1064,10 @@ public:
                                int limit = -1);
 
 private:
+    friend class ClientPool;
+    friend struct DiscoveryFetch;
+    Client(std::shared_ptr<ClientPoolPrivate> pool, const std::string &server, uint16_t port);
+
     template<class Request, class Response>
     void post(const std::string &endpoint,
               const Request &req,
@@ -831,9 +1115,27 @@ private:
 
     void delete_(const std::string &endpoint, ErrCallback cb, bool requires_auth = true);
 
-    coeurl::Headers prepare_headers(bool requires_auth);
+    //! GET a media endpoint like `download/server/media_id` using the media API, that the server
+    //! supports.
+    void get_media(const std::string &path, HeadersCallback<std::string> cb, int num_redirects = 0);
+    //! The requests of get_thumbnail() after the lookup in the media cache. Only thumbnails are
+    //! stored in the cache under the key of the thumbnail.
+    void fetch_thumbnail(const ThumbOpts &opts,
+                         Callback<std::string> cb,
+                         bool try_download,
+                         std::shared_ptr<MediaCache> media_cache);
+    //! The request of download() after the lookup in the media cache.
+    void fetch_download(const std::string &server,
+                        const std::string &media_id,
+                        std::function<void(const std::string &data,
+                                           const std::string &content_type,
+                                           const std::string &original_filename,
+                                           RequestErr err)> cb,
+                        std::shared_ptr<MediaCache> media_cache);
+
+    std::shared_ptr<const coeurl::Headers> prepare_headers(bool requires_auth) const;
     std::string endpoint_to_url(const std::string &endpoint,
-                                const char *endpoint_namespace = "/_matrix");
+                                const char *endpoint_namespace = "/_matrix") const;
 
     template<class Response>
     TypeErasedCallback prepare_callback(HeadersCallback<Response> callback);
@@ -855,6 +1157,44 @@ private:
 
     std::unique_ptr<ClientPrivate> p;
 };
+
+/// @brief Lets many clients share one network thread and connection cache.
+///
+/// Every Client owns a transport with its own event loop thread and connections. A bridge
+/// puppeting thousands of accounts on the same homeserver would run thousands of threads and TLS
+/// connections. Clients created by a pool send their requests through one shared transport
+/// instead, while keeping their own server, access token, scheduler and executor.
+///
+/// Responses to requests of a client, that was destroyed in the meantime, are dropped.
+class ClientPool
+{
+public:
+    /// @brief Create the shared transport.
+    ///
+    /// Certificate verification, the connect timeout and the alt-svc cache apply to all clients.
+    /// The concurrency limit is shared by all clients, so it bounds the connections of the whole
+    /// pool. The remaining options are the defaults for new clients.
+    explicit ClientPool(const ConnectionOptions &opts = {});
+    //! The transport is destroyed, once the pool and all of its clients are gone.
+    ~ClientPool();
+
+    ClientPool(const ClientPool &)            = delete;
+    ClientPool &operator=(const ClientPool &) = delete;
+
+    //! Create a client using the shared transport.
+    std::shared_ptr<Client> make_client(const std::string &server = "", uint16_t port = 443);
+
+    //! Returns how many clients of this pool are alive.
+    [[nodiscard]] std::size_t clients() const;
+
+    //! Abort all active pending requests of all clients.
+    void shutdown();
+    //! Wait for the transport to close.
+    void close(bool force = false);
+
+private:
+    std::shared_ptr<ClientPoolPrivate> p;
+};
 }
 }
 
@@ -0,0 +1,74 @@
+#pragma once
+
+/// @file
+/// @brief Fetch and cache what a client needs to know about its server before the first sync.
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include "mtx/responses/capabilities.hpp"
+#include "mtx/responses/login.hpp"
+#include "mtx/responses/version.hpp"
+#include "mtx/responses/well-known.hpp"
+#include "mtxclient/http/client.hpp"
+
+namespace mtx {
+namespace http {
+
+//! The discovery responses of a server, see discover().
+struct ServerDiscovery
+{
+    //! The homeserver, that answered the requests, see Client::server_url().
+    std::string homeserver;
+    //! The .well-known/matrix/client of the server name, if it has one.
+    std::optional<mtx::responses::WellKnown> well_known;
+    //! The supported versions of the specification.
+    mtx::responses::Versions versions;
+    //! The capabilities. Only fetched, if the client has an access token.
+    std::optional<mtx::responses::capabilities::Capabilities> capabilities;
+    //! The supported login flows.
+    mtx::responses::LoginFlows login_flows;
+    //! When the responses were fetched from the server.
+    std::chrono::system_clock::time_point fetched_at;
+    //! True, if the responses were loaded from the cache file.
+    bool from_cache = false;
+};
+
+//! Configuration of discover().
+struct DiscoveryOpts
+{
+    //! Where to cache the responses. Empty disables the cache.
+    std::string cache_file;
+    //! Cached responses older than this are not used anymore.
+    std::chrono::seconds max_age = std::chrono::hours(24);
+    //! Refresh cached responses in the background, after they were used.
+    bool revalidate = true;
+};
+
+//! Receives the discovered responses or the error of the first request, that failed.
+using DiscoveryCallback = std::function<void(const ServerDiscovery &, RequestErr)>;
+
+/// @brief Discover the homeserver of the client's server before it starts to sync.
+///
+/// The well-known, versions, capabilities and login flows are requested concurrently instead of
+/// one after another. If the well-known points to another homeserver, the client switches to it
+/// and asks that one again. A missing well-known is not an error.
+///
+/// With a cache file, responses for the same server, that are younger than `max_age`, are passed
+/// to `cb` right away, without any round trip, and the client switches to the cached homeserver.
+/// They are then refreshed in the background and the file is updated. The fresh responses are
+/// passed to `refreshed`, if set. The cached well-known is kept until the responses expire, as the
+/// client can't reach the server name anymore, once it switched to the homeserver.
+///
+/// The cache file is written on a background thread. Fetched responses are passed to the callbacks
+/// from that thread, after the file was written.
+void
+discover(std::shared_ptr<Client> client,
+         DiscoveryOpts opts,
+         DiscoveryCallback cb,
+         DiscoveryCallback refreshed = nullptr);
+} // namespace http
+} // namespace mtx
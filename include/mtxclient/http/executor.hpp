@@ -0,0 +1,42 @@
+#pragma once
+
+/// @file
+/// @brief Executors to run response handling off the network thread.
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+namespace mtx {
+namespace http {
+
+//! Runs a task, usually on another thread. See Client::set_executor().
+using Executor = std::function<void(std::function<void()>)>;
+
+/// @brief A fixed number of threads processing tasks in the order they were posted.
+///
+/// With more than one thread, tasks can run concurrently and complete out of order.
+class ThreadPool
+{
+    struct State;
+
+public:
+    //! Starts the threads. 0 uses the number of hardware threads.
+    explicit ThreadPool(std::size_t threads = 0);
+    //! Runs the tasks still queued and joins the threads.
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &)            = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    //! Queue a task. After the pool was destroyed, the task is run on the calling thread instead.
+    void post(std::function<void()> task);
+
+    //! Returns an executor posting to this pool. It can outlive the pool.
+    [[nodiscard]] Executor executor() const;
+
+private:
+    std::shared_ptr<State> state;
+};
+} // namespace http
+} // namespace mtx
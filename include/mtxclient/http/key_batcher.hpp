@@ -0,0 +1,88 @@
+#pragma once
+
+/// @file
+/// @brief Merge concurrent key queries and claims into fewer requests.
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include "mtx/requests.hpp"
+#include "mtx/responses/crypto.hpp"
+#include "mtxclient/http/client.hpp"
+
+namespace mtx {
+namespace http {
+
+//! Configuration of a KeyBatcher.
+struct KeyBatcherOpts
+{
+    //! How long the first request of a batch waits for others to join it.
+    std::chrono::milliseconds window{10};
+    //! Send a query batch right away, once it asks for this many users. 0 means no limit.
+    std::size_t max_users = 250;
+    //! Send a claim batch right away, once it claims keys for this many devices. 0 means no limit.
+    std::size_t max_devices = 250;
+};
+
+//! Statistics of a KeyBatcher.
+struct KeyBatcherStats
+{
+    //! Calls of query_keys() and claim_keys().
+    std::uint64_t calls = 0;
+    //! Requests sent to the server.
+    std::uint64_t requests = 0;
+    //! Requests, that failed. All their callers received the error.
+    std::uint64_t errors = 0;
+};
+
+/// @brief Merges concurrent /keys/query and /keys/claim requests.
+///
+/// New members, device list changes and sharing a session all ask for keys, often at the same
+/// time. The batcher collects these requests for a short window and sends one request per
+/// endpoint instead. Every caller receives the part of the response for the users and devices it
+/// asked for, together with the failures of the whole batch.
+///
+/// Queries are only merged, if they have the same sync token. A device is never claimed twice in
+/// one batch, as both callers would receive the same one-time key. Such a claim starts the next
+/// batch instead.
+class KeyBatcher
+{
+    struct State;
+
+public:
+    //! Sends a query. Used to replace the client in tests.
+    using QueryFn = std::function<void(const mtx::requests::QueryKeys &,
+                                       Callback<mtx::responses::QueryKeys>)>;
+    //! Sends a claim. Used to replace the client in tests.
+    using ClaimFn = std::function<void(const mtx::requests::ClaimKeys &,
+                                       Callback<mtx::responses::ClaimKeys>)>;
+
+    //! Send the batches using a client.
+    explicit KeyBatcher(std::shared_ptr<Client> client, KeyBatcherOpts opts = {});
+    //! Send the batches using custom functions.
+    KeyBatcher(QueryFn query, ClaimFn claim, KeyBatcherOpts opts = {});
+    //! Sends the batches, that are still waiting. Their callbacks are still called.
+    ~KeyBatcher();
+
+    KeyBatcher(const KeyBatcher &)            = delete;
+    KeyBatcher &operator=(const KeyBatcher &) = delete;
+
+    //! Query the device keys of users as part of the next batch.
+    void query_keys(const mtx::requests::QueryKeys &req, Callback<mtx::responses::QueryKeys> cb);
+    //! Claim one-time keys as part of the next batch.
+    void claim_keys(const mtx::requests::ClaimKeys &req, Callback<mtx::responses::ClaimKeys> cb);
+
+    //! Send the waiting batches without waiting for the window to end.
+    void flush();
+
+    //! Returns the current statistics.
+    [[nodiscard]] KeyBatcherStats stats() const;
+
+private:
+    std::shared_ptr<State> state;
+};
+} // namespace http
+} // namespace mtx
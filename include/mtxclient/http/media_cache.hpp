@@ -0,0 +1,138 @@
+#pragma once
+
+/// @file
+/// @brief A size limited cache of downloaded media and thumbnails on disk.
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "mtx/common.hpp"
+#include "mtxclient/http/client.hpp"
+#include "mtxclient/http/executor.hpp"
+
+namespace mtx {
+namespace http {
+
+//! Configuration of a MediaCache.
+struct MediaCacheOpts
+{
+    //! Where the files are stored. Created, if it doesn't exist.
+    std::string directory;
+    //! The least recently used files are deleted, once the files take up more space than this.
+    std::uint64_t max_bytes = 256 * 1024 * 1024;
+    //! Also store decrypted attachments, see MediaCache::decrypted(). Saves decrypting them again,
+    //! but anyone, who can read the directory, can read them.
+    bool store_plaintext = false;
+};
+
+//! Statistics of a MediaCache.
+struct MediaCacheStats
+{
+    //! Lookups, that found a file.
+    std::uint64_t hits = 0;
+    //! Lookups, that didn't find a file.
+    std::uint64_t misses = 0;
+    //! Bytes read from the cache instead of the network.
+    std::uint64_t bytes_saved = 0;
+    //! Files deleted to stay within the size limit.
+    std::uint64_t evictions = 0;
+    //! Files currently cached.
+    std::size_t files = 0;
+    //! Size of the cached files.
+    std::uint64_t bytes = 0;
+
+    //! Returns the share of lookups, that found a file.
+    [[nodiscard]] double hit_rate() const
+    {
+        auto total = hits + misses;
+        return total ? static_cast<double>(hits) / static_cast<double>(total) : 0.0;
+    }
+};
+
+/// @brief A file read from the MediaCache.
+///
+/// The file is mapped into memory, where the platform supports it, so reading it doesn't copy it.
+/// The data stays valid, even if the file is evicted in the meantime.
+class MediaFile
+{
+public:
+    struct Data;
+
+    explicit MediaFile(std::shared_ptr<const Data> data);
+
+    //! The content of the file.
+    [[nodiscard]] std::string_view data() const;
+    //! The Content-Type the server sent.
+    [[nodiscard]] const std::string &content_type() const;
+    //! The file name from the Content-Disposition the server sent.
+    [[nodiscard]] const std::string &filename() const;
+
+private:
+    std::shared_ptr<const Data> data_;
+};
+
+/// @brief Stores downloaded media and thumbnails on disk.
+///
+/// Files are named after the SHA-256 of their key, i.e. the mxc url and the thumbnail parameters,
+/// and written to a temporary file first, which is then renamed, so a crash never leaves a partial
+/// file behind. Once the files exceed `max_bytes`, the least recently used ones are deleted. The
+/// order survives restarts, as reading a file updates its modification time.
+///
+/// Attach it to a client with Client::set_media_cache() to answer Client::download() and
+/// Client::get_thumbnail() from the cache. Clients read and write the files on a thread of the
+/// cache, so the network thread never waits for the disk. Encrypted attachments are stored as
+/// ciphertext like any other download, see decrypted() to read them.
+class MediaCache
+{
+    struct State;
+
+public:
+    //! Opens the cache directory and indexes the files from earlier runs.
+    explicit MediaCache(MediaCacheOpts opts);
+    ~MediaCache();
+
+    MediaCache(const MediaCache &)            = delete;
+    MediaCache &operator=(const MediaCache &) = delete;
+
+    //! The key of the full media of an mxc url.
+    static std::string key(const std::string &mxc_url);
+    //! The key of a thumbnail.
+    static std::string key(const ThumbOpts &opts);
+
+    //! Returns the file stored for the key.
+    std::optional<MediaFile> get(const std::string &key);
+    //! Store a file, replacing the previous one for the key. Files larger than the whole cache are
+    //! not stored.
+    void put(const std::string &key,
+             std::string_view data,
+             const std::string &content_type = "",
+             const std::string &filename     = "");
+    //! Delete the file stored for the key.
+    void remove(const std::string &key);
+    //! Delete all files.
+    void clear();
+
+    /// @brief Returns the plaintext of an encrypted attachment.
+    ///
+    /// Uses the stored plaintext, if `store_plaintext` is set. Otherwise the cached ciphertext of
+    /// `file.url` is verified and decrypted, see mtx::crypto::decrypt_file(), and stored as
+    /// plaintext, if `store_plaintext` is set. Returns nothing, if neither is cached or the
+    /// ciphertext doesn't match the hash.
+    std::optional<MediaFile> decrypted(const mtx::crypto::EncryptedFile &file);
+
+    //! Returns the current statistics.
+    [[nodiscard]] MediaCacheStats stats() const;
+
+    //! Run a task on the thread, that clients use to read and write the files. Tasks run in the
+    //! order they were posted, so a get() posted after a put() finds the file.
+    void post(std::function<void()> task);
+
+private:
+    std::unique_ptr<State> state;
+};
+} // namespace http
+} // namespace mtx
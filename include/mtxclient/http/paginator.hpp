@@ -0,0 +1,134 @@
+#pragma once
+
+/// @file
+/// @brief Iterate over paginated endpoints, while the next pages are fetched in the background.
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include "mtx/responses/messages.hpp"
+#include "mtx/responses/notifications.hpp"
+#include "mtx/responses/public_rooms.hpp"
+#include "mtxclient/http/client.hpp"
+
+namespace mtx {
+namespace http {
+
+//! Configuration of a Paginator.
+struct PaginatorOpts
+{
+    //! How many pages are fetched ahead of the consumer. 0 only fetches a page, when it is asked
+    //! for.
+    std::size_t prefetch_pages = 2;
+    //! Stop prefetching, while the buffered pages hold this many items (events, notifications or
+    //! rooms). Bounds the memory, if the consumer is slower than the server. 0 means no limit.
+    std::size_t max_buffered_items = 1'000;
+};
+
+//! Statistics of a Paginator.
+struct PaginatorStats
+{
+    //! Pages received from the server.
+    std::uint64_t pages = 0;
+    //! Items in the received pages.
+    std::uint64_t items = 0;
+    //! Failed requests.
+    std::uint64_t errors = 0;
+    //! Pages, that were already buffered, when the consumer asked for them.
+    std::uint64_t prefetch_hits = 0;
+    //! Pages fetched, but not taken by the consumer yet.
+    std::size_t buffered_pages = 0;
+    //! Items in the buffered pages.
+    std::size_t buffered_items = 0;
+    //! Time the consumer spent waiting for pages.
+    std::chrono::steady_clock::duration wait_time{};
+};
+
+/// @brief Walks through all pages of a paginated endpoint.
+///
+/// Every page carries the token of the next one, so pages can only be requested one after
+/// another. To hide the round trips anyway, the paginator requests the next pages as soon as it is
+/// created and keeps up to PaginatorOpts::prefetch_pages of them buffered, while the consumer
+/// processes the current one. Pages are returned in order. A failed request stops the prefetching,
+/// the next call to next() retries it.
+///
+/// Use the factories below to create one for a specific endpoint.
+template<class Page>
+class Paginator
+{
+    struct State;
+
+public:
+    //! Receives the next page or nothing at the end. The error is set, if the request failed.
+    using PageCallback = std::function<void(std::optional<Page>, RequestErr)>;
+    //! Requests the page starting at the token. Used to replace the client in tests.
+    using Fetcher = std::function<void(const std::string &from, Callback<Page>)>;
+
+    //! Start fetching from the `from` token. An empty token starts at the beginning.
+    Paginator(Fetcher fetcher, PaginatorOpts opts = {}, std::string from = {});
+    //! Stops fetching. Callbacks still waiting for a page are not called anymore.
+    ~Paginator();
+
+    Paginator(const Paginator &)            = delete;
+    Paginator &operator=(const Paginator &) = delete;
+
+    //! Pass the next page to the callback. It is called immediately, if the page is buffered
+    //! already, otherwise on the thread of the client, once it arrives. Calls are served in order,
+    //! so the callback can ask for the following page right away.
+    void next(PageCallback cb);
+
+    /// @brief Wait for the next page.
+    ///
+    /// Must not be called from a callback of the client, as that would block the thread, that
+    /// receives the page.
+    /// \returns nothing at the end or on an error, which is stored in `err`, if passed.
+    std::optional<Page> wait_next(std::optional<ClientError> *err = nullptr);
+
+    //! Returns true, if the last page was handed to the consumer.
+    [[nodiscard]] bool finished() const;
+
+    //! Returns the current statistics.
+    [[nodiscard]] PaginatorStats stats() const;
+
+private:
+    std::shared_ptr<State> state;
+};
+
+extern template class Paginator<mtx::responses::Messages>;
+extern template class Paginator<mtx::responses::Notifications>;
+extern template class Paginator<mtx::responses::PublicRooms>;
+extern template class Paginator<mtx::responses::HierarchyRooms>;
+
+//! Iterate over the events of a room with /messages, starting at `opts.from` in `opts.dir`.
+Paginator<mtx::responses::Messages>
+paginate_messages(std::shared_ptr<Client> client, MessagesOpts opts, PaginatorOpts paginator = {});
+
+//! Iterate over the notifications of the user, newest first.
+Paginator<mtx::responses::Notifications>
+paginate_notifications(std::shared_ptr<Client> client,
+                       uint64_t limit,
+                       const std::string &only = "",
+                       PaginatorOpts paginator = {});
+
+//! Iterate over the public room directory of a server. An empty server uses the own one.
+Paginator<mtx::responses::PublicRooms>
+paginate_public_rooms(std::shared_ptr<Client> client,
+                      const std::string &server = "",
+                      size_t limit              = 0,
+                      PaginatorOpts paginator   = {});
+
+//! Iterate over the rooms of a space.
+Paginator<mtx::responses::HierarchyRooms>
+paginate_hierarchy(std::shared_ptr<Client> client,
+                   const std::string &room_id,
+                   size_t limit            = 0,
+                   size_t max_depth        = 0,
+                   bool suggested_only     = false,
+                   PaginatorOpts paginator = {});
+} // namespace http
+} // namespace mtx
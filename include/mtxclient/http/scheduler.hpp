@@ -0,0 +1,198 @@
+#pragma once
+
+/// @file
+/// @brief Optional pacing and retrying of requests to avoid the rate limits of a homeserver.
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace mtx {
+namespace http {
+
+//! Priority of an endpoint class. Queued requests of a higher priority are always sent first.
+enum class RequestPriority
+{
+    //! The sync long poll.
+    Sync,
+    //! Requests the user waits for, like sending messages. The default.
+    Interactive,
+    //! Backfill, key backup and other requests nobody is actively waiting for.
+    Background,
+    //! Media up- and downloads.
+    BulkMedia,
+};
+
+//! Number of priorities, for indexing SchedulerOpts::max_in_flight.
+inline constexpr std::size_t request_priority_count = 4;
+
+//! Pacing of a single endpoint class.
+struct RateLimit
+{
+    //! Sustained number of requests per second. 0 disables pacing.
+    double requests_per_second = 10.0;
+    //! How many requests can be sent at once after the class has been idle.
+    double burst = 20.0;
+};
+
+//! Configuration of the request scheduler.
+struct SchedulerOpts
+{
+    //! The limit used for every endpoint class without an entry in class_limits.
+    RateLimit default_limit;
+    //! Limits for specific endpoint classes, i.e. "rooms/send" or "media/download".
+    //! See endpoint_class().
+    std::map<std::string, RateLimit, std::less<>> class_limits;
+    //! How often a rate limited request is retried, before the error is passed to the callback.
+    int max_retries = 5;
+    //! The first backoff, if the server did not tell us, how long to wait.
+    std::chrono::milliseconds initial_backoff{500};
+    //! The backoff is doubled on every retry, up to this value.
+    std::chrono::milliseconds max_backoff{30'000};
+    //! Priorities for specific endpoint classes. Other classes use default_priority().
+    std::map<std::string, RequestPriority, std::less<>> class_priorities;
+    //! How many requests of each priority can be in flight at once, indexed by RequestPriority.
+    //! 0 means unlimited. Capping the lower priorities keeps connections free for the higher ones.
+    std::array<std::size_t, request_priority_count> max_in_flight = {0, 0, 4, 4};
+};
+
+//! Statistics of the request scheduler.
+struct SchedulerStats
+{
+    //! Statistics of a single endpoint class.
+    struct Class
+    {
+        //! Requests waiting to be sent.
+        std::size_t queued = 0;
+        //! Requests sent, that have not completed yet.
+        std::size_t in_flight = 0;
+        //! Requests sent in total, including retries.
+        std::uint64_t dispatched = 0;
+        //! Responses with status 429.
+        std::uint64_t rate_limited = 0;
+        //! Rate limited requests, that were sent again.
+        std::uint64_t retried = 0;
+        //! The priority of the class.
+        RequestPriority priority = RequestPriority::Interactive;
+    };
+
+    //! The statistics per endpoint class.
+    std::map<std::string, Class, std::less<>> classes;
+
+    //! Returns the number of requests waiting to be sent over all classes.
+    [[nodiscard]] std::size_t queued() const
+    {
+        std::size_t total = 0;
+        for (const auto &[name, c] : classes)
+            total += c.queued;
+        return total;
+    }
+    //! Returns the number of requests of a priority waiting to be sent.
+    [[nodiscard]] std::size_t queued(RequestPriority priority) const
+    {
+        std::size_t total = 0;
+        for (const auto &[name, c] : classes)
+            if (c.priority == priority)
+                total += c.queued;
+        return total;
+    }
+    //! Returns the number of requests of a priority in flight.
+    [[nodiscard]] std::size_t in_flight(RequestPriority priority) const
+    {
+        std::size_t total = 0;
+        for (const auto &[name, c] : classes)
+            if (c.priority == priority)
+                total += c.in_flight;
+        return total;
+    }
+};
+
+/// @brief Returns the class of an endpoint, that requests are paced by.
+///
+/// Rate limits of homeservers usually apply per kind of request, so the class consists of the first
+/// two path segments after the API version, that are not identifiers. For example
+/// `/client/v3/rooms/!abc:example.com/send/m.room.message/txn` becomes "rooms/send". Media
+/// endpoints are prefixed with "media/". The prefix of unstable endpoints is skipped, so the
+/// sliding sync endpoint is "sync" as well.
+std::string
+endpoint_class(std::string_view endpoint);
+
+/// @brief Returns the priority of an endpoint class, if none was configured.
+///
+/// "sync" is RequestPriority::Sync, media endpoints are RequestPriority::BulkMedia, pagination,
+/// notifications, key backup and directory requests are RequestPriority::Background and everything
+/// else is RequestPriority::Interactive.
+RequestPriority
+default_priority(std::string_view endpoint_class);
+
+/// @brief Parse the value of a `Retry-After` header.
+///
+/// Only the delay-seconds form is supported, dates return nothing.
+std::optional<std::chrono::milliseconds>
+parse_retry_after(std::string_view header);
+
+/// @brief Queues requests per endpoint class and sends them paced by a token bucket.
+///
+/// Requests rejected with 429 are sent again after the delay requested by the server, or after a
+/// jittered exponential backoff, if there was none. While a class waits for a retry, no other
+/// requests of that class are sent, so a group of requests does not hit the limit again all at
+/// once. Classes are dispatched in the order of their priority and lower priorities can be limited
+/// in how many requests they have in flight, so a backfill never delays sending a message. The
+/// scheduler is independent of the transport and uses its own thread for the timers.
+class RequestScheduler
+{
+    struct State;
+
+public:
+    /// @brief Handed to a job when it is started. Report the result of the request with finish().
+    ///
+    /// Copies share the same request. If the last copy is destroyed without finish() being called,
+    /// the request is treated as completed, so that it doesn't keep its slot forever.
+    class Attempt
+    {
+    public:
+        /// @brief Report the result of the request.
+        ///
+        /// \returns true, if the response should be passed on to the callback or false, if the
+        /// request will be sent again. Must be called exactly once.
+        bool finish(int status_code, std::optional<std::chrono::milliseconds> retry_after);
+
+    private:
+        friend struct RequestScheduler::State;
+        struct Slot;
+        std::shared_ptr<Slot> slot;
+    };
+
+    //! Starts a request. The job is called again for every retry.
+    using Job = std::function<void(Attempt)>;
+    //! Called instead of the job, if a queued request is dropped without being sent.
+    using Dropped = std::function<void()>;
+
+    RequestScheduler(SchedulerOpts opts = {});
+    ~RequestScheduler();
+
+    RequestScheduler(const RequestScheduler &)            = delete;
+    RequestScheduler &operator=(const RequestScheduler &) = delete;
+
+    //! Queue a request of the given endpoint class.
+    void enqueue(std::string endpoint_class, Job job, Dropped dropped = {});
+
+    //! Drop all queued requests, including the ones waiting for a retry. Their Dropped callbacks
+    //! are called. The destructor does the same.
+    void clear();
+
+    //! Returns the current statistics.
+    [[nodiscard]] SchedulerStats stats() const;
+
+private:
+    std::shared_ptr<State> state;
+};
+} // namespace http
+} // namespace mtx
@@ -0,0 +1,180 @@
+#pragma once
+
+/// @file
+/// @brief An ordered, persistent queue for outgoing room messages.
+
+#include <nlohmann/json.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mtx/events/collections.hpp"
+#include "mtxclient/http/client.hpp"
+
+namespace mtx {
+namespace http {
+
+//! A message, that was queued but not confirmed by the server yet.
+struct PendingMessage
+{
+    //! The room to send the message to.
+    std::string room_id;
+    //! The transaction id. It stays the same across retries and restarts, so the server can
+    //! deduplicate the message.
+    std::string txn_id;
+    //! The event type, i.e. m.room.message.
+    std::string type;
+    //! The event content.
+    nlohmann::json content;
+
+    friend void to_json(nlohmann::json &obj, const PendingMessage &msg);
+    friend void from_json(const nlohmann::json &obj, PendingMessage &msg);
+};
+
+//! Persistent storage for the messages of a SendQueue. The queue never calls it concurrently.
+class SendQueueStore
+{
+public:
+    virtual ~SendQueueStore() = default;
+
+    //! Called when a message was queued.
+    virtual void add(const PendingMessage &msg) = 0;
+    //! Called when a message was sent or dropped.
+    virtual void remove(const std::string &room_id, const std::string &txn_id) = 0;
+    //! Returns all stored messages in the order they were added.
+    virtual std::vector<PendingMessage> load() = 0;
+};
+
+/// @brief Stores the pending messages in an append-only log file.
+///
+/// Every change appends one JSON line, so queueing a burst of messages doesn't rewrite the whole
+/// queue each time. Added messages are synced to disk before add() returns. Removals are only
+/// flushed, a removal lost in a crash just sends the message again with the same transaction id,
+/// which the server deduplicates. A partially written last line is skipped when loading. Once most
+/// lines are obsolete, the log is compacted by writing a new file, syncing it and renaming it over
+/// the old one. Files in the JSON array format of older versions are converted on load.
+class FileSendQueueStore : public SendQueueStore
+{
+public:
+    explicit FileSendQueueStore(std::filesystem::path path);
+    ~FileSendQueueStore() override;
+
+    FileSendQueueStore(const FileSendQueueStore &)            = delete;
+    FileSendQueueStore &operator=(const FileSendQueueStore &) = delete;
+
+    void add(const PendingMessage &msg) override;
+    void remove(const std::string &room_id, const std::string &txn_id) override;
+    std::vector<PendingMessage> load() override;
+
+private:
+    void read_log();
+    void append(const nlohmann::json &record, bool sync);
+    void compact();
+
+    std::filesystem::path path_;
+    std::vector<PendingMessage> messages;
+    //! The number of lines in the log, including the obsolete ones.
+    std::size_t records = 0;
+    bool loaded         = false;
+    //! The log opened for appending, opened on the first change.
+    std::FILE *log_ = nullptr;
+};
+
+//! Configuration of a SendQueue.
+struct SendQueueOpts
+{
+    //! How many rooms can have a message in flight at the same time.
+    std::size_t max_rooms_in_flight = 8;
+    //! The delay before the first retry after a transient error. Doubled on every failure.
+    std::chrono::milliseconds initial_backoff{1'000};
+    //! The maximum delay between retries.
+    std::chrono::milliseconds max_backoff{60'000};
+    //! How often a message is sent, before it is dropped. 0 retries transient errors forever.
+    int max_attempts = 0;
+    //! Where to persist the pending messages. If set, stored messages are sent again on startup.
+    std::shared_ptr<SendQueueStore> store;
+};
+
+//! Statistics of a SendQueue.
+struct SendQueueStats
+{
+    //! Messages waiting to be sent, including the ones in flight.
+    std::size_t pending = 0;
+    //! Messages currently being sent.
+    std::size_t in_flight = 0;
+    //! Messages confirmed by the server.
+    std::uint64_t sent = 0;
+    //! Messages dropped because of a permanent error or too many attempts.
+    std::uint64_t failed = 0;
+    //! Number of times a message was sent again after a transient error.
+    std::uint64_t retries = 0;
+    //! Time from the first send to the last confirmation.
+    std::chrono::steady_clock::duration busy_time{};
+
+    //! Returns the throughput of the queue in messages per second.
+    [[nodiscard]] double messages_per_second() const
+    {
+        auto seconds = std::chrono::duration<double>(busy_time).count();
+        return seconds > 0 ? static_cast<double>(sent) / seconds : 0.0;
+    }
+};
+
+/// @brief Sends room messages in order, while pipelining sends to different rooms.
+///
+/// Every room has its own queue and only one message per room is in flight, so messages arrive in
+/// the order they were queued. Different rooms are sent in parallel. Messages failing with a
+/// network error, a 429 or a 5xx are retried with the same transaction id after a backoff. All
+/// rooms, that fail within the same backoff window, are retried together. Other errors drop the
+/// message.
+class SendQueue
+{
+    struct State;
+
+public:
+    //! Called when a message was sent or dropped.
+    using SentCallback =
+      std::function<void(const PendingMessage &, const mtx::responses::EventId &, RequestErr)>;
+    //! Sends a single message. Used to replace the client in tests or to add custom handling.
+    using Sender =
+      std::function<void(const PendingMessage &, Callback<mtx::responses::EventId>)>;
+
+    //! Send the messages using a client.
+    SendQueue(std::shared_ptr<Client> client, SendQueueOpts opts = {}, SentCallback cb = nullptr);
+    //! Send the messages using a custom sender.
+    SendQueue(Sender sender, SendQueueOpts opts = {}, SentCallback cb = nullptr);
+    ~SendQueue();
+
+    SendQueue(const SendQueue &)            = delete;
+    SendQueue &operator=(const SendQueue &) = delete;
+
+    //! Queue a message. \returns the transaction id.
+    template<class Content>
+    std::string enqueue(const std::string &room_id, const Content &content)
+    {
+        constexpr auto event_type = mtx::events::message_content_to_type<Content>;
+        static_assert(event_type != mtx::events::EventType::Unsupported);
+        return enqueue(room_id, std::string(mtx::events::to_string(event_type)), content);
+    }
+    //! Queue a message of any type. \returns the transaction id.
+    std::string
+    enqueue(const std::string &room_id, const std::string &type, nlohmann::json content);
+
+    //! Returns the messages, that have not been confirmed yet, grouped by room in the order they
+    //! will be sent.
+    [[nodiscard]] std::vector<PendingMessage> pending() const;
+
+    //! Returns the current statistics.
+    [[nodiscard]] SendQueueStats stats() const;
+
+private:
+    std::shared_ptr<State> state;
+};
+} // namespace http
+} // namespace mtx
@@ -0,0 +1,115 @@
+#pragma once
+
+/// @file
+/// @brief A continuous /sync driver, that overlaps the next long poll with handling a response.
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "mtx/responses/sync.hpp"
+#include "mtxclient/http/client.hpp"
+
+namespace mtx {
+namespace http {
+
+//! Configuration of a SyncLoop.
+struct SyncLoopOpts
+{
+    //! Options for every sync request. `since` is only used for the first one.
+    SyncOpts sync;
+    //! The delay before the first retry after a failed sync. Doubled on every failure.
+    std::chrono::milliseconds initial_backoff{1'000};
+    //! The maximum delay between retries.
+    std::chrono::milliseconds max_backoff{60'000};
+    //! How many responses can wait to be handled, before no new sync is started. Keeps the memory
+    //! bounded, if the callback is slower than the server.
+    std::size_t max_queued_batches = 4;
+};
+
+//! Statistics of a SyncLoop.
+struct SyncLoopStats
+{
+    //! Successful sync responses.
+    std::uint64_t syncs = 0;
+    //! Failed requests, including responses, that could not be parsed.
+    std::uint64_t errors = 0;
+    //! Syncs started while an earlier response was still waiting to be handled.
+    std::uint64_t pipelined = 0;
+    //! Responses waiting to be parsed and handled.
+    std::size_t queued = 0;
+    //! Time spent parsing responses on the worker.
+    std::chrono::steady_clock::duration parse_time{};
+    //! Time spent in the sync callback.
+    std::chrono::steady_clock::duration callback_time{};
+};
+
+/// @brief Find the top level `next_batch` token in a sync response without parsing it.
+///
+/// \returns nothing, if the body has no such string or is malformed before it.
+std::optional<std::string>
+find_next_batch(std::string_view body);
+
+/// @brief Syncs continuously and hands every response to a callback.
+///
+/// Replaces the usual loop of calling Client::sync() from its own callback. As soon as a response
+/// arrives, its `next_batch` token is scanned from the raw body and the next long poll is started.
+/// Parsing the response and calling the callback happen on a worker thread afterwards, so a slow
+/// handler no longer delays the next sync. Responses are always handled in order. Failed syncs are
+/// retried with the same token after an exponential backoff. A response, that was received but
+/// can't be parsed, is passed to the error callback with its raw body and skipped, as the next
+/// sync already continues from its token.
+class SyncLoop
+{
+    struct State;
+
+public:
+    //! Called on the worker thread for every response, in order.
+    using SyncCallback = std::function<void(const mtx::responses::Sync &)>;
+    /// @brief Called for every failed sync, before it is retried, and for every response, that
+    /// can't be parsed.
+    ///
+    /// For unparsable responses `body` is the raw response, so the application can recover the
+    /// batch from it. It is empty for failed requests.
+    using ErrorCallback = std::function<void(RequestErr, const std::string &body)>;
+    //! Starts a sync request. Used to replace the client in tests.
+    using Syncer = std::function<void(const SyncOpts &, Callback<std::string>)>;
+
+    //! Sync using a client.
+    SyncLoop(std::shared_ptr<Client> client,
+             SyncLoopOpts opts,
+             SyncCallback on_sync,
+             ErrorCallback on_error = nullptr);
+    //! Sync using a custom syncer.
+    SyncLoop(Syncer syncer,
+             SyncLoopOpts opts,
+             SyncCallback on_sync,
+             ErrorCallback on_error = nullptr);
+    //! Stops the loop. Waits for the callback to return, unless called from within it.
+    ~SyncLoop();
+
+    SyncLoop(const SyncLoop &)            = delete;
+    SyncLoop &operator=(const SyncLoop &) = delete;
+
+    //! Start syncing. Does nothing, if the loop is already running.
+    void start();
+    //! Stop syncing. A request in flight is ignored, when it completes. Queued responses are
+    //! dropped and requested again by the next start().
+    void stop();
+
+    //! Returns the `next_batch` of the last response passed to the callback.
+    [[nodiscard]] std::string next_batch() const;
+
+    //! Returns the current statistics.
+    [[nodiscard]] SyncLoopStats stats() const;
+
+private:
+    std::shared_ptr<State> state;
+};
+} // namespace http
+} // namespace mtx
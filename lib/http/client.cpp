@@ -1,13 +1,27 @@
 #include "mtxclient/http/client.hpp"
 #include "mtx/log.hpp"
+#include "mtxclient/crypto/utils.hpp"
 #include "mtxclient/http/client_impl.hpp"
+#include "mtxclient/http/executor.hpp"
+#include "mtxclient/http/media_cache.hpp"
+#include "mtxclient/http/scheduler.hpp"
 
 #include <nlohmann/json.hpp>
 
 #include <coeurl/client.hpp>
+#include <algorithm>
+#include <atomic>
 #include <coeurl/request.hpp>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 
+#include <zlib.h>
+
 #include "mtxclient/utils.hpp"
 
 #include "mtx/log.hpp"
@@ -17,11 +31,1173 @@
 using namespace mtx::http;
 
 namespace mtx::http {
+namespace {
+using Completion = std::function<void(const coeurl::Request &)>;
+//! Starts a request and calls the completion, when it is done.
+using Start = std::function<void(Completion)>;
+//! Called instead of the completion, if a queued request is dropped without being sent.
+using Dropped = std::function<void()>;
+
+//! The error code passed to the callbacks of requests, that were dropped from a queue, i.e. by
+//! Client::shutdown().
+constexpr int dropped_error = CURLE_ABORTED_BY_CALLBACK;
+
+//! Limits how many requests are in flight and queues the others.
+struct RequestGate : std::enable_shared_from_this<RequestGate>
+{
+    explicit RequestGate(std::size_t limit_)
+      : limit(limit_)
+    {}
+
+    //! Holds a place in the gate while a request is in flight. The next queued request is
+    //! started, when the slot is released or the last copy of the completion is destroyed, so a
+    //! request, that never completes, doesn't block the gate.
+    struct Slot
+    {
+        explicit Slot(std::shared_ptr<RequestGate> gate_)
+          : gate(std::move(gate_))
+        {}
+        ~Slot() { release(); }
+
+        Slot(const Slot &)            = delete;
+        Slot &operator=(const Slot &) = delete;
+
+        void release()
+        {
+            if (auto g = std::move(gate))
+                g->finished();
+        }
+
+        std::shared_ptr<RequestGate> gate;
+    };
+
+    //! Start or queue a request. The owner identifies the client, when the gate is shared by the
+    //! clients of a pool. If the request is dropped from the queue, dropped is called instead.
+    void submit(Start start, Completion done, Dropped dropped, const void *owner = nullptr)
+    {
+        {
+            std::lock_guard lock(mtx);
+            if (in_flight >= limit) {
+                waiting.push_back({std::move(start), std::move(done), std::move(dropped), owner});
+                return;
+            }
+            in_flight++;
+        }
+        run(start, std::move(done));
+    }
+
+    void run(const Start &start, Completion done)
+    {
+        start([slot = std::make_shared<Slot>(shared_from_this()),
+               done = std::move(done)](const coeurl::Request &r) {
+            done(r);
+            slot->release();
+        });
+    }
+
+    void finished()
+    {
+        std::unique_lock lock(mtx);
+        if (waiting.empty()) {
+            in_flight--;
+            return;
+        }
+
+        auto next = std::move(waiting.front());
+        waiting.pop_front();
+        lock.unlock();
+        run(next.start, std::move(next.done));
+    }
+
+    //! Drop the queued requests of one owner or all of them and call their Dropped callbacks.
+    void clear(const void *owner = nullptr)
+    {
+        std::vector<Waiting> dropped;
+        {
+            std::lock_guard lock(mtx);
+            for (auto it = waiting.begin(); it != waiting.end();) {
+                if (!owner || it->owner == owner) {
+                    dropped.push_back(std::move(*it));
+                    it = waiting.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        // Called without the lock, they may queue new requests.
+        for (const auto &w : dropped)
+            if (w.dropped)
+                w.dropped();
+    }
+
+    struct Waiting
+    {
+        Start start;
+        Completion done;
+        Dropped dropped;
+        const void *owner;
+    };
+
+    const std::size_t limit;
+    std::mutex mtx;
+    std::size_t in_flight = 0;
+    std::deque<Waiting> waiting;
+};
+
+//! Response sizes per endpoint class. Shared with the completions of pending requests.
+struct Transfers
+{
+    void add(const std::string &endpoint, std::size_t wire, std::size_t decoded, bool compressed)
+    {
+        std::lock_guard lock(mtx);
+        auto &c = counters[endpoint];
+        c.responses++;
+        c.compressed_responses += compressed;
+        c.wire_bytes += wire;
+        c.decoded_bytes += decoded;
+    }
+
+    std::mutex mtx;
+    std::map<std::string, TransferCounters> counters;
+};
+
+//! Cached GET responses and the requests in flight, that identical requests can join. Shared with
+//! the completions of pending requests.
+struct ResponseCache
+{
+    using clock = std::chrono::steady_clock;
+
+    struct Entry
+    {
+        std::string path;
+        std::optional<coeurl::Headers> headers;
+        std::string body;
+        int status_code = 0;
+        std::string etag;
+        clock::time_point expires;
+        std::list<std::string>::iterator position;
+    };
+
+    explicit ResponseCache(ResponseCacheOpts opts_)
+      : opts(std::move(opts_))
+    {}
+
+    //! Returns the TTL of the endpoint or nothing, if it isn't cached.
+    std::optional<std::chrono::milliseconds> ttl(const std::string &endpoint) const
+    {
+        if (auto it = opts.ttl.find(endpoint_class(endpoint)); it != opts.ttl.end())
+            return it->second;
+        return std::nullopt;
+    }
+
+    //! Sends a request again without If-None-Match.
+    using Refetch = std::function<void(TypeErasedCallback)>;
+
+    /// @brief Answer a request from the cache or join an identical one in flight.
+    ///
+    /// \returns the callback to send the request with or nothing, if it was handled already.
+    /// `etag` is set, if a stale response can be revalidated. If the entry is gone, when the
+    /// server confirms it with a 304, the request is sent again using refetch.
+    std::optional<TypeErasedCallback> begin(const std::shared_ptr<ResponseCache> &self,
+                                            const std::string &url,
+                                            bool requires_auth,
+                                            std::chrono::milliseconds ttl,
+                                            TypeErasedCallback cb,
+                                            const Executor &executor,
+                                            std::string &etag,
+                                            Refetch refetch)
+    {
+        // Some endpoints answer differently, if the user is known.
+        auto key = requires_auth ? url : "unauthenticated " + url;
+
+        std::unique_lock lock(mtx);
+        auto cached = entries.find(key);
+        if (cached != entries.end() && cached->second.expires > clock::now()) {
+            stats.hits++;
+            auto respond = [cb      = std::move(cb),
+                            headers = cached->second.headers,
+                            body    = cached->second.body,
+                            status  = cached->second.status_code] { cb(headers, body, 0, status); };
+            lock.unlock();
+
+            if (executor)
+                executor(std::move(respond));
+            else
+                respond();
+            return std::nullopt;
+        }
+
+        auto path            = url.substr(0, url.find('?'));
+        auto [flight, first] = in_flight.try_emplace(key, Waiters{path, {}, false});
+        flight->second.callbacks.push_back(std::move(cb));
+        if (!first) {
+            stats.coalesced++;
+            return std::nullopt;
+        }
+
+        stats.misses++;
+        if (cached != entries.end())
+            etag = cached->second.etag;
+        if (etag.empty())
+            refetch = nullptr;
+
+        return respond_to(
+          std::make_shared<Flight>(self, std::move(key)), std::move(path), ttl, std::move(refetch));
+    }
+
+    //! Drops the related cached responses now and once the response of the request, that may
+    //! change them, arrives. Responses read before the change completed are not stored then.
+    static TypeErasedCallback
+    invalidating(const std::shared_ptr<ResponseCache> &self, std::string url, TypeErasedCallback cb)
+    {
+        self->invalidate(url);
+        return [weak = std::weak_ptr<ResponseCache>(self),
+                url  = std::move(url),
+                cb   = std::move(cb)](
+                 HeaderFields headers, const std::string_view &body, int err, int status) {
+            if (auto cache = weak.lock())
+                cache->invalidate(url);
+            cb(headers, body, err, status);
+        };
+    }
+
+    //! Forget the requests waiting for a response without calling them, i.e. because the client
+    //! is destroyed.
+    void detach()
+    {
+        std::lock_guard lock(mtx);
+        in_flight.clear();
+    }
+
+    /// @brief Store the response and pass it to every request waiting for it.
+    ///
+    /// \returns false without calling anyone, if the response is a 304, the entry to revalidate
+    /// is gone and can_refetch is set.
+    bool finish(const std::string &key,
+                const std::string &path,
+                std::chrono::milliseconds ttl,
+                HeaderFields headers,
+                std::string_view body,
+                int err,
+                int status,
+                bool can_refetch)
+    {
+        std::vector<TypeErasedCallback> callbacks;
+        std::optional<coeurl::Headers> cached_headers;
+        std::string cached_body;
+        const auto *out_headers = &headers;
+        {
+            std::lock_guard lock(mtx);
+            // Evicted or invalidated, while the request was in flight.
+            auto entry = entries.find(key);
+            if (!err && status == 304 && entry == entries.end() && can_refetch)
+                return false;
+
+            bool invalidated = false;
+            if (auto flight = in_flight.find(key); flight != in_flight.end()) {
+                callbacks   = std::move(flight->second.callbacks);
+                invalidated = flight->second.invalidated;
+                in_flight.erase(flight);
+            }
+
+            if (!err && status == 304 && entry != entries.end()) {
+                stats.revalidated++;
+                entry->second.expires = clock::now() + ttl;
+                cached_headers        = entry->second.headers;
+                cached_body           = entry->second.body;
+                out_headers           = &cached_headers;
+                body                  = cached_body;
+                status                = entry->second.status_code;
+            } else if (!err && status >= 200 && status < 300 && !invalidated) {
+                std::string etag;
+                if (headers)
+                    if (auto it = headers->find("ETag"); it != headers->end())
+                        etag = it->second;
+                store(key, Entry{path,
+                                 headers,
+                                 std::string(body),
+                                 status,
+                                 std::move(etag),
+                                 clock::now() + ttl,
+                                 {}});
+            }
+        }
+
+        for (const auto &cb : callbacks)
+            cb(*out_headers, body, err, status);
+        return true;
+    }
+
+    //! Drop the cached responses for the path of a request, that may change them, and its parents.
+    void invalidate(std::string_view url)
+    {
+        url = url.substr(0, url.find('?'));
+        auto related = [url](std::string_view path) {
+            auto &shorter = path.size() < url.size() ? path : url;
+            auto &longer  = path.size() < url.size() ? url : path;
+            return longer.starts_with(shorter) &&
+                   (longer.size() == shorter.size() || longer[shorter.size()] == '/');
+        };
+
+        std::lock_guard lock(mtx);
+        // Responses in flight may have been read before the change.
+        for (auto &[key, flight] : in_flight)
+            if (related(flight.path))
+                flight.invalidated = true;
+        for (auto it = entries.begin(); it != entries.end();) {
+            if (related(it->second.path)) {
+                order.erase(it->second.position);
+                it = entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void clear()
+    {
+        std::lock_guard lock(mtx);
+        for (auto &[key, flight] : in_flight)
+            flight.invalidated = true;
+        entries.clear();
+        order.clear();
+    }
+
+    ResponseCacheStats get_stats() const
+    {
+        std::lock_guard lock(mtx);
+        auto s    = stats;
+        s.entries = entries.size();
+        return s;
+    }
+
+    const ResponseCacheOpts opts;
+
+private:
+    //! A request in flight, that identical requests wait for. If its callback is destroyed without
+    //! being called, the waiting requests fail instead of waiting forever.
+    struct Flight
+    {
+        Flight(std::shared_ptr<ResponseCache> cache_, std::string key_)
+          : cache(std::move(cache_))
+          , key(std::move(key_))
+        {}
+        ~Flight()
+        {
+            if (cache)
+                cache->abandon(key);
+        }
+
+        Flight(const Flight &)            = delete;
+        Flight &operator=(const Flight &) = delete;
+
+        //! Reset, once the response was passed on.
+        std::shared_ptr<ResponseCache> cache;
+        std::string key;
+    };
+
+    //! Returns the callback passing the response of a flight to the cache.
+    static TypeErasedCallback respond_to(std::shared_ptr<Flight> flight,
+                                         std::string path,
+                                         std::chrono::milliseconds ttl,
+                                         Refetch refetch)
+    {
+        return [flight, path = std::move(path), ttl, refetch = std::move(refetch)](
+                 HeaderFields headers, const std::string_view &body, int err, int status) {
+            auto cache = std::move(flight->cache);
+            if (!cache ||
+                cache->finish(flight->key, path, ttl, headers, body, err, status, !!refetch))
+                return;
+
+            // The server confirmed an entry, that is gone now, so fetch the full response.
+            flight->cache = std::move(cache);
+            refetch(respond_to(flight, path, ttl, nullptr));
+        };
+    }
+
+    //! Fail the requests waiting for a flight, that was dropped without a response.
+    void abandon(const std::string &key)
+    {
+        std::vector<TypeErasedCallback> callbacks;
+        {
+            std::lock_guard lock(mtx);
+            if (auto flight = in_flight.find(key); flight != in_flight.end()) {
+                callbacks = std::move(flight->second.callbacks);
+                in_flight.erase(flight);
+            }
+        }
+
+        for (const auto &cb : callbacks)
+            cb(std::nullopt, "", dropped_error, 0);
+    }
+
+    //! Must be called with the lock held.
+    void store(const std::string &key, Entry entry)
+    {
+        if (auto old = entries.find(key); old != entries.end()) {
+            order.erase(old->second.position);
+            entries.erase(old);
+        }
+
+        while (!order.empty() && entries.size() >= opts.max_entries) {
+            entries.erase(order.front());
+            order.pop_front();
+            stats.evictions++;
+        }
+        if (opts.max_entries == 0)
+            return;
+
+        entry.position = order.insert(order.end(), key);
+        entries.emplace(key, std::move(entry));
+    }
+
+    //! The requests waiting for a response in flight.
+    struct Waiters
+    {
+        std::string path;
+        std::vector<TypeErasedCallback> callbacks;
+        //! Set, if a request to a related path started or completed in the meantime. The
+        //! response is passed on, but not stored.
+        bool invalidated = false;
+    };
+
+    mutable std::mutex mtx;
+    std::unordered_map<std::string, Entry> entries;
+    //! The keys of the entries, least recently stored first.
+    std::list<std::string> order;
+    std::unordered_map<std::string, Waiters> in_flight;
+    ResponseCacheStats stats;
+};
+
+/// @brief Serializes the messages of a send_to_device request into bodies within the limits.
+///
+/// Every content is only serialized once. A single message above the size limit gets a body of
+/// its own.
+std::vector<std::string>
+split_to_device(const nlohmann::json &messages, const ToDeviceLimits &limits)
+{
+    constexpr std::string_view prefix = R"({"messages":{)", suffix = "}}";
+
+    std::vector<std::string> bodies;
+    std::string body, user_key, user_entries;
+    std::size_t count = 0;
+
+    auto close_user = [&] {
+        if (user_entries.empty())
+            return;
+        if (!body.empty())
+            body += ',';
+        body.append(user_key).append(":{").append(user_entries).append("}");
+        user_entries.clear();
+    };
+    auto flush = [&] {
+        close_user();
+        if (count == 0)
+            return;
+        bodies.push_back(std::string(prefix).append(body).append(suffix));
+        body.clear();
+        count = 0;
+    };
+
+    for (const auto &[user_id, devices] : messages.items()) {
+        user_key = nlohmann::json(user_id).dump();
+        for (const auto &[device_id, content] : devices.items()) {
+            auto entry = nlohmann::json(device_id).dump() + ":" + content.dump();
+
+            // The body with this entry and the separators and braces around it.
+            auto size = prefix.size() + body.size() + 1 + user_key.size() + 2 +
+                        user_entries.size() + 1 + entry.size() + 1 + suffix.size();
+            bool full = (limits.max_messages && count >= limits.max_messages) ||
+                        (limits.max_bytes && size > limits.max_bytes);
+            if (count > 0 && full)
+                flush();
+
+            if (!user_entries.empty())
+                user_entries += ',';
+            user_entries += entry;
+            count++;
+        }
+        close_user();
+    }
+    flush();
+
+    return bodies;
+}
+
+//! Sends the bodies of one send_to_device() call a few at a time and reports, once all are done.
+struct ToDeviceBatch : std::enable_shared_from_this<ToDeviceBatch>
+{
+    using Put =
+      std::function<void(const std::string &txn_id, const std::string &body, ErrCallback)>;
+
+    ToDeviceBatch(std::vector<std::string> bodies_, std::string txn_id_, Put put_, ErrCallback cb_)
+      : bodies(std::move(bodies_))
+      , txn_id(std::move(txn_id_))
+      , put(std::move(put_))
+      , cb(std::move(cb_))
+      , remaining(bodies.size())
+    {}
+
+    void send_next()
+    {
+        std::size_t index;
+        {
+            std::lock_guard lock(mtx);
+            if (next == bodies.size())
+                return;
+            index = next++;
+        }
+
+        put(txn_id + "." + std::to_string(index),
+            bodies[index],
+            [self = shared_from_this()](RequestErr err) { self->sent(err); });
+    }
+
+    void sent(RequestErr err)
+    {
+        bool done;
+        {
+            std::lock_guard lock(mtx);
+            // Keep sending the others, a retry with the same transaction id only sends the missing
+            // ones again.
+            if (err && !error)
+                error = err;
+            done = --remaining == 0;
+        }
+
+        if (done)
+            cb(error);
+        else
+            send_next();
+    }
+
+    const std::vector<std::string> bodies;
+    const std::string txn_id;
+    const Put put;
+    const ErrCallback cb;
+
+    std::mutex mtx;
+    std::size_t next = 0;
+    std::size_t remaining;
+    std::optional<ClientError> error;
+};
+
+//! Returns true, if the body starts with a gzip or zlib header. libcurl may have decoded the body
+//! already, in which case the Content-Encoding header is still present.
+bool
+has_compression_header(std::string_view body)
+{
+    if (body.size() < 2)
+        return false;
+
+    auto first  = static_cast<unsigned char>(body[0]);
+    auto second = static_cast<unsigned char>(body[1]);
+    if (first == 0x1f && second == 0x8b)
+        return true;
+    return (first & 0x0f) == 8 && (first * 256 + second) % 31 == 0;
+}
+
+//! Inflates a gzip or zlib encoded body. \returns nullopt, if the body is corrupt or truncated or
+//! if it inflates to more than max_size bytes, in which case too_large is set.
+std::optional<std::string>
+inflate_body(std::string_view body, std::size_t max_size, bool &too_large)
+{
+    z_stream stream{};
+    // 15 is the maximum window size, adding 32 detects gzip and zlib headers.
+    if (inflateInit2(&stream, 15 + 32) != Z_OK)
+        return std::nullopt;
+
+    stream.next_in  = reinterpret_cast<Bytef *>(const_cast<char *>(body.data()));
+    stream.avail_in = static_cast<uInt>(body.size());
+
+    std::string decoded(std::min(std::max<std::size_t>(body.size() * 4, 4096), max_size), '\0');
+    int ret = Z_OK;
+    while (ret == Z_OK) {
+        if (stream.total_out == decoded.size()) {
+            // A few kilobytes can inflate to gigabytes, stop before they exhaust the memory.
+            if (decoded.size() >= max_size) {
+                too_large = true;
+                break;
+            }
+            decoded.resize(std::min(decoded.size() * 2, max_size));
+        }
+
+        stream.next_out  = reinterpret_cast<Bytef *>(decoded.data() + stream.total_out);
+        stream.avail_out = static_cast<uInt>(decoded.size() - stream.total_out);
+        ret              = inflate(&stream, Z_NO_FLUSH);
+    }
+    inflateEnd(&stream);
+
+    if (ret != Z_STREAM_END)
+        return std::nullopt;
+    decoded.resize(stream.total_out);
+    return decoded;
+}
+
+//! The result of decode_body().
+enum class Decoded
+{
+    //! The body is passed on as received, because it wasn't compressed or is corrupt.
+    Plain,
+    //! The body was decompressed.
+    Inflated,
+    //! The body decompresses to more than the limit and must not be used.
+    TooLarge,
+};
+
+//! Decompresses the body in place, if the server compressed it.
+Decoded
+decode_body(const coeurl::Headers &headers,
+            std::string_view &body,
+            std::string &storage,
+            std::size_t max_size)
+{
+    auto encoding = headers.find("Content-Encoding");
+    if (encoding == headers.end() ||
+        (encoding->second != "gzip" && encoding->second != "deflate") ||
+        !has_compression_header(body))
+        return Decoded::Plain;
+
+    bool too_large = false;
+    auto decoded   = inflate_body(body, max_size, too_large);
+    if (too_large) {
+        mtx::utils::log::log()->warn("a {} response decompresses to more than {} bytes",
+                                     encoding->second,
+                                     max_size);
+        return Decoded::TooLarge;
+    }
+    if (!decoded) {
+        mtx::utils::log::log()->warn("failed to decompress a {} response", encoding->second);
+        return Decoded::Plain;
+    }
+
+    storage = std::move(*decoded);
+    body    = storage;
+    return Decoded::Inflated;
+}
+
+//! Runs tasks at a point in time on its own thread, which is started on first use.
+class DeadlineTimer
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    static DeadlineTimer &instance()
+    {
+        static DeadlineTimer timer;
+        return timer;
+    }
+
+    void schedule(clock::time_point at, std::function<void()> task)
+    {
+        std::lock_guard lock(mtx);
+        bool earliest = tasks.empty() || at < tasks.begin()->first;
+        tasks.emplace(at, std::move(task));
+        if (earliest)
+            cv.notify_one();
+    }
+
+    ~DeadlineTimer()
+    {
+        {
+            std::lock_guard lock(mtx);
+            stopped = true;
+        }
+        cv.notify_one();
+        worker.join();
+    }
+
+private:
+    DeadlineTimer()
+      : worker([this] { run(); })
+    {}
+
+    void run()
+    {
+        std::unique_lock lock(mtx);
+        while (!stopped) {
+            if (tasks.empty()) {
+                cv.wait(lock);
+                continue;
+            }
+
+            auto next = tasks.begin();
+            if (next->first > clock::now()) {
+                cv.wait_until(lock, next->first);
+                continue;
+            }
+
+            auto task = std::move(next->second);
+            tasks.erase(next);
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::multimap<clock::time_point, std::function<void()>> tasks;
+    bool stopped = false;
+    std::thread worker;
+};
+}
+
+struct TrackedRequest;
+
+struct RequestHandle::State
+{
+    std::optional<std::chrono::milliseconds> timeout;
+
+    mutable std::mutex mtx;
+    bool cancelled = false;
+    //! The requests, that may still be pending.
+    std::vector<std::weak_ptr<TrackedRequest>> pending;
+    //! Handles of requests started on behalf of this one, i.e. the sides of a thumbnail race.
+    //! They are cancelled with it.
+    std::vector<std::weak_ptr<State>> children;
+    RequestHandleStats stats;
+};
+
+namespace {
+//! The handle of the innermost RequestScope of this thread.
+thread_local std::shared_ptr<RequestHandle::State> current_handle;
+
+//! Attaches the requests started from a callback to the handle of the request, that called it.
+struct HandleScope
+{
+    explicit HandleScope(std::shared_ptr<RequestHandle::State> handle)
+      : previous(std::exchange(current_handle, std::move(handle)))
+    {}
+    ~HandleScope() { current_handle = std::move(previous); }
+
+    HandleScope(const HandleScope &)            = delete;
+    HandleScope &operator=(const HandleScope &) = delete;
+
+    std::shared_ptr<RequestHandle::State> previous;
+};
+
+//! The media endpoints a server supports.
+enum class MediaApi
+{
+    Unknown,
+    //! /_matrix/client/v1/media, since v1.11 of the specification.
+    Authenticated,
+    //! /_matrix/media/v3
+    Legacy,
+};
+
+//! True, if the server doesn't know the endpoint. Besides M_UNRECOGNIZED, that is a 404 without a
+//! Matrix error, which reverse proxies send for paths they don't forward. A missing file is
+//! M_NOT_FOUND instead.
+bool
+unrecognized(const RequestErr &err)
+{
+    if (!err)
+        return false;
+    if (err->status_code == 404 && !err->parse_error.empty())
+        return true;
+    return (err->status_code == 404 || err->status_code == 400) &&
+           err->matrix_error.errcode == mtx::errors::ErrorCode::M_UNRECOGNIZED;
+}
+
+//! True, if the server knows the endpoint. Network errors don't tell anything about the server.
+bool
+known(const RequestErr &err)
+{
+    return !err || (err->status_code != 0 && !unrecognized(err));
+}
+}
+
+//! A request started within a RequestScope.
+struct TrackedRequest
+{
+    std::shared_ptr<RequestHandle::State> handle;
+    //! Called with a timeout error, if the deadline passes before the response arrives.
+    TypeErasedCallback on_timeout;
+    Executor executor;
+    //! Set by whatever happens first: the response, cancel() or the deadline.
+    std::atomic<bool> settled = false;
+    //! Set when the request is passed to the transport.
+    std::atomic<bool> sent = false;
+
+    //! \returns true, if this call settled the request.
+    bool settle() { return !settled.exchange(true); }
+
+    void time_out()
+    {
+        if (!settle())
+            return;
+
+        {
+            std::lock_guard lock(handle->mtx);
+            handle->stats.timed_out++;
+        }
+
+        auto fail = [cb = std::move(on_timeout)] {
+            cb(std::nullopt, "", CURLE_OPERATION_TIMEDOUT, 0);
+        };
+        if (executor)
+            executor(std::move(fail));
+        else
+            fail();
+    }
+
+    void not_sent()
+    {
+        std::lock_guard lock(handle->mtx);
+        handle->stats.not_sent++;
+    }
+
+    void discarded(std::size_t bytes)
+    {
+        if (!sent)
+            return;
+
+        std::lock_guard lock(handle->mtx);
+        handle->stats.discarded_responses++;
+        handle->stats.discarded_bytes += bytes;
+    }
+};
+
+struct ClientPoolPrivate
+{
+    std::shared_ptr<coeurl::Client> client = std::make_shared<coeurl::Client>();
+    ConnectionOptions connection_opts;
+    //! Set if the number of concurrent requests of the whole pool is limited.
+    std::shared_ptr<RequestGate> gate;
+    std::atomic<std::size_t> clients = 0;
+};
+
 struct ClientPrivate
 {
-    coeurl::Client client;
+    using Completion = mtx::http::Completion;
+    using Start      = mtx::http::Start;
+    using Dropped    = mtx::http::Dropped;
+
+    explicit ClientPrivate(std::shared_ptr<ClientPoolPrivate> pool_ = nullptr)
+      : client(pool_ ? pool_->client : std::make_shared<coeurl::Client>())
+      , pool(std::move(pool_))
+    {
+        if (pool) {
+            pool->clients++;
+            lifetime = std::make_shared<bool>(true);
+        }
+    }
+    ~ClientPrivate()
+    {
+        if (pool)
+            pool->clients--;
+    }
+
+    //! Shared with the other clients of the pool, if the client belongs to one.
+    std::shared_ptr<coeurl::Client> client;
+    std::shared_ptr<ClientPoolPrivate> pool;
+    //! Only set for clients of a pool. Their requests can complete after the client was destroyed,
+    //! so the completions check, that it is still alive.
+    std::shared_ptr<bool> lifetime;
+    //! Declared after the client, so that it is destroyed first and can't start requests on a
+    //! destroyed client.
+    std::unique_ptr<RequestScheduler> scheduler;
+    //! Set if the number of concurrent requests is limited.
+    std::shared_ptr<RequestGate> gate;
+    ConnectionOptions connection_opts;
+    //! Where responses are handled. Empty to handle them on the network thread.
+    Executor executor;
+    std::shared_ptr<Transfers> transfers = std::make_shared<Transfers>();
+    //! Set if GET responses are cached.
+    std::shared_ptr<ResponseCache> cache;
+    //! Set if media is cached on disk.
+    std::shared_ptr<MediaCache> media_cache;
+    ToDeviceLimits to_device_limits;
+
+    //! protocol://server:port, so it doesn't need to be built for every request.
+    std::string base_url;
+    //! The headers for requests without and with authentication. They are replaced as a whole
+    //! using atomic_load() and atomic_store(), as requests copy them on other threads, while a
+    //! login callback sets the token.
+    std::shared_ptr<const coeurl::Headers> headers, auth_headers;
+
+    std::mutex filters_mtx;
+    //! Uploaded filter ids by the hash of the user, the server and the filter.
+    std::map<std::string, std::string> filter_ids;
+
+    std::mutex media_mtx;
+    //! The media API, that worked for each base url.
+    std::map<std::string, MediaApi> media_apis;
+
+    MediaApi media_api()
+    {
+        std::lock_guard lock(media_mtx);
+        auto it = media_apis.find(base_url);
+        return it != media_apis.end() ? it->second : MediaApi::Unknown;
+    }
+    void set_media_api(MediaApi api)
+    {
+        std::lock_guard lock(media_mtx);
+        media_apis[base_url] = api;
+    }
+
+    void set_base_url(const std::string &protocol, const std::string &server, std::uint16_t port);
+    //! Rebuild the cached headers for the token and the connection options.
+    void set_access_token(const std::string &token);
+
+    //! Queue a request in the scheduler. Rate limited requests are started again and only the
+    //! final response is passed to done. If the request is dropped from the queue, dropped is
+    //! called instead.
+    void schedule(const std::string &endpoint, Start start, Completion done, Dropped dropped);
+
+    //! Send a GET request, bypassing the response cache.
+    void get(const std::string &endpoint,
+             std::string url,
+             TypeErasedCallback cb,
+             std::shared_ptr<const coeurl::Headers> headers,
+             int num_redirects);
+
+    //! Start a request through the concurrency limit and the scheduler, if they are enabled.
+    //! Tracked requests, that were settled in the meantime, are not sent.
+    void dispatch(const std::string &endpoint,
+                  Start start,
+                  Completion done,
+                  Dropped dropped,
+                  std::shared_ptr<TrackedRequest> tracked = nullptr);
+
+    //! Attach a request to the handle of the current RequestScope. \returns nothing, if there is
+    //! no scope. If the handle was cancelled already, the returned request is settled.
+    std::shared_ptr<TrackedRequest> track(const TypeErasedCallback &cb) const;
+
+    //! Returns a completion passing the response to the callback, on the executor if one is set.
+    //! Compressed responses are decompressed and their sizes counted for the endpoint. Responses
+    //! to tracked requests, that were settled already, are dropped.
+    Completion complete(const std::string &endpoint,
+                        TypeErasedCallback cb,
+                        std::shared_ptr<TrackedRequest> tracked = nullptr) const;
+    //! Returns a function failing the request with dropped_error, for when it is dropped before
+    //! it was sent. Tracked requests, that were settled already, are skipped.
+    Dropped drop(TypeErasedCallback cb, std::shared_ptr<TrackedRequest> tracked = nullptr) const;
 };
 
+namespace {
+std::optional<std::chrono::milliseconds>
+retry_after(const coeurl::Request &r)
+{
+    if (r.response_code() != 429)
+        return std::nullopt;
+
+    auto headers = r.response_headers();
+    if (auto header = headers.find("Retry-After"); header != headers.end())
+        if (auto delay = parse_retry_after(header->second))
+            return delay;
+
+    auto body = nlohmann::json::parse(r.response(), nullptr, false);
+    if (body.is_object() && body.contains("retry_after_ms"))
+        return std::chrono::milliseconds(body.value("retry_after_ms", std::uint64_t{0}));
+
+    return std::nullopt;
+}
+}
+
+void
+ClientPrivate::schedule(const std::string &endpoint,
+                        Start start,
+                        Completion done,
+                        Dropped dropped)
+{
+    scheduler->enqueue(
+      endpoint_class(endpoint),
+      [start = std::move(start), done = std::move(done)](RequestScheduler::Attempt attempt) {
+          start([done, attempt](const coeurl::Request &r) mutable {
+              if (attempt.finish(r.response_code(), retry_after(r)))
+                  done(r);
+          });
+      },
+      std::move(dropped));
+}
+
+void
+ClientPrivate::set_base_url(const std::string &protocol,
+                            const std::string &server,
+                            std::uint16_t port)
+{
+    base_url = protocol + "://" + server + ":" + std::to_string(port);
+}
+
+void
+ClientPrivate::set_access_token(const std::string &token)
+{
+    coeurl::Headers plain = {{"User-Agent", "mtxclient v0.9.2"}};
+    if (connection_opts.compress_responses)
+        plain["Accept-Encoding"] = "gzip, deflate";
+
+    auto auth = plain;
+    if (!token.empty())
+        auth["Authorization"] = "Bearer " + token;
+
+    std::atomic_store(&headers, std::make_shared<const coeurl::Headers>(std::move(plain)));
+    std::atomic_store(&auth_headers, std::make_shared<const coeurl::Headers>(std::move(auth)));
+}
+
+void
+ClientPrivate::dispatch(const std::string &endpoint,
+                        Start start,
+                        Completion done,
+                        Dropped dropped,
+                        std::shared_ptr<TrackedRequest> tracked)
+{
+    if (tracked)
+        start = [start = std::move(start), tracked](Completion completion) {
+            if (tracked->settled) {
+                // Dropping the completion frees the slots of the gate and the scheduler.
+                tracked->not_sent();
+                return;
+            }
+            tracked->sent = true;
+            start(std::move(completion));
+        };
+
+    if (gate)
+        start = [gate = gate, start = std::move(start), dropped, owner = this](
+                  Completion completion) {
+            gate->submit(start, std::move(completion), dropped, owner);
+        };
+
+    if (scheduler)
+        schedule(endpoint, std::move(start), std::move(done), std::move(dropped));
+    else
+        start(std::move(done));
+}
+
+void
+ClientPrivate::get(const std::string &endpoint,
+                   std::string url,
+                   TypeErasedCallback cb,
+                   std::shared_ptr<const coeurl::Headers> headers,
+                   int num_redirects)
+{
+    auto tracked = track(cb);
+    if (tracked && tracked->settled)
+        return;
+
+    if (!scheduler && !gate && !tracked)
+        return client->get(url, complete(endpoint, std::move(cb)), *headers, num_redirects);
+
+    auto dropped = drop(cb, tracked);
+    auto done    = complete(endpoint, std::move(cb), tracked);
+    dispatch(endpoint,
+             [client = client.get(), url = std::move(url), headers, num_redirects](
+               Completion completion) {
+                 client->get(url, std::move(completion), *headers, num_redirects);
+             },
+             std::move(done),
+             std::move(dropped),
+             std::move(tracked));
+}
+
+std::shared_ptr<TrackedRequest>
+ClientPrivate::track(const TypeErasedCallback &cb) const
+{
+    auto handle = current_handle;
+    if (!handle)
+        return nullptr;
+
+    auto request    = std::make_shared<TrackedRequest>();
+    request->handle = handle;
+
+    std::lock_guard lock(handle->mtx);
+    handle->stats.requests++;
+    if (handle->cancelled) {
+        request->settled = true;
+        handle->stats.not_sent++;
+        return request;
+    }
+
+    // Forget the completed requests, before the list grows.
+    if (handle->pending.size() == handle->pending.capacity())
+        std::erase_if(handle->pending, [](const auto &r) { return r.expired(); });
+    handle->pending.push_back(request);
+
+    if (handle->timeout) {
+        request->on_timeout = cb;
+        request->executor   = executor;
+        DeadlineTimer::instance().schedule(
+          DeadlineTimer::clock::now() + *handle->timeout,
+          [weak = std::weak_ptr<TrackedRequest>(request)] {
+              if (auto r = weak.lock())
+                  r->time_out();
+          });
+    }
+    return request;
+}
+
+ClientPrivate::Completion
+ClientPrivate::complete(const std::string &endpoint,
+                        TypeErasedCallback cb,
+                        std::shared_ptr<TrackedRequest> tracked) const
+{
+    return [cb = std::move(cb),
+            executor  = executor,
+            transfers = transfers,
+            endpoint  = endpoint_class(endpoint),
+            max_size  = connection_opts.max_decompressed_size,
+            pooled    = lifetime != nullptr,
+            alive     = std::weak_ptr<bool>(lifetime),
+            tracked   = std::move(tracked)](const coeurl::Request &r) {
+        if (pooled && alive.expired())
+            return;
+        if (tracked && !tracked->settle())
+            return tracked->discarded(r.response().size());
+
+        auto headers    = r.response_headers();
+        auto body       = r.response();
+        auto error_code = r.error_code();
+        std::string decoded;
+        auto decoding = decode_body(headers, body, decoded, max_size);
+        if (decoding == Decoded::TooLarge) {
+            body       = {};
+            error_code = CURLE_FILESIZE_EXCEEDED;
+        }
+        transfers->add(endpoint, r.response().size(), body.size(), decoding == Decoded::Inflated);
+
+        if (!executor)
+            return cb(std::move(headers), body, error_code, r.response_code());
+
+        // The request is destroyed after the completion returns, so the response has to be
+        // copied.
+        executor([cb,
+                  headers     = std::optional<coeurl::Headers>(std::move(headers)),
+                  body = decoding == Decoded::Inflated ? std::move(decoded) : std::string(body),
+                  error_code,
+                  status_code = r.response_code()] {
+            cb(headers, body, error_code, status_code);
+        });
+    };
+}
+
+ClientPrivate::Dropped
+ClientPrivate::drop(TypeErasedCallback cb, std::shared_ptr<TrackedRequest> tracked) const
+{
+    return [cb = std::move(cb),
+            executor = executor,
+            pooled   = lifetime != nullptr,
+            alive    = std::weak_ptr<bool>(lifetime),
+            tracked  = std::move(tracked)] {
+        if (pooled && alive.expired())
+            return;
+        if (tracked) {
+            if (!tracked->settle())
+                return;
+            tracked->not_sent();
+        }
+
+        auto fail = [cb] { cb(std::nullopt, "", dropped_error, 0); };
+        if (executor)
+            executor(std::move(fail));
+        else
+            fail();
+    };
+}
+
 void
 UIAHandler::next(const user_interactive::Auth &auth) const
 {
@@ -34,43 +1210,181 @@ Client::Client(const std::string &server, uint16_t port)
 {
     set_server(server);
     set_port(port);
+    p->set_access_token(access_token_);
 
-    p->client.set_verify_peer(true);
-    p->client.connection_timeout(60);
+    set_connection_options({});
+}
+
+Client::Client(std::shared_ptr<ClientPoolPrivate> pool, const std::string &server, uint16_t port)
+  : p{new ClientPrivate(std::move(pool))}
+{
+    set_server(server);
+    set_port(port);
+
+    set_connection_options(p->pool->connection_opts);
+    p->gate = p->pool->gate;
 }
 
 // call destuctor of work queue and ios first!
-Client::~Client() { p.reset(); }
+Client::~Client()
+{
+    // The gate can outlive the client, if it is shared with a pool or a request is still in
+    // flight. Its queued requests would start on a transport, that may be gone.
+    if (p->gate)
+        p->gate->clear(p.get());
+    // Responses to requests of a pooled client can arrive after it is gone, they must not reach
+    // the requests waiting for them.
+    if (p->cache)
+        p->cache->detach();
+    p.reset();
+}
 
 void
 Client::shutdown()
 {
-    p->client.shutdown();
+    if (p->scheduler)
+        p->scheduler->clear();
+    if (p->gate)
+        p->gate->clear(p.get());
+
+    // The transport of a pool is shared with the other clients.
+    if (!p->pool)
+        p->client->shutdown();
 }
 
 void
 Client::alt_svc_cache_path(const std::string &path)
 {
-    p->client.alt_svc_cache_path(path);
+    if (p->pool)
+        return;
+
+    p->client->alt_svc_cache_path(path);
+    p->connection_opts.alt_svc_cache_path = path;
+}
+
+void
+Client::set_scheduler(std::optional<SchedulerOpts> opts)
+{
+    if (opts)
+        p->scheduler = std::make_unique<RequestScheduler>(std::move(*opts));
+    else
+        p->scheduler.reset();
+}
+
+void
+Client::set_connection_options(const ConnectionOptions &opts)
+{
+    auto alt_svc       = std::move(p->connection_opts.alt_svc_cache_path);
+    p->connection_opts = opts;
+    if (opts.alt_svc_cache_path.empty())
+        p->connection_opts.alt_svc_cache_path = std::move(alt_svc);
+
+    if (p->pool) {
+        // The transport and the connection limit are shared with the other clients of the pool.
+        const auto &pooled                         = p->pool->connection_opts;
+        p->connection_opts.verify_peer             = pooled.verify_peer;
+        p->connection_opts.connect_timeout         = pooled.connect_timeout;
+        p->connection_opts.alt_svc_cache_path      = pooled.alt_svc_cache_path;
+        p->connection_opts.max_concurrent_requests = pooled.max_concurrent_requests;
+    } else {
+        p->client->set_verify_peer(opts.verify_peer);
+        p->client->connection_timeout(opts.connect_timeout);
+        if (!opts.alt_svc_cache_path.empty())
+            p->client->alt_svc_cache_path(opts.alt_svc_cache_path);
+
+        // Requests already queued in an old gate are still started by it.
+        if (opts.max_concurrent_requests != (p->gate ? p->gate->limit : 0)) {
+            if (opts.max_concurrent_requests)
+                p->gate = std::make_shared<RequestGate>(opts.max_concurrent_requests);
+            else
+                p->gate.reset();
+        }
+    }
+
+    p->set_access_token(access_token_);
+}
+
+ConnectionOptions
+Client::connection_options() const
+{
+    auto opts        = p->connection_opts;
+    opts.verify_peer = p->client->does_verify_peer();
+    return opts;
+}
+
+void
+Client::set_executor(Executor executor)
+{
+    p->executor = std::move(executor);
+}
+
+SchedulerStats
+Client::scheduler_stats() const
+{
+    return p->scheduler ? p->scheduler->stats() : SchedulerStats{};
 }
 
-coeurl::Headers
-mtx::http::Client::prepare_headers(bool requires_auth)
+std::map<std::string, TransferCounters>
+Client::transfer_stats() const
 {
-    coeurl::Headers headers;
-    headers["User-Agent"] = "mtxclient v0.9.2";
+    std::lock_guard lock(p->transfers->mtx);
+    return p->transfers->counters;
+}
+
+void
+Client::reset_transfer_stats()
+{
+    std::lock_guard lock(p->transfers->mtx);
+    p->transfers->counters.clear();
+}
+
+void
+Client::set_response_cache(std::optional<ResponseCacheOpts> opts)
+{
+    p->cache = opts ? std::make_shared<ResponseCache>(std::move(*opts)) : nullptr;
+}
 
-    if (requires_auth && !access_token_.empty())
-        headers["Authorization"] = "Bearer " + access_token();
+ResponseCacheStats
+Client::response_cache_stats() const
+{
+    return p->cache ? p->cache->get_stats() : ResponseCacheStats{};
+}
 
-    return headers;
+void
+Client::clear_response_cache()
+{
+    if (p->cache)
+        p->cache->clear();
+}
+
+void
+Client::set_media_cache(std::shared_ptr<MediaCache> cache)
+{
+    p->media_cache = std::move(cache);
+}
+
+void
+Client::set_to_device_limits(ToDeviceLimits limits)
+{
+    p->to_device_limits = limits;
+}
+
+std::shared_ptr<const coeurl::Headers>
+mtx::http::Client::prepare_headers(bool requires_auth) const
+{
+    return std::atomic_load(requires_auth ? &p->auth_headers : &p->headers);
 }
 
 std::string
-mtx::http::Client::endpoint_to_url(const std::string &endpoint, const char *endpoint_namespace)
+mtx::http::Client::endpoint_to_url(const std::string &endpoint,
+                                   const char *endpoint_namespace) const
 {
-    return protocol_ + "://" + server_ + ":" + std::to_string(port_) + endpoint_namespace +
-           endpoint;
+    std::string_view ns = endpoint_namespace;
+
+    std::string url;
+    url.reserve(p->base_url.size() + ns.size() + endpoint.size());
+    url.append(p->base_url).append(ns).append(endpoint);
+    return url;
 }
 
 void
@@ -80,45 +1394,88 @@ mtx::http::Client::post(const std::string &endpoint,
                         bool requires_auth,
                         const std::string &content_type)
 {
-    p->client.post(
-      endpoint_to_url(endpoint),
-      req,
-      content_type,
-      [cb = std::move(cb)](const coeurl::Request &r) {
-          cb(r.response_headers(), r.response(), r.error_code(), r.response_code());
-      },
-      prepare_headers(requires_auth));
+    if (p->cache)
+        cb = ResponseCache::invalidating(p->cache, endpoint_to_url(endpoint), std::move(cb));
+
+    auto tracked = p->track(cb);
+    if (tracked && tracked->settled)
+        return;
+
+    if (!p->scheduler && !p->gate && !tracked)
+        return p->client->post(endpoint_to_url(endpoint),
+                              req,
+                              content_type,
+                              p->complete(endpoint, std::move(cb)),
+                              *prepare_headers(requires_auth));
+
+    auto dropped = p->drop(cb, tracked);
+    auto done    = p->complete(endpoint, std::move(cb), tracked);
+    p->dispatch(endpoint,
+                [client       = p->client.get(),
+                 url          = endpoint_to_url(endpoint),
+                 req,
+                 content_type,
+                 headers = prepare_headers(requires_auth)](ClientPrivate::Completion completion) {
+                    client->post(url, req, content_type, std::move(completion), *headers);
+                },
+                std::move(done),
+                std::move(dropped),
+                std::move(tracked));
 }
 
 void
 mtx::http::Client::delete_(const std::string &endpoint, ErrCallback cb, bool requires_auth)
 {
-    p->client.delete_(
-      endpoint_to_url(endpoint),
-      [cb = std::move(cb)](const coeurl::Request &r) {
-          mtx::http::ClientError client_error;
-          if (r.error_code()) {
-              client_error.error_code = r.error_code();
-              return cb(client_error);
-          }
+    TypeErasedCallback handler = [cb = std::move(cb)](HeaderFields,
+                                                      const std::string_view &body,
+                                                      int error_code,
+                                                      int status_code) {
+        mtx::http::ClientError client_error;
+        if (error_code) {
+            client_error.error_code = error_code;
+            return cb(client_error);
+        }
 
-          client_error.status_code = r.response_code();
-
-          // We only count 2xx status codes as success.
-          if (client_error.status_code < 200 || client_error.status_code >= 300) {
-              // The homeserver should return an error struct.
-              try {
-                  nlohmann::json json_error = nlohmann::json::parse(r.response());
-                  client_error.matrix_error = json_error.get<mtx::errors::Error>();
-              } catch (const nlohmann::json::exception &e) {
-                  client_error.parse_error =
-                    std::string(e.what()) + ": " + std::string(r.response());
-              }
-              return cb(client_error);
-          }
-          return cb({});
-      },
-      prepare_headers(requires_auth));
+        client_error.status_code = status_code;
+
+        // We only count 2xx status codes as success.
+        if (client_error.status_code < 200 || client_error.status_code >= 300) {
+            // The homeserver should return an error struct.
+            try {
+                nlohmann::json json_error = nlohmann::json::parse(body);
+                client_error.matrix_error = json_error.get<mtx::errors::Error>();
+            } catch (const nlohmann::json::exception &e) {
+                client_error.parse_error = std::string(e.what()) + ": " + std::string(body);
+            }
+            return cb(client_error);
+        }
+        return cb({});
+    };
+
+    if (p->cache)
+        handler =
+          ResponseCache::invalidating(p->cache, endpoint_to_url(endpoint), std::move(handler));
+
+    auto tracked = p->track(handler);
+    if (tracked && tracked->settled)
+        return;
+
+    if (!p->scheduler && !p->gate && !tracked)
+        return p->client->delete_(endpoint_to_url(endpoint),
+                                 p->complete(endpoint, std::move(handler)),
+                                 *prepare_headers(requires_auth));
+
+    auto dropped = p->drop(handler, tracked);
+    auto done    = p->complete(endpoint, std::move(handler), tracked);
+    p->dispatch(endpoint,
+                [client  = p->client.get(),
+                 url     = endpoint_to_url(endpoint),
+                 headers = prepare_headers(requires_auth)](ClientPrivate::Completion completion) {
+                    client->delete_(url, std::move(completion), *headers);
+                },
+                std::move(done),
+                std::move(dropped),
+                std::move(tracked));
 }
 
 void
@@ -127,14 +1484,32 @@ mtx::http::Client::put(const std::string &endpoint,
                        mtx::http::TypeErasedCallback cb,
                        bool requires_auth)
 {
-    p->client.put(
-      endpoint_to_url(endpoint),
-      req,
-      "application/json",
-      [cb = std::move(cb)](const coeurl::Request &r) {
-          cb(r.response_headers(), r.response(), r.error_code(), r.response_code());
-      },
-      prepare_headers(requires_auth));
+    if (p->cache)
+        cb = ResponseCache::invalidating(p->cache, endpoint_to_url(endpoint), std::move(cb));
+
+    auto tracked = p->track(cb);
+    if (tracked && tracked->settled)
+        return;
+
+    if (!p->scheduler && !p->gate && !tracked)
+        return p->client->put(endpoint_to_url(endpoint),
+                             req,
+                             "application/json",
+                             p->complete(endpoint, std::move(cb)),
+                             *prepare_headers(requires_auth));
+
+    auto dropped = p->drop(cb, tracked);
+    auto done    = p->complete(endpoint, std::move(cb), tracked);
+    p->dispatch(endpoint,
+                [client  = p->client.get(),
+                 url     = endpoint_to_url(endpoint),
+                 req,
+                 headers = prepare_headers(requires_auth)](ClientPrivate::Completion completion) {
+                    client->put(url, req, "application/json", std::move(completion), *headers);
+                },
+                std::move(done),
+                std::move(dropped),
+                std::move(tracked));
 }
 
 void
@@ -144,19 +1519,40 @@ mtx::http::Client::get(const std::string &endpoint,
                        const std::string &endpoint_namespace,
                        int num_redirects)
 {
-    p->client.get(
-      endpoint_to_url(endpoint, endpoint_namespace.c_str()),
-      [cb = std::move(cb)](const coeurl::Request &r) {
-          cb(r.response_headers(), r.response(), r.error_code(), r.response_code());
-      },
-      prepare_headers(requires_auth),
-      num_redirects);
+    auto url      = endpoint_to_url(endpoint, endpoint_namespace.c_str());
+    auto headers = prepare_headers(requires_auth);
+
+    // Requests with a handle may be cancelled or time out individually, so they neither use cached
+    // responses nor join others.
+    auto ttl = p->cache ? p->cache->ttl(endpoint) : std::nullopt;
+    if (ttl && !current_handle) {
+        std::string etag;
+        auto refetch = [weak = weak_from_this(), endpoint, url, headers, num_redirects](
+                         TypeErasedCallback cb) {
+            if (auto self = weak.lock())
+                self->p->get(endpoint, url, std::move(cb), headers, num_redirects);
+        };
+        auto fetch = p->cache->begin(
+          p->cache, url, requires_auth, *ttl, std::move(cb), p->executor, etag, std::move(refetch));
+        if (!fetch)
+            return;
+
+        cb = std::move(*fetch);
+        if (!etag.empty()) {
+            auto revalidate             = *headers;
+            revalidate["If-None-Match"] = etag;
+            headers = std::make_shared<const coeurl::Headers>(std::move(revalidate));
+        }
+    }
+
+    p->get(endpoint, std::move(url), std::move(cb), std::move(headers), num_redirects);
 }
 
 void
 Client::verify_certificates(bool enabled)
 {
-    p->client.set_verify_peer(enabled);
+    if (!p->pool)
+        p->client->set_verify_peer(enabled);
 }
 
 void
@@ -185,18 +1581,162 @@ Client::set_server(const std::string &server)
         auto tmp = std::string(server_name.substr(colon_offset + 1));
         if (mtx::client::utils::is_number(tmp)) {
             port_ = static_cast<std::uint16_t>(std::stoul(tmp));
+            p->set_base_url(protocol_, server_, port_);
             return;
         }
     }
 
     server_ = std::string(server_name);
     port_   = port;
+    p->set_base_url(protocol_, server_, port_);
+}
+
+std::string
+Client::server_url()
+{
+    return p->base_url;
+}
+
+void
+Client::set_port(uint16_t port)
+{
+    port_ = port;
+    p->set_base_url(protocol_, server_, port_);
+}
+
+void
+Client::set_access_token(const std::string &token)
+{
+    access_token_ = token;
+    p->set_access_token(access_token_);
+    if (p->cache)
+        p->cache->clear();
+}
+
+void
+Client::clear()
+{
+    device_id_.clear();
+    access_token_.clear();
+    next_batch_token_.clear();
+    server_.clear();
+    port_ = 443;
+    p->set_base_url(protocol_, server_, port_);
+    p->set_access_token(access_token_);
+
+    if (p->cache)
+        p->cache->clear();
+
+    std::lock_guard lock(p->filters_mtx);
+    p->filter_ids.clear();
 }
 
 void
 Client::close(bool force)
 {
-    p->client.close(force);
+    if (!p->pool)
+        p->client->close(force);
+}
+
+RequestHandle::RequestHandle()
+  : state(std::make_shared<State>())
+{}
+
+RequestHandle::RequestHandle(std::chrono::milliseconds timeout)
+  : RequestHandle()
+{
+    state->timeout = timeout;
+}
+
+namespace {
+void
+cancel_requests(RequestHandle::State &state)
+{
+    std::vector<std::shared_ptr<RequestHandle::State>> children;
+    {
+        std::lock_guard lock(state.mtx);
+        state.cancelled = true;
+        for (const auto &weak : state.pending)
+            if (auto request = weak.lock(); request && request->settle())
+                state.stats.cancelled++;
+        state.pending.clear();
+
+        for (const auto &weak : state.children)
+            if (auto child = weak.lock())
+                children.push_back(std::move(child));
+        state.children.clear();
+    }
+
+    for (const auto &child : children)
+        cancel_requests(*child);
+}
+}
+
+void
+RequestHandle::cancel()
+{
+    cancel_requests(*state);
+}
+
+bool
+RequestHandle::cancelled() const
+{
+    std::lock_guard lock(state->mtx);
+    return state->cancelled;
+}
+
+RequestHandleStats
+RequestHandle::stats() const
+{
+    std::lock_guard lock(state->mtx);
+    return state->stats;
+}
+
+RequestScope::RequestScope(const RequestHandle &handle)
+  : previous(std::exchange(current_handle, handle.state))
+{}
+
+RequestScope::~RequestScope() { current_handle = std::move(previous); }
+
+ClientPool::ClientPool(const ConnectionOptions &opts)
+  : p(std::make_shared<ClientPoolPrivate>())
+{
+    p->client->set_verify_peer(opts.verify_peer);
+    p->client->connection_timeout(opts.connect_timeout);
+    if (!opts.alt_svc_cache_path.empty())
+        p->client->alt_svc_cache_path(opts.alt_svc_cache_path);
+
+    if (opts.max_concurrent_requests)
+        p->gate = std::make_shared<RequestGate>(opts.max_concurrent_requests);
+    p->connection_opts = opts;
+}
+
+ClientPool::~ClientPool() = default;
+
+std::shared_ptr<Client>
+ClientPool::make_client(const std::string &server, uint16_t port)
+{
+    return std::shared_ptr<Client>(new Client(p, server, port));
+}
+
+std::size_t
+ClientPool::clients() const
+{
+    return p->clients;
+}
+
+void
+ClientPool::shutdown()
+{
+    if (p->gate)
+        p->gate->clear();
+    p->client->shutdown();
+}
+
+void
+ClientPool::close(bool force)
+{
+    p->client->close(force);
 }
 
 //
@@ -238,9 +1778,9 @@ Client::login(const mtx::requests::Login &req, Callback<mtx::responses::Login> c
       [_this    = shared_from_this(),
        callback = std::move(callback)](const mtx::responses::Login &resp, RequestErr err) {
           if (!err && resp.access_token.size()) {
-              _this->user_id_      = resp.user_id;
-              _this->device_id_    = resp.device_id;
-              _this->access_token_ = resp.access_token;
+              _this->user_id_   = resp.user_id;
+              _this->device_id_ = resp.device_id;
+              _this->set_access_token(resp.access_token);
           }
           callback(resp, err);
       },
@@ -262,8 +1802,7 @@ std::string
 Client::login_sso_redirect(std::string redirectUrl, const std::string &idp)
 {
     const std::string idp_suffix = idp.empty() ? idp : ("/" + mtx::client::utils::url_encode(idp));
-    return protocol_ + "://" + server() + ":" + std::to_string(port()) +
-           "/_matrix/client/v3/login/sso/redirect" + idp_suffix + "?" +
+    return p->base_url + "/_matrix/client/v3/login/sso/redirect" + idp_suffix + "?" +
            mtx::client::utils::query_params({{"redirectUrl", redirectUrl}});
 }
 
@@ -659,8 +2198,9 @@ Client::unban_user(const std::string &room_id,
       api_path, req, std::move(callback));
 }
 
-void
-Client::sync(const SyncOpts &opts, Callback<mtx::responses::Sync> callback)
+namespace {
+std::string
+sync_endpoint(const SyncOpts &opts)
 {
     std::map<std::string, std::string> params;
 
@@ -678,12 +2218,51 @@ Client::sync(const SyncOpts &opts, Callback<mtx::responses::Sync> callback)
 
     params.emplace("timeout", std::to_string(opts.timeout));
 
+    return "/client/v3/sync?" + mtx::client::utils::query_params(params);
+}
+}
+
+void
+Client::sync(const SyncOpts &opts, Callback<mtx::responses::Sync> callback)
+{
     get<mtx::responses::Sync>(
-      "/client/v3/sync?" + mtx::client::utils::query_params(params),
+      sync_endpoint(opts),
       [callback = std::move(callback)](
         const mtx::responses::Sync &res, HeaderFields, RequestErr err) { callback(res, err); });
 }
 
+void
+Client::sync_raw(const SyncOpts &opts, Callback<std::string> callback)
+{
+    get<std::string>(
+      sync_endpoint(opts),
+      [callback = std::move(callback)](const std::string &res, HeaderFields, RequestErr err) {
+          callback(res, err);
+      });
+}
+
+void
+Client::sliding_sync(const mtx::requests::SlidingSync &req,
+                     const SlidingSyncOpts &opts,
+                     Callback<mtx::responses::SlidingSync> callback)
+{
+    std::map<std::string, std::string> params;
+
+    if (!opts.pos.empty())
+        params.emplace("pos", opts.pos);
+
+    if (opts.set_presence)
+        params.emplace("set_presence", mtx::presence::to_string(opts.set_presence.value()));
+
+    params.emplace("timeout", std::to_string(opts.timeout));
+
+    post<mtx::requests::SlidingSync, mtx::responses::SlidingSync>(
+      "/client/unstable/org.matrix.simplified_msc3575/sync?" +
+        mtx::client::utils::query_params(params),
+      req,
+      std::move(callback));
+}
+
 void
 Client::versions(Callback<mtx::responses::Versions> callback)
 {
@@ -758,55 +2337,216 @@ Client::preview_url(const std::optional<std::int64_t> &timestamp,
       });
 }
 
+namespace {
+//! A thumbnail and a download of the same media. The first successful response wins and the other
+//! request is cancelled.
+struct MediaRace
+{
+    explicit MediaRace(Callback<std::string> cb_)
+      : cb(std::move(cb_))
+    {
+        // Cancelling the handle of the caller cancels both sides.
+        for (auto *side : {&thumbnail, &download}) {
+            *side = std::make_shared<RequestHandle::State>();
+            if (!current_handle)
+                continue;
+
+            std::lock_guard lock(current_handle->mtx);
+            (*side)->timeout   = current_handle->timeout;
+            (*side)->cancelled = current_handle->cancelled;
+            current_handle->children.push_back(*side);
+        }
+    }
+
+    void finished(bool is_thumbnail, const std::string &res, RequestErr err)
+    {
+        std::shared_ptr<RequestHandle::State> loser;
+        std::optional<ClientError> error;
+        {
+            std::lock_guard lock(mtx);
+            if (done)
+                return;
+
+            if (err) {
+                (is_thumbnail ? thumbnail_error : download_error) = err;
+                if (--pending > 0)
+                    return;
+
+                // Like the sequential fallback, only report the error of the download, if there
+                // is no thumbnail.
+                error = thumbnail_error->status_code == 404 ? download_error : thumbnail_error;
+            } else {
+                loser = is_thumbnail ? download : thumbnail;
+            }
+            done = true;
+        }
+
+        if (loser)
+            cancel_requests(*loser);
+        cb(res, error);
+    }
+
+    Callback<std::string> cb;
+    std::shared_ptr<RequestHandle::State> thumbnail, download;
+
+    std::mutex mtx;
+    int pending = 2;
+    bool done   = false;
+    std::optional<ClientError> thumbnail_error, download_error;
+};
+}
+
+namespace {
+//! Stores a response on the I/O thread of the cache. Lookups posted afterwards find it.
+void
+store_media(const std::shared_ptr<MediaCache> &cache,
+            std::string key,
+            const std::string &data,
+            std::string content_type = "",
+            std::string filename     = "")
+{
+    cache->post([cache,
+                 key          = std::move(key),
+                 data         = data,
+                 content_type = std::move(content_type),
+                 filename     = std::move(filename)] {
+        cache->put(key, data, content_type, filename);
+    });
+}
+}
+
 void
 Client::get_thumbnail(const ThumbOpts &opts, Callback<std::string> callback, bool try_download)
+{
+    auto media_cache = p->media_cache;
+    if (!media_cache)
+        return fetch_thumbnail(opts, std::move(callback), try_download, nullptr);
+
+    // Reading the disk on the network thread would stall every other request of the pool.
+    media_cache->post([_this       = shared_from_this(),
+                       media_cache = std::move(media_cache),
+                       opts,
+                       callback = std::move(callback),
+                       try_download,
+                       executor = p->executor,
+                       handle   = current_handle]() mutable {
+        if (auto file = media_cache->get(MediaCache::key(opts))) {
+            auto respond = [callback = std::move(callback), file = std::move(*file)] {
+                callback(std::string(file.data()), std::nullopt);
+            };
+            if (executor)
+                executor(std::move(respond));
+            else
+                respond();
+            return;
+        }
+
+        HandleScope scope(handle);
+        _this->fetch_thumbnail(opts, std::move(callback), try_download, std::move(media_cache));
+    });
+}
+
+void
+Client::fetch_thumbnail(const ThumbOpts &opts,
+                        Callback<std::string> callback,
+                        bool try_download,
+                        std::shared_ptr<MediaCache> media_cache)
 {
     std::map<std::string, std::string> params;
     params.emplace("width", std::to_string(opts.width));
     params.emplace("height", std::to_string(opts.height));
     params.emplace("method", opts.method);
 
-    auto mxc            = mtx::client::utils::parse_mxc_url(opts.mxc_url);
-    const auto api_path = "/client/v1/media/thumbnail/" + mxc.server + "/" + mxc.media_id + "?" +
-                          client::utils::query_params(params);
-    auto fallback_api_path = "/media/v3/thumbnail/" + mxc.server + "/" + mxc.media_id + "?" +
-                             client::utils::query_params(params);
+    auto mxc  = mtx::client::utils::parse_mxc_url(opts.mxc_url);
+    auto path = "thumbnail/" + mxc.server + "/" + mxc.media_id + "?" +
+                client::utils::query_params(params);
+
+    // Only the thumbnail itself is stored under its key. A download used instead is stored under
+    // the key of the media by download().
+    auto store = [media_cache, key = MediaCache::key(opts)](const std::string &res,
+                                                            RequestErr err) {
+        if (media_cache && !err)
+            store_media(media_cache, key, res);
+    };
+
+    if (try_download && opts.race_download) {
+        auto race = std::make_shared<MediaRace>(std::move(callback));
+        {
+            HandleScope scope(race->thumbnail);
+            get_media(path, [race, store](const std::string &res, HeaderFields, RequestErr err) {
+                store(res, err);
+                race->finished(true, res, err);
+            });
+        }
+        HandleScope scope(race->download);
+        download(mxc.server,
+                 mxc.media_id,
+                 [race](const std::string &res,
+                        const std::string &, // content_type
+                        const std::string &, // original_filename
+                        RequestErr err) { race->finished(false, res, err); });
+        return;
+    }
+
+    get_media(path,
+              [callback = std::move(callback),
+               store,
+               try_download,
+               mxc    = std::move(mxc),
+               _this  = shared_from_this(),
+               handle = current_handle](const std::string &res, HeaderFields, RequestErr err) {
+                  store(res, err);
+                  if (!err || !try_download || err->status_code != 404)
+                      return callback(res, err);
+
+                  HandleScope scope(handle);
+                  _this->download(mxc.server,
+                                  mxc.media_id,
+                                  [callback](const std::string &res,
+                                             const std::string &, // content_type
+                                             const std::string &, // original_filename
+                                             RequestErr err) { callback(res, err); });
+              });
+}
+
+void
+Client::get_media(const std::string &path, HeadersCallback<std::string> cb, int num_redirects)
+{
+    auto api = p->media_api();
+    if (api == MediaApi::Legacy)
+        return get<std::string>(
+          "/media/v3/" + path, std::move(cb), true, "/_matrix", num_redirects);
 
     get<std::string>(
-      api_path,
-      [callback = std::move(callback),
-       try_download,
-       mxc   = std::move(mxc),
-       _this = shared_from_this(),
-       fallback_api_path =
-         std::move(fallback_api_path)](const std::string &res, HeaderFields, RequestErr err) {
-          if (!err || !(err->status_code == 404 || err->status_code == 400)) {
-              callback(res, err);
-          } else if (err && try_download && err->status_code == 404) {
-              _this->download(mxc.server,
-                              mxc.media_id,
-                              [callback](const std::string &res,
-                                         const std::string &, // content_type
-                                         const std::string &, // original_filename
-                                         RequestErr err) { callback(res, err); });
-          } else {
-              _this->get<std::string>(fallback_api_path,
-                                      [callback = callback, try_download, mxc, _this](
-                                        const std::string &res, HeaderFields, RequestErr err) {
-                                          if (err && try_download && err->status_code == 404) {
-                                              _this->download(
-                                                mxc.server,
-                                                mxc.media_id,
-                                                [callback](const std::string &res,
-                                                           const std::string &, // content_type
-                                                           const std::string &, // original_filename
-                                                           RequestErr err) { callback(res, err); });
-                                          } else {
-                                              callback(res, err);
-                                          }
-                                      });
+      "/client/v1/media/" + path,
+      [_this = shared_from_this(),
+       cb    = std::move(cb),
+       path,
+       api,
+       num_redirects,
+       handle = current_handle](const std::string &res, HeaderFields fields, RequestErr err) {
+          if (!unrecognized(err) || api == MediaApi::Authenticated) {
+              // Errors like a missing file are sent by servers without the endpoint as well.
+              if (!err)
+                  _this->p->set_media_api(MediaApi::Authenticated);
+              return cb(res, fields, err);
           }
-      });
+
+          HandleScope scope(handle);
+          _this->get<std::string>(
+            "/media/v3/" + path,
+            [_this, cb](const std::string &res, HeaderFields fields, RequestErr err) {
+                if (known(err))
+                    _this->p->set_media_api(MediaApi::Legacy);
+                cb(res, fields, err);
+            },
+            true,
+            "/_matrix",
+            num_redirects);
+      },
+      true,
+      "/_matrix",
+      num_redirects);
 }
 
 void
@@ -817,8 +2557,47 @@ Client::download(const std::string &server,
                                     const std::string &original_filename,
                                     RequestErr err)> callback)
 {
-    auto cb = [callback =
-                 std::move(callback)](const std::string &res, HeaderFields fields, RequestErr err) {
+    auto media_cache = p->media_cache;
+    if (!media_cache)
+        return fetch_download(server, media_id, std::move(callback), nullptr);
+
+    // Reading the disk on the network thread would stall every other request of the pool.
+    media_cache->post([_this       = shared_from_this(),
+                       media_cache = std::move(media_cache),
+                       server,
+                       media_id,
+                       callback = std::move(callback),
+                       executor = p->executor,
+                       handle   = current_handle]() mutable {
+        if (auto file = media_cache->get(MediaCache::key("mxc://" + server + "/" + media_id))) {
+            auto respond = [callback = std::move(callback), file = std::move(*file)] {
+                callback(std::string(file.data()), file.content_type(), file.filename(), {});
+            };
+            if (executor)
+                executor(std::move(respond));
+            else
+                respond();
+            return;
+        }
+
+        HandleScope scope(handle);
+        _this->fetch_download(server, media_id, std::move(callback), std::move(media_cache));
+    });
+}
+
+void
+Client::fetch_download(const std::string &server,
+                       const std::string &media_id,
+                       std::function<void(const std::string &res,
+                                          const std::string &content_type,
+                                          const std::string &original_filename,
+                                          RequestErr err)> callback,
+                       std::shared_ptr<MediaCache> media_cache)
+{
+    auto key = MediaCache::key("mxc://" + server + "/" + media_id);
+
+    auto cb = [callback = std::move(callback), media_cache, key](
+                const std::string &res, HeaderFields fields, RequestErr err) {
         std::string content_type, original_filename;
 
         if (fields) {
@@ -838,26 +2617,15 @@ Client::download(const std::string &server,
             }
         }
 
+        if (!err && media_cache)
+            store_media(media_cache, key, res, content_type, original_filename);
         callback(res, content_type, original_filename, err);
     };
 
-    const auto api_path = "/client/v1/media/download/" + client::utils::url_encode(server) + "/" +
-                          client::utils::url_encode(media_id);
-    get<std::string>(
-      api_path,
-      [_this = shared_from_this(), cb = std::move(cb), server, media_id](
-        const std::string &res, HeaderFields fields, RequestErr err) {
-          if (!err || !(err->status_code == 404 || err->status_code == 400)) {
-              cb(res, fields, err);
-          } else {
-              const auto api_path = "/media/v3/download/" + client::utils::url_encode(server) +
-                                    "/" + client::utils::url_encode(media_id);
-              _this->get<std::string>(api_path, std::move(cb));
-          }
-      },
-      true,
-      "/_matrix",
-      3);
+    get_media("download/" + client::utils::url_encode(server) + "/" +
+                client::utils::url_encode(media_id),
+              std::move(cb),
+              3);
 }
 
 void
@@ -992,6 +2760,55 @@ Client::upload_filter(const nlohmann::json &j, Callback<mtx::responses::FilterId
     post<nlohmann::json, mtx::responses::FilterId>(api_path, j, std::move(callback));
 }
 
+void
+Client::upload_filter(const mtx::requests::Filter &filter,
+                      Callback<mtx::responses::FilterId> callback)
+{
+    // The keys of a json object are sorted, so the dump is canonical. Filter ids are only valid
+    // for the user, that uploaded them, so the user and the server are part of the key.
+    auto body = nlohmann::json(filter).dump();
+    auto hash = mtx::crypto::bin2base64_unpadded(
+      mtx::crypto::sha256(user_id_.to_string() + "\n" + p->base_url + "\n" + body));
+
+    mtx::responses::FilterId cached;
+    {
+        std::lock_guard lock(p->filters_mtx);
+        if (auto it = p->filter_ids.find(hash); it != p->filter_ids.end())
+            cached.filter_id = it->second;
+    }
+    if (!cached.filter_id.empty())
+        return callback(cached, {});
+
+    const auto api_path =
+      "/client/v3/user/" + mtx::client::utils::url_encode(user_id_.to_string()) + "/filter";
+
+    post<std::string, mtx::responses::FilterId>(
+      api_path,
+      body,
+      [_this = shared_from_this(), hash = std::move(hash), callback = std::move(callback)](
+        const mtx::responses::FilterId &res, RequestErr err) {
+          if (!err) {
+              std::lock_guard lock(_this->p->filters_mtx);
+              _this->p->filter_ids[hash] = res.filter_id;
+          }
+          callback(res, err);
+      });
+}
+
+std::map<std::string, std::string>
+Client::filter_ids() const
+{
+    std::lock_guard lock(p->filters_mtx);
+    return p->filter_ids;
+}
+
+void
+Client::set_filter_ids(std::map<std::string, std::string> ids)
+{
+    std::lock_guard lock(p->filters_mtx);
+    p->filter_ids = std::move(ids);
+}
+
 void
 Client::read_event(const std::string &room_id,
                    const std::string &event_id,
@@ -1083,9 +2900,9 @@ Client::registration(const std::string &user,
                   h.prompt(h, e->matrix_error.unauthorized);
               } else {
                   if (!e && !r.access_token.empty()) {
-                      this->user_id_      = r.user_id;
-                      this->device_id_    = r.device_id;
-                      this->access_token_ = r.access_token;
+                      this->user_id_   = r.user_id;
+                      this->device_id_ = r.device_id;
+                      this->set_access_token(r.access_token);
                   }
                   cb(r, e);
               }
@@ -1165,14 +2982,28 @@ Client::validate_submit_token(const std::string &url,
       [cb = std::move(cb)](const mtx::responses::Success &res, HeaderFields, RequestErr err) {
           cb(res, err);
       });
-    p->client.post(
+    p->client->post(
       url,
       nlohmann::json(r).dump(),
       "application/json",
       [callback = std::move(callback)](const coeurl::Request &r) {
           callback(r.response_headers(), r.response(), r.error_code(), r.response_code());
       },
-      prepare_headers(false));
+      *prepare_headers(false));
+}
+
+void
+Client::send_room_message(const std::string &room_id,
+                          const std::string &txn_id,
+                          const std::string &event_type,
+                          const nlohmann::json &payload,
+                          Callback<mtx::responses::EventId> callback)
+{
+    const auto api_path = "/client/v3/rooms/" + mtx::client::utils::url_encode(room_id) +
+                          "/send/" + mtx::client::utils::url_encode(event_type) + "/" +
+                          mtx::client::utils::url_encode(txn_id);
+
+    put<nlohmann::json, mtx::responses::EventId>(api_path, payload, std::move(callback));
 }
 
 void
@@ -1196,9 +3027,31 @@ Client::send_to_device(const std::string &event_type,
                        ErrCallback callback)
 {
     const auto api_path = "/client/v3/sendToDevice/" + mtx::client::utils::url_encode(event_type) +
-                          "/" + mtx::client::utils::url_encode(txn_id);
+                          "/";
+
+    auto messages = body.find("messages");
+    if (body.size() != 1 || messages == body.end() || !messages->is_object())
+        return put<nlohmann::json>(
+          api_path + mtx::client::utils::url_encode(txn_id), body, std::move(callback));
+
+    auto bodies = split_to_device(*messages, p->to_device_limits);
+    if (bodies.size() <= 1)
+        return put<std::string>(api_path + mtx::client::utils::url_encode(txn_id),
+                                bodies.empty() ? body.dump() : bodies.front(),
+                                std::move(callback));
+
+    auto batch = std::make_shared<ToDeviceBatch>(
+      std::move(bodies),
+      txn_id,
+      [_this = shared_from_this(), api_path](
+        const std::string &chunk_txn_id, const std::string &chunk, ErrCallback cb) {
+          _this->put<std::string>(
+            api_path + mtx::client::utils::url_encode(chunk_txn_id), chunk, std::move(cb));
+      },
+      std::move(callback));
 
-    put<nlohmann::json>(api_path, body, std::move(callback));
+    for (std::size_t i = 0; i < std::max<std::size_t>(p->to_device_limits.max_concurrent, 1); i++)
+        batch->send_next();
 }
 
 void
@@ -1885,3 +3738,11 @@ MTXCLIENT_ACCOUNT_DATA(mtx::events::account_data::nheko_extensions::EventExpiry)
 MTXCLIENT_ACCOUNT_DATA(mtx::events::account_data::Tags)
 MTXCLIENT_ACCOUNT_DATA(mtx::events::account_data::Direct)
 MTXCLIENT_ACCOUNT_DATA(mtx::events::account_data::IgnoredUsers)
+
+// Used by discover(), which caches the responses as the server sent them.
+template void
+mtx::http::Client::get<nlohmann::json>(const std::string &endpoint,
+                                       HeadersCallback<nlohmann::json> cb,
+                                       bool requires_auth,
+                                       const std::string &endpoint_namespace,
+                                       int num_redirects);
@@ -0,0 +1,277 @@
+#include "mtxclient/http/discovery.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <utility>
+
+#include <nlohmann/json.hpp>
+
+#include "mtx/log.hpp"
+#include "mtxclient/http/executor.hpp"
+
+namespace mtx::http {
+
+namespace {
+//! Increment, when the layout of the cache file changes.
+constexpr int cache_version = 1;
+
+ServerDiscovery
+parse_bundle(const nlohmann::json &bundle)
+{
+    ServerDiscovery discovery;
+    discovery.homeserver = bundle.at("homeserver").get<std::string>();
+    if (!bundle.at("well_known").is_null())
+        discovery.well_known = bundle.at("well_known").get<mtx::responses::WellKnown>();
+    discovery.versions = bundle.at("versions").get<mtx::responses::Versions>();
+    if (!bundle.at("capabilities").is_null())
+        discovery.capabilities =
+          bundle.at("capabilities").get<mtx::responses::capabilities::Capabilities>();
+    discovery.login_flows = bundle.at("login").get<mtx::responses::LoginFlows>();
+    discovery.fetched_at  = std::chrono::system_clock::time_point(
+      std::chrono::milliseconds(bundle.at("fetched_at").get<std::int64_t>()));
+    return discovery;
+}
+
+//! Returns the cached bundle of the server, if it exists and didn't expire yet.
+std::optional<std::pair<nlohmann::json, ServerDiscovery>>
+load_bundle(const DiscoveryOpts &opts, const std::string &server)
+{
+    if (opts.cache_file.empty())
+        return std::nullopt;
+
+    std::ifstream file(opts.cache_file);
+    if (!file)
+        return std::nullopt;
+
+    try {
+        auto bundle = nlohmann::json::parse(file);
+        if (bundle.at("version").get<int>() != cache_version ||
+            bundle.at("server").get<std::string>() != server)
+            return std::nullopt;
+
+        auto discovery = parse_bundle(bundle);
+        auto age       = std::chrono::system_clock::now() - discovery.fetched_at;
+        if (age < std::chrono::seconds(0) || age >= opts.max_age)
+            return std::nullopt;
+
+        discovery.from_cache = true;
+        return std::pair{std::move(bundle), std::move(discovery)};
+    } catch (const nlohmann::json::exception &e) {
+        mtx::utils::log::log()->warn(
+          "Failed to load the discovery cache from {}: {}", opts.cache_file, e.what());
+        return std::nullopt;
+    }
+}
+
+//! Replaces the cache file with a temporary one, so it is never partially written.
+void
+write_bundle(const std::string &path, const nlohmann::json &bundle)
+{
+    auto tmp = path + ".tmp";
+
+    {
+        std::ofstream file(tmp, std::ios::trunc);
+        file << bundle.dump();
+        if (!file) {
+            mtx::utils::log::log()->warn("Failed to write the discovery cache to {}", tmp);
+            return;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    if (ec)
+        mtx::utils::log::log()->warn(
+          "Failed to write the discovery cache to {}: {}", path, ec.message());
+}
+
+//! Writes the cache files, so the network thread never waits for the disk. A single thread also
+//! keeps concurrent discoveries from writing the same temporary file at once.
+ThreadPool &
+cache_thread()
+{
+    static ThreadPool pool{1};
+    return pool;
+}
+}
+
+//! Requests the discovery endpoints concurrently. A friend of Client, as the responses are cached
+//! as the JSON the server sent, which also keeps the fields the structs don't know about.
+struct DiscoveryFetch : std::enable_shared_from_this<DiscoveryFetch>
+{
+    DiscoveryFetch(std::shared_ptr<Client> client_,
+                   std::string server_,
+                   DiscoveryOpts opts_,
+                   DiscoveryCallback cb_)
+      : client(std::move(client_))
+      , server(std::move(server_))
+      , opts(std::move(opts_))
+      , cb(std::move(cb_))
+    {}
+
+    //! Request the endpoints of the homeserver and the well-known, if `with_well_known` is set.
+    void start(bool with_well_known)
+    {
+        bool authenticated = !client->access_token().empty();
+        {
+            std::lock_guard lock(mtx);
+            redirected = redirected || !with_well_known;
+            pending    = 2 + with_well_known + authenticated;
+        }
+
+        if (with_well_known)
+            request("well_known", "/matrix/client", false, "/.well-known", 30);
+        request("versions", "/client/versions", true);
+        if (authenticated)
+            request("capabilities", "/client/v3/capabilities", true);
+        request("login", "/client/v3/login", false);
+    }
+
+    void request(const std::string &key,
+                 const std::string &endpoint,
+                 bool requires_auth,
+                 const std::string &endpoint_namespace = "/_matrix",
+                 int num_redirects                     = 0)
+    {
+        client->get<nlohmann::json>(
+          endpoint,
+          [self = shared_from_this(), key](const nlohmann::json &res,
+                                           HeaderFields,
+                                           RequestErr err) { self->received(key, res, err); },
+          requires_auth,
+          endpoint_namespace,
+          num_redirects);
+    }
+
+    void received(const std::string &key, const nlohmann::json &res, RequestErr err)
+    {
+        {
+            std::lock_guard lock(mtx);
+            if (!err)
+                responses[key] = res;
+            // Most servers don't have a well-known.
+            else if (key != "well_known" && !error)
+                error = err;
+
+            if (--pending > 0)
+                return;
+        }
+
+        finish();
+    }
+
+    void finish()
+    {
+        if (error)
+            return cb({}, error);
+
+        std::string base_url;
+        if (auto it = responses.find("well_known"); it != responses.end()) {
+            try {
+                base_url = it->second.get<mtx::responses::WellKnown>().homeserver.base_url;
+            } catch (const nlohmann::json::exception &e) {
+                mtx::utils::log::log()->warn("Ignoring invalid well-known of {}: {}",
+                                             server,
+                                             e.what());
+                responses.erase(it);
+            }
+        }
+
+        // The other responses came from the server name, ask the actual homeserver again.
+        if (!redirected && !base_url.empty()) {
+            client->set_server(base_url);
+            if (client->server_url() != server) {
+                responses.erase("versions");
+                responses.erase("capabilities");
+                responses.erase("login");
+                return start(false);
+            }
+        }
+
+        auto value = [this](const std::string &key) {
+            auto it = responses.find(key);
+            return it != responses.end() ? it->second : nlohmann::json();
+        };
+        nlohmann::json bundle = {
+          {"version", cache_version},
+          {"server", server},
+          {"homeserver", client->server_url()},
+          {"fetched_at",
+           std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+             .count()},
+          {"well_known", value("well_known")},
+          {"versions", value("versions")},
+          {"capabilities", value("capabilities")},
+          {"login", value("login")},
+        };
+
+        ServerDiscovery discovery;
+        try {
+            discovery = parse_bundle(bundle);
+        } catch (const nlohmann::json::exception &e) {
+            ClientError parse_error;
+            parse_error.parse_error = e.what();
+            return cb({}, parse_error);
+        }
+
+        if (opts.cache_file.empty())
+            return cb(discovery, std::nullopt);
+
+        cache_thread().post([path      = opts.cache_file,
+                             bundle    = std::move(bundle),
+                             discovery = std::move(discovery),
+                             cb        = cb] {
+            write_bundle(path, bundle);
+            cb(discovery, std::nullopt);
+        });
+    }
+
+    std::shared_ptr<Client> client;
+    //! The server the client was configured with, before switching to the homeserver.
+    std::string server;
+    DiscoveryOpts opts;
+    DiscoveryCallback cb;
+
+    std::mutex mtx;
+    int pending = 0;
+    //! Set, once the requests go to the homeserver from the well-known.
+    bool redirected = false;
+    std::map<std::string, nlohmann::json> responses;
+    std::optional<ClientError> error;
+};
+
+void
+discover(std::shared_ptr<Client> client,
+         DiscoveryOpts opts,
+         DiscoveryCallback cb,
+         DiscoveryCallback refreshed)
+{
+    auto server = client->server_url();
+
+    auto cached = load_bundle(opts, server);
+    if (!cached) {
+        auto fetch = std::make_shared<DiscoveryFetch>(
+          std::move(client), std::move(server), std::move(opts), std::move(cb));
+        return fetch->start(true);
+    }
+
+    auto &[bundle, discovery] = *cached;
+    client->set_server(discovery.homeserver);
+    cb(discovery, std::nullopt);
+
+    if (!opts.revalidate)
+        return;
+
+    if (!refreshed)
+        refreshed = [](const ServerDiscovery &, RequestErr) {};
+
+    auto fetch = std::make_shared<DiscoveryFetch>(
+      std::move(client), std::move(server), std::move(opts), std::move(refreshed));
+    if (!bundle.at("well_known").is_null())
+        fetch->responses["well_known"] = bundle.at("well_known");
+    fetch->start(false);
+}
+} // namespace mtx::http
@@ -0,0 +1,93 @@
+#include "mtxclient/http/executor.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mtx::http {
+
+struct ThreadPool::State
+{
+    //! Returns false, if the pool is stopped and the caller should run the task itself.
+    bool post(std::function<void()> &task)
+    {
+        {
+            std::lock_guard lock(mtx);
+            if (stopped)
+                return false;
+            tasks.push_back(std::move(task));
+        }
+        cv.notify_one();
+        return true;
+    }
+
+    void run()
+    {
+        std::unique_lock lock(mtx);
+        while (true) {
+            cv.wait(lock, [this] { return stopped || !tasks.empty(); });
+            if (tasks.empty())
+                return;
+
+            auto task = std::move(tasks.front());
+            tasks.pop_front();
+            lock.unlock();
+            task();
+            // The task may own the last reference to the pool, whose destructor takes the lock.
+            task = nullptr;
+            lock.lock();
+        }
+    }
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> tasks;
+    bool stopped = false;
+    std::vector<std::thread> threads;
+};
+
+ThreadPool::ThreadPool(std::size_t threads)
+  : state(std::make_shared<State>())
+{
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (std::size_t i = 0; i < threads; i++)
+        state->threads.emplace_back([s = state] { s->run(); });
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard lock(state->mtx);
+        state->stopped = true;
+    }
+    state->cv.notify_all();
+
+    for (auto &thread : state->threads) {
+        if (thread.get_id() == std::this_thread::get_id())
+            thread.detach();
+        else
+            thread.join();
+    }
+}
+
+void
+ThreadPool::post(std::function<void()> task)
+{
+    if (!state->post(task))
+        task();
+}
+
+Executor
+ThreadPool::executor() const
+{
+    return [state = state](std::function<void()> task) {
+        if (!state->post(task))
+            task();
+    };
+}
+} // namespace mtx::http
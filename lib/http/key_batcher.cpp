@@ -0,0 +1,338 @@
+#include "mtxclient/http/key_batcher.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace mtx::http {
+
+namespace {
+//! Returns the part of a merged response, that the request asked for.
+mtx::responses::QueryKeys
+part_of(const mtx::responses::QueryKeys &res, const mtx::requests::QueryKeys &req)
+{
+    mtx::responses::QueryKeys part;
+    part.failures = res.failures;
+
+    for (const auto &[user_id, device_ids] : req.device_keys) {
+        if (auto devices = res.device_keys.find(user_id); devices != res.device_keys.end()) {
+            if (device_ids.empty()) {
+                part.device_keys[user_id] = devices->second;
+            } else {
+                auto &keys = part.device_keys[user_id];
+                for (const auto &device_id : device_ids)
+                    if (auto device = devices->second.find(device_id);
+                        device != devices->second.end())
+                        keys[device_id] = device->second;
+            }
+        }
+
+        if (auto key = res.master_keys.find(user_id); key != res.master_keys.end())
+            part.master_keys[user_id] = key->second;
+        if (auto key = res.self_signing_keys.find(user_id); key != res.self_signing_keys.end())
+            part.self_signing_keys[user_id] = key->second;
+        if (auto key = res.user_signing_keys.find(user_id); key != res.user_signing_keys.end())
+            part.user_signing_keys[user_id] = key->second;
+    }
+
+    return part;
+}
+
+mtx::responses::ClaimKeys
+part_of(const mtx::responses::ClaimKeys &res, const mtx::requests::ClaimKeys &req)
+{
+    mtx::responses::ClaimKeys part;
+    part.failures = res.failures;
+
+    for (const auto &[user_id, device_ids] : req.one_time_keys) {
+        auto devices = res.one_time_keys.find(user_id);
+        if (devices == res.one_time_keys.end())
+            continue;
+
+        for (const auto &[device_id, algorithm] : device_ids)
+            if (auto keys = devices->second.find(device_id); keys != devices->second.end())
+                part.one_time_keys[user_id][device_id] = keys->second;
+    }
+
+    return part;
+}
+}
+
+struct KeyBatcher::State : std::enable_shared_from_this<KeyBatcher::State>
+{
+    using clock = std::chrono::steady_clock;
+
+    //! Requests merged into one, with the callers waiting for it.
+    template<class Request, class Response>
+    struct Batch
+    {
+        struct Caller
+        {
+            Request req;
+            Callback<Response> cb;
+        };
+
+        Request req;
+        std::vector<Caller> callers;
+        clock::time_point deadline;
+        //! Users or devices in the merged request.
+        std::size_t size = 0;
+    };
+    using QueryBatch = Batch<mtx::requests::QueryKeys, mtx::responses::QueryKeys>;
+    using ClaimBatch = Batch<mtx::requests::ClaimKeys, mtx::responses::ClaimKeys>;
+
+    State(QueryFn query_, ClaimFn claim_, KeyBatcherOpts opts_)
+      : query(std::move(query_))
+      , claim(std::move(claim_))
+      , opts(opts_)
+    {}
+
+    void add(const mtx::requests::QueryKeys &req, Callback<mtx::responses::QueryKeys> cb)
+    {
+        std::unique_lock lock(mtx);
+        calls++;
+
+        auto [it, created] = queries.try_emplace(req.token);
+        auto &batch        = it->second;
+        if (created) {
+            batch.req.token   = req.token;
+            batch.req.timeout = req.timeout;
+            batch.deadline    = clock::now() + opts.window;
+            cv.notify_one();
+        } else {
+            batch.req.timeout = std::max(batch.req.timeout, req.timeout);
+        }
+
+        for (const auto &[user_id, device_ids] : req.device_keys) {
+            auto [devices, added] = batch.req.device_keys.try_emplace(user_id, device_ids);
+            if (added || devices->second.empty())
+                continue;
+
+            // An empty list asks for all devices.
+            if (device_ids.empty()) {
+                devices->second.clear();
+                continue;
+            }
+            for (const auto &device_id : device_ids)
+                if (std::ranges::find(devices->second, device_id) == devices->second.end())
+                    devices->second.push_back(device_id);
+        }
+        batch.size = batch.req.device_keys.size();
+        batch.callers.push_back({req, std::move(cb)});
+
+        if (opts.max_users && batch.size >= opts.max_users) {
+            auto full = std::move(batch);
+            queries.erase(it);
+            lock.unlock();
+            send(std::move(full));
+        }
+    }
+
+    void add(const mtx::requests::ClaimKeys &req, Callback<mtx::responses::ClaimKeys> cb)
+    {
+        std::vector<ClaimBatch> ready;
+        {
+            std::lock_guard lock(mtx);
+            calls++;
+
+            auto claimed = [this](const std::string &user_id, const std::string &device_id) {
+                auto devices = claims->req.one_time_keys.find(user_id);
+                return devices != claims->req.one_time_keys.end() &&
+                       devices->second.count(device_id);
+            };
+            if (claims) {
+                for (const auto &[user_id, devices] : req.one_time_keys)
+                    for (const auto &[device_id, algorithm] : devices)
+                        if (claims && claimed(user_id, device_id)) {
+                            ready.push_back(std::move(*claims));
+                            claims.reset();
+                        }
+            }
+
+            if (!claims) {
+                claims.emplace();
+                claims->req.timeout = req.timeout;
+                claims->deadline    = clock::now() + opts.window;
+                cv.notify_one();
+            } else {
+                claims->req.timeout = std::max(claims->req.timeout, req.timeout);
+            }
+
+            for (const auto &[user_id, devices] : req.one_time_keys)
+                for (const auto &[device_id, algorithm] : devices)
+                    if (claims->req.one_time_keys[user_id].emplace(device_id, algorithm).second)
+                        claims->size++;
+            claims->callers.push_back({req, std::move(cb)});
+
+            if (opts.max_devices && claims->size >= opts.max_devices) {
+                ready.push_back(std::move(*claims));
+                claims.reset();
+            }
+        }
+
+        for (auto &batch : ready)
+            send(std::move(batch));
+    }
+
+    template<class Request, class Response>
+    void send(Batch<Request, Response> batch)
+    {
+        {
+            std::lock_guard lock(mtx);
+            requests++;
+        }
+
+        auto done = [self = shared_from_this(), callers = std::move(batch.callers)](
+                      const Response &res, RequestErr err) {
+            if (err) {
+                std::lock_guard lock(self->mtx);
+                self->errors++;
+            }
+
+            if (err || callers.size() == 1) {
+                for (const auto &caller : callers)
+                    caller.cb(res, err);
+                return;
+            }
+            for (const auto &caller : callers)
+                caller.cb(part_of(res, caller.req), err);
+        };
+
+        if constexpr (std::is_same_v<Request, mtx::requests::QueryKeys>)
+            query(batch.req, std::move(done));
+        else
+            claim(batch.req, std::move(done));
+    }
+
+    //! Sends the batches, whose window ended before `until`. Must be called with the lock held.
+    void send_due(std::unique_lock<std::mutex> &lock, clock::time_point until)
+    {
+        std::vector<QueryBatch> due_queries;
+        for (auto it = queries.begin(); it != queries.end();) {
+            if (it->second.deadline <= until) {
+                due_queries.push_back(std::move(it->second));
+                it = queries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        std::optional<ClaimBatch> due_claims;
+        if (claims && claims->deadline <= until) {
+            due_claims = std::move(claims);
+            claims.reset();
+        }
+
+        if (due_queries.empty() && !due_claims)
+            return;
+
+        lock.unlock();
+        for (auto &batch : due_queries)
+            send(std::move(batch));
+        if (due_claims)
+            send(std::move(*due_claims));
+        lock.lock();
+    }
+
+    //! Sends the batches, when their window ends.
+    void run()
+    {
+        std::unique_lock lock(mtx);
+        while (!stopped) {
+            auto next = clock::time_point::max();
+            for (const auto &[token, batch] : queries)
+                next = std::min(next, batch.deadline);
+            if (claims)
+                next = std::min(next, claims->deadline);
+
+            if (next == clock::time_point::max())
+                cv.wait(lock);
+            else
+                cv.wait_until(lock, next);
+
+            if (!stopped)
+                send_due(lock, clock::now());
+        }
+    }
+
+    QueryFn query;
+    ClaimFn claim;
+    KeyBatcherOpts opts;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    //! The waiting queries by their sync token.
+    std::map<std::string, QueryBatch> queries;
+    std::optional<ClaimBatch> claims;
+    bool stopped = false;
+
+    std::uint64_t calls = 0, requests = 0, errors = 0;
+
+    std::thread worker;
+};
+
+KeyBatcher::KeyBatcher(std::shared_ptr<Client> client, KeyBatcherOpts opts)
+  : KeyBatcher(
+      [client](const mtx::requests::QueryKeys &req, Callback<mtx::responses::QueryKeys> cb) {
+          client->query_keys(req, std::move(cb));
+      },
+      [client](const mtx::requests::ClaimKeys &req, Callback<mtx::responses::ClaimKeys> cb) {
+          client->claim_keys(req, std::move(cb));
+      },
+      opts)
+{}
+
+KeyBatcher::KeyBatcher(QueryFn query, ClaimFn claim, KeyBatcherOpts opts)
+  : state(std::make_shared<State>(std::move(query), std::move(claim), opts))
+{
+    state->worker = std::thread([s = state.get()] { s->run(); });
+}
+
+KeyBatcher::~KeyBatcher()
+{
+    {
+        std::lock_guard lock(state->mtx);
+        state->stopped = true;
+    }
+    state->cv.notify_all();
+    state->worker.join();
+
+    flush();
+}
+
+void
+KeyBatcher::query_keys(const mtx::requests::QueryKeys &req, Callback<mtx::responses::QueryKeys> cb)
+{
+    state->add(req, std::move(cb));
+}
+
+void
+KeyBatcher::claim_keys(const mtx::requests::ClaimKeys &req, Callback<mtx::responses::ClaimKeys> cb)
+{
+    state->add(req, std::move(cb));
+}
+
+void
+KeyBatcher::flush()
+{
+    std::unique_lock lock(state->mtx);
+    state->send_due(lock, State::clock::time_point::max());
+}
+
+KeyBatcherStats
+KeyBatcher::stats() const
+{
+    std::lock_guard lock(state->mtx);
+
+    KeyBatcherStats stats;
+    stats.calls    = state->calls;
+    stats.requests = state->requests;
+    stats.errors   = state->errors;
+    return stats;
+}
+} // namespace mtx::http
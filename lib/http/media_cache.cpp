@@ -0,0 +1,428 @@
+#include "mtxclient/http/media_cache.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <nlohmann/json.hpp>
+
+#include "mtx/log.hpp"
+#include "mtxclient/crypto/utils.hpp"
+
+namespace fs = std::filesystem;
+
+namespace mtx::http {
+
+struct MediaFile::Data
+{
+    Data() = default;
+    Data(const Data &)            = delete;
+    Data &operator=(const Data &) = delete;
+    ~Data()
+    {
+#ifndef _WIN32
+        if (mapping)
+            munmap(mapping, mapped_size);
+#endif
+    }
+
+    //! Set, if the file is mapped into memory.
+    void *mapping           = nullptr;
+    std::size_t mapped_size = 0;
+    //! The file, if it isn't mapped.
+    std::string buffer;
+    std::string_view content;
+    std::string content_type, filename;
+};
+
+MediaFile::MediaFile(std::shared_ptr<const Data> data)
+  : data_(std::move(data))
+{}
+
+std::string_view
+MediaFile::data() const
+{
+    return data_->content;
+}
+
+const std::string &
+MediaFile::content_type() const
+{
+    return data_->content_type;
+}
+
+const std::string &
+MediaFile::filename() const
+{
+    return data_->filename;
+}
+
+namespace {
+//! The length of a hex encoded SHA-256, which is the name of every cached file.
+constexpr std::size_t name_length = 64;
+
+std::string
+file_name(const std::string &key)
+{
+    static constexpr char digits[] = "0123456789abcdef";
+
+    std::string name;
+    name.reserve(name_length);
+    for (unsigned char c : mtx::crypto::sha256(key)) {
+        name.push_back(digits[c >> 4]);
+        name.push_back(digits[c & 0xf]);
+    }
+    return name;
+}
+
+std::string
+plaintext_key(const mtx::crypto::EncryptedFile &file)
+{
+    auto hash = file.hashes.find("sha256");
+    return file.url + "#plaintext?sha256=" + (hash != file.hashes.end() ? hash->second : "");
+}
+
+//! Splits the metadata line from the content. \returns false, if the file is damaged.
+bool
+parse(MediaFile::Data &data, std::string_view file)
+{
+    auto newline = file.find('\n');
+    if (newline == std::string_view::npos)
+        return false;
+
+    try {
+        auto meta         = nlohmann::json::parse(file.substr(0, newline));
+        data.content_type = meta.at("content_type").get<std::string>();
+        data.filename     = meta.at("filename").get<std::string>();
+    } catch (const nlohmann::json::exception &) {
+        return false;
+    }
+
+    data.content = file.substr(newline + 1);
+    return true;
+}
+
+std::shared_ptr<MediaFile::Data>
+read_file(const fs::path &path)
+{
+    auto data = std::make_shared<MediaFile::Data>();
+
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data->mapped_size = static_cast<std::size_t>(st.st_size);
+        data->mapping     = mmap(nullptr, data->mapped_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data->mapping == MAP_FAILED)
+            data->mapping = nullptr;
+    }
+    close(fd);
+
+    if (!data->mapping)
+        return nullptr;
+    std::string_view file(static_cast<const char *>(data->mapping), data->mapped_size);
+#else
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        return nullptr;
+    data->buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    std::string_view file = data->buffer;
+#endif
+
+    if (!parse(*data, file))
+        return nullptr;
+    return data;
+}
+}
+
+struct MediaCache::State
+{
+    struct Entry
+    {
+        std::uint64_t size = 0;
+        std::list<std::string>::iterator lru;
+    };
+
+    //! Returns the file without counting the lookup.
+    std::shared_ptr<MediaFile::Data> read(const std::string &key)
+    {
+        auto name = file_name(key);
+        {
+            std::lock_guard lock(mtx);
+            auto it = entries.find(name);
+            if (it == entries.end())
+                return nullptr;
+            lru.splice(lru.begin(), lru, it->second.lru);
+        }
+
+        auto path = dir / name;
+        auto data = read_file(path);
+        if (!data) {
+            mtx::utils::log::log()->warn("Dropping damaged media cache file {}", path.string());
+            drop(name);
+            return nullptr;
+        }
+
+        // Keeps the order of use for the next start.
+        std::error_code ec;
+        fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+        return data;
+    }
+
+    void count(const std::shared_ptr<MediaFile::Data> &data)
+    {
+        std::lock_guard lock(mtx);
+        if (data) {
+            stats.hits++;
+            stats.bytes_saved += data->content.size();
+        } else {
+            stats.misses++;
+        }
+    }
+
+    //! Forgets the file and deletes it.
+    void drop(const std::string &name)
+    {
+        {
+            std::lock_guard lock(mtx);
+            auto it = entries.find(name);
+            if (it == entries.end())
+                return;
+            bytes -= it->second.size;
+            lru.erase(it->second.lru);
+            entries.erase(it);
+        }
+
+        std::error_code ec;
+        fs::remove(dir / name, ec);
+    }
+
+    //! Adds a file to the index. Must be called with the lock held. \returns the evicted files.
+    std::vector<std::string> add(const std::string &name, std::uint64_t size)
+    {
+        if (auto it = entries.find(name); it != entries.end()) {
+            bytes -= it->second.size;
+            lru.erase(it->second.lru);
+            entries.erase(it);
+        }
+
+        lru.push_front(name);
+        entries[name] = {size, lru.begin()};
+        bytes += size;
+
+        std::vector<std::string> evicted;
+        while (bytes > opts.max_bytes && lru.size() > 1) {
+            auto it = entries.find(lru.back());
+            bytes -= it->second.size;
+            evicted.push_back(lru.back());
+            entries.erase(it);
+            lru.pop_back();
+            stats.evictions++;
+        }
+        return evicted;
+    }
+
+    MediaCacheOpts opts;
+    fs::path dir;
+    std::atomic<std::uint64_t> tmp_counter = 0;
+
+    mutable std::mutex mtx;
+    //! The file names, the most recently used first.
+    std::list<std::string> lru;
+    std::unordered_map<std::string, Entry> entries;
+    std::uint64_t bytes = 0;
+    MediaCacheStats stats;
+
+    //! Declared last, so the queued tasks run before the index is destroyed.
+    ThreadPool io{1};
+};
+
+MediaCache::MediaCache(MediaCacheOpts opts)
+  : state(std::make_unique<State>())
+{
+    state->opts = std::move(opts);
+    state->dir  = state->opts.directory;
+
+    std::error_code ec;
+    fs::create_directories(state->dir, ec);
+    if (ec) {
+        mtx::utils::log::log()->warn(
+          "Failed to create the media cache {}: {}", state->opts.directory, ec.message());
+        return;
+    }
+
+    std::vector<std::pair<fs::file_time_type, fs::directory_entry>> files;
+    for (const auto &entry : fs::directory_iterator(state->dir, ec)) {
+        if (!entry.is_regular_file(ec))
+            continue;
+
+        auto name = entry.path().filename().string();
+        // Left behind by a crash while writing.
+        if (entry.path().extension() == ".tmp")
+            fs::remove(entry.path(), ec);
+        else if (name.size() == name_length)
+            files.emplace_back(entry.last_write_time(ec), entry);
+    }
+
+    // Oldest first, so the most recently used file ends up at the front.
+    std::ranges::sort(files, {}, &decltype(files)::value_type::first);
+    std::vector<std::string> evicted;
+    for (const auto &[time, entry] : files) {
+        auto more = state->add(entry.path().filename().string(), entry.file_size(ec));
+        evicted.insert(evicted.end(), more.begin(), more.end());
+    }
+    for (const auto &name : evicted)
+        fs::remove(state->dir / name, ec);
+}
+
+MediaCache::~MediaCache() = default;
+
+std::string
+MediaCache::key(const std::string &mxc_url)
+{
+    return mxc_url;
+}
+
+std::string
+MediaCache::key(const ThumbOpts &opts)
+{
+    return opts.mxc_url + "#thumbnail?width=" + std::to_string(opts.width) +
+           "&height=" + std::to_string(opts.height) + "&method=" + opts.method;
+}
+
+std::optional<MediaFile>
+MediaCache::get(const std::string &key)
+{
+    auto data = state->read(key);
+    state->count(data);
+    if (!data)
+        return std::nullopt;
+    return MediaFile(std::move(data));
+}
+
+void
+MediaCache::put(const std::string &key,
+                std::string_view data,
+                const std::string &content_type,
+                const std::string &filename)
+{
+    auto meta = nlohmann::json{{"content_type", content_type}, {"filename", filename}}.dump();
+    auto size = meta.size() + 1 + data.size();
+    if (size > state->opts.max_bytes)
+        return;
+
+    auto name = file_name(key);
+    auto tmp  = state->dir / (name + "." + std::to_string(state->tmp_counter++) + ".tmp");
+    {
+        std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+        file << meta << '\n';
+        file.write(data.data(), static_cast<std::streamsize>(data.size()));
+        if (!file) {
+            mtx::utils::log::log()->warn("Failed to write the media cache file {}", tmp.string());
+            std::error_code ec;
+            fs::remove(tmp, ec);
+            return;
+        }
+    }
+
+    // Readers never see a partially written file.
+    std::error_code ec;
+    fs::rename(tmp, state->dir / name, ec);
+    if (ec) {
+        mtx::utils::log::log()->warn(
+          "Failed to write the media cache file {}: {}", name, ec.message());
+        fs::remove(tmp, ec);
+        return;
+    }
+
+    std::vector<std::string> evicted;
+    {
+        std::lock_guard lock(state->mtx);
+        evicted = state->add(name, size);
+    }
+    for (const auto &old : evicted)
+        fs::remove(state->dir / old, ec);
+}
+
+void
+MediaCache::remove(const std::string &key)
+{
+    state->drop(file_name(key));
+}
+
+void
+MediaCache::clear()
+{
+    std::vector<std::string> names;
+    {
+        std::lock_guard lock(state->mtx);
+        names.assign(state->lru.begin(), state->lru.end());
+    }
+    for (const auto &name : names)
+        state->drop(name);
+}
+
+std::optional<MediaFile>
+MediaCache::decrypted(const mtx::crypto::EncryptedFile &file)
+{
+    if (state->opts.store_plaintext) {
+        if (auto plaintext = state->read(plaintext_key(file))) {
+            state->count(plaintext);
+            return MediaFile(std::move(plaintext));
+        }
+    }
+
+    auto ciphertext = state->read(key(file.url));
+    state->count(ciphertext);
+    if (!ciphertext)
+        return std::nullopt;
+
+    auto data = std::make_shared<MediaFile::Data>();
+    try {
+        data->buffer = mtx::crypto::to_string(
+          mtx::crypto::decrypt_file(std::string(ciphertext->content), file));
+    } catch (const std::exception &e) {
+        mtx::utils::log::log()->warn("Failed to decrypt cached media {}: {}", file.url, e.what());
+        return std::nullopt;
+    }
+    data->content      = data->buffer;
+    data->content_type = ciphertext->content_type;
+    data->filename     = ciphertext->filename;
+
+    if (state->opts.store_plaintext)
+        put(plaintext_key(file), data->content, data->content_type, data->filename);
+    return MediaFile(std::move(data));
+}
+
+MediaCacheStats
+MediaCache::stats() const
+{
+    std::lock_guard lock(state->mtx);
+
+    auto stats  = state->stats;
+    stats.files = state->entries.size();
+    stats.bytes = state->bytes;
+    return stats;
+}
+
+void
+MediaCache::post(std::function<void()> task)
+{
+    state->io.post(std::move(task));
+}
+} // namespace mtx::http
@@ -0,0 +1,327 @@
+#include "mtxclient/http/paginator.hpp"
+
+#include <deque>
+#include <future>
+#include <mutex>
+
+namespace mtx::http {
+
+namespace {
+// The token of the following page and the number of items in a page. An empty token ends the
+// pagination.
+std::string
+page_token(const mtx::responses::Messages &page)
+{
+    // An empty chunk doesn't mean, that there are no more events. Only a missing `end` does.
+    return page.end;
+}
+
+std::size_t
+page_items(const mtx::responses::Messages &page)
+{
+    return page.chunk.size();
+}
+
+std::string
+page_token(const mtx::responses::Notifications &page)
+{
+    return page.next_token;
+}
+
+std::size_t
+page_items(const mtx::responses::Notifications &page)
+{
+    return page.notifications.size();
+}
+
+std::string
+page_token(const mtx::responses::PublicRooms &page)
+{
+    return page.next_batch;
+}
+
+std::size_t
+page_items(const mtx::responses::PublicRooms &page)
+{
+    return page.chunk.size();
+}
+
+std::string
+page_token(const mtx::responses::HierarchyRooms &page)
+{
+    return page.next_batch;
+}
+
+std::size_t
+page_items(const mtx::responses::HierarchyRooms &page)
+{
+    return page.rooms.size();
+}
+}
+
+template<class Page>
+struct Paginator<Page>::State
+{
+    using clock = std::chrono::steady_clock;
+
+    struct Waiter
+    {
+        PageCallback cb;
+        clock::time_point since;
+    };
+
+    struct Buffered
+    {
+        Page page;
+        std::size_t items;
+    };
+
+    State(Fetcher fetcher_, PaginatorOpts opts_, std::string from)
+      : fetcher(std::move(fetcher_))
+      , opts(opts_)
+      , token(std::move(from))
+    {}
+
+    //! Requests the next page, if a consumer is waiting for it or the buffer has room for it. Must
+    //! be called with the lock held.
+    void maybe_request(const std::shared_ptr<State> &self, std::unique_lock<std::mutex> &lock)
+    {
+        if (stopped || in_flight || end_reached || error)
+            return;
+
+        bool under_cap = opts.max_buffered_items == 0 || buffered_items < opts.max_buffered_items;
+        if (waiters.empty() && (buffered.size() >= opts.prefetch_pages || !under_cap))
+            return;
+
+        in_flight = true;
+        auto from = token;
+
+        lock.unlock();
+        fetcher(from,
+                [weak = std::weak_ptr<State>(self), from](const Page &page, RequestErr err) {
+                    if (auto s = weak.lock())
+                        s->received(s, from, page, err);
+                });
+        lock.lock();
+    }
+
+    void received(const std::shared_ptr<State> &self,
+                  const std::string &from,
+                  const Page &page,
+                  RequestErr err)
+    {
+        std::unique_lock lock(mtx);
+        if (stopped)
+            return;
+        in_flight = false;
+
+        if (err) {
+            stats.errors++;
+            error = err;
+        } else {
+            auto items = page_items(page);
+            stats.pages++;
+            stats.items += items;
+            buffered.push_back({page, items});
+            buffered_items += items;
+
+            token = page_token(page);
+            // A server returning the same token again would make us loop forever.
+            end_reached = token.empty() || token == from;
+        }
+
+        dispatch(self, lock);
+        // Keep the round trips back to back, if there is room for another page.
+        maybe_request(self, lock);
+    }
+
+    //! Hands buffered pages, the end or the error to the waiting consumers. Only one thread
+    //! dispatches at a time, so the pages stay in order, even if a callback asks for the next one.
+    void dispatch(const std::shared_ptr<State> &self, std::unique_lock<std::mutex> &lock)
+    {
+        if (dispatching)
+            return;
+        dispatching = true;
+
+        while (!stopped && !waiters.empty()) {
+            std::optional<Page> page;
+            std::optional<ClientError> err;
+
+            if (!buffered.empty()) {
+                page = std::move(buffered.front().page);
+                buffered_items -= buffered.front().items;
+                buffered.pop_front();
+                finished = end_reached && buffered.empty();
+            } else if (end_reached) {
+                finished = true;
+            } else if (error) {
+                err = error;
+            } else {
+                break;
+            }
+
+            auto waiter = std::move(waiters.front());
+            waiters.pop_front();
+            stats.wait_time += clock::now() - waiter.since;
+
+            // Popping a page made room for another one.
+            maybe_request(self, lock);
+
+            lock.unlock();
+            waiter.cb(std::move(page), err);
+            lock.lock();
+        }
+
+        dispatching = false;
+    }
+
+    Fetcher fetcher;
+    PaginatorOpts opts;
+
+    mutable std::mutex mtx;
+    //! The token of the next page to request.
+    std::string token;
+    bool in_flight   = false;
+    bool end_reached = false;
+    bool finished    = false;
+    bool stopped     = false;
+    bool dispatching = false;
+    //! The error of the last request. Cleared, when the consumer asks for the next page.
+    std::optional<ClientError> error;
+    std::deque<Buffered> buffered;
+    std::size_t buffered_items = 0;
+    std::deque<Waiter> waiters;
+    PaginatorStats stats;
+};
+
+template<class Page>
+Paginator<Page>::Paginator(Fetcher fetcher, PaginatorOpts opts, std::string from)
+  : state(std::make_shared<State>(std::move(fetcher), opts, std::move(from)))
+{
+    std::unique_lock lock(state->mtx);
+    state->maybe_request(state, lock);
+}
+
+template<class Page>
+Paginator<Page>::~Paginator()
+{
+    std::lock_guard lock(state->mtx);
+    state->stopped = true;
+    state->waiters.clear();
+}
+
+template<class Page>
+void
+Paginator<Page>::next(PageCallback cb)
+{
+    std::unique_lock lock(state->mtx);
+    if (state->waiters.empty() && !state->buffered.empty())
+        state->stats.prefetch_hits++;
+
+    state->waiters.push_back({std::move(cb), State::clock::now()});
+    // Retry a failed request.
+    state->error.reset();
+
+    state->maybe_request(state, lock);
+    state->dispatch(state, lock);
+}
+
+template<class Page>
+std::optional<Page>
+Paginator<Page>::wait_next(std::optional<ClientError> *err)
+{
+    std::promise<std::pair<std::optional<Page>, std::optional<ClientError>>> result;
+    next([&result](std::optional<Page> page, RequestErr e) {
+        result.set_value({std::move(page), e});
+    });
+
+    auto [page, error] = result.get_future().get();
+    if (err)
+        *err = std::move(error);
+    return std::move(page);
+}
+
+template<class Page>
+bool
+Paginator<Page>::finished() const
+{
+    std::lock_guard lock(state->mtx);
+    return state->finished;
+}
+
+template<class Page>
+PaginatorStats
+Paginator<Page>::stats() const
+{
+    std::lock_guard lock(state->mtx);
+
+    auto stats           = state->stats;
+    stats.buffered_pages = state->buffered.size();
+    stats.buffered_items = state->buffered_items;
+    return stats;
+}
+
+template class Paginator<mtx::responses::Messages>;
+template class Paginator<mtx::responses::Notifications>;
+template class Paginator<mtx::responses::PublicRooms>;
+template class Paginator<mtx::responses::HierarchyRooms>;
+
+Paginator<mtx::responses::Messages>
+paginate_messages(std::shared_ptr<Client> client, MessagesOpts opts, PaginatorOpts paginator)
+{
+    auto from = opts.from;
+    return Paginator<mtx::responses::Messages>(
+      [client = std::move(client), opts = std::move(opts)](
+        const std::string &token, Callback<mtx::responses::Messages> cb) {
+          auto page_opts = opts;
+          page_opts.from = token;
+          client->messages(page_opts, std::move(cb));
+      },
+      paginator,
+      std::move(from));
+}
+
+Paginator<mtx::responses::Notifications>
+paginate_notifications(std::shared_ptr<Client> client,
+                       uint64_t limit,
+                       const std::string &only,
+                       PaginatorOpts paginator)
+{
+    return Paginator<mtx::responses::Notifications>(
+      [client = std::move(client), limit, only](const std::string &token,
+                                                Callback<mtx::responses::Notifications> cb) {
+          client->notifications(limit, token, only, std::move(cb));
+      },
+      paginator);
+}
+
+Paginator<mtx::responses::PublicRooms>
+paginate_public_rooms(std::shared_ptr<Client> client,
+                      const std::string &server,
+                      size_t limit,
+                      PaginatorOpts paginator)
+{
+    return Paginator<mtx::responses::PublicRooms>(
+      [client = std::move(client), server, limit](const std::string &token,
+                                                  Callback<mtx::responses::PublicRooms> cb) {
+          client->get_public_rooms(std::move(cb), server, limit, token);
+      },
+      paginator);
+}
+
+Paginator<mtx::responses::HierarchyRooms>
+paginate_hierarchy(std::shared_ptr<Client> client,
+                   const std::string &room_id,
+                   size_t limit,
+                   size_t max_depth,
+                   bool suggested_only,
+                   PaginatorOpts paginator)
+{
+    return Paginator<mtx::responses::HierarchyRooms>(
+      [client = std::move(client), room_id, limit, max_depth, suggested_only](
+        const std::string &token, Callback<mtx::responses::HierarchyRooms> cb) {
+          client->get_hierarchy(room_id, std::move(cb), token, limit, max_depth, suggested_only);
+      },
+      paginator);
+}
+} // namespace mtx::http
@@ -0,0 +1,456 @@
+#include "mtxclient/http/scheduler.hpp"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace mtx::http {
+
+namespace {
+bool
+is_identifier(std::string_view segment)
+{
+    if (segment.empty())
+        return false;
+
+    switch (segment.front()) {
+    case '!':
+    case '@':
+    case '#':
+    case '$':
+        return true;
+    default:
+        break;
+    }
+
+    // url encoded sigils
+    return segment.starts_with("%21") || segment.starts_with("%40") || segment.starts_with("%23") ||
+           segment.starts_with("%24");
+}
+
+bool
+is_version(std::string_view segment)
+{
+    if (segment == "unstable")
+        return true;
+
+    return segment.size() >= 2 && (segment[0] == 'v' || segment[0] == 'r') && segment[1] >= '0' &&
+           segment[1] <= '9';
+}
+}
+
+std::string
+endpoint_class(std::string_view endpoint)
+{
+    if (auto query = endpoint.find('?'); query != std::string_view::npos)
+        endpoint = endpoint.substr(0, query);
+
+    std::vector<std::string_view> segments;
+    while (!endpoint.empty()) {
+        auto slash   = endpoint.find('/');
+        auto segment = endpoint.substr(0, slash);
+        if (!segment.empty())
+            segments.push_back(segment);
+        if (slash == std::string_view::npos)
+            break;
+        endpoint.remove_prefix(slash + 1);
+    }
+
+    std::string result;
+    std::size_t i = 0;
+    // Skip the namespace and api version, i.e. /client/v3
+    if (!segments.empty() && (segments[0] == "client" || segments[0] == "media")) {
+        if (segments[0] == "media")
+            result = "media";
+        i = segments.size() >= 2 && is_version(segments[1]) ? 2 : 1;
+        // Skip the prefix of unstable endpoints, i.e. org.matrix.msc3575
+        if (i == 2 && segments[1] == "unstable" && segments.size() > 2 &&
+            segments[2].find('.') != std::string_view::npos)
+            i = 3;
+    }
+
+    for (int added = 0; i < segments.size() && added < 2; i++) {
+        if (is_identifier(segments[i]))
+            continue;
+
+        if (!result.empty())
+            result += '/';
+        result += segments[i];
+        added++;
+    }
+
+    return result;
+}
+
+RequestPriority
+default_priority(std::string_view endpoint_class)
+{
+    if (endpoint_class == "sync")
+        return RequestPriority::Sync;
+    if (endpoint_class.starts_with("media/"))
+        return RequestPriority::BulkMedia;
+
+    constexpr std::string_view background[] = {
+      "rooms/messages",
+      "rooms/context",
+      "rooms/members",
+      "rooms/hierarchy",
+      "rooms/relations",
+      "notifications",
+      "publicRooms",
+      "room_keys/keys",
+      "room_keys/version",
+      "keys/changes",
+      "user_directory/search",
+    };
+    if (std::ranges::find(background, endpoint_class) != std::end(background))
+        return RequestPriority::Background;
+
+    return RequestPriority::Interactive;
+}
+
+std::optional<std::chrono::milliseconds>
+parse_retry_after(std::string_view header)
+{
+    while (!header.empty() && header.front() == ' ')
+        header.remove_prefix(1);
+    while (!header.empty() && header.back() == ' ')
+        header.remove_suffix(1);
+
+    std::uint64_t seconds = 0;
+    auto [end, ec]        = std::from_chars(header.data(), header.data() + header.size(), seconds);
+    if (ec != std::errc() || end != header.data() + header.size() || header.empty())
+        return std::nullopt;
+
+    return std::chrono::seconds(seconds);
+}
+
+struct RequestScheduler::State
+{
+    using clock = std::chrono::steady_clock;
+
+    struct Pending
+    {
+        std::uint64_t id = 0;
+        std::shared_ptr<Job> job;
+        Dropped dropped;
+        int retries = 0;
+    };
+
+    struct Class
+    {
+        std::deque<Pending> queue;
+        double tokens = -1;
+        clock::time_point refilled;
+        //! Set after a 429, nothing of this class is sent until then.
+        clock::time_point blocked_until;
+        //! Number of 429s in a row, used for the backoff.
+        int consecutive_limits = 0;
+        SchedulerStats::Class stats;
+    };
+
+    struct InFlight
+    {
+        std::string class_name;
+        Pending pending;
+    };
+
+    explicit State(SchedulerOpts opts_)
+      : opts(std::move(opts_))
+    {}
+
+    Class &class_for(std::string_view class_name)
+    {
+        auto it = classes.find(class_name);
+        if (it == classes.end()) {
+            it = classes.emplace(std::string(class_name), Class{}).first;
+            if (auto p = opts.class_priorities.find(class_name); p != opts.class_priorities.end())
+                it->second.stats.priority = p->second;
+            else
+                it->second.stats.priority = default_priority(class_name);
+        }
+        return it->second;
+    }
+
+    bool at_capacity(RequestPriority priority) const
+    {
+        auto index = static_cast<std::size_t>(priority);
+        return opts.max_in_flight[index] != 0 &&
+               in_flight_per_priority[index] >= opts.max_in_flight[index];
+    }
+
+    const RateLimit &limit_for(std::string_view class_name) const
+    {
+        if (auto it = opts.class_limits.find(class_name); it != opts.class_limits.end())
+            return it->second;
+        return opts.default_limit;
+    }
+
+    //! Returns the amount of time to wait for the next token or zero, if a request can be sent.
+    clock::duration take_token(Class &c, const RateLimit &limit, clock::time_point now)
+    {
+        if (limit.requests_per_second <= 0)
+            return clock::duration::zero();
+
+        if (c.tokens < 0) {
+            c.tokens = limit.burst;
+        } else {
+            std::chrono::duration<double> elapsed = now - c.refilled;
+            c.tokens =
+              std::min(limit.burst, c.tokens + elapsed.count() * limit.requests_per_second);
+        }
+        c.refilled = now;
+
+        if (c.tokens >= 1) {
+            c.tokens -= 1;
+            return clock::duration::zero();
+        }
+
+        auto wait = std::chrono::duration<double>((1 - c.tokens) / limit.requests_per_second);
+        return std::max(clock::duration(1),
+                        std::chrono::duration_cast<clock::duration>(wait));
+    }
+
+    std::chrono::milliseconds retry_delay(const Class &c,
+                                          std::optional<std::chrono::milliseconds> retry_after)
+    {
+        // Spread the retries a bit, so that not all waiting clients come back at the same time.
+        if (retry_after) {
+            std::uniform_int_distribution<std::int64_t> jitter(0, retry_after->count() / 10);
+            return *retry_after + std::chrono::milliseconds(jitter(rng));
+        }
+
+        auto backoff = opts.initial_backoff;
+        for (int i = 0; i < c.consecutive_limits && backoff < opts.max_backoff; i++)
+            backoff *= 2;
+        backoff = std::min(backoff, opts.max_backoff);
+
+        std::uniform_int_distribution<std::int64_t> jitter(backoff.count() / 2, backoff.count());
+        return std::chrono::milliseconds(jitter(rng));
+    }
+
+    void run();
+    //! Free the slot of a request in flight, that was not finished.
+    void release(std::uint64_t id);
+
+    SchedulerOpts opts;
+
+    mutable std::mutex mtx;
+    std::condition_variable cv;
+    std::map<std::string, Class, std::less<>> classes;
+    std::unordered_map<std::uint64_t, InFlight> in_flight;
+    std::array<std::size_t, request_priority_count> in_flight_per_priority{};
+    std::uint64_t next_id = 1;
+    bool stopped          = false;
+    std::mt19937 rng{std::random_device{}()};
+
+    //! Handed to the attempts, so they can report back even after the scheduler is gone.
+    std::weak_ptr<State> self;
+    std::thread worker;
+};
+
+struct RequestScheduler::Attempt::Slot
+{
+    Slot(std::shared_ptr<State> state_, std::uint64_t id_)
+      : state(std::move(state_))
+      , id(id_)
+    {}
+    ~Slot()
+    {
+        if (state)
+            state->release(id);
+    }
+
+    Slot(const Slot &)            = delete;
+    Slot &operator=(const Slot &) = delete;
+
+    //! Reset by finish().
+    std::shared_ptr<State> state;
+    std::uint64_t id;
+};
+
+void
+RequestScheduler::State::run()
+{
+    std::unique_lock lock(mtx);
+    while (!stopped) {
+        auto now         = clock::now();
+        auto next_wakeup = clock::time_point::max();
+        std::vector<std::pair<std::uint64_t, std::shared_ptr<Job>>> ready;
+
+        for (std::size_t priority = 0; priority < request_priority_count; priority++) {
+            for (auto &[name, c] : classes) {
+                if (c.queue.empty() || static_cast<std::size_t>(c.stats.priority) != priority)
+                    continue;
+
+                if (c.blocked_until > now) {
+                    next_wakeup = std::min(next_wakeup, c.blocked_until);
+                    continue;
+                }
+
+                // At capacity the next completing request wakes us up again.
+                const auto &limit = limit_for(name);
+                while (!c.queue.empty() && !at_capacity(c.stats.priority)) {
+                    if (auto wait = take_token(c, limit, now); wait != clock::duration::zero()) {
+                        next_wakeup = std::min(next_wakeup, now + wait);
+                        break;
+                    }
+
+                    auto pending = std::move(c.queue.front());
+                    c.queue.pop_front();
+                    c.stats.in_flight++;
+                    c.stats.dispatched++;
+                    in_flight_per_priority[priority]++;
+                    ready.emplace_back(pending.id, pending.job);
+                    in_flight.emplace(pending.id, InFlight{name, std::move(pending)});
+                }
+            }
+        }
+
+        if (!ready.empty()) {
+            // Start the requests without holding the lock, they might complete immediately.
+            lock.unlock();
+            for (auto &[id, job] : ready) {
+                Attempt attempt;
+                attempt.slot = std::make_shared<Attempt::Slot>(self.lock(), id);
+                (*job)(std::move(attempt));
+            }
+            lock.lock();
+            continue;
+        }
+
+        if (next_wakeup == clock::time_point::max())
+            cv.wait(lock);
+        else
+            cv.wait_until(lock, next_wakeup);
+    }
+}
+
+bool
+RequestScheduler::Attempt::finish(int status_code,
+                                  std::optional<std::chrono::milliseconds> retry_after)
+{
+    if (!slot || !slot->state)
+        return true;
+
+    auto s = std::move(slot->state);
+    std::lock_guard lock(s->mtx);
+
+    auto it = s->in_flight.find(slot->id);
+    if (it == s->in_flight.end())
+        return true;
+
+    auto node = s->in_flight.extract(it);
+    auto &c   = s->class_for(node.mapped().class_name);
+    c.stats.in_flight--;
+    s->in_flight_per_priority[static_cast<std::size_t>(c.stats.priority)]--;
+    // A slot for this priority is free again.
+    s->cv.notify_one();
+
+    if (status_code != 429) {
+        c.consecutive_limits = 0;
+        return true;
+    }
+
+    c.stats.rate_limited++;
+    auto &pending = node.mapped().pending;
+    if (s->stopped || pending.retries >= s->opts.max_retries)
+        return true;
+
+    auto until      = State::clock::now() + s->retry_delay(c, retry_after);
+    c.blocked_until = std::max(c.blocked_until, until);
+    c.consecutive_limits++;
+    c.stats.retried++;
+    pending.retries++;
+    // Retries go first, so the order of requests in a class is kept.
+    c.queue.push_front(std::move(pending));
+    return false;
+}
+
+void
+RequestScheduler::State::release(std::uint64_t id)
+{
+    std::lock_guard lock(mtx);
+    auto it = in_flight.find(id);
+    if (it == in_flight.end())
+        return;
+
+    auto &c = class_for(it->second.class_name);
+    c.stats.in_flight--;
+    in_flight_per_priority[static_cast<std::size_t>(c.stats.priority)]--;
+    in_flight.erase(it);
+    cv.notify_one();
+}
+
+RequestScheduler::RequestScheduler(SchedulerOpts opts)
+  : state(std::make_shared<State>(std::move(opts)))
+{
+    state->self   = state;
+    state->worker = std::thread([s = state.get()] { s->run(); });
+}
+
+RequestScheduler::~RequestScheduler()
+{
+    {
+        std::lock_guard lock(state->mtx);
+        state->stopped = true;
+    }
+    state->cv.notify_all();
+    state->worker.join();
+    clear();
+}
+
+void
+RequestScheduler::enqueue(std::string endpoint_class, Job job, Dropped dropped)
+{
+    {
+        std::lock_guard lock(state->mtx);
+        auto &c = state->class_for(endpoint_class);
+        c.queue.push_back(State::Pending{.id      = state->next_id++,
+                                         .job     = std::make_shared<Job>(std::move(job)),
+                                         .dropped = std::move(dropped),
+                                         .retries = 0});
+    }
+    state->cv.notify_one();
+}
+
+void
+RequestScheduler::clear()
+{
+    std::vector<Dropped> dropped;
+    {
+        std::lock_guard lock(state->mtx);
+        for (auto &[name, c] : state->classes) {
+            for (auto &pending : c.queue)
+                if (pending.dropped)
+                    dropped.push_back(std::move(pending.dropped));
+            c.queue.clear();
+        }
+    }
+
+    // Called without the lock, they may queue new requests.
+    for (const auto &cb : dropped)
+        cb();
+}
+
+SchedulerStats
+RequestScheduler::stats() const
+{
+    std::lock_guard lock(state->mtx);
+
+    SchedulerStats stats;
+    for (const auto &[name, c] : state->classes) {
+        auto &s  = stats.classes[name];
+        s        = c.stats;
+        s.queued = c.queue.size();
+    }
+    return stats;
+}
+} // namespace mtx::http
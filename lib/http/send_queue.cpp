@@ -0,0 +1,500 @@
+#include "mtxclient/http/send_queue.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "mtx/log.hpp"
+#include "mtx/responses/common.hpp"
+#include "mtxclient/utils.hpp"
+
+namespace mtx::http {
+
+void
+to_json(nlohmann::json &obj, const PendingMessage &msg)
+{
+    obj["room_id"] = msg.room_id;
+    obj["txn_id"]  = msg.txn_id;
+    obj["type"]    = msg.type;
+    obj["content"] = msg.content;
+}
+
+void
+from_json(const nlohmann::json &obj, PendingMessage &msg)
+{
+    msg.room_id = obj.at("room_id").get<std::string>();
+    msg.txn_id  = obj.at("txn_id").get<std::string>();
+    msg.type    = obj.at("type").get<std::string>();
+    msg.content = obj.at("content");
+}
+
+namespace {
+//! The log is compacted once it has this many more lines than pending messages.
+constexpr std::size_t max_obsolete_records = 64;
+
+//! Write the buffered data of a file to disk.
+bool
+sync_file(std::FILE *file)
+{
+    if (std::fflush(file) != 0)
+        return false;
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+//! Make a rename in the directory durable.
+void
+sync_directory([[maybe_unused]] const std::filesystem::path &dir)
+{
+#ifndef _WIN32
+    int fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return;
+    ::fsync(fd);
+    ::close(fd);
+#endif
+}
+}
+
+FileSendQueueStore::FileSendQueueStore(std::filesystem::path path)
+  : path_(std::move(path))
+{}
+
+FileSendQueueStore::~FileSendQueueStore()
+{
+    if (log_)
+        std::fclose(log_);
+}
+
+void
+FileSendQueueStore::add(const PendingMessage &msg)
+{
+    read_log();
+    messages.push_back(msg);
+    append(nlohmann::json{{"add", msg}}, true);
+}
+
+void
+FileSendQueueStore::remove(const std::string &room_id, const std::string &txn_id)
+{
+    read_log();
+    auto removed = std::erase_if(messages, [&room_id, &txn_id](const PendingMessage &msg) {
+        return msg.room_id == room_id && msg.txn_id == txn_id;
+    });
+    if (!removed)
+        return;
+
+    if (records - messages.size() > max_obsolete_records + messages.size())
+        compact();
+    else
+        append(nlohmann::json{{"remove", {{"room_id", room_id}, {"txn_id", txn_id}}}}, false);
+}
+
+std::vector<PendingMessage>
+FileSendQueueStore::load()
+{
+    read_log();
+    return messages;
+}
+
+void
+FileSendQueueStore::read_log()
+{
+    if (loaded)
+        return;
+    loaded = true;
+
+    std::ifstream file(path_);
+    if (!file)
+        return;
+
+    try {
+        // Older versions stored a single JSON array.
+        if ((file >> std::ws).peek() == '[') {
+            messages = nlohmann::json::parse(file).get<std::vector<PendingMessage>>();
+        } else {
+            std::string line;
+            while (std::getline(file, line)) {
+                if (line.empty())
+                    continue;
+
+                auto record = nlohmann::json::parse(line, nullptr, false);
+                if (record.is_discarded()) {
+                    // Only the last line can be cut off by a crash.
+                    mtx::utils::log::log()->warn("Skipping a corrupt line in the send queue {}",
+                                                 path_.string());
+                    continue;
+                }
+
+                if (auto added = record.find("add"); added != record.end()) {
+                    messages.push_back(added->get<PendingMessage>());
+                } else if (auto removed = record.find("remove"); removed != record.end()) {
+                    const auto &room_id = removed->at("room_id").get_ref<const std::string &>();
+                    const auto &txn_id  = removed->at("txn_id").get_ref<const std::string &>();
+                    std::erase_if(messages, [&room_id, &txn_id](const PendingMessage &msg) {
+                        return msg.room_id == room_id && msg.txn_id == txn_id;
+                    });
+                }
+            }
+        }
+    } catch (const nlohmann::json::exception &e) {
+        mtx::utils::log::log()->warn(
+          "Failed to load send queue from {}: {}", path_.string(), e.what());
+    }
+
+    file.close();
+    // Start with a log without obsolete lines, in the current format.
+    compact();
+}
+
+void
+FileSendQueueStore::append(const nlohmann::json &record, bool sync)
+{
+    if (!log_) {
+        log_ = std::fopen(path_.string().c_str(), "ab");
+        if (!log_) {
+            mtx::utils::log::log()->warn("Failed to open the send queue {}", path_.string());
+            return;
+        }
+    }
+
+    auto line = record.dump();
+    line += '\n';
+    bool ok = std::fwrite(line.data(), 1, line.size(), log_) == line.size();
+    ok      = ok && (sync ? sync_file(log_) : std::fflush(log_) == 0);
+    if (!ok)
+        mtx::utils::log::log()->warn("Failed to write send queue to {}", path_.string());
+    records++;
+}
+
+void
+FileSendQueueStore::compact()
+{
+    if (log_) {
+        std::fclose(log_);
+        log_ = nullptr;
+    }
+
+    auto tmp = path_;
+    tmp += ".tmp";
+
+    std::FILE *file = std::fopen(tmp.string().c_str(), "wb");
+    if (!file) {
+        mtx::utils::log::log()->warn("Failed to write send queue to {}", tmp.string());
+        return;
+    }
+
+    bool ok = true;
+    for (const auto &msg : messages) {
+        auto line = nlohmann::json{{"add", msg}}.dump();
+        line += '\n';
+        ok = ok && std::fwrite(line.data(), 1, line.size(), file) == line.size();
+    }
+    // Without the sync, the rename could reach the disk before the data and leave an empty file
+    // behind after a power loss.
+    ok = sync_file(file) && ok;
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok) {
+        mtx::utils::log::log()->warn("Failed to write send queue to {}", tmp.string());
+        return;
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp, path_, ec);
+    if (ec) {
+        mtx::utils::log::log()->warn(
+          "Failed to write send queue to {}: {}", path_.string(), ec.message());
+        return;
+    }
+    sync_directory(path_.parent_path());
+    records = messages.size();
+}
+
+struct SendQueue::State : std::enable_shared_from_this<SendQueue::State>
+{
+    using clock = std::chrono::steady_clock;
+
+    struct Entry
+    {
+        PendingMessage msg;
+        int attempts = 0;
+    };
+
+    struct Room
+    {
+        std::deque<Entry> queue;
+        bool in_flight = false;
+        clock::time_point retry_at;
+    };
+
+    State(Sender sender_, SendQueueOpts opts_, SentCallback callback_)
+      : sender(std::move(sender_))
+      , opts(std::move(opts_))
+      , callback(std::move(callback_))
+    {}
+
+    //! Marks the next message of every room, that can send, as in flight and returns them.
+    std::vector<PendingMessage> take_ready(clock::time_point now)
+    {
+        std::vector<PendingMessage> ready;
+        if (stopped)
+            return ready;
+
+        // Start after the room, that got the last slot, so busy rooms sorting first can't keep
+        // the others waiting.
+        auto it = rooms.upper_bound(last_started);
+        for (std::size_t checked = 0; checked < rooms.size(); checked++, ++it) {
+            if (rooms_in_flight >= opts.max_rooms_in_flight)
+                break;
+            if (it == rooms.end())
+                it = rooms.begin();
+
+            auto &[room_id, room] = *it;
+            if (room.in_flight || room.queue.empty() || room.retry_at > now)
+                continue;
+
+            room.in_flight = true;
+            room.queue.front().attempts++;
+            rooms_in_flight++;
+            ready.push_back(room.queue.front().msg);
+            last_started = room_id;
+        }
+
+        if (!ready.empty() && first_send == clock::time_point{})
+            first_send = now;
+        return ready;
+    }
+
+    //! Sends all messages, that are ready. Must be called with the lock held.
+    void pump(std::unique_lock<std::mutex> &lock)
+    {
+        auto ready = take_ready(clock::now());
+        if (ready.empty())
+            return;
+
+        lock.unlock();
+        for (const auto &msg : ready)
+            sender(msg,
+                   [weak = weak_from_this(), room_id = msg.room_id, txn_id = msg.txn_id](
+                     const mtx::responses::EventId &res, RequestErr err) {
+                       if (auto self = weak.lock())
+                           self->completed(room_id, txn_id, res, err);
+                   });
+        lock.lock();
+    }
+
+    //! Returns, when a room failing now should be retried. Failures in the same window share it.
+    clock::time_point retry_time(clock::time_point now)
+    {
+        if (next_retry > now)
+            return next_retry;
+
+        auto backoff = opts.initial_backoff;
+        for (int i = 0; i < consecutive_failures && backoff < opts.max_backoff; i++)
+            backoff *= 2;
+        consecutive_failures++;
+
+        next_retry = now + std::min(backoff, opts.max_backoff);
+        return next_retry;
+    }
+
+    void completed(const std::string &room_id,
+                   const std::string &txn_id,
+                   const mtx::responses::EventId &res,
+                   RequestErr err)
+    {
+        std::unique_lock lock(mtx);
+        // The message stays in the store and is sent again on the next start.
+        if (stopped)
+            return;
+
+        auto room = rooms.find(room_id);
+        if (room == rooms.end() || room->second.queue.empty() ||
+            room->second.queue.front().msg.txn_id != txn_id)
+            return;
+
+        auto &r     = room->second;
+        r.in_flight = false;
+        rooms_in_flight--;
+
+        auto now = clock::now();
+        if (err) {
+            bool transient = err->error_code != 0 || err->status_code == 0 ||
+                             err->status_code == 429 || err->status_code >= 500;
+            bool retry =
+              transient && (opts.max_attempts == 0 || r.queue.front().attempts < opts.max_attempts);
+
+            if (retry) {
+                retries++;
+                r.retry_at = retry_time(now);
+                cv.notify_one();
+                pump(lock);
+                return;
+            }
+            failed++;
+        } else {
+            sent++;
+            consecutive_failures = 0;
+            last_sent            = now;
+        }
+
+        auto msg = std::move(r.queue.front().msg);
+        r.queue.pop_front();
+        if (r.queue.empty() && !r.in_flight)
+            rooms.erase(room);
+
+        pump(lock);
+        lock.unlock();
+
+        if (opts.store) {
+            std::lock_guard store_lock(store_mtx);
+            opts.store->remove(msg.room_id, msg.txn_id);
+        }
+
+        if (callback)
+            callback(msg, res, err);
+    }
+
+    //! Sends rooms, that are waiting for a retry, when their time has come.
+    void run()
+    {
+        std::unique_lock lock(mtx);
+        while (!stopped) {
+            auto next = clock::time_point::max();
+            auto now  = clock::now();
+            for (const auto &[room_id, room] : rooms)
+                if (!room.in_flight && !room.queue.empty() && room.retry_at > now)
+                    next = std::min(next, room.retry_at);
+
+            if (next == clock::time_point::max())
+                cv.wait(lock);
+            else
+                cv.wait_until(lock, next);
+
+            if (!stopped)
+                pump(lock);
+        }
+    }
+
+    Sender sender;
+    SendQueueOpts opts;
+    SentCallback callback;
+
+    std::mutex mtx;
+    //! Serializes the calls to the store, which may block on disk I/O, without holding up the
+    //! queue.
+    std::mutex store_mtx;
+    std::condition_variable cv;
+    std::map<std::string, Room, std::less<>> rooms;
+    std::size_t rooms_in_flight = 0;
+    //! The room, that was sent last. The next free slot goes to the room after it.
+    std::string last_started;
+    clock::time_point next_retry;
+    int consecutive_failures = 0;
+    bool stopped             = false;
+
+    std::uint64_t sent = 0, failed = 0, retries = 0;
+    clock::time_point first_send, last_sent;
+
+    std::thread worker;
+};
+
+SendQueue::SendQueue(std::shared_ptr<Client> client, SendQueueOpts opts, SentCallback cb)
+  : SendQueue(
+      [client = std::move(client)](const PendingMessage &msg,
+                                   Callback<mtx::responses::EventId> sent) {
+          client->send_room_message(
+            msg.room_id, msg.txn_id, msg.type, msg.content, std::move(sent));
+      },
+      std::move(opts),
+      std::move(cb))
+{}
+
+SendQueue::SendQueue(Sender sender, SendQueueOpts opts, SentCallback cb)
+  : state(std::make_shared<State>(std::move(sender), std::move(opts), std::move(cb)))
+{
+    std::unique_lock lock(state->mtx);
+    if (state->opts.store)
+        for (auto &msg : state->opts.store->load())
+            state->rooms[msg.room_id].queue.push_back(State::Entry{std::move(msg), 0});
+
+    state->worker = std::thread([s = state.get()] { s->run(); });
+    state->pump(lock);
+}
+
+SendQueue::~SendQueue()
+{
+    {
+        std::lock_guard lock(state->mtx);
+        state->stopped = true;
+    }
+    state->cv.notify_all();
+    state->worker.join();
+}
+
+std::string
+SendQueue::enqueue(const std::string &room_id, const std::string &type, nlohmann::json content)
+{
+    PendingMessage msg{
+      .room_id = room_id,
+      .txn_id  = mtx::client::utils::random_token(32, false),
+      .type    = type,
+      .content = std::move(content),
+    };
+    auto txn_id = msg.txn_id;
+
+    // Stored before it can be sent, so the removal can't overtake it.
+    if (state->opts.store) {
+        std::lock_guard store_lock(state->store_mtx);
+        state->opts.store->add(msg);
+    }
+
+    std::unique_lock lock(state->mtx);
+    state->rooms[room_id].queue.push_back(State::Entry{std::move(msg), 0});
+    state->pump(lock);
+
+    return txn_id;
+}
+
+std::vector<PendingMessage>
+SendQueue::pending() const
+{
+    std::lock_guard lock(state->mtx);
+
+    std::vector<PendingMessage> messages;
+    for (const auto &[room_id, room] : state->rooms)
+        for (const auto &entry : room.queue)
+            messages.push_back(entry.msg);
+    return messages;
+}
+
+SendQueueStats
+SendQueue::stats() const
+{
+    std::lock_guard lock(state->mtx);
+
+    SendQueueStats stats;
+    for (const auto &[room_id, room] : state->rooms)
+        stats.pending += room.queue.size();
+    stats.in_flight = state->rooms_in_flight;
+    stats.sent      = state->sent;
+    stats.failed    = state->failed;
+    stats.retries   = state->retries;
+    if (state->last_sent > state->first_send)
+        stats.busy_time = state->last_sent - state->first_send;
+    return stats;
+}
+} // namespace mtx::http
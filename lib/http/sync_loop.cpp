@@ -0,0 +1,334 @@
+#include "mtxclient/http/sync_loop.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <nlohmann/json.hpp>
+
+#include "mtx/log.hpp"
+
+namespace mtx::http {
+
+namespace {
+//! Returns the index of the quote ending the string, that starts at `start`.
+std::size_t
+string_end(std::string_view body, std::size_t start)
+{
+    for (auto i = body.find_first_of("\"\\", start + 1); i != std::string_view::npos;
+         i      = body.find_first_of("\"\\", i + 2)) {
+        if (body[i] == '"')
+            return i;
+    }
+    return std::string_view::npos;
+}
+
+std::size_t
+skip_whitespace(std::string_view body, std::size_t pos)
+{
+    pos = body.find_first_not_of(" \t\r\n", pos);
+    return pos == std::string_view::npos ? body.size() : pos;
+}
+}
+
+std::optional<std::string>
+find_next_batch(std::string_view body)
+{
+    int depth = 0;
+    for (auto i = body.find_first_of("{}[]\""); i != std::string_view::npos;
+         i      = body.find_first_of("{}[]\"", i + 1)) {
+        switch (body[i]) {
+        case '{':
+        case '[':
+            depth++;
+            break;
+        case '}':
+        case ']':
+            depth--;
+            break;
+        default: {
+            auto end = string_end(body, i);
+            if (end == std::string_view::npos)
+                return std::nullopt;
+
+            if (depth == 1 && body.substr(i + 1, end - i - 1) == "next_batch") {
+                auto colon = skip_whitespace(body, end + 1);
+                if (colon < body.size() && body[colon] == ':') {
+                    auto value = skip_whitespace(body, colon + 1);
+                    if (value >= body.size() || body[value] != '"')
+                        return std::nullopt;
+
+                    auto value_end = string_end(body, value);
+                    if (value_end == std::string_view::npos)
+                        return std::nullopt;
+
+                    auto token = body.substr(value + 1, value_end - value - 1);
+                    if (token.find('\\') == std::string_view::npos)
+                        return std::string(token);
+
+                    // Rare enough, that it is simpler to let the parser handle the escapes.
+                    auto unescaped = nlohmann::json::parse(
+                      body.substr(value, value_end - value + 1), nullptr, false);
+                    if (unescaped.is_string())
+                        return unescaped.get<std::string>();
+                    return std::nullopt;
+                }
+            }
+            i = end;
+        }
+        }
+    }
+    return std::nullopt;
+}
+
+struct SyncLoop::State
+{
+    using clock = std::chrono::steady_clock;
+
+    State(Syncer syncer_, SyncLoopOpts opts_, SyncCallback on_sync_, ErrorCallback on_error_)
+      : syncer(std::move(syncer_))
+      , opts(std::move(opts_))
+      , on_sync(std::move(on_sync_))
+      , on_error(std::move(on_error_))
+    {}
+
+    //! Starts the next sync, if the loop is running and has room for another response. Must be
+    //! called with the lock held.
+    void maybe_request(const std::shared_ptr<State> &self, std::unique_lock<std::mutex> &lock)
+    {
+        if (!running || in_flight || retry_at || batches.size() >= opts.max_queued_batches)
+            return;
+
+        in_flight = true;
+        if (!batches.empty() || handling)
+            stats.pipelined++;
+
+        auto sync_opts  = opts.sync;
+        sync_opts.since = since;
+
+        lock.unlock();
+        syncer(sync_opts,
+               [weak = std::weak_ptr<State>(self), gen = generation](const std::string &body,
+                                                                     RequestErr err) {
+                   if (auto s = weak.lock())
+                       s->received(s, gen, body, err);
+               });
+        lock.lock();
+    }
+
+    void received(const std::shared_ptr<State> &self,
+                  std::uint64_t gen,
+                  const std::string &body,
+                  RequestErr err)
+    {
+        std::unique_lock lock(mtx);
+        if (gen != generation || !running)
+            return;
+        in_flight = false;
+
+        std::optional<std::string> token;
+        if (!err)
+            token = find_next_batch(body);
+
+        if (!token) {
+            ClientError error{};
+            if (err)
+                error = *err;
+            else
+                error.parse_error = "sync response without next_batch";
+
+            stats.errors++;
+            auto backoff = opts.initial_backoff;
+            for (int i = 0; i < consecutive_failures && backoff < opts.max_backoff; i++)
+                backoff *= 2;
+            consecutive_failures++;
+            retry_at = clock::now() + std::min(backoff, opts.max_backoff);
+            cv.notify_all();
+
+            lock.unlock();
+            if (on_error)
+                on_error(error, {});
+            return;
+        }
+
+        consecutive_failures = 0;
+        since                = std::move(*token);
+        batches.push_back(body);
+        cv.notify_all();
+
+        maybe_request(self, lock);
+    }
+
+    //! Parses and hands the responses to the callback and starts retries, when they are due.
+    void run(const std::shared_ptr<State> &self)
+    {
+        std::unique_lock lock(mtx);
+        while (!stopped) {
+            if (retry_at && *retry_at <= clock::now()) {
+                retry_at.reset();
+                maybe_request(self, lock);
+                continue;
+            }
+
+            if (batches.empty()) {
+                if (retry_at)
+                    cv.wait_until(lock, *retry_at);
+                else
+                    cv.wait(lock);
+                continue;
+            }
+
+            auto body = std::move(batches.front());
+            batches.pop_front();
+            handling = true;
+            auto gen = generation;
+            // Popping made room for another response.
+            maybe_request(self, lock);
+            lock.unlock();
+
+            auto start = clock::now();
+            std::optional<mtx::responses::Sync> res;
+            std::optional<ClientError> error;
+            try {
+                res = nlohmann::json::parse(body).get<mtx::responses::Sync>();
+            } catch (const std::exception &e) {
+                error.emplace().parse_error = e.what();
+            }
+            auto parsed = clock::now();
+
+            if (res && on_sync) {
+                try {
+                    on_sync(*res);
+                } catch (const std::exception &e) {
+                    mtx::utils::log::log()->critical(
+                      "Application bug, exception escaped callback: {}", e.what());
+                }
+            } else if (error && on_error) {
+                on_error(error, body);
+            }
+
+            lock.lock();
+            handling = false;
+            stats.parse_time += parsed - start;
+            stats.callback_time += clock::now() - parsed;
+            if (res) {
+                stats.syncs++;
+                processed = res->next_batch;
+            } else {
+                stats.errors++;
+            }
+            if (gen == generation)
+                maybe_request(self, lock);
+        }
+    }
+
+    Syncer syncer;
+    SyncLoopOpts opts;
+    SyncCallback on_sync;
+    ErrorCallback on_error;
+
+    mutable std::mutex mtx;
+    std::condition_variable cv;
+    //! Incremented on every start and stop, so that stale responses are ignored.
+    std::uint64_t generation = 0;
+    bool running             = false;
+    bool stopped             = false;
+    bool in_flight           = false;
+    bool handling            = false;
+    int consecutive_failures = 0;
+    std::optional<clock::time_point> retry_at;
+    //! The token for the next request.
+    std::string since;
+    //! The token of the last response passed to the callback.
+    std::string processed;
+    std::deque<std::string> batches;
+    SyncLoopStats stats;
+
+    std::thread worker;
+};
+
+SyncLoop::SyncLoop(std::shared_ptr<Client> client,
+                   SyncLoopOpts opts,
+                   SyncCallback on_sync,
+                   ErrorCallback on_error)
+  : SyncLoop(
+      [client](const SyncOpts &sync_opts, Callback<std::string> cb) {
+          client->sync_raw(sync_opts, std::move(cb));
+      },
+      [&opts, &client] {
+          if (opts.sync.since.empty())
+              opts.sync.since = client->next_batch_token();
+          return std::move(opts);
+      }(),
+      std::move(on_sync),
+      std::move(on_error))
+{}
+
+SyncLoop::SyncLoop(Syncer syncer, SyncLoopOpts opts, SyncCallback on_sync, ErrorCallback on_error)
+  : state(std::make_shared<State>(
+      std::move(syncer), std::move(opts), std::move(on_sync), std::move(on_error)))
+{
+    state->worker = std::thread([s = state] { s->run(s); });
+}
+
+SyncLoop::~SyncLoop()
+{
+    stop();
+    {
+        std::lock_guard lock(state->mtx);
+        state->stopped = true;
+    }
+    state->cv.notify_all();
+
+    // The worker keeps the state alive, so it can finish on its own, if we are destroyed from the
+    // callback.
+    if (state->worker.get_id() == std::this_thread::get_id())
+        state->worker.detach();
+    else
+        state->worker.join();
+}
+
+void
+SyncLoop::start()
+{
+    std::unique_lock lock(state->mtx);
+    if (state->running)
+        return;
+
+    state->running = true;
+    state->generation++;
+    // Responses dropped by stop() are requested again.
+    state->since = state->processed.empty() ? state->opts.sync.since : state->processed;
+    state->maybe_request(state, lock);
+}
+
+void
+SyncLoop::stop()
+{
+    std::lock_guard lock(state->mtx);
+    state->running   = false;
+    state->in_flight = false;
+    state->generation++;
+    state->batches.clear();
+    state->retry_at.reset();
+    state->consecutive_failures = 0;
+}
+
+std::string
+SyncLoop::next_batch() const
+{
+    std::lock_guard lock(state->mtx);
+    return state->processed;
+}
+
+SyncLoopStats
+SyncLoop::stats() const
+{
+    std::lock_guard lock(state->mtx);
+
+    auto stats   = state->stats;
+    stats.queued = state->batches.size();
+    return stats;
+}
+} // namespace mtx::http
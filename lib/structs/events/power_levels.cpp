@@ -27,11 +27,9 @@ from_json(const json &obj, PowerLevels &power_levels)
         power_levels.redact = obj.at("redact").get<power_level_t>();
 
     if (obj.count("events") != 0)
-        power_levels.events =
-          obj.at("events").get<std::map<std::string, power_level_t, std::less<>>>();
+        power_levels.events = obj.at("events").get<decltype(power_levels.events)>();
     if (obj.count("users") != 0)
-        power_levels.users =
-          obj.at("users").get<std::map<std::string, power_level_t, std::less<>>>();
+        power_levels.users = obj.at("users").get<decltype(power_levels.users)>();
 
     if (obj.count("events_default") != 0)
         power_levels.events_default = obj.at("events_default").get<power_level_t>();
@@ -79,10 +77,10 @@ PowerLevels::user_level(const std::string &user_id,
             return Creator;
     }
 
-    if (users.find(user_id) == users.end())
-        return users_default;
+    if (auto it = users.find(user_id); it != users.end())
+        return it->second;
 
-    return users.at(user_id);
+    return users_default;
 }
 
 } // namespace state
@@ -1,10 +1,84 @@
 #include "mtx/identifiers.hpp"
 
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
 #include <nlohmann/json.hpp>
 
 namespace mtx {
 namespace identifiers {
 
+namespace {
+struct Interner
+{
+    std::mutex mtx;
+    //! The keys point into the values, so they stay valid as long as the entry exists.
+    std::unordered_map<std::string_view, std::shared_ptr<const std::string>> table;
+    std::size_t hits   = 0;
+    std::size_t misses = 0;
+};
+
+std::atomic<bool> interning{false};
+
+Interner &
+interner()
+{
+    static Interner instance;
+    return instance;
+}
+}
+
+void
+set_interning_enabled(bool enabled)
+{
+    interning = enabled;
+}
+
+bool
+interning_enabled()
+{
+    return interning;
+}
+
+InternStats
+intern_stats()
+{
+    auto &i = interner();
+    std::lock_guard lock(i.mtx);
+    return InternStats{i.table.size(), i.hits, i.misses};
+}
+
+void
+purge_interned()
+{
+    auto &i = interner();
+    std::lock_guard lock(i.mtx);
+    std::erase_if(i.table, [](const auto &entry) { return entry.second.use_count() == 1; });
+}
+
+void
+ID::assign(std::string_view id, std::size_t separator)
+{
+    separator_ = static_cast<std::uint32_t>(separator);
+
+    if (!interning) {
+        id_ = std::make_shared<const std::string>(id);
+        return;
+    }
+
+    auto &i = interner();
+    std::lock_guard lock(i.mtx);
+    if (auto it = i.table.find(id); it != i.table.end()) {
+        i.hits++;
+        id_ = it->second;
+    } else {
+        i.misses++;
+        id_ = std::make_shared<const std::string>(id);
+        i.table.emplace(std::string_view(*id_), id_);
+    }
+}
+
 void
 from_json(const nlohmann::json &obj, User &user)
 {
@@ -1,6 +1,9 @@
 #include "mtx/pushrules.hpp"
 
 #include <charconv>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <nlohmann/json.hpp>
 #include <re2/re2.h>
@@ -787,5 +790,243 @@ PushRuleEvaluator::evaluate(
     return {};
 }
 
+bool
+notifies(const std::vector<actions::Action> &actions)
+{
+    for (const auto &action : actions) {
+        if (std::holds_alternative<actions::notify>(action) ||
+            std::holds_alternative<actions::coalesce>(action))
+            return true;
+    }
+    return false;
+}
+
+bool
+highlights(const std::vector<actions::Action> &actions)
+{
+    for (const auto &action : actions) {
+        if (auto h = std::get_if<actions::set_tweak_highlight>(&action); h && h->value)
+            return true;
+    }
+    return false;
+}
+
+struct NotificationCounter::RoomCounters
+{
+    //! The number of read event ids remembered per room.
+    static constexpr std::size_t max_read_ids = 256;
+
+    struct Room
+    {
+        //! The position of every event seen since the oldest unread notification. Used to order
+        //! receipts relative to the unread events. Nothing is tracked while nothing is unread.
+        std::unordered_map<std::string, std::uint64_t> positions;
+        //! The event ids in positions, in timeline order, so that they can be dropped in order.
+        std::deque<std::string> order;
+        //! The position and highlight flag of every unread notification.
+        std::deque<std::pair<std::uint64_t, bool>> unread;
+        //! Recently read events, that were dropped from positions. Remembered so that an event,
+        //! which is delivered again, i.e. by a backfill, isn't counted as unread again.
+        std::unordered_set<std::string> read;
+        //! The event ids in read, oldest first.
+        std::deque<std::string> read_order;
+        std::uint64_t next_position = 0;
+        Counts counts;
+        //! The part of counts set by reset_room() for events, that were never processed.
+        Counts unknown;
+
+        [[nodiscard]] bool seen(const std::string &event_id) const
+        {
+            return positions.count(event_id) || read.count(event_id);
+        }
+
+        void remember_read(std::string event_id)
+        {
+            if (!read.insert(event_id).second)
+                return;
+            read_order.push_back(std::move(event_id));
+            if (read_order.size() > max_read_ids) {
+                read.erase(read_order.front());
+                read_order.pop_front();
+            }
+        }
+    };
+
+    std::unordered_map<std::string, Room> rooms;
+};
+
+NotificationCounter::NotificationCounter(std::string user_id)
+  : user_id_(std::move(user_id))
+  , rooms(std::make_unique<RoomCounters>())
+{
+}
+
+NotificationCounter::~NotificationCounter() = default;
+
+std::vector<actions::Action>
+NotificationCounter::process_event(
+  const std::string &room_id,
+  const mtx::events::collections::TimelineEvents &event,
+  const PushRuleEvaluator &evaluator,
+  const PushRuleEvaluator::RoomContext &ctx,
+  const std::vector<std::pair<mtx::common::Relation, mtx::events::collections::TimelineEvents>>
+    &relatedEvents)
+{
+    // The decrypted event should be passed in instead.
+    if (std::holds_alternative<mtx::events::EncryptedEvent<mtx::events::msg::Encrypted>>(event))
+        return {};
+
+    // Don't evaluate events we already counted, i.e. when a sync overlaps with a backfill.
+    if (auto room = rooms->rooms.find(room_id); room != rooms->rooms.end()) {
+        const auto &event_id =
+          std::visit([](const auto &e) -> const std::string & { return e.event_id; }, event);
+        if (room->second.seen(event_id))
+            return {};
+    }
+
+    auto actions = evaluator.evaluate(event, ctx, relatedEvents);
+    process_event(room_id, event, actions);
+    return actions;
+}
+
+void
+NotificationCounter::process_event(const std::string &room_id,
+                                   const mtx::events::collections::TimelineEvents &event,
+                                   const std::vector<actions::Action> &actions)
+{
+    const auto &[event_id, sender] = std::visit(
+      [](const auto &e) {
+          return std::pair<const std::string &, const std::string &>(e.event_id, e.sender);
+      },
+      event);
+
+    auto &room = rooms->rooms[room_id];
+    if (room.seen(event_id))
+        return;
+
+    const bool own_event = sender == user_id_;
+    const bool notify    = !own_event && notifies(actions);
+
+    // Receipts for events before the oldest unread notification don't change anything.
+    if (!notify && room.unread.empty() && room.unknown == Counts{})
+        return;
+
+    auto position = room.next_position++;
+    room.positions.emplace(event_id, position);
+    room.order.push_back(event_id);
+
+    if (notify) {
+        const bool highlight = highlights(actions);
+        room.unread.emplace_back(position, highlight);
+        room.counts.notification_count++;
+        total_.notification_count++;
+        if (highlight) {
+            room.counts.highlight_count++;
+            total_.highlight_count++;
+        }
+    }
+
+    // Sending an event implies having read everything before it.
+    if (own_event)
+        mark_read(room_id, event_id);
+}
+
+void
+NotificationCounter::process_receipts(const std::string &room_id,
+                                      const mtx::events::ephemeral::Receipt &receipts)
+{
+    for (const auto &[event_id, receiptsByType] : receipts.receipts) {
+        for (const auto &[type, receipt] : receiptsByType) {
+            (void)type;
+            if (receipt.users.count(user_id_)) {
+                mark_read(room_id, event_id);
+                break;
+            }
+        }
+    }
+}
+
+bool
+NotificationCounter::mark_read(const std::string &room_id, const std::string &event_id)
+{
+    auto room_it = rooms->rooms.find(room_id);
+    if (room_it == rooms->rooms.end())
+        return false;
+
+    auto &room       = room_it->second;
+    auto position_it = room.positions.find(event_id);
+    if (position_it == room.positions.end())
+        return false;
+    const auto read_up_to = position_it->second;
+
+    // Every event processed since the reset is newer than the unknown unread ones.
+    room.counts.notification_count -= room.unknown.notification_count;
+    room.counts.highlight_count -= room.unknown.highlight_count;
+    total_.notification_count -= room.unknown.notification_count;
+    total_.highlight_count -= room.unknown.highlight_count;
+    room.unknown = {};
+
+    while (!room.unread.empty() && room.unread.front().first <= read_up_to) {
+        room.counts.notification_count--;
+        total_.notification_count--;
+        if (room.unread.front().second) {
+            room.counts.highlight_count--;
+            total_.highlight_count--;
+        }
+        room.unread.pop_front();
+    }
+
+    // Only positions after the oldest unread notification need to be remembered.
+    const auto keep_from = room.unread.empty() ? room.next_position : room.unread.front().first;
+    while (!room.order.empty()) {
+        auto it = room.positions.find(room.order.front());
+        if (it != room.positions.end() && it->second >= keep_from)
+            break;
+        if (it != room.positions.end())
+            room.positions.erase(it);
+        room.remember_read(std::move(room.order.front()));
+        room.order.pop_front();
+    }
+
+    return true;
+}
+
+NotificationCounter::Counts
+NotificationCounter::counts(const std::string &room_id) const
+{
+    if (auto room = rooms->rooms.find(room_id); room != rooms->rooms.end())
+        return room->second.counts;
+    return {};
+}
+
+void
+NotificationCounter::reset_room(const std::string &room_id, Counts counts)
+{
+    auto &room = rooms->rooms[room_id];
+    total_.notification_count -= room.counts.notification_count;
+    total_.highlight_count -= room.counts.highlight_count;
+
+    // Remember the forgotten events as read, so a backfill doesn't count them again.
+    for (auto &event_id : room.order)
+        room.remember_read(std::move(event_id));
+    room.positions.clear();
+    room.order.clear();
+    room.unread.clear();
+
+    room.counts  = counts;
+    room.unknown = counts;
+    total_.notification_count += counts.notification_count;
+    total_.highlight_count += counts.highlight_count;
+}
+
+void
+NotificationCounter::remove_room(const std::string &room_id)
+{
+    if (auto room = rooms->rooms.find(room_id); room != rooms->rooms.end()) {
+        total_.notification_count -= room->second.counts.notification_count;
+        total_.highlight_count -= room->second.counts.highlight_count;
+        rooms->rooms.erase(room);
+    }
+}
 }
 }
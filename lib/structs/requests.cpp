@@ -288,5 +288,186 @@ to_json(json &obj, const SetPusher &req)
     obj["append"] = req.append;
 }
 
+void
+to_json(json &obj, const EventFilter &filter)
+{
+    obj = json::object();
+    if (filter.limit)
+        obj["limit"] = *filter.limit;
+    if (filter.types)
+        obj["types"] = *filter.types;
+    if (!filter.not_types.empty())
+        obj["not_types"] = filter.not_types;
+    if (filter.senders)
+        obj["senders"] = *filter.senders;
+    if (!filter.not_senders.empty())
+        obj["not_senders"] = filter.not_senders;
+}
+
+void
+to_json(json &obj, const RoomEventFilter &filter)
+{
+    obj = json::object();
+    if (filter.limit)
+        obj["limit"] = *filter.limit;
+    if (filter.types)
+        obj["types"] = *filter.types;
+    if (!filter.not_types.empty())
+        obj["not_types"] = filter.not_types;
+    if (filter.senders)
+        obj["senders"] = *filter.senders;
+    if (!filter.not_senders.empty())
+        obj["not_senders"] = filter.not_senders;
+    if (filter.rooms)
+        obj["rooms"] = *filter.rooms;
+    if (!filter.not_rooms.empty())
+        obj["not_rooms"] = filter.not_rooms;
+    if (filter.contains_url)
+        obj["contains_url"] = *filter.contains_url;
+    if (filter.lazy_load_members)
+        obj["lazy_load_members"] = true;
+    if (filter.include_redundant_members)
+        obj["include_redundant_members"] = true;
+    if (filter.unread_thread_notifications)
+        obj["unread_thread_notifications"] = true;
+}
+
+void
+to_json(json &obj, const RoomFilter &filter)
+{
+    obj = json::object();
+    if (filter.rooms)
+        obj["rooms"] = *filter.rooms;
+    if (!filter.not_rooms.empty())
+        obj["not_rooms"] = filter.not_rooms;
+    if (filter.include_leave)
+        obj["include_leave"] = true;
+    if (filter.timeline)
+        obj["timeline"] = *filter.timeline;
+    if (filter.state)
+        obj["state"] = *filter.state;
+    if (filter.ephemeral)
+        obj["ephemeral"] = *filter.ephemeral;
+    if (filter.account_data)
+        obj["account_data"] = *filter.account_data;
+}
+
+void
+to_json(json &obj, const Filter &filter)
+{
+    obj = json::object();
+    if (!filter.event_fields.empty())
+        obj["event_fields"] = filter.event_fields;
+    if (!filter.event_format.empty())
+        obj["event_format"] = filter.event_format;
+    if (filter.presence)
+        obj["presence"] = *filter.presence;
+    if (filter.account_data)
+        obj["account_data"] = *filter.account_data;
+    if (filter.room)
+        obj["room"] = *filter.room;
+}
+
+namespace sliding_sync {
+void
+to_json(json &obj, const ListFilters &filters)
+{
+    obj = json::object();
+    if (filters.is_dm)
+        obj["is_dm"] = *filters.is_dm;
+    if (filters.is_encrypted)
+        obj["is_encrypted"] = *filters.is_encrypted;
+    if (filters.is_invite)
+        obj["is_invite"] = *filters.is_invite;
+    if (!filters.room_types.empty())
+        obj["room_types"] = filters.room_types;
+    if (!filters.not_room_types.empty())
+        obj["not_room_types"] = filters.not_room_types;
+}
+
+static json
+required_state_to_json(const RequiredState &required_state)
+{
+    auto state = json::array();
+    for (const auto &[type, state_key] : required_state)
+        state.push_back(json::array({type, state_key}));
+    return state;
+}
+
+void
+to_json(json &obj, const List &list)
+{
+    auto ranges = json::array();
+    for (const auto &[first, last] : list.ranges)
+        ranges.push_back(json::array({first, last}));
+
+    obj["ranges"]         = std::move(ranges);
+    obj["required_state"] = required_state_to_json(list.required_state);
+    obj["timeline_limit"] = list.timeline_limit;
+    if (list.filters)
+        obj["filters"] = *list.filters;
+}
+
+void
+to_json(json &obj, const RoomSubscription &subscription)
+{
+    obj["required_state"] = required_state_to_json(subscription.required_state);
+    obj["timeline_limit"] = subscription.timeline_limit;
+}
+
+void
+to_json(json &obj, const ToDeviceExtension &ext)
+{
+    obj["enabled"] = ext.enabled;
+    if (!ext.since.empty())
+        obj["since"] = ext.since;
+    if (ext.limit)
+        obj["limit"] = *ext.limit;
+}
+
+void
+to_json(json &obj, const RoomDataExtension &ext)
+{
+    obj["enabled"] = ext.enabled;
+    if (ext.lists)
+        obj["lists"] = *ext.lists;
+    if (ext.rooms)
+        obj["rooms"] = *ext.rooms;
+}
+
+void
+to_json(json &obj, const Extensions &extensions)
+{
+    obj = json::object();
+    if (extensions.to_device.enabled)
+        obj["to_device"] = extensions.to_device;
+    if (extensions.e2ee)
+        obj["e2ee"] = {{"enabled", true}};
+    if (extensions.account_data.enabled)
+        obj["account_data"] = extensions.account_data;
+    if (extensions.receipts.enabled)
+        obj["receipts"] = extensions.receipts;
+    if (extensions.typing.enabled)
+        obj["typing"] = extensions.typing;
+}
+} // namespace sliding_sync
+
+void
+to_json(json &obj, const SlidingSync &request)
+{
+    if (!request.conn_id.empty())
+        obj["conn_id"] = request.conn_id;
+
+    obj["lists"] = json::object();
+    for (const auto &[name, list] : request.lists)
+        obj["lists"][name] = list;
+
+    obj["room_subscriptions"] = json::object();
+    for (const auto &[room_id, subscription] : request.room_subscriptions)
+        obj["room_subscriptions"][room_id] = subscription;
+
+    obj["extensions"] = request.extensions;
+}
+
 } // namespace requests
 } // namespace mtx
@@ -21,7 +21,7 @@ from_json(const nlohmann::json &obj, QueryKeys &response)
             response.failures[key] = value.dump();
     }
     if (obj.contains("device_keys"))
-        response.device_keys = obj.at("device_keys").get<std::map<std::string, DeviceToKeysMap>>();
+        response.device_keys = obj.at("device_keys").get<decltype(response.device_keys)>();
     if (obj.contains("master_keys"))
         response.master_keys =
           obj.at("master_keys").get<std::map<std::string, mtx::crypto::CrossSigningKeys>>();
@@ -61,9 +61,7 @@ from_json(const nlohmann::json &obj, ClaimKeys &response)
             response.failures[key] = value.dump();
     }
     if (obj.contains("one_time_keys"))
-        response.one_time_keys =
-          obj.at("one_time_keys")
-            .get<std::map<std::string, std::map<std::string, nlohmann::json>>>();
+        response.one_time_keys = obj.at("one_time_keys").get<decltype(response.one_time_keys)>();
 }
 
 void
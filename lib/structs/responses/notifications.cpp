@@ -69,7 +69,7 @@ to_json(json &obj, const Notification &res)
 void
 from_json(const json &obj, Notifications &res)
 {
-    // res.next_token    = obj.at("next_token").get<std::string>();
+    res.next_token    = obj.value("next_token", std::string{});
     res.notifications = obj.at("notifications").get<std::vector<Notification>>();
 }
 
@@ -77,6 +77,9 @@ void
 to_json(json &obj, const Notifications &notif)
 {
     obj["notifications"] = notif.notifications;
+
+    if (!notif.next_token.empty())
+        obj["next_token"] = notif.next_token;
 }
 } // namespace responses
 } // namespace mtx
@@ -0,0 +1,154 @@
+#include "mtx/responses/sliding_sync.hpp"
+#include "mtx/log.hpp"
+#include "mtx/responses/common.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <iterator>
+
+using json = nlohmann::json;
+
+namespace mtx {
+namespace responses {
+namespace sliding_sync {
+
+void
+from_json(const json &obj, Hero &hero)
+{
+    hero.user_id     = obj.at("user_id").get<std::string>();
+    hero.displayname = obj.value("displayname", std::string{});
+    hero.avatar_url  = obj.value("avatar_url", std::string{});
+}
+
+template<class T>
+static void
+optional_count(const json &obj, const char *key, std::optional<T> &count)
+{
+    if (auto it = obj.find(key); it != obj.end() && it->is_number_unsigned())
+        count = it->get<T>();
+}
+
+void
+from_json(const json &obj, Room &room)
+{
+    room.name    = obj.value("name", std::string{});
+    room.avatar  = obj.value("avatar", std::string{});
+    room.initial = obj.value("initial", false);
+    room.is_dm   = obj.value("is_dm", false);
+
+    if (auto it = obj.find("heroes"); it != obj.end() && it->is_array())
+        room.heroes = it->get<std::vector<Hero>>();
+
+    if (auto it = obj.find("required_state"); it != obj.end() && it->is_array())
+        utils::parse_state_events(*it, room.required_state);
+
+    if (auto it = obj.find("timeline"); it != obj.end() && it->is_array())
+        utils::parse_timeline_events(*it, room.timeline);
+
+    room.prev_batch = obj.value("prev_batch", std::string{});
+    room.limited    = obj.value("limited", false);
+
+    optional_count(obj, "num_live", room.num_live);
+    optional_count(obj, "bump_stamp", room.bump_stamp);
+    optional_count(obj, "joined_count", room.joined_count);
+    optional_count(obj, "invited_count", room.invited_count);
+
+    // The counts are sent directly in the room instead of in an unread_notifications object.
+    room.unread_notifications = obj.get<UnreadNotifications>();
+
+    // Older proxies and drafts of the MSC call it invite_state.
+    auto stripped = obj.find("stripped_state");
+    if (stripped == obj.end())
+        stripped = obj.find("invite_state");
+    if (stripped != obj.end() && stripped->is_array())
+        utils::parse_stripped_events(*stripped, room.invite_state);
+}
+
+void
+from_json(const json &obj, List &list)
+{
+    list.count = obj.value("count", uint64_t{0});
+}
+
+//! Parses the per room ephemeral events of the receipts and typing extensions.
+static void
+parse_room_ephemeral(const json &obj, mtx::common::StringMap<Ephemeral> &ephemeral)
+{
+    auto rooms = obj.find("rooms");
+    if (rooms == obj.end() || !rooms->is_object())
+        return;
+
+    // Each room has a single event. The parser replaces the events, so append them instead.
+    for (const auto &room : rooms->items()) {
+        utils::EphemeralEvents events;
+        utils::parse_ephemeral_events(json::array({room.value()}), events);
+
+        auto &room_events = ephemeral[room.key()].events;
+        room_events.insert(room_events.end(),
+                           std::make_move_iterator(events.begin()),
+                           std::make_move_iterator(events.end()));
+    }
+}
+
+void
+from_json(const json &obj, Extensions &extensions)
+{
+    if (auto it = obj.find("to_device"); it != obj.end()) {
+        extensions.to_device            = it->get<ToDevice>();
+        extensions.to_device_next_batch = it->value("next_batch", std::string{});
+    }
+
+    if (auto e2ee = obj.find("e2ee"); e2ee != obj.end()) {
+        if (auto it = e2ee->find("device_lists"); it != e2ee->end())
+            extensions.device_lists = it->get<DeviceLists>();
+
+        if (auto it = e2ee->find("device_one_time_keys_count"); it != e2ee->end())
+            extensions.device_one_time_keys_count = it->get<std::map<std::string, uint16_t>>();
+
+        if (auto it = e2ee->find("device_unused_fallback_key_types");
+            it != e2ee->end() && it->is_array())
+            extensions.device_unused_fallback_key_types = it->get<std::vector<std::string>>();
+    }
+
+    if (auto account_data = obj.find("account_data"); account_data != obj.end()) {
+        if (auto it = account_data->find("global"); it != account_data->end() && it->is_array())
+            utils::parse_room_account_data_events(*it, extensions.account_data.events);
+
+        if (auto rooms = account_data->find("rooms");
+            rooms != account_data->end() && rooms->is_object())
+            for (const auto &room : rooms->items())
+                if (room.value().is_array())
+                    utils::parse_room_account_data_events(
+                      room.value(), extensions.room_account_data[room.key()].events);
+    }
+
+    if (auto it = obj.find("receipts"); it != obj.end())
+        parse_room_ephemeral(*it, extensions.ephemeral);
+
+    if (auto it = obj.find("typing"); it != obj.end())
+        parse_room_ephemeral(*it, extensions.ephemeral);
+}
+} // namespace sliding_sync
+
+void
+from_json(const json &obj, SlidingSync &response)
+{
+    response.pos = obj.at("pos").get<std::string>();
+
+    if (auto it = obj.find("lists"); it != obj.end() && it->is_object())
+        response.lists = it->get<std::map<std::string, sliding_sync::List>>();
+
+    if (auto it = obj.find("rooms"); it != obj.end() && it->is_object()) {
+        for (const auto &room : it->items()) {
+            if (room.key().size() < 256)
+                response.rooms.emplace(room.key(), room.value().get<sliding_sync::Room>());
+            else
+                mtx::utils::log::log()->warn("Skipping roomid which exceeds 255 bytes.");
+        }
+    }
+
+    if (auto it = obj.find("extensions"); it != obj.end())
+        response.extensions = it->get<sliding_sync::Extensions>();
+}
+}
+}
@@ -145,10 +145,20 @@ from_json(const json &obj, KnockedRoom &room)
             utils::parse_stripped_events(*events, room.knock_state);
 }
 
+//! Only the hash map variant of StringMap can preallocate its buckets.
+template<class Map>
+static void
+reserve_entries(Map &map, std::size_t count)
+{
+    if constexpr (requires { map.reserve(count); })
+        map.reserve(map.size() + count);
+}
+
 void
 from_json(const json &obj, Rooms &rooms)
 {
     if (auto entries = obj.find("join"); entries != obj.end()) {
+        reserve_entries(rooms.join, entries->size());
         for (const auto &r : entries->items()) {
             if (r.key().size() < 256) {
                 rooms.join.emplace_hint(rooms.join.end(), r.key(), r.value().get<JoinedRoom>());
@@ -159,6 +169,7 @@ from_json(const json &obj, Rooms &rooms)
     }
 
     if (auto entries = obj.find("leave"); entries != obj.end()) {
+        reserve_entries(rooms.leave, entries->size());
         for (const auto &r : entries->items()) {
             if (r.key().size() < 256) {
                 rooms.leave.emplace_hint(rooms.leave.end(), r.key(), r.value().get<LeftRoom>());
@@ -169,6 +180,7 @@ from_json(const json &obj, Rooms &rooms)
     }
 
     if (auto entries = obj.find("invite"); entries != obj.end()) {
+        reserve_entries(rooms.invite, entries->size());
         for (const auto &r : entries->items()) {
             if (r.key().size() < 256) {
                 rooms.invite.emplace_hint(
@@ -180,6 +192,7 @@ from_json(const json &obj, Rooms &rooms)
     }
 
     if (auto entries = obj.find("knock"); entries != obj.end()) {
+        reserve_entries(rooms.knock, entries->size());
         for (const auto &r : entries->items()) {
             if (r.key().size() < 256) {
                 rooms.knock.emplace_hint(rooms.knock.end(), r.key(), r.value().get<KnockedRoom>());
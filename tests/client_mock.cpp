@@ -0,0 +1,1511 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <curl/curl.h>
+
+#include <mtx/requests.hpp>
+#include <mtx/responses.hpp>
+#include <mtxclient/http/client.hpp>
+#include <mtxclient/http/discovery.hpp>
+#include <mtxclient/http/media_cache.hpp>
+#include <mtxclient/http/paginator.hpp>
+#include <mtxclient/http/send_queue.hpp>
+
+#include "mock_homeserver.hpp"
+#include "test_helpers.hpp"
+
+using namespace mtx::http;
+using namespace mtx::test;
+using namespace std::chrono_literals;
+
+namespace {
+std::shared_ptr<Client>
+login(const MockHomeserver &server,
+      const std::string &user,
+      std::shared_ptr<Client> client = std::make_shared<Client>())
+{
+    client->set_server(server.url());
+
+    std::atomic<bool> done = false;
+    client->login(user, "secret", [&done](const mtx::responses::Login &, RequestErr err) {
+        check_error(err);
+        done = true;
+    });
+    WAIT_UNTIL(done)
+    return client;
+}
+
+//! Returns a field like `Threads:` of /proc/self/status or 0, if it isn't available.
+std::size_t
+proc_status(const std::string &field)
+{
+    std::ifstream status("/proc/self/status");
+    for (std::string line; std::getline(status, line);)
+        if (line.rfind(field, 0) == 0)
+            return std::stoul(line.substr(field.size()));
+    return 0;
+}
+
+std::string
+create_room(const std::shared_ptr<Client> &client)
+{
+    std::string room_id;
+    std::atomic<bool> done = false;
+    client->create_room({}, [&](const mtx::responses::CreateRoom &res, RequestErr err) {
+        check_error(err);
+        room_id = res.room_id.to_string();
+        done    = true;
+    });
+    WAIT_UNTIL(done)
+    return room_id;
+}
+
+mtx::responses::Sync
+sync(const std::shared_ptr<Client> &client, const std::string &since = "")
+{
+    mtx::responses::Sync sync;
+    std::atomic<bool> done = false;
+
+    SyncOpts opts;
+    opts.since   = since;
+    opts.timeout = 10'000;
+    client->sync(opts, [&](const mtx::responses::Sync &res, RequestErr err) {
+        check_error(err);
+        sync = res;
+        done = true;
+    });
+    WAIT_UNTIL(done)
+    return sync;
+}
+
+mtx::events::msg::Text
+text(const std::string &body)
+{
+    mtx::events::msg::Text msg;
+    msg.body = body;
+    return msg;
+}
+}
+
+TEST(MockHomeserver, LoginAndVersions)
+{
+    MockHomeserver server;
+    auto alice = login(server, "alice");
+    EXPECT_EQ(alice->user_id().to_string(), "@alice:localhost");
+    EXPECT_FALSE(alice->access_token().empty());
+
+    std::atomic<bool> done = false;
+    alice->versions([&done](const mtx::responses::Versions &res, RequestErr err) {
+        check_error(err);
+        EXPECT_FALSE(res.versions.empty());
+        done = true;
+    });
+    WAIT_UNTIL(done)
+
+    EXPECT_EQ(server.request_count("POST", "/_matrix/client/v3/login"), 1);
+    alice->close();
+}
+
+TEST(MockHomeserver, TokenChangesDuringRequests)
+{
+    MockHomeserver server;
+    auto alice = login(server, "alice");
+    auto token = alice->access_token();
+
+    // Requests copy the headers, while another thread replaces them.
+    std::atomic<bool> stop = false;
+    std::thread login_thread([&] {
+        while (!stop)
+            alice->set_access_token(token);
+    });
+
+    std::atomic<int> done = 0;
+    for (int i = 0; i < 50; i++)
+        alice->versions([&done](const mtx::responses::Versions &, RequestErr err) {
+            check_error(err);
+            done++;
+        });
+    WAIT_UNTIL(done == 50)
+
+    stop = true;
+    login_thread.join();
+    alice->close();
+}
+
+TEST(MockHomeserver, SendAndSync)
+{
+    MockHomeserver server;
+    auto alice   = login(server, "alice");
+    auto bob     = login(server, "bob");
+    auto room_id = create_room(alice);
+
+    std::atomic<bool> joined = false;
+    bob->join_room(room_id, [&joined](const mtx::responses::RoomId &, RequestErr err) {
+        check_error(err);
+        joined = true;
+    });
+    WAIT_UNTIL(joined)
+
+    auto initial = sync(bob);
+    ASSERT_TRUE(initial.rooms.join.count(room_id));
+
+    // The long poll returns as soon as the message is sent.
+    std::atomic<bool> received = false;
+    SyncOpts opts;
+    opts.since   = initial.next_batch;
+    opts.timeout = 10'000;
+    bob->sync(opts, [&](const mtx::responses::Sync &res, RequestErr err) {
+        check_error(err);
+        const auto &events = res.rooms.join.at(room_id).timeline.events;
+        ASSERT_EQ(events.size(), 1);
+        auto msg = std::get<mtx::events::RoomEvent<mtx::events::msg::Text>>(events.front());
+        EXPECT_EQ(msg.content.body, "hello");
+        EXPECT_EQ(msg.sender, "@alice:localhost");
+        received = true;
+    });
+
+    auto sent = std::chrono::steady_clock::now();
+    alice->send_room_message(
+      room_id, text("hello"), [](const mtx::responses::EventId &, RequestErr err) {
+          check_error(err);
+      });
+    WAIT_UNTIL(received)
+    EXPECT_LT(std::chrono::steady_clock::now() - sent, 5s);
+
+    alice->close();
+    bob->close();
+}
+
+TEST(MockHomeserver, Messages)
+{
+    MockHomeserver server;
+    auto alice   = login(server, "alice");
+    auto room_id = create_room(alice);
+    for (int i = 0; i < 5; i++)
+        server.inject_event(room_id,
+                            "@bob:localhost",
+                            {{"type", "m.room.message"},
+                             {"content", {{"msgtype", "m.text"}, {"body", std::to_string(i)}}}});
+
+    std::atomic<bool> done = false;
+    MessagesOpts opts;
+    opts.room_id = room_id;
+    opts.limit   = 3;
+    alice->messages(opts, [&done](const mtx::responses::Messages &res, RequestErr err) {
+        check_error(err);
+        ASSERT_EQ(res.chunk.size(), 3);
+        EXPECT_EQ(
+          std::get<mtx::events::RoomEvent<mtx::events::msg::Text>>(res.chunk.front()).content.body,
+          "4");
+        EXPECT_FALSE(res.end.empty());
+        done = true;
+    });
+    WAIT_UNTIL(done)
+    alice->close();
+}
+
+TEST(MockHomeserver, PaginateMessages)
+{
+    MockHomeserver server;
+    auto alice   = login(server, "alice");
+    auto room_id = create_room(alice);
+    for (int i = 0; i < 45; i++)
+        server.inject_event(room_id,
+                            "@bob:localhost",
+                            {{"type", "m.room.message"},
+                             {"content", {{"msgtype", "m.text"}, {"body", std::to_string(i)}}}});
+
+    MessagesOpts opts;
+    opts.room_id = room_id;
+    opts.limit   = 10;
+    auto history = paginate_messages(alice, opts);
+
+    std::vector<std::string> bodies;
+    std::optional<ClientError> err;
+    while (auto page = history.wait_next(&err))
+        for (const auto &event : page->chunk)
+            if (auto text = std::get_if<mtx::events::RoomEvent<mtx::events::msg::Text>>(&event))
+                bodies.push_back(text->content.body);
+
+    EXPECT_FALSE(err);
+    EXPECT_TRUE(history.finished());
+    // Newest first, down to the creation of the room.
+    ASSERT_EQ(bodies.size(), 45);
+    EXPECT_EQ(bodies.front(), "44");
+    EXPECT_EQ(bodies.back(), "0");
+    EXPECT_EQ(history.stats().items, 47);
+    alice->close();
+}
+
+TEST(MockHomeserver, ToDeviceAndKeys)
+{
+    MockHomeserver server;
+    auto alice = login(server, "alice");
+    auto bob   = login(server, "bob");
+
+    mtx::requests::UploadKeys upload;
+    upload.device_keys.user_id                             = bob->user_id().to_string();
+    upload.device_keys.device_id                           = bob->device_id();
+    upload.device_keys.keys["ed25519:" + bob->device_id()] = "ed_key";
+    upload.one_time_keys["signed_curve25519:AAAA"]         = std::string("otk");
+
+    std::atomic<bool> done = false;
+    bob->upload_keys(upload, [&done](const mtx::responses::UploadKeys &res, RequestErr err) {
+        check_error(err);
+        EXPECT_EQ(res.one_time_key_counts.at("signed_curve25519"), 1);
+        done = true;
+    });
+    WAIT_UNTIL(done)
+
+    done = false;
+    mtx::requests::QueryKeys query;
+    query.device_keys[bob->user_id().to_string()] = {};
+    alice->query_keys(query, [&](const mtx::responses::QueryKeys &res, RequestErr err) {
+        check_error(err);
+        EXPECT_EQ(res.device_keys.at(bob->user_id().to_string()).count(bob->device_id()), 1);
+        done = true;
+    });
+    WAIT_UNTIL(done)
+
+    done = false;
+    auto initial = sync(bob);
+    nlohmann::json messages = {
+      {"messages", {{bob->user_id().to_string(), {{bob->device_id(), {{"a", "b"}}}}}}}};
+    alice->send_to_device("m.dummy", messages, [&done](RequestErr err) {
+        check_error(err);
+        done = true;
+    });
+    WAIT_UNTIL(done)
+
+    auto next = sync(bob, initial.next_batch);
+    EXPECT_EQ(next.to_device.events.size(), 1);
+
+    alice->close();
+    bob->close();
+}
+
+TEST(MockHomeserver, ChunkedToDevice)
+{
+    MockHomeserver server;
+    auto alice   = login(server, "alice");
+    auto bob     = login(server, "bob");
+    auto initial = sync(bob);
+
+    // Messages for a user with 1000 devices, one of them real, about 240kB in total.
+    constexpr std::size_t device_count = 1000;
+    auto bob_id                        = bob->user_id().to_string();
+    nlohmann::json messages;
+    for (std::size_t i = 0; i < device_count; i++) {
+        auto device = i == 0 ? bob->device_id() : "OTHER" + std::to_string(i);
+        messages["messages"][bob_id][device] = {{"padding", std::string(200, 'a')}};
+    }
+
+    ToDeviceLimits limits;
+    limits.max_bytes    = 16 * 1024;
+    limits.max_messages = 100;
+    server.set_latency(50ms);
+
+    // Returns the time the call took and the most chunks the server handled at once.
+    auto send = [&](std::size_t max_concurrent, const std::string &txn_id) {
+        limits.max_concurrent = max_concurrent;
+        alice->set_to_device_limits(limits);
+        server.clear_requests();
+
+        std::atomic<int> called = 0;
+        std::chrono::steady_clock::duration took;
+        auto start = std::chrono::steady_clock::now();
+        alice->send_to_device("m.dummy", txn_id, messages, [&](RequestErr err) {
+            check_error(err);
+            took = std::chrono::steady_clock::now() - start;
+            called++;
+        });
+        WAIT_UNTIL(called == 1)
+        std::this_thread::sleep_for(100ms);
+        EXPECT_EQ(called, 1);
+        return std::pair{took, server.max_concurrent_requests()};
+    };
+
+    auto [sequential, sequential_peak] = send(1, "sequential");
+    auto [concurrent, concurrent_peak] = send(4, "concurrent");
+    EXPECT_EQ(sequential_peak, 1);
+    EXPECT_GT(concurrent_peak, 1);
+    EXPECT_LE(concurrent_peak, 4);
+
+    // Every message was sent exactly once in bodies within the limits.
+    std::set<std::string> paths;
+    std::size_t sent = 0, chunks = 0;
+    for (const auto &req : server.requests()) {
+        if (req.method != "PUT")
+            continue;
+        chunks++;
+        paths.insert(req.path);
+        EXPECT_LE(req.body.size(), limits.max_bytes);
+
+        auto devices = req.json().at("messages").at(bob_id).size();
+        EXPECT_LE(devices, limits.max_messages);
+        sent += devices;
+    }
+    EXPECT_GT(chunks, 1);
+    EXPECT_EQ(paths.size(), chunks);
+    EXPECT_EQ(sent, device_count);
+
+    // The real device received one message per call.
+    auto next = sync(bob, initial.next_batch);
+    EXPECT_EQ(next.to_device.events.size(), 2);
+
+    using std::chrono::duration_cast;
+    using std::chrono::milliseconds;
+    RecordProperty("requests", std::to_string(chunks));
+    RecordProperty("sequential_ms",
+                   std::to_string(duration_cast<milliseconds>(sequential).count()));
+    RecordProperty("concurrent_ms",
+                   std::to_string(duration_cast<milliseconds>(concurrent).count()));
+
+    alice->close();
+    bob->close();
+}
+
+TEST(MockHomeserver, Media)
+{
+    MockHomeserver server;
+    auto alice = login(server, "alice");
+
+    std::string uri;
+    std::atomic<bool> done = false;
+    alice->upload("some data",
+                  "text/plain",
+                  "file.txt",
+                  [&](const mtx::responses::ContentURI &res, RequestErr err) {
+                      check_error(err);
+                      uri  = res.content_uri;
+                      done = true;
+                  });
+    WAIT_UNTIL(done)
+
+    done = false;
+    alice->download(uri,
+                    [&done](const std::string &data,
+                            const std::string &content_type,
+                            const std::string &,
+                            RequestErr err) {
+                        check_error(err);
+                        EXPECT_EQ(data, "some data");
+                        EXPECT_EQ(content_type, "text/plain");
+                        done = true;
+                    });
+    WAIT_UNTIL(done)
+    alice->close();
+}
+
+TEST(MockHomeserver, MediaApiFallback)
+{
+    MockHomeserver server;
+    auto alice = login(server, "alice");
+
+    std::string uri;
+    std::atomic<bool> done = false;
+    alice->upload("some data",
+                  "text/plain",
+                  "file.txt",
+                  [&](const mtx::responses::ContentURI &res, RequestErr err) {
+                      check_error(err);
+                      uri  = res.content_uri;
+                      done = true;
+                  });
+    WAIT_UNTIL(done)
+
+    auto download = [&] {
+        server.clear_requests();
+        std::optional<ClientError> error;
+        done = false;
+        alice->download(
+          uri,
+          [&](const std::string &data, const std::string &, const std::string &, RequestErr err) {
+              if (!err)
+                  EXPECT_EQ(data, "some data");
+              error = err;
+              done  = true;
+          });
+        WAIT_UNTIL(done)
+        return error;
+    };
+    auto authenticated_requests = [&server] {
+        return server.request_count("GET", "/_matrix/client/v1/media/.*");
+    };
+
+    // A missing file doesn't tell, that the server supports the authenticated endpoints.
+    server.script("GET",
+                  "/_matrix/client/v1/media/download/.*",
+                  {MockResponse::error(404, "M_NOT_FOUND", "Unknown media")});
+    auto err = download();
+    ASSERT_TRUE(err);
+    EXPECT_EQ(err->matrix_error.errcode, mtx::errors::ErrorCode::M_NOT_FOUND);
+    EXPECT_EQ(server.requests().size(), 1);
+
+    // A proxy answering unknown paths with a plain 404 falls back to the legacy endpoints.
+    MockResponse not_found;
+    not_found.status                  = 404;
+    not_found.body                    = "<html><body>Not Found</body></html>";
+    not_found.headers["Content-Type"] = "text/html";
+    server.script("GET", "/_matrix/client/v1/media/download/.*", {not_found});
+    EXPECT_FALSE(download());
+    EXPECT_EQ(authenticated_requests(), 1);
+    EXPECT_EQ(server.requests().size(), 2);
+
+    // Which is remembered.
+    EXPECT_FALSE(download());
+    EXPECT_EQ(authenticated_requests(), 0);
+    EXPECT_EQ(server.requests().size(), 1);
+    alice->close();
+}
+
+TEST(MockHomeserver, ThumbnailMediaApi)
+{
+    // A server without the authenticated media endpoints, that has no thumbnail of the media.
+    MockHomeserver server;
+    server.on("GET", "/_matrix/client/v1/media/.*", [](const MockRequest &) {
+        return MockResponse::error(404, "M_UNRECOGNIZED", "Unrecognized request");
+    });
+    server.on("GET", "/_matrix/media/v3/thumbnail/.*", [](const MockRequest &) {
+        return MockResponse::error(404, "M_NOT_FOUND", "No thumbnail");
+    });
+    auto alice = login(server, "alice");
+
+    ThumbOpts opts;
+    std::atomic<bool> done = false;
+    alice->upload("image data",
+                  "image/png",
+                  "image.png",
+                  [&](const mtx::responses::ContentURI &res, RequestErr err) {
+                      check_error(err);
+                      opts.mxc_url = res.content_uri;
+                      done         = true;
+                  });
+    WAIT_UNTIL(done)
+    server.set_latency(30ms);
+
+    auto thumbnail = [&](bool race) {
+        opts.race_download = race;
+        server.clear_requests();
+
+        std::atomic<int> called = 0;
+        std::chrono::steady_clock::duration took;
+        auto start = std::chrono::steady_clock::now();
+        alice->get_thumbnail(opts, [&](const std::string &res, RequestErr err) {
+            check_error(err);
+            EXPECT_EQ(res, "image data");
+            took = std::chrono::steady_clock::now() - start;
+            called++;
+        });
+        WAIT_UNTIL(called == 1)
+        return took;
+    };
+    auto median = [&](bool race) {
+        std::vector<std::chrono::steady_clock::duration> took;
+        for (int i = 0; i < 5; i++)
+            took.push_back(thumbnail(race));
+        std::ranges::sort(took);
+        return took[took.size() / 2];
+    };
+
+    // Only the first request finds out, that the server only has the legacy endpoints.
+    auto first = thumbnail(false);
+    EXPECT_EQ(server.requests().size(), 3);
+    auto sequential = median(false);
+    EXPECT_EQ(server.request_count("GET", "/_matrix/client/v1/media/.*"), 0);
+    EXPECT_EQ(server.requests().size(), 2);
+    EXPECT_EQ(server.max_concurrent_requests(), 1);
+
+    // A race asks for the thumbnail and the full file at once.
+    auto raced = median(true);
+    EXPECT_EQ(server.request_count("GET", "/_matrix/client/v1/media/.*"), 0);
+    EXPECT_EQ(server.requests().size(), 2);
+    EXPECT_EQ(server.max_concurrent_requests(), 2);
+
+    using std::chrono::duration_cast;
+    using std::chrono::milliseconds;
+    RecordProperty("first_ms", std::to_string(duration_cast<milliseconds>(first).count()));
+    RecordProperty("median_ms", std::to_string(duration_cast<milliseconds>(sequential).count()));
+    RecordProperty("median_raced_ms", std::to_string(duration_cast<milliseconds>(raced).count()));
+
+    // The callback doesn't wait for the slower side of a race and is only called once.
+    std::atomic<bool> released = false, timed_out = false, answered = false;
+    server.on("GET", "/_matrix/media/v3/thumbnail/.*", [&](const MockRequest &) {
+        for (int i = 0; i < 500 && !released; i++)
+            std::this_thread::sleep_for(10ms);
+        timed_out = !released;
+        answered  = true;
+        return MockResponse::error(404, "M_NOT_FOUND", "No thumbnail");
+    });
+    thumbnail(true);
+    released = true;
+    WAIT_UNTIL(answered)
+    EXPECT_FALSE(timed_out);
+
+    // Cancelling the handle of the caller cancels both sides.
+    std::atomic<int> called = 0;
+    RequestHandle handle;
+    {
+        RequestScope scope(handle);
+        alice->get_thumbnail(opts, [&called](const std::string &, RequestErr) { called++; });
+    }
+    handle.cancel();
+    std::this_thread::sleep_for(100ms);
+    EXPECT_EQ(called, 0);
+    alice->close();
+}
+
+TEST(MockHomeserver, MediaCache)
+{
+    MockHomeserver server;
+    auto alice = login(server, "alice");
+
+    MediaCacheOpts opts;
+    opts.directory = (std::filesystem::temp_directory_path() /
+                      ("mtxclient_media_" + std::to_string(random_number())))
+                       .string();
+    auto cache = std::make_shared<MediaCache>(opts);
+    alice->set_media_cache(cache);
+
+    std::string image(64 * 1024, 'x');
+    ThumbOpts thumb;
+    std::atomic<bool> done = false;
+    alice->upload(image,
+                  "image/png",
+                  "image.png",
+                  [&](const mtx::responses::ContentURI &res, RequestErr err) {
+                      check_error(err);
+                      thumb.mxc_url = res.content_uri;
+                      done          = true;
+                  });
+    WAIT_UNTIL(done)
+    server.clear_requests();
+
+    constexpr int views = 10;
+    for (int i = 0; i < views; i++) {
+        std::atomic<int> called = 0;
+        alice->download(thumb.mxc_url,
+                        [&](const std::string &data,
+                            const std::string &content_type,
+                            const std::string &,
+                            RequestErr err) {
+                            check_error(err);
+                            EXPECT_EQ(data.size(), image.size());
+                            EXPECT_EQ(content_type, "image/png");
+                            called++;
+                        });
+        alice->get_thumbnail(thumb, [&](const std::string &data, RequestErr err) {
+            check_error(err);
+            EXPECT_EQ(data.size(), image.size());
+            called++;
+        });
+        WAIT_UNTIL(called == 2)
+    }
+
+    // Only the first download and thumbnail hit the network.
+    EXPECT_EQ(server.request_count("GET", ".*/download/.*"), 1);
+    EXPECT_EQ(server.request_count("GET", ".*/thumbnail/.*"), 1);
+
+    auto stats = cache->stats();
+    EXPECT_EQ(stats.files, 2);
+    EXPECT_EQ(stats.hits, 2 * (views - 1));
+    EXPECT_EQ(stats.bytes_saved, 2 * (views - 1) * image.size());
+    RecordProperty("hit_rate", std::to_string(stats.hit_rate()));
+    RecordProperty("bytes_saved", std::to_string(stats.bytes_saved));
+
+    // Another client, i.e. after a restart, reuses the files.
+    auto bob = login(server, "bob");
+    bob->set_media_cache(std::make_shared<MediaCache>(opts));
+    done = false;
+    bob->get_thumbnail(thumb, [&](const std::string &data, RequestErr err) {
+        check_error(err);
+        EXPECT_EQ(data, image);
+        done = true;
+    });
+    WAIT_UNTIL(done)
+    EXPECT_EQ(server.request_count("GET", ".*/thumbnail/.*"), 1);
+
+    std::filesystem::remove_all(opts.directory);
+    alice->close();
+    bob->close();
+}
+
+TEST(MockHomeserver, MediaCacheKeysOfRacedDownloads)
+{
+    MockHomeserver server;
+    auto alice = login(server, "alice");
+
+    MediaCacheOpts opts;
+    opts.directory = (std::filesystem::temp_directory_path() /
+                      ("mtxclient_media_" + std::to_string(random_number())))
+                       .string();
+    auto cache = std::make_shared<MediaCache>(opts);
+    alice->set_media_cache(cache);
+
+    ThumbOpts thumb;
+    std::atomic<bool> done = false;
+    alice->upload("full size",
+                  "image/png",
+                  "image.png",
+                  [&](const mtx::responses::ContentURI &res, RequestErr err) {
+                      check_error(err);
+                      thumb.mxc_url = res.content_uri;
+                      done          = true;
+                  });
+    WAIT_UNTIL(done)
+
+    // The download wins, as there is no thumbnail.
+    server.script(
+      "GET", "/_matrix/client/v1/media/thumbnail/.*", {MockResponse::error(404, "M_NOT_FOUND")});
+    thumb.race_download = true;
+    done                = false;
+    alice->get_thumbnail(thumb, [&](const std::string &data, RequestErr err) {
+        check_error(err);
+        EXPECT_EQ(data, "full size");
+        done = true;
+    });
+    WAIT_UNTIL(done)
+
+    // Runs after the responses were stored.
+    std::atomic<bool> stored = false;
+    cache->post([&stored] { stored = true; });
+    WAIT_UNTIL(stored)
+
+    EXPECT_FALSE(cache->get(MediaCache::key(thumb)));
+    auto file = cache->get(MediaCache::key(thumb.mxc_url));
+    ASSERT_TRUE(file);
+    EXPECT_EQ(file->data(), "full size");
+    EXPECT_EQ(file->content_type(), "image/png");
+
+    std::filesystem::remove_all(opts.directory);
+    alice->close();
+}
+
+TEST(MockHomeserver, ScriptedResponsesAndLatency)
+{
+    MockHomeserver server;
+    auto alice = login(server, "alice");
+
+    server.script("GET",
+                  "/_matrix/client/versions",
+                  {MockResponse::error(429, "M_LIMIT_EXCEEDED"), MockResponse::error(502, "")});
+    server.set_latency(200ms);
+
+    std::atomic<int> done = 0;
+    std::vector<int> status;
+    auto check = [&](const mtx::responses::Versions &, RequestErr err) {
+        status.push_back(err ? err->status_code : 200);
+        done++;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    alice->versions(check);
+    WAIT_UNTIL(done == 1)
+    EXPECT_GE(std::chrono::steady_clock::now() - start, 200ms);
+
+    alice->versions(check);
+    WAIT_UNTIL(done == 2)
+    alice->versions(check);
+    WAIT_UNTIL(done == 3)
+
+    EXPECT_EQ(status, (std::vector<int>{429, 502, 200}));
+    alice->close();
+}
+
+TEST(MockHomeserver, FilterIdsAreCached)
+{
+    MockHomeserver server;
+    auto alice = login(server, "alice");
+
+    mtx::requests::Filter filter;
+    filter.room.emplace().timeline.emplace().limit = 10;
+
+    auto upload = [&filter](const std::shared_ptr<Client> &client) {
+        std::string filter_id;
+        std::atomic<bool> done = false;
+        client->upload_filter(filter, [&](const mtx::responses::FilterId &res, RequestErr err) {
+            check_error(err);
+            filter_id = res.filter_id;
+            done      = true;
+        });
+        WAIT_UNTIL(done)
+        return filter_id;
+    };
+
+    auto filter_id = upload(alice);
+    EXPECT_FALSE(filter_id.empty());
+    EXPECT_EQ(upload(alice), filter_id);
+    EXPECT_EQ(server.request_count("POST", "/_matrix/client/v3/user/.*/filter"), 1);
+
+    // A restarted client with the persisted ids doesn't upload again.
+    auto restarted = login(server, "alice");
+    restarted->set_filter_ids(alice->filter_ids());
+    EXPECT_EQ(upload(restarted), filter_id);
+    EXPECT_EQ(server.request_count("POST", "/_matrix/client/v3/user/.*/filter"), 1);
+
+    // A different filter is uploaded.
+    filter.room->timeline->limit = 20;
+    EXPECT_NE(upload(restarted), filter_id);
+    EXPECT_EQ(server.request_count("POST", "/_matrix/client/v3/user/.*/filter"), 2);
+
+    // Another account on the same client doesn't reuse the filter ids of alice.
+    login(server, "bob", restarted);
+    upload(restarted);
+    EXPECT_EQ(server.request_count("POST", "/_matrix/client/v3/user/.*bob.*/filter"), 1);
+    EXPECT_EQ(server.request_count("POST", "/_matrix/client/v3/user/.*/filter"), 3);
+
+    alice->close();
+    restarted->close();
+}
+
+TEST(MockHomeserver, LazyLoadingShrinksSync)
+{
+    using Member = mtx::events::StateEvent<mtx::events::state::Member>;
+
+    MockHomeserver server;
+    auto alice   = login(server, "alice");
+    auto room_id = create_room(alice);
+    for (int i = 0; i < 1000; i++) {
+        auto user = "@user" + std::to_string(i) + ":localhost";
+        server.inject_event(room_id,
+                            user,
+                            {{"type", "m.room.member"},
+                             {"state_key", user},
+                             {"content", {{"membership", "join"}, {"displayname", user}}}});
+    }
+    for (int i = 0; i < 20; i++)
+        server.inject_event(room_id,
+                            "@user" + std::to_string(i % 3) + ":localhost",
+                            {{"type", "m.room.message"},
+                             {"content", {{"msgtype", "m.text"}, {"body", std::to_string(i)}}}});
+
+    // Sync with a limited timeline, once with all members and once lazy loaded.
+    std::map<bool, std::uint64_t> sync_bytes;
+    std::map<bool, std::size_t> members;
+    for (bool lazy : {false, true}) {
+        mtx::requests::Filter filter;
+        filter.room.emplace().timeline.emplace().limit = 10;
+        filter.room->state.emplace().lazy_load_members = lazy;
+
+        std::string filter_id;
+        std::atomic<bool> done = false;
+        alice->upload_filter(filter, [&](const mtx::responses::FilterId &res, RequestErr err) {
+            check_error(err);
+            filter_id = res.filter_id;
+            done      = true;
+        });
+        WAIT_UNTIL(done)
+
+        alice->reset_transfer_stats();
+        done = false;
+        SyncOpts opts;
+        opts.filter  = filter_id;
+        opts.timeout = 0;
+        alice->sync(opts, [&](const mtx::responses::Sync &res, RequestErr err) {
+            check_error(err);
+            const auto &room = res.rooms.join.at(room_id);
+            EXPECT_EQ(room.timeline.events.size(), 10);
+            EXPECT_TRUE(room.timeline.limited);
+            members[lazy] = std::count_if(
+              room.state.events.begin(), room.state.events.end(), [](const auto &e) {
+                  return std::holds_alternative<Member>(e);
+              });
+            done = true;
+        });
+        WAIT_UNTIL(done)
+        sync_bytes[lazy] = alice->transfer_stats().at("sync").decoded_bytes;
+    }
+
+    // alice and the three senders of the timeline.
+    EXPECT_EQ(members[true], 4);
+    EXPECT_EQ(members[false], 1001);
+    EXPECT_LT(sync_bytes[true] * 10, sync_bytes[false]);
+    RecordProperty("full_sync_bytes", std::to_string(sync_bytes[false]));
+    RecordProperty("lazy_sync_bytes", std::to_string(sync_bytes[true]));
+    alice->close();
+}
+
+TEST(MockHomeserver, SlidingSync)
+{
+    MockHomeserver server;
+    auto alice = login(server, "alice");
+
+    server.on("POST",
+              "/_matrix/client/unstable/org.matrix.simplified_msc3575/sync",
+              [](const MockRequest &req) {
+                  auto body = req.json();
+                  EXPECT_EQ(body["lists"]["all"]["ranges"], nlohmann::json::parse("[[0, 9]]"));
+                  EXPECT_EQ(req.query.at("timeout"), "0");
+
+                  auto pos = req.query.count("pos") ? std::stoi(req.query.at("pos")) : 0;
+                  return MockResponse::json({{"pos", std::to_string(pos + 1)},
+                                             {"lists", {{"all", {{"count", 5000}}}}},
+                                             {"rooms", {{"!a:localhost", {{"name", "A"}}}}}});
+              });
+
+    mtx::requests::SlidingSync req;
+    req.lists["all"].ranges = {{0, 9}};
+
+    SlidingSyncOpts opts;
+    opts.timeout = 0;
+    for (auto expected : {"1", "2"}) {
+        std::atomic<bool> done = false;
+        alice->sliding_sync(req, opts, [&](const mtx::responses::SlidingSync &res, RequestErr err) {
+            check_error(err);
+            EXPECT_EQ(res.pos, expected);
+            EXPECT_EQ(res.lists.at("all").count, 5000);
+            EXPECT_EQ(res.rooms.at("!a:localhost").name, "A");
+            opts.pos = res.pos;
+            done     = true;
+        });
+        WAIT_UNTIL(done)
+    }
+    alice->close();
+}
+
+TEST(MockHomeserver, CompressedResponses)
+{
+    MockHomeserver server;
+    server.set_compression(true);
+    auto alice   = login(server, "alice");
+    auto room_id = create_room(alice);
+    for (int i = 0; i < 500; i++)
+        server.inject_event(room_id,
+                            "@bob:localhost",
+                            {{"type", "m.room.message"},
+                             {"content", {{"msgtype", "m.text"}, {"body", std::to_string(i)}}}});
+
+    // Sync once uncompressed and once compressed. The times include decompression and parsing.
+    std::map<bool, std::chrono::steady_clock::duration> sync_time;
+    for (bool compress : {false, true}) {
+        auto opts               = alice->connection_options();
+        opts.compress_responses = compress;
+        alice->set_connection_options(opts);
+        alice->reset_transfer_stats();
+        server.clear_requests();
+
+        auto start = std::chrono::steady_clock::now();
+        auto res   = sync(alice);
+        sync_time[compress] = std::chrono::steady_clock::now() - start;
+        // The create and member events precede the messages.
+        EXPECT_EQ(res.rooms.join.at(room_id).timeline.events.size(), 502);
+
+        auto request = server.requests().at(0);
+        auto stats   = alice->transfer_stats().at("sync");
+        EXPECT_EQ(stats.responses, 1);
+        if (compress) {
+            EXPECT_EQ(request.header("accept-encoding"), "gzip, deflate");
+            EXPECT_EQ(stats.compressed_responses, 1);
+            EXPECT_LT(stats.wire_bytes * 5, stats.decoded_bytes);
+            RecordProperty("compression_ratio",
+                           std::to_string(static_cast<double>(stats.decoded_bytes) /
+                                          static_cast<double>(stats.wire_bytes)));
+        } else {
+            EXPECT_EQ(request.header("accept-encoding"), "");
+            EXPECT_EQ(stats.compressed_responses, 0);
+            EXPECT_EQ(stats.wire_bytes, stats.decoded_bytes);
+        }
+    }
+
+    auto us = [](auto duration) {
+        return std::to_string(
+          std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+    };
+    RecordProperty("plain_sync_us", us(sync_time[false]));
+    RecordProperty("gzip_sync_us", us(sync_time[true]));
+
+    // Responses, that decompress to more than the limit, fail instead of being inflated.
+    auto opts                  = alice->connection_options();
+    opts.max_decompressed_size = 4096;
+    alice->set_connection_options(opts);
+
+    std::atomic<bool> done = false;
+    alice->sync(SyncOpts{}, [&done](const mtx::responses::Sync &, RequestErr err) {
+        ASSERT_TRUE(err);
+        EXPECT_EQ(err->error_code, CURLE_FILESIZE_EXCEEDED);
+        done = true;
+    });
+    WAIT_UNTIL(done)
+    alice->close();
+}
+
+TEST(MockHomeserver, ClientPoolSharesTransport)
+{
+    MockHomeserver server;
+    constexpr std::size_t accounts = 200;
+
+    // Threads and memory added per account, while the clients are alive.
+    auto per_account = [](auto make_client) {
+        auto threads = proc_status("Threads:");
+        auto rss     = proc_status("VmRSS:");
+
+        std::vector<std::shared_ptr<Client>> clients;
+        for (std::size_t i = 0; i < accounts; i++)
+            clients.push_back(make_client());
+
+        auto added_threads = static_cast<double>(proc_status("Threads:") - threads);
+        auto added_rss     = static_cast<double>(proc_status("VmRSS:")) - static_cast<double>(rss);
+        return std::pair{added_threads / accounts, added_rss / accounts};
+    };
+
+    auto [standalone_threads, standalone_kb] =
+      per_account([] { return std::make_shared<Client>(); });
+
+    ClientPool pool;
+    auto [pooled_threads, pooled_kb] = per_account([&pool] { return pool.make_client(); });
+    EXPECT_EQ(pool.clients(), 0);
+
+    RecordProperty("threads_per_account_standalone", std::to_string(standalone_threads));
+    RecordProperty("threads_per_account_pooled", std::to_string(pooled_threads));
+    RecordProperty("rss_kb_per_account_standalone", std::to_string(standalone_kb));
+    RecordProperty("rss_kb_per_account_pooled", std::to_string(pooled_kb));
+
+    // At most the network thread of the pool is added.
+    EXPECT_LE(pooled_threads * accounts, 1.0);
+    EXPECT_LE(pooled_threads, standalone_threads);
+
+    // Every client keeps its own session.
+    std::vector<std::shared_ptr<Client>> clients;
+    std::vector<std::string> rooms;
+    for (int i = 0; i < 4; i++) {
+        clients.push_back(login(server, "user" + std::to_string(i), pool.make_client()));
+        rooms.push_back(create_room(clients.back()));
+    }
+    EXPECT_EQ(pool.clients(), 4);
+
+    for (std::size_t i = 0; i < clients.size(); i++) {
+        EXPECT_EQ(clients[i]->user_id().to_string(), "@user" + std::to_string(i) + ":localhost");
+
+        auto res = sync(clients[i]);
+        ASSERT_EQ(res.rooms.join.size(), 1);
+        EXPECT_EQ(res.rooms.join.begin()->first, rooms[i]);
+    }
+
+    // A destroyed client doesn't get the responses to its requests anymore.
+    server.set_latency(200ms);
+    std::atomic<bool> called = false;
+    clients[0]->versions(
+      [&called](const mtx::responses::Versions &, RequestErr) { called = true; });
+    clients[0].reset();
+    EXPECT_EQ(pool.clients(), 3);
+
+    std::atomic<bool> done = false;
+    clients[1]->versions([&done](const mtx::responses::Versions &, RequestErr err) {
+        check_error(err);
+        done = true;
+    });
+    WAIT_UNTIL(done)
+    EXPECT_FALSE(called);
+}
+
+TEST(MockHomeserver, ShutdownFailsQueuedRequests)
+{
+    MockHomeserver server;
+
+    ConnectionOptions opts;
+    opts.max_concurrent_requests = 1;
+    ClientPool pool(opts);
+    auto alice = login(server, "alice", pool.make_client());
+    server.set_latency(200ms);
+    server.clear_requests();
+
+    std::atomic<int> succeeded = 0, dropped = 0;
+    for (int i = 0; i < 3; i++)
+        alice->versions([&](const mtx::responses::Versions &, RequestErr err) {
+            if (!err)
+                succeeded++;
+            else if (err->error_code == CURLE_ABORTED_BY_CALLBACK)
+                dropped++;
+        });
+    WAIT_UNTIL(server.request_count("GET", "/_matrix/client/versions") == 1)
+
+    // The queued requests fail, the one in flight completes.
+    alice->shutdown();
+    WAIT_UNTIL(dropped == 2 && succeeded == 1)
+
+    // The gate is free again.
+    std::atomic<bool> done = false;
+    alice->versions([&done](const mtx::responses::Versions &, RequestErr err) {
+        check_error(err);
+        done = true;
+    });
+    WAIT_UNTIL(done)
+    EXPECT_EQ(server.request_count("GET", "/_matrix/client/versions"), 2);
+}
+
+TEST(MockHomeserver, PooledClientsKeepThePoolLimit)
+{
+    MockHomeserver server;
+
+    ConnectionOptions opts;
+    opts.max_concurrent_requests = 1;
+    ClientPool pool(opts);
+    auto alice = login(server, "alice", pool.make_client());
+
+    // Only sets the client options, the limit of the pool stays.
+    ConnectionOptions client_opts;
+    client_opts.compress_responses = true;
+    alice->set_connection_options(client_opts);
+    EXPECT_EQ(alice->connection_options().max_concurrent_requests, 1);
+    EXPECT_TRUE(alice->connection_options().compress_responses);
+
+    server.set_latency(100ms);
+    server.clear_requests();
+    std::atomic<int> done = 0;
+    for (int i = 0; i < 3; i++)
+        alice->versions([&done](const mtx::responses::Versions &, RequestErr err) {
+            check_error(err);
+            done++;
+        });
+    WAIT_UNTIL(done == 3)
+    EXPECT_EQ(server.max_concurrent_requests(), 1);
+}
+
+TEST(MockHomeserver, CancelRequests)
+{
+    MockHomeserver server;
+    auto alice = login(server, "alice");
+
+    ConnectionOptions opts;
+    opts.max_concurrent_requests = 1;
+    alice->set_connection_options(opts);
+    server.set_latency(200ms);
+    server.clear_requests();
+
+    std::atomic<int> called = 0;
+    RequestHandle search;
+    {
+        RequestScope scope(search);
+        for (int i = 0; i < 5; i++)
+            alice->versions([&called](const mtx::responses::Versions &, RequestErr) { called++; });
+    }
+    WAIT_UNTIL(server.request_count("GET", "/_matrix/client/versions") == 1)
+    search.cancel();
+
+    // Requests outside of the scope are not affected.
+    std::atomic<bool> done = false;
+    alice->versions([&done](const mtx::responses::Versions &, RequestErr err) {
+        check_error(err);
+        done = true;
+    });
+    WAIT_UNTIL(done)
+
+    // The queued requests were never sent and the one in flight was dropped.
+    EXPECT_EQ(called, 0);
+    EXPECT_EQ(server.request_count("GET", "/_matrix/client/versions"), 2);
+
+    auto stats = search.stats();
+    EXPECT_EQ(stats.requests, 5);
+    EXPECT_EQ(stats.cancelled, 5);
+    EXPECT_EQ(stats.not_sent, 4);
+    EXPECT_EQ(stats.discarded_responses, 1);
+    EXPECT_GT(stats.discarded_bytes, 0);
+    RecordProperty("requests_not_sent", std::to_string(stats.not_sent));
+    RecordProperty("discarded_bytes", std::to_string(stats.discarded_bytes));
+
+    // Requests started after cancelling are dropped right away.
+    {
+        RequestScope scope(search);
+        alice->versions([&called](const mtx::responses::Versions &, RequestErr) { called++; });
+    }
+    EXPECT_EQ(search.stats().not_sent, 5);
+    EXPECT_EQ(called, 0);
+
+    // Cancelled requests, that are started by the scheduler, free their slots without a response.
+    alice->set_scheduler(SchedulerOpts{});
+    RequestHandle queued;
+    {
+        RequestScope scope(queued);
+        for (int i = 0; i < 3; i++)
+            alice->versions([&called](const mtx::responses::Versions &, RequestErr) { called++; });
+    }
+    queued.cancel();
+
+    done = false;
+    alice->versions([&done](const mtx::responses::Versions &, RequestErr err) {
+        check_error(err);
+        done = true;
+    });
+    WAIT_UNTIL(done)
+    WAIT_UNTIL(alice->scheduler_stats().classes.at("versions").in_flight == 0)
+    EXPECT_EQ(called, 0);
+    alice->close();
+}
+
+TEST(MockHomeserver, RequestDeadline)
+{
+    MockHomeserver server;
+    auto alice = login(server, "alice");
+    server.set_latency(500ms);
+
+    std::atomic<bool> done = false;
+    std::optional<ClientError> error;
+    auto start = std::chrono::steady_clock::now();
+    RequestHandle deadline(50ms);
+    {
+        RequestScope scope(deadline);
+        alice->versions([&](const mtx::responses::Versions &, RequestErr err) {
+            error = err;
+            done  = true;
+        });
+    }
+    WAIT_UNTIL(done)
+
+    EXPECT_LT(std::chrono::steady_clock::now() - start, 400ms);
+    ASSERT_TRUE(error);
+    EXPECT_EQ(error->error_code, CURLE_OPERATION_TIMEDOUT);
+    EXPECT_EQ(deadline.stats().timed_out, 1);
+
+    // The late response is dropped.
+    WAIT_UNTIL(deadline.stats().discarded_responses == 1)
+    alice->close();
+}
+
+TEST(MockHomeserver, ResponseCache)
+{
+    MockHomeserver server;
+    auto alice = login(server, "alice");
+
+    // The mock has no profiles, so serve one with an ETag.
+    std::mutex profile_mtx;
+    std::string displayname = "Alice";
+    server.on("GET", "/_matrix/client/v3/profile/([^/]*)", [&](const MockRequest &req) {
+        std::lock_guard lock(profile_mtx);
+        auto etag = "\"" + displayname + "\"";
+        if (req.header("If-None-Match") == etag) {
+            MockResponse res;
+            res.status = 304;
+            res.body.clear();
+            return res;
+        }
+        auto res            = MockResponse::json({{"displayname", displayname}});
+        res.headers["ETag"] = etag;
+        return res;
+    });
+    // Set hold_put to keep a change of the display name in flight, until it is released.
+    std::atomic<bool> hold_put = false, put_received = false;
+    server.on("PUT", "/_matrix/client/v3/profile/([^/]*)/displayname", [&](const MockRequest &req) {
+        put_received = true;
+        while (hold_put)
+            std::this_thread::sleep_for(10ms);
+        std::lock_guard lock(profile_mtx);
+        displayname = req.json()["displayname"].get<std::string>();
+        return MockResponse::json(nlohmann::json::object());
+    });
+
+    ResponseCacheOpts opts;
+    opts.ttl["profile"] = 300ms;
+    alice->set_response_cache(opts);
+    server.set_latency(100ms);
+    server.clear_requests();
+
+    auto profile = [&alice] {
+        std::string name;
+        std::atomic<bool> done = false;
+        alice->get_profile(alice->user_id().to_string(),
+                           [&](const mtx::responses::Profile &res, RequestErr err) {
+                               check_error(err);
+                               name = res.display_name;
+                               done = true;
+                           });
+        WAIT_UNTIL(done)
+        return name;
+    };
+    auto profile_requests = [&server] {
+        return server.request_count("GET", "/_matrix/client/v3/profile/.*");
+    };
+
+    // Identical requests in flight share one round trip.
+    std::atomic<int> received = 0;
+    for (int i = 0; i < 5; i++)
+        alice->versions([&received](const mtx::responses::Versions &res, RequestErr err) {
+            check_error(err);
+            EXPECT_FALSE(res.versions.empty());
+            received++;
+        });
+    WAIT_UNTIL(received == 5)
+    EXPECT_EQ(server.request_count("GET", "/_matrix/client/versions"), 1);
+
+    // Fresh responses are served without a request.
+    EXPECT_EQ(profile(), "Alice");
+    EXPECT_EQ(profile(), "Alice");
+    EXPECT_EQ(profile_requests(), 1);
+
+    // Expired responses are revalidated.
+    std::this_thread::sleep_for(400ms);
+    EXPECT_EQ(profile(), "Alice");
+    EXPECT_EQ(profile_requests(), 2);
+    EXPECT_EQ(alice->response_cache_stats().revalidated, 1);
+
+    // Changing the profile drops it from the cache.
+    std::atomic<bool> done = false;
+    alice->set_displayname("Bob", [&done](RequestErr err) {
+        check_error(err);
+        done = true;
+    });
+    WAIT_UNTIL(done)
+
+    EXPECT_EQ(profile(), "Bob");
+    EXPECT_EQ(profile_requests(), 3);
+
+    // Requests with a handle bypass the cache.
+    RequestHandle handle;
+    {
+        RequestScope scope(handle);
+        received = 0;
+        alice->versions([&received](const mtx::responses::Versions &, RequestErr err) {
+            check_error(err);
+            received++;
+        });
+    }
+    WAIT_UNTIL(received == 1)
+    EXPECT_EQ(server.request_count("GET", "/_matrix/client/versions"), 2);
+
+    auto stats = alice->response_cache_stats();
+    EXPECT_EQ(stats.coalesced, 4);
+    EXPECT_EQ(stats.misses, 4);
+    EXPECT_EQ(stats.hits, 1);
+    EXPECT_EQ(stats.entries, 2);
+    RecordProperty("hit_rate", std::to_string(stats.hit_rate()));
+
+    // A 304 for an entry, that was invalidated while revalidating it, fetches the full response.
+    std::this_thread::sleep_for(400ms);
+    std::string name;
+    done = false;
+    alice->get_profile(alice->user_id().to_string(),
+                       [&](const mtx::responses::Profile &res, RequestErr err) {
+                           check_error(err);
+                           name = res.display_name;
+                           done = true;
+                       });
+    alice->set_displayname("Bob", [](RequestErr err) { check_error(err); });
+    WAIT_UNTIL(done)
+    EXPECT_EQ(name, "Bob");
+    EXPECT_EQ(profile_requests(), 5);
+    EXPECT_EQ(alice->response_cache_stats().revalidated, 1);
+
+    // A response read before a change in flight completes is dropped, once it completes.
+    alice->clear_response_cache();
+    hold_put     = true;
+    put_received = false;
+    done         = false;
+    alice->set_displayname("Carol", [&done](RequestErr err) {
+        check_error(err);
+        done = true;
+    });
+    WAIT_UNTIL(put_received)
+    EXPECT_EQ(profile(), "Bob");
+    hold_put = false;
+    WAIT_UNTIL(done)
+    EXPECT_EQ(profile(), "Carol");
+    EXPECT_EQ(profile_requests(), 7);
+
+    // Changes of unrelated paths don't keep responses in flight from being stored.
+    alice->clear_response_cache();
+    std::atomic<int> finished = 0;
+    alice->get_profile(alice->user_id().to_string(),
+                       [&](const mtx::responses::Profile &, RequestErr err) {
+                           check_error(err);
+                           finished++;
+                       });
+    alice->query_keys({}, [&](const mtx::responses::QueryKeys &, RequestErr err) {
+        check_error(err);
+        finished++;
+    });
+    WAIT_UNTIL(finished == 2)
+    EXPECT_EQ(profile(), "Carol");
+    EXPECT_EQ(profile_requests(), 8);
+
+    alice->clear_response_cache();
+    EXPECT_EQ(alice->response_cache_stats().entries, 0);
+    alice->close();
+}
+
+TEST(MockHomeserver, DiscoveryCache)
+{
+    using clock = std::chrono::steady_clock;
+    auto ms     = [](clock::duration d) {
+        return std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(d).count());
+    };
+
+    MockHomeserver server;
+    auto alice = login(server, "alice");
+    server.set_latency(100ms);
+
+    // A client restoring its session on startup, that can only sync once it knows the server.
+    auto restore = [&] {
+        auto client = std::make_shared<Client>();
+        client->set_server(server.url());
+        client->set_access_token(alice->access_token());
+        return client;
+    };
+
+    DiscoveryOpts opts;
+    opts.cache_file = (std::filesystem::temp_directory_path() /
+                       ("mtxclient_discovery_" + std::to_string(random_number()) + ".json"))
+                        .string();
+
+    // Returns the time until the first sync could be sent. If set, `requests` is set to the
+    // number of requests the server received until then.
+    auto startup = [&opts, &server](std::shared_ptr<Client> client,
+                                    ServerDiscovery &result,
+                                    DiscoveryCallback refreshed = nullptr,
+                                    std::size_t *requests       = nullptr) {
+        std::atomic<bool> done = false;
+        auto start             = clock::now();
+        clock::time_point end;
+        discover(
+          std::move(client),
+          opts,
+          [&](const ServerDiscovery &res, RequestErr err) {
+              check_error(err);
+              end = clock::now();
+              if (requests)
+                  *requests = server.requests().size();
+              result = res;
+              done   = true;
+          },
+          std::move(refreshed));
+        WAIT_UNTIL(done)
+        return end - start;
+    };
+
+    // Asking one endpoint after another.
+    server.clear_requests();
+    clock::duration sequential;
+    {
+        auto client            = restore();
+        std::atomic<bool> done = false;
+        auto start             = clock::now();
+        client->well_known([&](const mtx::responses::WellKnown &, RequestErr) {
+            client->versions([&](const mtx::responses::Versions &, RequestErr err) {
+                check_error(err);
+                client->capabilities(
+                  [&](const mtx::responses::capabilities::Capabilities &, RequestErr err) {
+                      check_error(err);
+                      client->get_login([&](const mtx::responses::LoginFlows &, RequestErr err) {
+                          check_error(err);
+                          sequential = clock::now() - start;
+                          done       = true;
+                      });
+                  });
+            });
+        });
+        WAIT_UNTIL(done)
+    }
+    EXPECT_EQ(server.max_concurrent_requests(), 1);
+
+    // The discovery asks all endpoints at once.
+    server.clear_requests();
+    ServerDiscovery fresh;
+    std::size_t fresh_requests = 0;
+    auto concurrent            = startup(restore(), fresh, nullptr, &fresh_requests);
+    EXPECT_EQ(fresh_requests, 4);
+    EXPECT_GT(server.max_concurrent_requests(), 1);
+    EXPECT_FALSE(fresh.from_cache);
+    EXPECT_FALSE(fresh.well_known);
+    EXPECT_FALSE(fresh.versions.versions.empty());
+    ASSERT_TRUE(fresh.capabilities);
+    EXPECT_EQ(fresh.capabilities->room_versions.default_, "10");
+    EXPECT_EQ(fresh.login_flows.flows.size(), 1);
+    EXPECT_TRUE(std::filesystem::exists(opts.cache_file));
+
+    // The next start uses the cache and refreshes it in the background.
+    server.clear_requests();
+    std::atomic<bool> refreshed = false;
+    ServerDiscovery cached;
+    std::size_t cached_requests = 0;
+    auto from_cache             = startup(
+      restore(),
+      cached,
+      [&](const ServerDiscovery &res, RequestErr err) {
+          check_error(err);
+          EXPECT_FALSE(res.from_cache);
+          refreshed = true;
+      },
+      &cached_requests);
+    EXPECT_TRUE(cached.from_cache);
+    // The client can sync before any request was sent.
+    EXPECT_EQ(cached_requests, 0);
+    EXPECT_EQ(cached.homeserver, fresh.homeserver);
+    EXPECT_EQ(cached.versions.versions, fresh.versions.versions);
+    WAIT_UNTIL(refreshed)
+    EXPECT_EQ(server.request_count("GET", "/_matrix/client/versions"), 1);
+    EXPECT_EQ(server.request_count("GET", "/.well-known/matrix/client"), 0);
+
+    RecordProperty("first_sync_after_ms_sequential", ms(sequential));
+    RecordProperty("first_sync_after_ms_concurrent", ms(concurrent));
+    RecordProperty("first_sync_after_ms_cached", ms(from_cache));
+
+    // Expired responses are fetched again.
+    opts.max_age = 0s;
+    ServerDiscovery expired;
+    startup(restore(), expired);
+    EXPECT_FALSE(expired.from_cache);
+    std::filesystem::remove(opts.cache_file);
+
+    // The well-known can point to another homeserver.
+    MockHomeserver homeserver;
+    server.on("GET", "/.well-known/matrix/client", [&homeserver](const MockRequest &) {
+        return MockResponse::json({{"m.homeserver", {{"base_url", homeserver.url()}}}});
+    });
+    opts.cache_file.clear();
+    auto client = std::make_shared<Client>();
+    client->set_server(server.url());
+
+    ServerDiscovery moved;
+    startup(client, moved);
+    ASSERT_TRUE(moved.well_known);
+    EXPECT_EQ(moved.homeserver, homeserver.url());
+    EXPECT_EQ(client->server_url(), homeserver.url());
+    EXPECT_FALSE(moved.capabilities);
+    EXPECT_EQ(homeserver.request_count("GET", "/_matrix/client/v3/login"), 1);
+}
+
+TEST(MockHomeserver, SendQueueThroughput)
+{
+    MockHomeserver server;
+    auto alice = login(server, "alice");
+
+    std::vector<std::string> rooms;
+    for (int i = 0; i < 4; i++)
+        rooms.push_back(create_room(alice));
+    auto initial = sync(alice);
+
+    constexpr int count = 100;
+    std::atomic<int> sent = 0;
+    SendQueue queue(alice, {}, [&sent](const PendingMessage &, const auto &, RequestErr err) {
+        check_error(err);
+        sent++;
+    });
+    for (int i = 0; i < count; i++)
+        queue.enqueue(rooms[i % rooms.size()], text(std::to_string(i)));
+
+    WAIT_UNTIL(sent == count)
+    RecordProperty("messages_per_second", std::to_string(queue.stats().messages_per_second()));
+
+    // Every room received its messages in order.
+    auto res = sync(alice, initial.next_batch);
+    for (std::size_t r = 0; r < rooms.size(); r++) {
+        const auto &events = res.rooms.join.at(rooms[r]).timeline.events;
+        ASSERT_EQ(events.size(), count / rooms.size());
+        for (std::size_t i = 0; i < events.size(); i++)
+            EXPECT_EQ(
+              std::get<mtx::events::RoomEvent<mtx::events::msg::Text>>(events[i]).content.body,
+              std::to_string(i * rooms.size() + r));
+    }
+
+    alice->close();
+}
@@ -1,3 +1,4 @@
+#include <atomic>
 #include <gtest/gtest.h>
 #include <iostream>
 
@@ -34,6 +35,48 @@ TEST(Basic, ServerWithPort)
     alice->close();
 }
 
+TEST(Basic, ServerUrlFollowsChanges)
+{
+    auto alice = std::make_shared<Client>("example.org");
+    EXPECT_EQ(alice->server_url(), "https://example.org:443");
+
+    alice->set_server("http://localhost:8008/");
+    EXPECT_EQ(alice->server_url(), "http://localhost:8008");
+
+    alice->set_port(8448);
+    EXPECT_EQ(alice->server_url(), "http://localhost:8448");
+    EXPECT_EQ(alice->login_sso_redirect("http://a/"),
+              "http://localhost:8448/_matrix/client/v3/login/sso/"
+              "redirect?redirectUrl=http%3A%2F%2Fa%2F");
+
+    alice->clear();
+    alice->set_server("example.com");
+    EXPECT_EQ(alice->server_url(), "https://example.com:443");
+}
+
+TEST(Basic, ConcurrencyLimit)
+{
+    auto alice = std::make_shared<Client>("not-resolvable-example-domain.wrong");
+
+    ConnectionOptions opts;
+    opts.verify_peer             = false;
+    opts.max_concurrent_requests = 2;
+    alice->set_connection_options(opts);
+    EXPECT_FALSE(alice->connection_options().verify_peer);
+    EXPECT_EQ(alice->connection_options().max_concurrent_requests, 2);
+
+    // Queued requests are started, when earlier ones complete.
+    std::atomic<int> completed = 0;
+    for (int i = 0; i < 5; i++)
+        alice->versions([&completed](const mtx::responses::Versions &, RequestErr err) {
+            EXPECT_TRUE(err);
+            completed++;
+        });
+
+    WAIT_UNTIL(completed == 5)
+    alice->close();
+}
+
 TEST(Basic, Failure)
 {
     auto alice = std::make_shared<Client>("not-resolvable-example-domain.wrong");
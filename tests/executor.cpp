@@ -0,0 +1,91 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <mtxclient/http/executor.hpp>
+
+#include "test_helpers.hpp"
+
+using namespace mtx::http;
+using namespace std::chrono_literals;
+
+TEST(ThreadPool, RunsTasksInOrderOnASingleThread)
+{
+    std::mutex mtx;
+    std::vector<int> order;
+    {
+        ThreadPool pool(1);
+        for (int i = 0; i < 100; i++)
+            pool.post([&, i] {
+                std::lock_guard lock(mtx);
+                order.push_back(i);
+            });
+    }
+
+    ASSERT_EQ(order.size(), 100);
+    for (int i = 0; i < 100; i++)
+        EXPECT_EQ(order[i], i);
+}
+
+TEST(ThreadPool, RunsTasksConcurrently)
+{
+    ThreadPool pool(4);
+    auto executor = pool.executor();
+
+    std::mutex mtx;
+    std::set<std::thread::id> threads;
+    std::atomic<int> running = 0, max_running = 0, done = 0;
+    for (int i = 0; i < 4; i++)
+        executor([&] {
+            int now  = ++running;
+            int seen = max_running;
+            while (now > seen && !max_running.compare_exchange_weak(seen, now)) {
+            }
+            std::this_thread::sleep_for(50ms);
+            {
+                std::lock_guard lock(mtx);
+                threads.insert(std::this_thread::get_id());
+            }
+            running--;
+            done++;
+        });
+
+    WAIT_UNTIL(done == 4)
+    EXPECT_GT(max_running, 1);
+    EXPECT_EQ(threads.count(std::this_thread::get_id()), 0);
+}
+
+TEST(ThreadPool, ExecutorOutlivesThePool)
+{
+    Executor executor;
+    {
+        ThreadPool pool(1);
+        executor = pool.executor();
+    }
+
+    bool ran = false;
+    executor([&ran] { ran = true; });
+    EXPECT_TRUE(ran);
+}
+
+TEST(ThreadPool, TaskOwningThePoolDestroysIt)
+{
+    // Like an object owning a pool, that posts tasks holding a reference to itself.
+    auto pool = std::make_shared<ThreadPool>(1);
+    std::atomic<bool> released = false, ran = false;
+    pool->post([pool, &released] {
+        while (!released)
+            std::this_thread::sleep_for(1ms);
+    });
+    pool->post([&ran] { ran = true; });
+    pool.reset();
+    released = true;
+
+    // The first task destroys the pool on its own thread, which still runs the queued task.
+    WAIT_UNTIL(ran)
+}
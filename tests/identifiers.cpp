@@ -59,3 +59,56 @@ TEST(MatrixIdentifiers, IdentifierInvalid)
     ASSERT_THROW(parse<Room>("39fasdsdfsdf:example.com:5000"), std::invalid_argument);
     ASSERT_THROW(parse<User>("39fasdsdfsdf:example.com:5000"), std::invalid_argument);
 }
+
+TEST(MatrixIdentifiers, Views)
+{
+    User user = parse<User>("@alice:example.com");
+    User copy = user;
+
+    EXPECT_EQ(copy.view().data(), user.view().data());
+    EXPECT_EQ(user.localpart_view().data(), user.view().data() + 1);
+    EXPECT_EQ(user.hostname_view().data(), user.view().data() + 7);
+    EXPECT_EQ(user.localpart(), "alice");
+    EXPECT_EQ(user.hostname(), "example.com");
+
+    User empty;
+    EXPECT_EQ(empty.to_string(), "");
+    EXPECT_EQ(empty.localpart(), "");
+    EXPECT_EQ(empty.hostname(), "");
+    EXPECT_EQ(empty.localpart_view(), "");
+    EXPECT_EQ(empty.hostname_view(), "");
+
+    EXPECT_LE(sizeof(User), 3 * sizeof(void *));
+}
+
+TEST(MatrixIdentifiers, Interning)
+{
+    User a = parse<User>("@alice:example.com");
+    User b = parse<User>("@alice:example.com");
+    EXPECT_NE(a.view().data(), b.view().data());
+    EXPECT_EQ(a, b);
+
+    set_interning_enabled(true);
+    auto before = intern_stats();
+
+    User c = parse<User>("@alice:example.com");
+    User d = parse<User>("@alice:example.com");
+    User e = parse<User>("@bob:example.com");
+    EXPECT_EQ(c.view().data(), d.view().data());
+    EXPECT_EQ(c, d);
+    EXPECT_NE(c, e);
+    EXPECT_EQ(c, a);
+    EXPECT_LT(c, e);
+
+    auto after = intern_stats();
+    EXPECT_EQ(after.entries, before.entries + 2);
+    EXPECT_EQ(after.hits, before.hits + 1);
+    EXPECT_EQ(after.misses, before.misses + 2);
+
+    set_interning_enabled(false);
+    EXPECT_FALSE(interning_enabled());
+
+    // still referenced, so nothing is dropped
+    purge_interned();
+    EXPECT_EQ(intern_stats().entries, after.entries);
+}
@@ -0,0 +1,313 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <mtxclient/http/key_batcher.hpp>
+
+#include "test_helpers.hpp"
+
+using namespace mtx::http;
+using namespace std::chrono_literals;
+
+namespace {
+//! Records the batched requests and lets the test decide, when and how they complete.
+struct FakeServer
+{
+    KeyBatcher::QueryFn query()
+    {
+        return [this](const mtx::requests::QueryKeys &req,
+                      Callback<mtx::responses::QueryKeys> cb) {
+            std::lock_guard lock(mtx);
+            queries.push_back({req, std::move(cb)});
+        };
+    }
+
+    KeyBatcher::ClaimFn claim()
+    {
+        return [this](const mtx::requests::ClaimKeys &req,
+                      Callback<mtx::responses::ClaimKeys> cb) {
+            std::lock_guard lock(mtx);
+            claims.push_back({req, std::move(cb)});
+        };
+    }
+
+    //! Answers the oldest query with two devices for every user.
+    void answer_query()
+    {
+        WAIT_UNTIL(query_count() > 0)
+        auto [req, cb] = [this] {
+            std::lock_guard lock(mtx);
+            auto q = std::move(queries.front());
+            queries.erase(queries.begin());
+            return q;
+        }();
+
+        mtx::responses::QueryKeys res;
+        for (const auto &[user_id, devices] : req.device_keys) {
+            for (const auto &device_id : {"D1", "D2"}) {
+                mtx::crypto::DeviceKeys keys;
+                keys.user_id                        = user_id;
+                keys.device_id                      = device_id;
+                res.device_keys[user_id][device_id] = keys;
+            }
+            res.master_keys[user_id].user_id = user_id;
+        }
+        res.failures["remote.example"] = "unreachable";
+        cb(res, std::nullopt);
+    }
+
+    //! Answers the oldest claim with a key for every device.
+    void answer_claim()
+    {
+        WAIT_UNTIL(claim_count() > 0)
+        auto [req, cb] = [this] {
+            std::lock_guard lock(mtx);
+            auto c = std::move(claims.front());
+            claims.erase(claims.begin());
+            return c;
+        }();
+
+        mtx::responses::ClaimKeys res;
+        for (const auto &[user_id, devices] : req.one_time_keys)
+            for (const auto &[device_id, algorithm] : devices)
+                res.one_time_keys[user_id][device_id] = {
+                  {algorithm + ":AAAA", user_id + "/" + device_id}};
+        cb(res, std::nullopt);
+    }
+
+    std::size_t query_count()
+    {
+        std::lock_guard lock(mtx);
+        return queries.size();
+    }
+
+    std::size_t claim_count()
+    {
+        std::lock_guard lock(mtx);
+        return claims.size();
+    }
+
+    std::mutex mtx;
+    std::vector<std::pair<mtx::requests::QueryKeys, Callback<mtx::responses::QueryKeys>>> queries;
+    std::vector<std::pair<mtx::requests::ClaimKeys, Callback<mtx::responses::ClaimKeys>>> claims;
+};
+
+mtx::requests::QueryKeys
+query(const std::map<std::string, std::vector<std::string>> &device_keys,
+      const std::string &token = "")
+{
+    mtx::requests::QueryKeys req;
+    req.device_keys = device_keys;
+    req.token       = token;
+    return req;
+}
+
+mtx::requests::ClaimKeys
+claim(const std::string &user_id, const std::string &device_id)
+{
+    mtx::requests::ClaimKeys req;
+    req.one_time_keys[user_id][device_id] = "signed_curve25519";
+    return req;
+}
+
+//! Stores the response of a callback and counts the calls.
+template<class Response>
+struct Result
+{
+    Callback<Response> cb()
+    {
+        return [this](const Response &res, RequestErr err) {
+            std::lock_guard lock(mtx);
+            response = res;
+            error    = err;
+            calls++;
+        };
+    }
+
+    std::mutex mtx;
+    Response response;
+    std::optional<ClientError> error;
+    std::atomic<int> calls = 0;
+};
+}
+
+TEST(KeyBatcher, MergesConcurrentQueries)
+{
+    FakeServer server;
+    KeyBatcherOpts opts;
+    opts.window = 50ms;
+    KeyBatcher batcher(server.query(), server.claim(), opts);
+
+    Result<mtx::responses::QueryKeys> all_of_alice, bob_d1, bob_d2;
+    batcher.query_keys(query({{"@alice:a", {}}}), all_of_alice.cb());
+    batcher.query_keys(query({{"@bob:b", {"D1"}}}), bob_d1.cb());
+    batcher.query_keys(query({{"@bob:b", {"D2"}}}), bob_d2.cb());
+
+    WAIT_UNTIL(server.query_count() == 1)
+    {
+        std::lock_guard lock(server.mtx);
+        auto &req = server.queries.front().first;
+        EXPECT_EQ(req.device_keys.at("@alice:a"), std::vector<std::string>{});
+        EXPECT_EQ(req.device_keys.at("@bob:b"), (std::vector<std::string>{"D1", "D2"}));
+    }
+    server.answer_query();
+
+    // Every caller only receives what it asked for.
+    ASSERT_EQ(all_of_alice.calls, 1);
+    EXPECT_EQ(all_of_alice.response.device_keys.size(), 1);
+    EXPECT_EQ(all_of_alice.response.device_keys.at("@alice:a").size(), 2);
+    EXPECT_EQ(all_of_alice.response.master_keys.count("@alice:a"), 1);
+    EXPECT_EQ(all_of_alice.response.failures.size(), 1);
+
+    ASSERT_EQ(bob_d1.calls, 1);
+    EXPECT_EQ(bob_d1.response.device_keys.at("@bob:b").size(), 1);
+    EXPECT_EQ(bob_d1.response.device_keys.at("@bob:b").count("D1"), 1);
+    EXPECT_EQ(bob_d1.response.master_keys.count("@alice:a"), 0);
+    EXPECT_EQ(bob_d2.response.device_keys.at("@bob:b").count("D2"), 1);
+
+    auto stats = batcher.stats();
+    EXPECT_EQ(stats.calls, 3);
+    EXPECT_EQ(stats.requests, 1);
+}
+
+TEST(KeyBatcher, AskingForAllDevicesWins)
+{
+    FakeServer server;
+    KeyBatcher batcher(server.query(), server.claim(), {});
+
+    Result<mtx::responses::QueryKeys> one, all;
+    batcher.query_keys(query({{"@bob:b", {"D1"}}}), one.cb());
+    batcher.query_keys(query({{"@bob:b", {}}}), all.cb());
+    batcher.flush();
+
+    ASSERT_EQ(server.query_count(), 1);
+    EXPECT_TRUE(server.queries.front().first.device_keys.at("@bob:b").empty());
+    server.answer_query();
+
+    EXPECT_EQ(one.response.device_keys.at("@bob:b").size(), 1);
+    EXPECT_EQ(all.response.device_keys.at("@bob:b").size(), 2);
+}
+
+TEST(KeyBatcher, QueriesWithDifferentTokensAreNotMerged)
+{
+    FakeServer server;
+    KeyBatcher batcher(server.query(), server.claim(), {});
+
+    Result<mtx::responses::QueryKeys> first, second;
+    batcher.query_keys(query({{"@bob:b", {}}}, "s1"), first.cb());
+    batcher.query_keys(query({{"@bob:b", {}}}, "s2"), second.cb());
+    batcher.flush();
+
+    EXPECT_EQ(server.query_count(), 2);
+    EXPECT_EQ(batcher.stats().requests, 2);
+}
+
+TEST(KeyBatcher, NeverClaimsADeviceTwiceInOneRequest)
+{
+    FakeServer server;
+    KeyBatcher batcher(server.query(), server.claim(), {});
+
+    Result<mtx::responses::ClaimKeys> first, other, second;
+    batcher.claim_keys(claim("@bob:b", "D1"), first.cb());
+    batcher.claim_keys(claim("@bob:b", "D2"), other.cb());
+    batcher.claim_keys(claim("@bob:b", "D1"), second.cb());
+    batcher.flush();
+
+    ASSERT_EQ(server.claim_count(), 2);
+    EXPECT_EQ(server.claims[0].first.one_time_keys.at("@bob:b").size(), 2);
+    EXPECT_EQ(server.claims[1].first.one_time_keys.at("@bob:b").size(), 1);
+    server.answer_claim();
+    server.answer_claim();
+
+    EXPECT_EQ(first.response.one_time_keys.at("@bob:b").size(), 1);
+    EXPECT_EQ(first.response.one_time_keys.at("@bob:b").count("D1"), 1);
+    EXPECT_EQ(other.response.one_time_keys.at("@bob:b").count("D2"), 1);
+    EXPECT_EQ(second.response.one_time_keys.at("@bob:b").count("D1"), 1);
+}
+
+TEST(KeyBatcher, FullBatchesAreSentRightAway)
+{
+    FakeServer server;
+    KeyBatcherOpts opts;
+    opts.window      = 1h;
+    opts.max_users   = 2;
+    opts.max_devices = 2;
+    Result<mtx::responses::QueryKeys> q1, q2, q3;
+    Result<mtx::responses::ClaimKeys> c1, c2;
+    {
+        KeyBatcher batcher(server.query(), server.claim(), opts);
+
+        batcher.query_keys(query({{"@a:a", {}}}), q1.cb());
+        EXPECT_EQ(server.query_count(), 0);
+        batcher.query_keys(query({{"@b:b", {}}}), q2.cb());
+        EXPECT_EQ(server.query_count(), 1);
+
+        batcher.claim_keys(claim("@a:a", "D1"), c1.cb());
+        batcher.claim_keys(claim("@b:b", "D1"), c2.cb());
+        EXPECT_EQ(server.claim_count(), 1);
+
+        batcher.query_keys(query({{"@c:c", {}}}), q3.cb());
+    }
+
+    // Waiting batches are sent, when the batcher is destroyed.
+    EXPECT_EQ(server.query_count(), 2);
+    server.answer_query();
+    server.answer_query();
+    EXPECT_EQ(q3.calls, 1);
+}
+
+TEST(KeyBatcher, ErrorsReachEveryCaller)
+{
+    FakeServer server;
+    KeyBatcher batcher(server.query(), server.claim(), {});
+
+    Result<mtx::responses::QueryKeys> first, second;
+    batcher.query_keys(query({{"@a:a", {}}}), first.cb());
+    batcher.query_keys(query({{"@b:b", {}}}), second.cb());
+    batcher.flush();
+
+    ClientError err{};
+    err.status_code = 502;
+    server.queries.front().second({}, err);
+
+    ASSERT_TRUE(first.error);
+    ASSERT_TRUE(second.error);
+    EXPECT_EQ(second.error->status_code, 502);
+    EXPECT_EQ(batcher.stats().errors, 1);
+}
+
+TEST(KeyBatcher, JoiningARoomNeedsOneRoundTrip)
+{
+    // Every member of a newly joined room triggers a query from its own thread.
+    FakeServer server;
+    KeyBatcher batcher(server.query(), server.claim(), {});
+
+    constexpr int members = 50;
+    std::vector<Result<mtx::responses::QueryKeys>> results(members);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < members; i++)
+        threads.emplace_back([&, i] {
+            batcher.query_keys(query({{"@user" + std::to_string(i) + ":a", {}}}),
+                               results[i].cb());
+        });
+    for (auto &t : threads)
+        t.join();
+
+    std::this_thread::sleep_for(50ms);
+    while (server.query_count() > 0)
+        server.answer_query();
+
+    for (auto &result : results)
+        EXPECT_EQ(result.calls, 1);
+
+    auto stats = batcher.stats();
+    ::testing::Test::RecordProperty("calls", std::to_string(stats.calls));
+    ::testing::Test::RecordProperty("requests", std::to_string(stats.requests));
+    EXPECT_EQ(stats.calls, members);
+    EXPECT_LT(stats.requests, 5);
+}
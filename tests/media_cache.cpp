@@ -0,0 +1,211 @@
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include <mtxclient/crypto/utils.hpp>
+#include <mtxclient/http/media_cache.hpp>
+
+#include "test_helpers.hpp"
+
+using namespace mtx::http;
+using namespace std::chrono_literals;
+
+namespace {
+std::string
+temp_dir()
+{
+    return (std::filesystem::temp_directory_path() /
+            ("mtxclient_media_cache_" + std::to_string(random_number())))
+      .string();
+}
+
+std::size_t
+files_in(const std::string &dir)
+{
+    auto files = std::distance(std::filesystem::directory_iterator(dir),
+                               std::filesystem::directory_iterator());
+    return static_cast<std::size_t>(files);
+}
+}
+
+TEST(MediaCache, StoresAndMapsFiles)
+{
+    MediaCacheOpts opts;
+    opts.directory = temp_dir();
+    MediaCache cache(opts);
+
+    auto key = MediaCache::key("mxc://example.org/abc");
+    EXPECT_FALSE(cache.get(key));
+
+    std::string binary("image\0data\n", 11);
+    cache.put(key, binary, "image/png", "cat.png");
+
+    auto file = cache.get(key);
+    ASSERT_TRUE(file);
+    EXPECT_EQ(file->data(), binary);
+    EXPECT_EQ(file->content_type(), "image/png");
+    EXPECT_EQ(file->filename(), "cat.png");
+
+    // The mapping stays valid after the file was deleted.
+    cache.remove(key);
+    EXPECT_FALSE(cache.get(key));
+    EXPECT_EQ(file->data(), binary);
+
+    auto stats = cache.stats();
+    EXPECT_EQ(stats.hits, 1);
+    EXPECT_EQ(stats.misses, 2);
+    EXPECT_EQ(stats.bytes_saved, binary.size());
+    EXPECT_EQ(stats.files, 0);
+    EXPECT_EQ(stats.bytes, 0);
+
+    std::filesystem::remove_all(opts.directory);
+}
+
+TEST(MediaCache, ThumbnailsHaveTheirOwnKeys)
+{
+    MediaCacheOpts opts;
+    opts.directory = temp_dir();
+    MediaCache cache(opts);
+
+    ThumbOpts small, large;
+    small.mxc_url = large.mxc_url = "mxc://example.org/abc";
+    large.width = large.height = 800;
+
+    cache.put(MediaCache::key(small), "small");
+    cache.put(MediaCache::key(large), "large");
+    cache.put(MediaCache::key(small.mxc_url), "full");
+
+    EXPECT_EQ(cache.get(MediaCache::key(small))->data(), "small");
+    EXPECT_EQ(cache.get(MediaCache::key(large))->data(), "large");
+    EXPECT_EQ(cache.get(MediaCache::key(small.mxc_url))->data(), "full");
+
+    // Files are named after the hash of the key.
+    for (const auto &entry : std::filesystem::directory_iterator(opts.directory))
+        EXPECT_EQ(entry.path().filename().string().size(), 64);
+
+    std::filesystem::remove_all(opts.directory);
+}
+
+TEST(MediaCache, EvictsTheLeastRecentlyUsedFiles)
+{
+    MediaCacheOpts opts;
+    opts.directory = temp_dir();
+    // Room for three files with their metadata.
+    opts.max_bytes = 3 * 1100;
+    MediaCache cache(opts);
+
+    std::string data(1000, 'x');
+    cache.put("a", data);
+    cache.put("b", data);
+    cache.put("c", data);
+    EXPECT_TRUE(cache.get("a"));
+
+    cache.put("d", data);
+    EXPECT_TRUE(cache.get("a"));
+    EXPECT_FALSE(cache.get("b"));
+    EXPECT_TRUE(cache.get("c"));
+    EXPECT_TRUE(cache.get("d"));
+
+    auto stats = cache.stats();
+    EXPECT_EQ(stats.evictions, 1);
+    EXPECT_EQ(stats.files, 3);
+    EXPECT_LE(stats.bytes, opts.max_bytes);
+    EXPECT_EQ(files_in(opts.directory), 3);
+
+    // Files larger than the whole cache are not stored.
+    cache.put("e", std::string(opts.max_bytes, 'x'));
+    EXPECT_FALSE(cache.get("e"));
+    EXPECT_EQ(cache.stats().files, 3);
+
+    std::filesystem::remove_all(opts.directory);
+}
+
+TEST(MediaCache, KeepsFilesAndTheirOrderAcrossRestarts)
+{
+    MediaCacheOpts opts;
+    opts.directory = temp_dir();
+    opts.max_bytes = 3 * 1100;
+
+    std::string data(1000, 'x');
+    {
+        MediaCache cache(opts);
+        cache.put("a", data);
+        std::this_thread::sleep_for(10ms);
+        cache.put("b", data);
+        std::this_thread::sleep_for(10ms);
+        cache.put("c", data);
+        std::this_thread::sleep_for(10ms);
+        EXPECT_TRUE(cache.get("a"));
+    }
+
+    // A write interrupted by a crash.
+    std::ofstream(std::filesystem::path(opts.directory) / "0123.1.tmp") << "partial";
+
+    MediaCache cache(opts);
+    EXPECT_EQ(cache.stats().files, 3);
+    EXPECT_EQ(files_in(opts.directory), 3);
+
+    cache.put("d", data);
+    EXPECT_TRUE(cache.get("a"));
+    EXPECT_FALSE(cache.get("b"));
+
+    std::filesystem::remove_all(opts.directory);
+}
+
+TEST(MediaCache, DropsDamagedFiles)
+{
+    MediaCacheOpts opts;
+    opts.directory = temp_dir();
+    MediaCache cache(opts);
+
+    cache.put("a", "data");
+    for (const auto &entry : std::filesystem::directory_iterator(opts.directory))
+        std::ofstream(entry.path(), std::ios::trunc) << "no metadata";
+
+    EXPECT_FALSE(cache.get("a"));
+    EXPECT_EQ(cache.stats().files, 0);
+    EXPECT_EQ(files_in(opts.directory), 0);
+
+    std::filesystem::remove_all(opts.directory);
+}
+
+TEST(MediaCache, EncryptedAttachments)
+{
+    std::string plaintext = "secret image";
+    auto [ciphertext, file] = mtx::crypto::encrypt_file(plaintext);
+    file.url                = "mxc://example.org/encrypted";
+
+    for (bool store_plaintext : {false, true}) {
+        MediaCacheOpts opts;
+        opts.directory       = temp_dir();
+        opts.store_plaintext = store_plaintext;
+        MediaCache cache(opts);
+
+        EXPECT_FALSE(cache.decrypted(file));
+        cache.put(MediaCache::key(file.url), mtx::crypto::to_string(ciphertext), "image/png");
+
+        auto decrypted = cache.decrypted(file);
+        ASSERT_TRUE(decrypted);
+        EXPECT_EQ(decrypted->data(), plaintext);
+        EXPECT_EQ(decrypted->content_type(), "image/png");
+        EXPECT_EQ(cache.stats().files, store_plaintext ? 2 : 1);
+
+        // The plaintext is read without the ciphertext.
+        cache.remove(MediaCache::key(file.url));
+        EXPECT_EQ(bool(cache.decrypted(file)), store_plaintext);
+
+        std::filesystem::remove_all(opts.directory);
+    }
+
+    // The ciphertext has to match the hash.
+    MediaCacheOpts opts;
+    opts.directory = temp_dir();
+    MediaCache cache(opts);
+    cache.put(MediaCache::key(file.url), "tampered");
+    EXPECT_FALSE(cache.decrypted(file));
+
+    std::filesystem::remove_all(opts.directory);
+}
@@ -373,6 +373,67 @@ TEST(RoomEvents, EncryptedImageMessage)
     EXPECT_EQ(event.content.file.value().url, "mxc://example.org/FHyPlCeYUSFFxlgbQYZmoEoe");
     EXPECT_EQ(event.content.info.thumbnail_file.value().url,
               "mxc://example.org/pmVJxyxGlmxHposwVSlOaEOv");
+
+    // The out of line members survive a round trip and copies are deep. The mimetype is not part
+    // of an EncryptedFile.
+    json serialized = event;
+    auto file       = data["content"]["file"];
+    auto thumbnail  = data["content"]["info"]["thumbnail_file"];
+    file.erase("mimetype");
+    thumbnail.erase("mimetype");
+    EXPECT_EQ(serialized["content"]["file"], file);
+    EXPECT_EQ(serialized["content"]["info"]["thumbnail_file"], thumbnail);
+
+    auto copy = event;
+    ASSERT_TRUE(copy.content.file.has_value());
+    EXPECT_NE(&copy.content.file.value(), &event.content.file.value());
+    copy.content.file->url = "mxc://example.org/changed";
+    EXPECT_EQ(event.content.file->url, "mxc://example.org/FHyPlCeYUSFFxlgbQYZmoEoe");
+
+    auto moved = std::move(copy);
+    EXPECT_EQ(moved.content.file->url, "mxc://example.org/changed");
+    EXPECT_EQ(json(moved)["content"]["info"], serialized["content"]["info"]);
+}
+
+TEST(RoomEvents, BoxedOptional)
+{
+    mtx::common::BoxedOptional<std::string> empty, value = std::string("value");
+    EXPECT_FALSE(empty.has_value());
+    EXPECT_TRUE(empty == std::nullopt);
+    EXPECT_THROW(empty.value(), std::bad_optional_access);
+    EXPECT_EQ(empty.value_or("default"), "default");
+    EXPECT_EQ(value.value_or("default"), "value");
+
+    // copies are deep
+    auto copy = value;
+    EXPECT_EQ(copy, value);
+    EXPECT_NE(&*copy, &*value);
+    *copy = "changed";
+    EXPECT_EQ(*value, "value");
+    EXPECT_FALSE(copy == value);
+    EXPECT_TRUE(copy == std::string("changed"));
+
+    copy = value;
+    EXPECT_EQ(copy, value);
+    copy = empty;
+    EXPECT_EQ(copy, empty);
+    EXPECT_FALSE(copy.has_value());
+
+    // moves transfer the allocation
+    const auto *address = &*value;
+    auto moved          = std::move(value);
+    EXPECT_EQ(&*moved, address);
+    EXPECT_FALSE(value.has_value());
+
+    std::optional<std::string> converted = moved;
+    EXPECT_EQ(converted, "value");
+    EXPECT_EQ(mtx::common::BoxedOptional<std::string>(converted), moved);
+    EXPECT_EQ(mtx::common::BoxedOptional<std::string>(std::optional<std::string>()), empty);
+
+    moved.reset();
+    EXPECT_EQ(moved, empty);
+    moved.emplace(3, 'a');
+    EXPECT_EQ(*moved, "aaa");
 }
 
 TEST(RoomEvents, ImageMessage)
@@ -0,0 +1,961 @@
+#include "mock_homeserver.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <regex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+using json = nlohmann::json;
+
+namespace mtx::test {
+
+namespace {
+std::string
+lower(std::string_view s)
+{
+    std::string out(s);
+    std::transform(out.begin(), out.end(), out.begin(), [](unsigned char c) {
+        return static_cast<char>(std::tolower(c));
+    });
+    return out;
+}
+
+std::string
+gzip(std::string_view data)
+{
+    z_stream stream{};
+    // 16 selects a gzip header instead of a zlib one.
+    deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+
+    std::string out(deflateBound(&stream, static_cast<uLong>(data.size())) + 32, '\0');
+    stream.next_in   = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    stream.avail_in  = static_cast<uInt>(data.size());
+    stream.next_out  = reinterpret_cast<Bytef *>(out.data());
+    stream.avail_out = static_cast<uInt>(out.size());
+    deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return out;
+}
+
+std::string
+url_decode(std::string_view s)
+{
+    std::string out;
+    out.reserve(s.size());
+    for (std::size_t i = 0; i < s.size(); i++) {
+        bool escaped = s[i] == '%' && i + 2 < s.size() &&
+                       std::isxdigit(static_cast<unsigned char>(s[i + 1])) &&
+                       std::isxdigit(static_cast<unsigned char>(s[i + 2]));
+        if (escaped) {
+            auto byte = std::stoi(std::string(s.substr(i + 1, 2)), nullptr, 16);
+            out.push_back(static_cast<char>(byte));
+            i += 2;
+        } else {
+            out.push_back(s[i]);
+        }
+    }
+    return out;
+}
+
+const char *
+reason(int status)
+{
+    switch (status) {
+    case 200:
+        return "OK";
+    case 400:
+        return "Bad Request";
+    case 401:
+        return "Unauthorized";
+    case 403:
+        return "Forbidden";
+    case 404:
+        return "Not Found";
+    case 429:
+        return "Too Many Requests";
+    case 500:
+        return "Internal Server Error";
+    case 502:
+        return "Bad Gateway";
+    case 503:
+        return "Service Unavailable";
+    default:
+        return "Unknown";
+    }
+}
+
+bool
+send_all(int fd, std::string_view data)
+{
+    while (!data.empty()) {
+        auto sent = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (sent <= 0)
+            return false;
+        data.remove_prefix(static_cast<std::size_t>(sent));
+    }
+    return true;
+}
+}
+
+json
+MockRequest::json() const
+{
+    return nlohmann::json::parse(body, nullptr, false);
+}
+
+std::string
+MockRequest::header(std::string_view name) const
+{
+    auto it = headers.find(lower(name));
+    return it == headers.end() ? "" : it->second;
+}
+
+MockResponse
+MockResponse::json(const nlohmann::json &body, int status)
+{
+    MockResponse res;
+    res.status = status;
+    res.body   = body.dump();
+    return res;
+}
+
+MockResponse
+MockResponse::error(int status, const std::string &errcode, const std::string &error)
+{
+    return json({{"errcode", errcode}, {"error", error}}, status);
+}
+
+struct MockHomeserver::Impl
+{
+    struct Route
+    {
+        std::string method;
+        std::regex path;
+        Handler handler;
+    };
+
+    struct Script
+    {
+        std::string method;
+        std::regex path;
+        std::deque<MockResponse> responses;
+    };
+
+    struct Session
+    {
+        std::string user_id;
+        std::string device_id;
+    };
+
+    struct Event
+    {
+        std::string room_id;
+        json event;
+    };
+
+    struct ToDevice
+    {
+        std::string user_id;
+        std::string device_id;
+        json event;
+    };
+
+    struct Media
+    {
+        std::string content_type;
+        std::string data;
+    };
+
+    Impl();
+    ~Impl();
+
+    void accept_loop();
+    void serve(int fd);
+    MockResponse dispatch(MockRequest &req);
+    void add_builtin_routes();
+
+    //! Returns the user of the access token. Must be called with the state lock held.
+    std::optional<Session> session(const MockRequest &req) const;
+    //! Appends an event and wakes up waiting syncs. Must be called with the state lock held.
+    std::string add_event(const std::string &room_id, const std::string &sender, json event);
+
+    MockResponse login(const MockRequest &req);
+    MockResponse sync(const MockRequest &req);
+    MockResponse messages(const MockRequest &req);
+
+    int listen_fd       = -1;
+    std::uint16_t port_ = 0;
+    std::atomic<bool> stopped{false};
+    std::atomic<std::int64_t> latency_ms{0};
+    std::atomic<bool> compression{false};
+    //! Requests currently handled and the most at once.
+    std::atomic<std::size_t> active{0}, peak{0};
+    std::thread acceptor;
+
+    std::mutex connections_mtx;
+    std::set<int> connections;
+    std::vector<std::thread> workers;
+
+    mutable std::mutex routes_mtx;
+    std::vector<Route> routes;
+    std::vector<Script> scripts;
+    std::vector<MockRequest> received;
+
+    //! The state of the homeserver.
+    mutable std::mutex mtx;
+    std::condition_variable cv;
+    std::map<std::string, Session> sessions;
+    std::map<std::string, std::set<std::string>> members;
+    std::vector<Event> events;
+    std::vector<ToDevice> to_device;
+    std::map<std::string, std::string> transactions;
+    std::map<std::string, std::map<std::string, json>> device_keys;
+    std::map<std::string, std::map<std::string, std::map<std::string, json>>> one_time_keys;
+    std::map<std::string, Media> media;
+    std::map<std::string, json> filters;
+    std::uint64_t counter = 0;
+};
+
+MockHomeserver::Impl::Impl()
+{
+    listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+        throw std::runtime_error("failed to create socket");
+
+    int yes = 1;
+    ::setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    sockaddr_in addr{};
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = 0;
+    if (::bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        ::listen(listen_fd, 128) != 0) {
+        ::close(listen_fd);
+        throw std::runtime_error("failed to listen on the loopback interface");
+    }
+
+    socklen_t len = sizeof(addr);
+    ::getsockname(listen_fd, reinterpret_cast<sockaddr *>(&addr), &len);
+    port_ = ntohs(addr.sin_port);
+
+    add_builtin_routes();
+    acceptor = std::thread([this] { accept_loop(); });
+}
+
+MockHomeserver::Impl::~Impl()
+{
+    stopped = true;
+    {
+        std::lock_guard lock(mtx);
+        cv.notify_all();
+    }
+    acceptor.join();
+    ::close(listen_fd);
+
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard lock(connections_mtx);
+        for (int fd : connections)
+            ::shutdown(fd, SHUT_RDWR);
+        threads = std::move(workers);
+    }
+    for (auto &t : threads)
+        t.join();
+}
+
+void
+MockHomeserver::Impl::accept_loop()
+{
+    while (!stopped) {
+        pollfd pfd{listen_fd, POLLIN, 0};
+        if (::poll(&pfd, 1, 50) <= 0)
+            continue;
+
+        int fd = ::accept(listen_fd, nullptr, nullptr);
+        if (fd < 0)
+            continue;
+
+        std::lock_guard lock(connections_mtx);
+        connections.insert(fd);
+        workers.emplace_back([this, fd] {
+            serve(fd);
+            std::lock_guard l(connections_mtx);
+            connections.erase(fd);
+            ::close(fd);
+        });
+    }
+}
+
+void
+MockHomeserver::Impl::serve(int fd)
+{
+    std::string buffer;
+    char chunk[16 * 1024];
+
+    auto fill = [&]() {
+        auto n = ::recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0)
+            return false;
+        buffer.append(chunk, static_cast<std::size_t>(n));
+        return true;
+    };
+
+    while (!stopped) {
+        std::size_t header_end;
+        while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos)
+            if (!fill())
+                return;
+
+        MockRequest req;
+        std::string_view head(buffer.data(), header_end);
+
+        auto line_end = head.find("\r\n");
+        auto request_line = head.substr(0, line_end);
+        auto sp1          = request_line.find(' ');
+        auto sp2          = request_line.rfind(' ');
+        req.method        = std::string(request_line.substr(0, sp1));
+        auto target       = request_line.substr(sp1 + 1, sp2 - sp1 - 1);
+
+        auto qmark = target.find('?');
+        req.path   = std::string(target.substr(0, qmark));
+        if (qmark != std::string_view::npos) {
+            auto query = target.substr(qmark + 1);
+            while (!query.empty()) {
+                auto amp   = query.find('&');
+                auto param = query.substr(0, amp);
+                auto eq    = param.find('=');
+                req.query[url_decode(param.substr(0, eq))] =
+                  eq == std::string_view::npos ? "" : url_decode(param.substr(eq + 1));
+                query = amp == std::string_view::npos ? "" : query.substr(amp + 1);
+            }
+        }
+
+        while (line_end != std::string_view::npos) {
+            auto start = line_end + 2;
+            line_end   = head.find("\r\n", start);
+            auto line  = head.substr(start, line_end - start);
+            auto colon = line.find(':');
+            if (colon == std::string_view::npos)
+                continue;
+            auto value = line.substr(colon + 1);
+            while (!value.empty() && value.front() == ' ')
+                value.remove_prefix(1);
+            req.headers[lower(line.substr(0, colon))] = std::string(value);
+        }
+
+        std::size_t content_length = 0;
+        if (auto len = req.header("content-length"); !len.empty())
+            content_length = std::stoul(len);
+        if (lower(req.header("expect")) == "100-continue" &&
+            buffer.size() < header_end + 4 + content_length)
+            send_all(fd, "HTTP/1.1 100 Continue\r\n\r\n");
+
+        while (buffer.size() < header_end + 4 + content_length)
+            if (!fill())
+                return;
+        req.body = buffer.substr(header_end + 4, content_length);
+        buffer.erase(0, header_end + 4 + content_length);
+
+        auto now_active = ++active;
+        for (auto seen = peak.load(); now_active > seen;)
+            if (peak.compare_exchange_weak(seen, now_active))
+                break;
+
+        auto res = dispatch(req);
+
+        auto delay = std::chrono::milliseconds(latency_ms.load()) + res.delay;
+        if (delay.count() > 0)
+            std::this_thread::sleep_for(delay);
+
+        if (!res.headers.count("Content-Type"))
+            res.headers["Content-Type"] = "application/json";
+        if (compression && !res.headers.count("Content-Encoding") &&
+            lower(req.header("accept-encoding")).find("gzip") != std::string::npos) {
+            res.body                        = gzip(res.body);
+            res.headers["Content-Encoding"] = "gzip";
+        }
+
+        std::string out = "HTTP/1.1 " + std::to_string(res.status) + " " + reason(res.status) +
+                          "\r\nContent-Length: " + std::to_string(res.body.size()) + "\r\n";
+        for (const auto &[name, value] : res.headers)
+            out += name + ": " + value + "\r\n";
+        out += "\r\n";
+        if (req.method != "HEAD")
+            out += res.body;
+
+        bool sent = send_all(fd, out);
+        active--;
+        if (!sent || lower(req.header("connection")) == "close")
+            return;
+    }
+}
+
+MockResponse
+MockHomeserver::Impl::dispatch(MockRequest &req)
+{
+    Handler handler;
+    {
+        std::lock_guard lock(routes_mtx);
+        received.push_back(req);
+
+        for (auto &script : scripts) {
+            if (script.method == req.method && !script.responses.empty() &&
+                std::regex_match(req.path, script.path)) {
+                auto res = std::move(script.responses.front());
+                script.responses.pop_front();
+                return res;
+            }
+        }
+
+        for (auto route = routes.rbegin(); route != routes.rend(); ++route) {
+            std::smatch match;
+            if (route->method == req.method && std::regex_match(req.path, match, route->path)) {
+                for (std::size_t i = 1; i < match.size(); i++)
+                    req.params.push_back(url_decode(match[i].str()));
+                handler = route->handler;
+                break;
+            }
+        }
+    }
+
+    if (!handler)
+        return MockResponse::error(404, "M_UNRECOGNIZED", "Unrecognized request");
+
+    try {
+        return handler(req);
+    } catch (const std::exception &e) {
+        return MockResponse::error(400, "M_BAD_JSON", e.what());
+    }
+}
+
+std::optional<MockHomeserver::Impl::Session>
+MockHomeserver::Impl::session(const MockRequest &req) const
+{
+    auto auth = req.header("authorization");
+    if (auth.rfind("Bearer ", 0) != 0)
+        return std::nullopt;
+
+    auto it = sessions.find(auth.substr(7));
+    if (it == sessions.end())
+        return std::nullopt;
+    return it->second;
+}
+
+std::string
+MockHomeserver::Impl::add_event(const std::string &room_id, const std::string &sender, json event)
+{
+    auto event_id             = "$" + std::to_string(++counter) + ":localhost";
+    event["event_id"]         = event_id;
+    event["sender"]           = sender;
+    event["room_id"]          = room_id;
+    event["origin_server_ts"] = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                  std::chrono::system_clock::now().time_since_epoch())
+                                  .count();
+    if (!event.contains("content"))
+        event["content"] = json::object();
+
+    events.push_back({room_id, std::move(event)});
+    cv.notify_all();
+    return event_id;
+}
+
+MockResponse
+MockHomeserver::Impl::login(const MockRequest &req)
+{
+    auto body = req.json();
+    std::string user;
+    if (body.contains("identifier") && body["identifier"].contains("user"))
+        user = body["identifier"]["user"].get<std::string>();
+    else
+        user = body.value("user", "");
+    if (user.empty())
+        return MockResponse::error(400, "M_BAD_JSON", "No user given");
+
+    auto user_id = user.front() == '@' ? user : "@" + user + ":localhost";
+
+    std::lock_guard lock(mtx);
+    auto n         = ++counter;
+    auto device_id = body.value("device_id", "DEVICE" + std::to_string(n));
+    auto token     = "token_" + std::to_string(n);
+    sessions[token] = {user_id, device_id};
+
+    return MockResponse::json({
+      {"user_id", user_id},
+      {"device_id", device_id},
+      {"access_token", token},
+      {"home_server", "localhost"},
+    });
+}
+
+MockResponse
+MockHomeserver::Impl::sync(const MockRequest &req)
+{
+    std::unique_lock lock(mtx);
+    auto s = session(req);
+    if (!s)
+        return MockResponse::error(401, "M_MISSING_TOKEN");
+
+    // The token is the position in the event and the to-device list.
+    std::size_t event_pos = 0, to_device_pos = 0;
+    if (auto since = req.query.find("since"); since != req.query.end()) {
+        auto underscore = since->second.find('_');
+        if (since->second.size() < 2 || since->second[0] != 's' || underscore == std::string::npos)
+            return MockResponse::error(400, "M_INVALID_PARAM", "Invalid since token");
+        event_pos     = std::stoul(since->second.substr(1, underscore - 1));
+        to_device_pos = std::stoul(since->second.substr(underscore + 1));
+    }
+
+    auto joined = [this, &s](const std::string &room_id) {
+        auto it = members.find(room_id);
+        return it != members.end() && it->second.count(s->user_id);
+    };
+    auto has_news = [&] {
+        for (auto i = event_pos; i < events.size(); i++)
+            if (joined(events[i].room_id))
+                return true;
+        for (auto i = to_device_pos; i < to_device.size(); i++)
+            if (to_device[i].user_id == s->user_id)
+                return true;
+        return false;
+    };
+
+    auto timeout = std::chrono::milliseconds(std::stoul(
+      req.query.count("timeout") ? req.query.at("timeout") : std::string("0")));
+    if (req.query.count("since"))
+        cv.wait_for(lock, timeout, [&] { return stopped || has_news(); });
+
+    // Filters are uploaded or passed inline. Only the timeline limit and lazy loading of members
+    // are applied.
+    json filter = json::object();
+    if (auto it = req.query.find("filter"); it != req.query.end()) {
+        if (!it->second.empty() && it->second.front() == '{')
+            filter = json::parse(it->second);
+        else if (auto stored = filters.find(it->second); stored != filters.end())
+            filter = stored->second;
+        else
+            return MockResponse::error(400, "M_INVALID_PARAM", "Unknown filter");
+    }
+    auto limit = filter.value(json::json_pointer("/room/timeline/limit"),
+                              std::numeric_limits<std::size_t>::max());
+    bool lazy  = filter.value(json::json_pointer("/room/state/lazy_load_members"), false);
+
+    std::map<std::string, std::vector<std::size_t>> room_events;
+    for (auto i = event_pos; i < events.size(); i++)
+        if (joined(events[i].room_id))
+            room_events[events[i].room_id].push_back(i);
+
+    json join = json::object();
+    for (const auto &[room_id, indices] : room_events) {
+        auto first = indices.size() > limit ? indices.size() - limit : 0;
+
+        json timeline = json::array();
+        std::set<std::string> senders{s->user_id};
+        for (auto i = first; i < indices.size(); i++) {
+            const auto &event = events[indices[i]].event;
+            timeline.push_back(event);
+            senders.insert(event["sender"].get<std::string>());
+        }
+
+        // The latest state before the timeline.
+        std::map<std::pair<std::string, std::string>, const json *> state;
+        for (std::size_t i = 0; i < first; i++) {
+            const auto &event = events[indices[i]].event;
+            if (event.contains("state_key"))
+                state[{event["type"].get<std::string>(), event["state_key"].get<std::string>()}] =
+                  &event;
+        }
+        json state_events = json::array();
+        for (const auto &[key, event] : state)
+            if (!lazy || key.first != "m.room.member" || senders.count(key.second))
+                state_events.push_back(*event);
+
+        join[room_id] = {{"timeline",
+                          {{"events", std::move(timeline)},
+                           {"limited", first > 0},
+                           {"prev_batch", "t" + std::to_string(indices[first])}}},
+                         {"state", {{"events", std::move(state_events)}}}};
+    }
+
+    json device_events = json::array();
+    for (auto i = to_device_pos; i < to_device.size(); i++) {
+        const auto &msg = to_device[i];
+        if (msg.user_id == s->user_id && (msg.device_id == "*" || msg.device_id == s->device_id))
+            device_events.push_back(msg.event);
+    }
+
+    return MockResponse::json({
+      {"next_batch",
+       "s" + std::to_string(events.size()) + "_" + std::to_string(to_device.size())},
+      {"rooms", {{"join", join}}},
+      {"to_device", {{"events", device_events}}},
+    });
+}
+
+MockResponse
+MockHomeserver::Impl::messages(const MockRequest &req)
+{
+    const auto &room_id = req.params.at(0);
+    bool backwards      = req.query.count("dir") == 0 || req.query.at("dir") == "b";
+    std::size_t limit   = req.query.count("limit") ? std::stoul(req.query.at("limit")) : 10;
+
+    std::lock_guard lock(mtx);
+    if (!session(req))
+        return MockResponse::error(401, "M_MISSING_TOKEN");
+
+    std::size_t from = backwards ? events.size() : 0;
+    if (auto it = req.query.find("from"); it != req.query.end() && it->second.size() > 1)
+        from = std::stoul(it->second.substr(1));
+
+    json chunk = json::array();
+    std::size_t pos = std::min(from, events.size());
+    if (backwards) {
+        while (pos > 0 && chunk.size() < limit) {
+            pos--;
+            if (events[pos].room_id == room_id)
+                chunk.push_back(events[pos].event);
+        }
+    } else {
+        for (; pos < events.size() && chunk.size() < limit; pos++)
+            if (events[pos].room_id == room_id)
+                chunk.push_back(events[pos].event);
+    }
+
+    json res = {{"start", "t" + std::to_string(from)}, {"chunk", chunk}};
+    if ((backwards && pos > 0) || (!backwards && pos < events.size()))
+        res["end"] = "t" + std::to_string(pos);
+    return MockResponse::json(res);
+}
+
+void
+MockHomeserver::Impl::add_builtin_routes()
+{
+    auto route = [this](std::string method, const std::string &path, Handler handler) {
+        routes.push_back({std::move(method), std::regex(path), std::move(handler)});
+    };
+    auto authenticated = [this](auto handler) {
+        return [this, handler](const MockRequest &req) {
+            std::lock_guard lock(mtx);
+            auto s = session(req);
+            if (!s)
+                return MockResponse::error(401, "M_MISSING_TOKEN");
+            return handler(req, *s);
+        };
+    };
+
+    route("GET", "/_matrix/client/versions", [](const MockRequest &) {
+        return MockResponse::json({{"versions", {"r0.6.1", "v1.1", "v1.11"}}});
+    });
+    route("GET", "/_matrix/client/v3/login", [](const MockRequest &) {
+        return MockResponse::json({{"flows", {{{"type", "m.login.password"}}}}});
+    });
+    route("GET",
+          "/_matrix/client/v3/capabilities",
+          authenticated([](const MockRequest &, const Session &) {
+              return MockResponse::json(
+                {{"capabilities",
+                  {{"m.room_versions",
+                    {{"default", "10"}, {"available", {{"10", "stable"}, {"11", "stable"}}}}}}}});
+          }));
+    route("POST", "/_matrix/client/v3/login", [this](const MockRequest &req) {
+        return login(req);
+    });
+    route("POST",
+          "/_matrix/client/v3/logout",
+          authenticated([this](const MockRequest &req, const Session &) {
+              sessions.erase(req.header("authorization").substr(7));
+              return MockResponse::json(json::object());
+          }));
+    route("GET", "/_matrix/client/v3/sync", [this](const MockRequest &req) { return sync(req); });
+    route("GET", "/_matrix/client/v3/rooms/([^/]+)/messages", [this](const MockRequest &req) {
+        return messages(req);
+    });
+
+    route("POST",
+          "/_matrix/client/v3/createRoom",
+          authenticated([this](const MockRequest &req, const Session &s) {
+              auto room_id = "!" + std::to_string(++counter) + ":localhost";
+              members[room_id].insert(s.user_id);
+              add_event(room_id,
+                        s.user_id,
+                        {{"type", "m.room.create"},
+                         {"state_key", ""},
+                         {"content", {{"creator", s.user_id}, {"room_version", "10"}}}});
+              add_event(room_id,
+                        s.user_id,
+                        {{"type", "m.room.member"},
+                         {"state_key", s.user_id},
+                         {"content", {{"membership", "join"}}}});
+
+              auto body = req.json();
+              if (body.is_object() && body.contains("invite"))
+                  for (const auto &user : body["invite"])
+                      add_event(room_id,
+                                s.user_id,
+                                {{"type", "m.room.member"},
+                                 {"state_key", user},
+                                 {"content", {{"membership", "invite"}}}});
+              if (body.is_object() && body.contains("name"))
+                  add_event(room_id,
+                            s.user_id,
+                            {{"type", "m.room.name"},
+                             {"state_key", ""},
+                             {"content", {{"name", body["name"]}}}});
+              return MockResponse::json({{"room_id", room_id}});
+          }));
+    auto join = authenticated([this](const MockRequest &req, const Session &s) {
+        const auto &room_id = req.params.at(0);
+        if (!members.count(room_id))
+            return MockResponse::error(404, "M_NOT_FOUND", "Unknown room");
+        members[room_id].insert(s.user_id);
+        add_event(room_id,
+                  s.user_id,
+                  {{"type", "m.room.member"},
+                   {"state_key", s.user_id},
+                   {"content", {{"membership", "join"}}}});
+        return MockResponse::json({{"room_id", room_id}});
+    });
+    route("POST", "/_matrix/client/v3/join/([^/]+)", join);
+    route("POST", "/_matrix/client/v3/rooms/([^/]+)/join", join);
+
+    route("POST",
+          "/_matrix/client/v3/user/([^/]+)/filter",
+          authenticated([this](const MockRequest &req, const Session &) {
+              auto filter_id     = std::to_string(++counter);
+              filters[filter_id] = req.json();
+              return MockResponse::json({{"filter_id", filter_id}});
+          }));
+
+    route("PUT",
+          "/_matrix/client/v3/rooms/([^/]+)/send/([^/]+)/([^/]+)",
+          authenticated([this](const MockRequest &req, const Session &s) {
+              const auto &room_id = req.params.at(0);
+              if (!members.count(room_id) || !members[room_id].count(s.user_id))
+                  return MockResponse::error(403, "M_FORBIDDEN", "Not in room");
+
+              auto txn = s.device_id + "|" + req.params.at(2);
+              if (auto it = transactions.find(txn); it != transactions.end())
+                  return MockResponse::json({{"event_id", it->second}});
+
+              auto event_id = add_event(
+                room_id, s.user_id, {{"type", req.params.at(1)}, {"content", req.json()}});
+              transactions[txn] = event_id;
+              return MockResponse::json({{"event_id", event_id}});
+          }));
+    route("PUT",
+          "/_matrix/client/v3/rooms/([^/]+)/state/([^/]+)(?:/(.*))?",
+          authenticated([this](const MockRequest &req, const Session &s) {
+              auto event_id = add_event(req.params.at(0),
+                                        s.user_id,
+                                        {{"type", req.params.at(1)},
+                                         {"state_key", req.params.at(2)},
+                                         {"content", req.json()}});
+              return MockResponse::json({{"event_id", event_id}});
+          }));
+
+    route("POST",
+          "/_matrix/client/v3/keys/upload",
+          authenticated([this](const MockRequest &req, const Session &s) {
+              auto body = req.json();
+              if (body.contains("device_keys"))
+                  device_keys[s.user_id][s.device_id] = body["device_keys"];
+              auto &keys = one_time_keys[s.user_id][s.device_id];
+              if (body.contains("one_time_keys"))
+                  for (const auto &[id, key] : body["one_time_keys"].items())
+                      keys[id] = key;
+
+              std::map<std::string, int> counts;
+              for (const auto &[id, key] : keys)
+                  counts[id.substr(0, id.find(':'))]++;
+              return MockResponse::json({{"one_time_key_counts", counts}});
+          }));
+    route("POST",
+          "/_matrix/client/v3/keys/query",
+          authenticated([this](const MockRequest &req, const Session &) {
+              auto body   = req.json();
+              json result = json::object();
+              for (const auto &[user_id, devices] : body.at("device_keys").items()) {
+                  result[user_id] = json::object();
+                  for (const auto &[device_id, keys] : device_keys[user_id])
+                      if (devices.empty() ||
+                          std::find(devices.begin(), devices.end(), device_id) != devices.end())
+                          result[user_id][device_id] = keys;
+              }
+              return MockResponse::json({{"device_keys", result}, {"failures", json::object()}});
+          }));
+    route("POST",
+          "/_matrix/client/v3/keys/claim",
+          authenticated([this](const MockRequest &req, const Session &) {
+              auto body   = req.json();
+              json result = json::object();
+              for (const auto &[user_id, devices] : body.at("one_time_keys").items()) {
+                  for (const auto &[device_id, algorithm] : devices.items()) {
+                      auto &keys = one_time_keys[user_id][device_id];
+                      auto prefix = algorithm.get<std::string>() + ":";
+                      auto key    = std::find_if(keys.begin(), keys.end(), [&](const auto &k) {
+                          return k.first.rfind(prefix, 0) == 0;
+                      });
+                      if (key == keys.end())
+                          continue;
+                      result[user_id][device_id][key->first] = key->second;
+                      keys.erase(key);
+                  }
+              }
+              return MockResponse::json(
+                {{"one_time_keys", result}, {"failures", json::object()}});
+          }));
+    route("PUT",
+          "/_matrix/client/v3/sendToDevice/([^/]+)/([^/]+)",
+          authenticated([this](const MockRequest &req, const Session &s) {
+              auto txn = s.device_id + "|to_device|" + req.params.at(1);
+              if (transactions.count(txn))
+                  return MockResponse::json(json::object());
+              transactions[txn] = "";
+
+              auto body = req.json();
+              for (const auto &[user_id, devices] : body.at("messages").items())
+                  for (const auto &[device_id, content] : devices.items())
+                      to_device.push_back({user_id,
+                                           device_id,
+                                           {{"type", req.params.at(0)},
+                                            {"sender", s.user_id},
+                                            {"content", content}}});
+              cv.notify_all();
+              return MockResponse::json(json::object());
+          }));
+
+    route("POST",
+          "/_matrix/media/v3/upload",
+          authenticated([this](const MockRequest &req, const Session &) {
+              auto id = "media" + std::to_string(++counter);
+              media[id] = {req.header("content-type"), req.body};
+              return MockResponse::json({{"content_uri", "mxc://localhost/" + id}});
+          }));
+    auto download = [this](const MockRequest &req) {
+        std::lock_guard lock(mtx);
+        auto it = media.find(req.params.at(1));
+        if (req.params.at(0) != "localhost" || it == media.end())
+            return MockResponse::error(404, "M_NOT_FOUND", "Unknown media");
+
+        MockResponse res;
+        res.body                    = it->second.data;
+        res.headers["Content-Type"] = it->second.content_type.empty()
+                                        ? "application/octet-stream"
+                                        : it->second.content_type;
+        return res;
+    };
+    route("GET", "/_matrix/media/v3/download/([^/]+)/([^/]+)(?:/.*)?", download);
+    route("GET", "/_matrix/client/v1/media/download/([^/]+)/([^/]+)(?:/.*)?", download);
+    // Thumbnails are the media itself, as nothing is scaled.
+    route("GET", "/_matrix/media/v3/thumbnail/([^/]+)/([^/]+)", download);
+    route("GET", "/_matrix/client/v1/media/thumbnail/([^/]+)/([^/]+)", download);
+}
+
+MockHomeserver::MockHomeserver()
+  : impl(std::make_unique<Impl>())
+{}
+
+MockHomeserver::~MockHomeserver() = default;
+
+std::uint16_t
+MockHomeserver::port() const
+{
+    return impl->port_;
+}
+
+std::string
+MockHomeserver::url() const
+{
+    return "http://127.0.0.1:" + std::to_string(impl->port_);
+}
+
+void
+MockHomeserver::on(const std::string &method, const std::string &path_regex, Handler handler)
+{
+    std::lock_guard lock(impl->routes_mtx);
+    impl->routes.push_back({method, std::regex(path_regex), std::move(handler)});
+}
+
+void
+MockHomeserver::script(const std::string &method,
+                       const std::string &path_regex,
+                       std::vector<MockResponse> responses)
+{
+    std::lock_guard lock(impl->routes_mtx);
+    impl->scripts.push_back({method,
+                             std::regex(path_regex),
+                             std::deque<MockResponse>(std::make_move_iterator(responses.begin()),
+                                                      std::make_move_iterator(responses.end()))});
+}
+
+void
+MockHomeserver::set_latency(std::chrono::milliseconds latency)
+{
+    impl->latency_ms = latency.count();
+}
+
+void
+MockHomeserver::set_compression(bool enabled)
+{
+    impl->compression = enabled;
+}
+
+std::string
+MockHomeserver::inject_event(const std::string &room_id,
+                             const std::string &sender,
+                             nlohmann::json event)
+{
+    std::lock_guard lock(impl->mtx);
+    return impl->add_event(room_id, sender, std::move(event));
+}
+
+std::vector<MockRequest>
+MockHomeserver::requests() const
+{
+    std::lock_guard lock(impl->routes_mtx);
+    return impl->received;
+}
+
+std::size_t
+MockHomeserver::request_count(const std::string &method, const std::string &path_regex) const
+{
+    std::regex path(path_regex);
+
+    std::lock_guard lock(impl->routes_mtx);
+    return static_cast<std::size_t>(
+      std::count_if(impl->received.begin(), impl->received.end(), [&](const MockRequest &req) {
+          return req.method == method && std::regex_match(req.path, path);
+      }));
+}
+
+std::size_t
+MockHomeserver::max_concurrent_requests() const
+{
+    return impl->peak;
+}
+
+void
+MockHomeserver::clear_requests()
+{
+    std::lock_guard lock(impl->routes_mtx);
+    impl->received.clear();
+    impl->peak = impl->active.load();
+}
+} // namespace mtx::test
@@ -0,0 +1,121 @@
+#pragma once
+
+/// @file
+/// @brief A loopback homeserver for tests, that can't rely on a real Synapse.
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+namespace mtx {
+//! Helpers for testing.
+namespace test {
+
+//! A request received by the MockHomeserver.
+struct MockRequest
+{
+    //! The HTTP method, i.e. GET.
+    std::string method;
+    //! The path without the query string, still percent encoded.
+    std::string path;
+    //! The decoded query parameters.
+    std::map<std::string, std::string> query;
+    //! The request headers with lower case names.
+    std::map<std::string, std::string> headers;
+    //! The request body.
+    std::string body;
+    //! The decoded captures of the route, that matched the path.
+    std::vector<std::string> params;
+
+    //! Returns the body parsed as JSON or a discarded value, if it isn't JSON.
+    [[nodiscard]] nlohmann::json json() const;
+    //! Returns a header or an empty string. The name is case insensitive.
+    [[nodiscard]] std::string header(std::string_view name) const;
+};
+
+//! A response of the MockHomeserver.
+struct MockResponse
+{
+    int status       = 200;
+    std::string body = "{}";
+    //! Additional headers. The Content-Type defaults to application/json.
+    std::map<std::string, std::string> headers;
+    //! Wait this long before responding, in addition to the latency of the server.
+    std::chrono::milliseconds delay{0};
+
+    //! A JSON response.
+    static MockResponse json(const nlohmann::json &body, int status = 200);
+    //! A Matrix error response.
+    static MockResponse
+    error(int status, const std::string &errcode, const std::string &error = "");
+};
+
+/// @brief An HTTP/1.1 server on 127.0.0.1 implementing the endpoints used by the client.
+///
+/// Login, capabilities, room creation and joins, sending events, filters, /sync (including long
+/// polling, the timeline limit and lazy loading of members), /messages, key upload, query and
+/// claim, to-device messages, media up- and downloads and thumbnails are backed by an in memory
+/// state, so several clients can talk to each other. Any endpoint can be overridden with on() or
+/// script(), and every response can be delayed to simulate a slow network. Users are created on
+/// their first login, every room is on the server `localhost`.
+class MockHomeserver
+{
+    struct Impl;
+
+public:
+    using Handler = std::function<MockResponse(const MockRequest &)>;
+
+    //! Starts listening on a free port.
+    MockHomeserver();
+    //! Stops the server and closes all connections.
+    ~MockHomeserver();
+
+    MockHomeserver(const MockHomeserver &)            = delete;
+    MockHomeserver &operator=(const MockHomeserver &) = delete;
+
+    //! The port the server is listening on.
+    [[nodiscard]] std::uint16_t port() const;
+    //! The url to pass to Client::set_server(), i.e. http://127.0.0.1:1234.
+    [[nodiscard]] std::string url() const;
+
+    //! Handle requests matching the method and the regex of the whole path. Later handlers take
+    //! precedence over earlier ones and the built in endpoints. Captures are passed as params.
+    void on(const std::string &method, const std::string &path_regex, Handler handler);
+    //! Answer the next matching requests with these responses in order, then fall back to the
+    //! other handlers. Useful to inject errors or rate limits.
+    void script(const std::string &method,
+                const std::string &path_regex,
+                std::vector<MockResponse> responses);
+    //! Delay every response by this much.
+    void set_latency(std::chrono::milliseconds latency);
+    //! Compress response bodies with gzip, if the client accepts it.
+    void set_compression(bool enabled);
+
+    //! Send an event to a room on behalf of a user. \returns the event id.
+    std::string
+    inject_event(const std::string &room_id, const std::string &sender, nlohmann::json event);
+
+    //! Returns the requests received so far.
+    [[nodiscard]] std::vector<MockRequest> requests() const;
+    //! Returns how many requests matched the method and the path regex.
+    [[nodiscard]] std::size_t
+    request_count(const std::string &method, const std::string &path_regex) const;
+    //! Returns the highest number of requests, that were handled at the same time, since the
+    //! server started or the requests were cleared.
+    [[nodiscard]] std::size_t max_concurrent_requests() const;
+    //! Forget the requests received so far.
+    void clear_requests();
+
+private:
+    std::unique_ptr<Impl> impl;
+};
+} // namespace test
+} // namespace mtx
@@ -0,0 +1,297 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <mtxclient/http/paginator.hpp>
+
+#include "test_helpers.hpp"
+
+using namespace mtx::http;
+using namespace std::chrono_literals;
+
+using mtx::responses::Messages;
+
+namespace {
+//! A page with `items` events, that links to `next`.
+Messages
+page(const std::string &start, const std::string &next, std::size_t items = 10)
+{
+    Messages msgs;
+    msgs.start = start;
+    msgs.end   = next;
+    for (std::size_t i = 0; i < items; i++)
+        msgs.chunk.push_back(mtx::events::RoomEvent<mtx::events::msg::Text>{});
+    return msgs;
+}
+
+//! Records the page requests and lets the test decide, when and how they complete.
+struct FakeServer
+{
+    struct Request
+    {
+        std::string from;
+        Callback<Messages> cb;
+    };
+
+    Paginator<Messages>::Fetcher fetcher()
+    {
+        return [this](const std::string &from, Callback<Messages> cb) {
+            std::lock_guard lock(mtx);
+            requests.push_back({from, std::move(cb)});
+            total++;
+        };
+    }
+
+    //! Completes the request in flight with a page linking to `next`.
+    void respond(const std::string &next, std::size_t items = 10)
+    {
+        auto req = take();
+        req.cb(page(req.from, next, items), std::nullopt);
+    }
+
+    void fail(int status_code)
+    {
+        ClientError err{};
+        err.status_code = status_code;
+        take().cb({}, err);
+    }
+
+    Request take()
+    {
+        WAIT_UNTIL(pending() > 0)
+        std::lock_guard lock(mtx);
+        auto req = std::move(requests.front());
+        requests.erase(requests.begin());
+        return req;
+    }
+
+    std::size_t pending()
+    {
+        std::lock_guard lock(mtx);
+        return requests.size();
+    }
+
+    std::string from()
+    {
+        WAIT_UNTIL(pending() > 0)
+        std::lock_guard lock(mtx);
+        return requests.front().from;
+    }
+
+    std::mutex mtx;
+    std::vector<Request> requests;
+    std::atomic<int> total = 0;
+};
+
+//! Serves `pages` pages after a delay on their own thread, like a client with some latency.
+struct SlowServer
+{
+    ~SlowServer()
+    {
+        for (auto &t : threads)
+            t.join();
+    }
+
+    Paginator<Messages>::Fetcher fetcher()
+    {
+        return [this](const std::string &from, Callback<Messages> cb) {
+            std::lock_guard lock(mtx);
+            threads.emplace_back([this, from, cb = std::move(cb)] {
+                std::this_thread::sleep_for(latency);
+                auto index = from.empty() ? 0 : std::stoi(from);
+                auto next  = index + 1 < pages ? std::to_string(index + 1) : std::string{};
+                cb(page(from, next), std::nullopt);
+            });
+        };
+    }
+
+    int pages = 10;
+    std::chrono::milliseconds latency{20};
+    std::mutex mtx;
+    std::vector<std::thread> threads;
+};
+}
+
+TEST(Paginator, ReturnsPagesInOrderUntilTheEnd)
+{
+    // Answer synchronously, which also checks, that a page can't overtake the one before it.
+    Paginator<Messages> paginator(
+      [](const std::string &from, Callback<Messages> cb) {
+          auto index = from.empty() ? 0 : std::stoi(from);
+          cb(page(from, index < 4 ? std::to_string(index + 1) : ""), std::nullopt);
+      },
+      {});
+
+    std::vector<std::string> starts;
+    while (auto msgs = paginator.wait_next())
+        starts.push_back(msgs->start);
+
+    EXPECT_EQ(starts, (std::vector<std::string>{"", "1", "2", "3", "4"}));
+    EXPECT_TRUE(paginator.finished());
+
+    // Asking again keeps returning the end.
+    std::optional<ClientError> err;
+    EXPECT_FALSE(paginator.wait_next(&err));
+    EXPECT_FALSE(err);
+
+    auto stats = paginator.stats();
+    EXPECT_EQ(stats.pages, 5);
+    EXPECT_EQ(stats.items, 50);
+    EXPECT_EQ(stats.buffered_pages, 0);
+}
+
+TEST(Paginator, PrefetchesAhead)
+{
+    FakeServer server;
+    PaginatorOpts opts;
+    opts.prefetch_pages = 2;
+    Paginator<Messages> paginator(server.fetcher(), opts, "t100");
+
+    // The first page is requested right away and the second one, as soon as the first arrived.
+    EXPECT_EQ(server.from(), "t100");
+    server.respond("t90");
+    EXPECT_EQ(server.from(), "t90");
+    server.respond("t80");
+
+    // The buffer is full now.
+    std::this_thread::sleep_for(50ms);
+    EXPECT_EQ(server.pending(), 0);
+    EXPECT_EQ(paginator.stats().buffered_pages, 2);
+
+    // Taking a page makes room for the next one.
+    auto msgs = paginator.wait_next();
+    ASSERT_TRUE(msgs);
+    EXPECT_EQ(msgs->start, "t100");
+    EXPECT_EQ(server.from(), "t80");
+    EXPECT_EQ(paginator.stats().prefetch_hits, 1);
+}
+
+TEST(Paginator, WithoutPrefetchingOnlyFetchesOnDemand)
+{
+    FakeServer server;
+    PaginatorOpts opts;
+    opts.prefetch_pages = 0;
+    Paginator<Messages> paginator(server.fetcher(), opts);
+
+    std::this_thread::sleep_for(50ms);
+    EXPECT_EQ(server.total, 0);
+
+    std::optional<Messages> received;
+    std::atomic<bool> done = false;
+    paginator.next([&](std::optional<Messages> msgs, RequestErr err) {
+        EXPECT_FALSE(err);
+        received = std::move(msgs);
+        done     = true;
+    });
+
+    server.respond("next");
+    WAIT_UNTIL(done)
+    ASSERT_TRUE(received);
+    EXPECT_EQ(received->end, "next");
+    EXPECT_EQ(server.total, 1);
+}
+
+TEST(Paginator, MemoryCapStopsPrefetching)
+{
+    FakeServer server;
+    PaginatorOpts opts;
+    opts.prefetch_pages     = 10;
+    opts.max_buffered_items = 25;
+    Paginator<Messages> paginator(server.fetcher(), opts);
+
+    server.respond("1");
+    server.respond("2");
+    server.respond("3");
+
+    // 30 buffered events are above the cap, so no fourth page is requested.
+    std::this_thread::sleep_for(50ms);
+    EXPECT_EQ(server.pending(), 0);
+    EXPECT_EQ(paginator.stats().buffered_items, 30);
+
+    ASSERT_TRUE(paginator.wait_next());
+    EXPECT_EQ(server.from(), "3");
+}
+
+TEST(Paginator, FailedRequestsAreRetriedOnDemand)
+{
+    FakeServer server;
+    Paginator<Messages> paginator(server.fetcher(), {}, "t1");
+
+    std::optional<ClientError> err;
+    std::optional<Messages> msgs;
+    std::atomic<bool> done = false;
+    auto receive = [&](std::optional<Messages> page, RequestErr e) {
+        msgs = std::move(page);
+        err  = e;
+        done = true;
+    };
+
+    paginator.next(receive);
+    server.fail(502);
+    WAIT_UNTIL(done)
+
+    EXPECT_FALSE(msgs);
+    ASSERT_TRUE(err);
+    EXPECT_EQ(err->status_code, 502);
+    EXPECT_FALSE(paginator.finished());
+
+    // No retries happen in the background.
+    std::this_thread::sleep_for(50ms);
+    EXPECT_EQ(server.pending(), 0);
+
+    done = false;
+    paginator.next(receive);
+    EXPECT_EQ(server.from(), "t1");
+    server.respond("");
+    WAIT_UNTIL(done)
+
+    ASSERT_TRUE(msgs);
+    EXPECT_FALSE(err);
+    EXPECT_TRUE(paginator.finished());
+    EXPECT_EQ(paginator.stats().errors, 1);
+}
+
+TEST(Paginator, RepeatedTokenEndsThePagination)
+{
+    FakeServer server;
+    Paginator<Messages> paginator(server.fetcher(), {}, "same");
+    server.respond("same");
+
+    ASSERT_TRUE(paginator.wait_next());
+    EXPECT_FALSE(paginator.wait_next());
+    EXPECT_EQ(server.total, 1);
+}
+
+TEST(Paginator, PipelinesRoundTripsWithProcessing)
+{
+    auto export_history = [](std::size_t prefetch_pages) {
+        SlowServer server;
+        PaginatorOpts opts;
+        opts.prefetch_pages = prefetch_pages;
+
+        auto start = std::chrono::steady_clock::now();
+        {
+            Paginator<Messages> paginator(server.fetcher(), opts);
+            while (paginator.wait_next())
+                // Writing the page somewhere takes as long as fetching it.
+                std::this_thread::sleep_for(server.latency);
+        }
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - start);
+    };
+
+    auto sequential = export_history(0);
+    auto prefetched = export_history(2);
+
+    ::testing::Test::RecordProperty("sequential_ms", static_cast<int>(sequential.count()));
+    ::testing::Test::RecordProperty("prefetched_ms", static_cast<int>(prefetched.count()));
+
+    // Sequentially every page pays the round trip and the processing, 10 * 40ms. With prefetching
+    // the round trips overlap the processing, about 10 * 20ms.
+    EXPECT_LT(prefetched.count() * 4, sequential.count() * 3);
+}
@@ -3388,3 +3388,141 @@ TEST(Pushrules, EmptyOrInvalidContentRulesDontMatch)
 
     EXPECT_FALSE(notifies(actions));
 }
+
+TEST(Pushrules, NotificationCounter)
+{
+    mtx::pushrules::Ruleset ruleset;
+
+    mtx::pushrules::PushRule highlight_rule;
+    highlight_rule.rule_id = ".m.rule.contains_display_name";
+    highlight_rule.actions = {
+      mtx::pushrules::actions::notify{},
+      mtx::pushrules::actions::set_tweak_highlight{},
+    };
+    highlight_rule.conditions.push_back(mtx::pushrules::PushCondition{
+      .kind    = "contains_display_name",
+      .key     = "",
+      .pattern = "",
+      .value   = std::nullopt,
+      .is      = "",
+    });
+    ruleset.override_.push_back(highlight_rule);
+
+    mtx::pushrules::PushRule message_rule;
+    message_rule.rule_id = ".m.rule.message";
+    message_rule.actions = {mtx::pushrules::actions::notify{}};
+    message_rule.conditions.push_back(mtx::pushrules::PushCondition{
+      .kind    = "event_match",
+      .key     = "type",
+      .pattern = "m.room.message",
+      .value   = std::nullopt,
+      .is      = "",
+    });
+    ruleset.underride.push_back(message_rule);
+
+    mtx::pushrules::PushRuleEvaluator evaluator{ruleset};
+    mtx::pushrules::PushRuleEvaluator::RoomContext ctx{};
+    ctx.user_display_name = "Alice";
+
+    const std::string room_id = "!room:example.org";
+    int next_id               = 0;
+    auto message              = [&](const std::string &sender, const std::string &body) {
+        mtx::events::RoomEvent<mtx::events::msg::Text> ev{};
+        ev.type         = mtx::events::EventType::RoomMessage;
+        ev.content.body = body;
+        ev.room_id      = room_id;
+        ev.event_id     = "$" + std::to_string(next_id++) + ":example.org";
+        ev.sender       = sender;
+        return mtx::events::collections::TimelineEvents{ev};
+    };
+
+    mtx::pushrules::NotificationCounter counter{"@alice:example.org"};
+    EXPECT_EQ(counter.counts(room_id), (mtx::pushrules::NotificationCounter::Counts{0, 0}));
+
+    counter.process_event(room_id, message("@bob:example.org", "hello"), evaluator, ctx);
+    auto mention = message("@bob:example.org", "hi Alice");
+    counter.process_event(room_id, mention, evaluator, ctx);
+    auto question = message("@bob:example.org", "anyone?");
+    counter.process_event(room_id, question, evaluator, ctx);
+    EXPECT_EQ(counter.counts(room_id), (mtx::pushrules::NotificationCounter::Counts{3, 1}));
+    EXPECT_EQ(counter.total(), (mtx::pushrules::NotificationCounter::Counts{3, 1}));
+
+    // duplicates are ignored
+    counter.process_event(room_id, mention, evaluator, ctx);
+    EXPECT_EQ(counter.counts(room_id), (mtx::pushrules::NotificationCounter::Counts{3, 1}));
+
+    // a receipt by someone else changes nothing
+    mtx::events::ephemeral::Receipt receipt;
+    receipt.receipts["$1:example.org"][mtx::events::ephemeral::Receipt::Read]
+      .users["@bob:example.org"] = {};
+    counter.process_receipts(room_id, receipt);
+    EXPECT_EQ(counter.counts(room_id), (mtx::pushrules::NotificationCounter::Counts{3, 1}));
+
+    // reading up to the mention clears it and everything before it
+    receipt.receipts["$1:example.org"][mtx::events::ephemeral::Receipt::ReadPrivate]
+      .users["@alice:example.org"] = {};
+    counter.process_receipts(room_id, receipt);
+    EXPECT_EQ(counter.counts(room_id), (mtx::pushrules::NotificationCounter::Counts{1, 0}));
+
+    // events delivered again after they were read are not counted again
+    counter.process_event(room_id, mention, evaluator, ctx);
+    EXPECT_EQ(counter.counts(room_id), (mtx::pushrules::NotificationCounter::Counts{1, 0}));
+
+    // unknown events don't change the counts
+    EXPECT_FALSE(counter.mark_read(room_id, "$unknown:example.org"));
+    EXPECT_EQ(counter.counts(room_id), (mtx::pushrules::NotificationCounter::Counts{1, 0}));
+
+    // encrypted events are skipped until they are decrypted
+    mtx::events::EncryptedEvent<mtx::events::msg::Encrypted> encrypted{};
+    encrypted.event_id = "$encrypted:example.org";
+    encrypted.sender   = "@bob:example.org";
+    counter.process_event(room_id, encrypted, evaluator, ctx);
+    EXPECT_EQ(counter.counts(room_id), (mtx::pushrules::NotificationCounter::Counts{1, 0}));
+
+    // sending a message is an implicit read receipt
+    counter.process_event(room_id, message("@alice:example.org", "hi Alice"), evaluator, ctx);
+    EXPECT_EQ(counter.counts(room_id), (mtx::pushrules::NotificationCounter::Counts{0, 0}));
+
+    // the same after an explicit read marker
+    auto ping = message("@bob:example.org", "Alice!");
+    counter.process_event(room_id, ping, evaluator, ctx);
+    EXPECT_EQ(counter.counts(room_id), (mtx::pushrules::NotificationCounter::Counts{1, 1}));
+    EXPECT_TRUE(counter.mark_read(room_id, "$4:example.org"));
+    counter.process_event(room_id, ping, evaluator, ctx);
+    counter.process_event(room_id, question, evaluator, ctx);
+    EXPECT_EQ(counter.counts(room_id), (mtx::pushrules::NotificationCounter::Counts{0, 0}));
+
+    counter.process_event(room_id, message("@bob:example.org", "Alice?"), evaluator, ctx);
+    counter.process_event("!other:example.org", message("@bob:example.org", "x"), evaluator, ctx);
+    EXPECT_EQ(counter.total(), (mtx::pushrules::NotificationCounter::Counts{2, 1}));
+    counter.remove_room(room_id);
+    EXPECT_EQ(counter.total(), (mtx::pushrules::NotificationCounter::Counts{1, 0}));
+
+    // a limited sync skips events, so receipts for them are unknown
+    auto before_gap = message("@bob:example.org", "Alice, before the gap");
+    counter.process_event(room_id, before_gap, evaluator, ctx);
+    EXPECT_EQ(counter.counts(room_id), (mtx::pushrules::NotificationCounter::Counts{1, 1}));
+    EXPECT_FALSE(counter.mark_read(room_id, "$skipped:example.org"));
+    EXPECT_EQ(counter.counts(room_id), (mtx::pushrules::NotificationCounter::Counts{1, 1}));
+
+    // resetting to the counts of the server resyncs the room
+    counter.reset_room(room_id, {2, 0});
+    EXPECT_EQ(counter.counts(room_id), (mtx::pushrules::NotificationCounter::Counts{2, 0}));
+    EXPECT_EQ(counter.total(), (mtx::pushrules::NotificationCounter::Counts{3, 0}));
+    counter.process_event(room_id, before_gap, evaluator, ctx);
+    EXPECT_EQ(counter.counts(room_id), (mtx::pushrules::NotificationCounter::Counts{2, 0}));
+
+    // new events add to them and a receipt for a new event clears the unknown ones as well
+    counter.process_event(room_id, message("@bob:example.org", "after the gap"), evaluator, ctx);
+    auto latest = message("@carol:example.org", "still there?");
+    counter.process_event(room_id, latest, evaluator, ctx);
+    EXPECT_EQ(counter.counts(room_id), (mtx::pushrules::NotificationCounter::Counts{4, 0}));
+    EXPECT_TRUE(counter.mark_read(room_id, "$8:example.org"));
+    EXPECT_EQ(counter.counts(room_id), (mtx::pushrules::NotificationCounter::Counts{1, 0}));
+    EXPECT_EQ(counter.total(), (mtx::pushrules::NotificationCounter::Counts{2, 0}));
+
+    // or the room can simply be marked as read
+    counter.reset_room(room_id, {});
+    EXPECT_EQ(counter.counts(room_id), (mtx::pushrules::NotificationCounter::Counts{0, 0}));
+    EXPECT_EQ(counter.total(), (mtx::pushrules::NotificationCounter::Counts{1, 0}));
+}
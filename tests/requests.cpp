@@ -354,3 +354,78 @@ TEST(Requests, PublicRooms)
 
     EXPECT_THROW(json req = b3, std::invalid_argument);
 }
+
+TEST(Requests, Filter)
+{
+    Filter filter;
+    json j = filter;
+    EXPECT_EQ(j, json::object());
+
+    filter.presence.emplace().types = std::vector<std::string>{};
+    filter.room.emplace();
+    filter.room->timeline.emplace().limit              = 20;
+    filter.room->state.emplace().lazy_load_members     = true;
+    filter.room->state->not_types                      = {"m.room.third_party_invite"};
+    filter.room->timeline->unread_thread_notifications = true;
+    filter.room->not_rooms                             = {"!spam:example.org"};
+    filter.event_format                                = "client";
+
+    j = filter;
+    EXPECT_EQ(j, R"({
+    "event_format": "client",
+    "presence": {"types": []},
+    "room": {
+      "not_rooms": ["!spam:example.org"],
+      "state": {"lazy_load_members": true, "not_types": ["m.room.third_party_invite"]},
+      "timeline": {"limit": 20, "unread_thread_notifications": true}
+    }
+  })"_json);
+}
+
+TEST(Requests, SlidingSync)
+{
+    SlidingSync req;
+    req.conn_id = "main";
+
+    sliding_sync::List list;
+    list.ranges         = {{0, 19}};
+    list.required_state = {{"m.room.name", ""}, {"m.room.member", "$LAZY"}};
+    list.timeline_limit = 5;
+    list.filters        = sliding_sync::ListFilters{};
+    list.filters->is_dm = true;
+    req.lists["dms"]    = list;
+
+    req.room_subscriptions["!room:example.org"].required_state = {{"*", "*"}};
+    req.room_subscriptions["!room:example.org"].timeline_limit = 50;
+
+    req.extensions.to_device.enabled = true;
+    req.extensions.to_device.since   = "td1";
+    req.extensions.e2ee              = true;
+    req.extensions.receipts.enabled  = true;
+    req.extensions.receipts.lists    = std::vector<std::string>{"dms"};
+
+    json j = req;
+    EXPECT_EQ(j, R"({
+    "conn_id": "main",
+    "lists": {
+      "dms": {
+        "ranges": [[0, 19]],
+        "required_state": [["m.room.name", ""], ["m.room.member", "$LAZY"]],
+        "timeline_limit": 5,
+        "filters": {"is_dm": true}
+      }
+    },
+    "room_subscriptions": {
+      "!room:example.org": {"required_state": [["*", "*"]], "timeline_limit": 50}
+    },
+    "extensions": {
+      "to_device": {"enabled": true, "since": "td1"},
+      "e2ee": {"enabled": true},
+      "receipts": {"enabled": true, "lists": ["dms"]}
+    }
+  })"_json);
+
+    // Disabled extensions are left out.
+    j = SlidingSync{};
+    EXPECT_EQ(j, R"({"lists": {}, "room_subscriptions": {}, "extensions": {}})"_json);
+}
@@ -1,5 +1,6 @@
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <fstream>
 #include <variant>
 
@@ -651,7 +652,185 @@ TEST(Responses, SyncWithEncryption)
     EXPECT_EQ(event_id, "$1522842442112652dsEBQ:matrix.org");
 }
 
-TEST(Responses, Rooms) {}
+TEST(Responses, SlidingSync)
+{
+    json data = R"({
+      "pos": "5",
+      "lists": {"all": {"count": 1337}},
+      "rooms": {
+        "!joined:example.org": {
+          "name": "Test",
+          "initial": true,
+          "heroes": [{"user_id": "@bob:example.org", "displayname": "Bob"}],
+          "required_state": [{
+            "type": "m.room.name",
+            "state_key": "",
+            "event_id": "$name",
+            "sender": "@alice:example.org",
+            "origin_server_ts": 1,
+            "content": {"name": "Test"}
+          }],
+          "timeline": [{
+            "type": "m.room.message",
+            "event_id": "$msg",
+            "sender": "@bob:example.org",
+            "origin_server_ts": 2,
+            "content": {"msgtype": "m.text", "body": "hi"}
+          }],
+          "prev_batch": "p1",
+          "limited": true,
+          "num_live": 1,
+          "bump_stamp": 42,
+          "joined_count": 2,
+          "notification_count": 3,
+          "highlight_count": 1
+        },
+        "!invite:example.org": {
+          "stripped_state": [{
+            "type": "m.room.name",
+            "state_key": "",
+            "sender": "@carl:example.org",
+            "content": {"name": "Invite"}
+          }, {
+            "type": "m.room.member",
+            "state_key": "@alice:example.org",
+            "sender": "@carl:example.org",
+            "content": {"membership": "invite"}
+          }]
+        },
+        "!old_invite:example.org": {
+          "invite_state": [{
+            "type": "m.room.name",
+            "state_key": "",
+            "sender": "@carl:example.org",
+            "content": {"name": "Old invite"}
+          }]
+        }
+      },
+      "extensions": {
+        "to_device": {
+          "next_batch": "td2",
+          "events": [{"type": "m.dummy", "sender": "@bob:example.org", "content": {}}]
+        },
+        "e2ee": {
+          "device_lists": {"changed": ["@bob:example.org"], "left": []},
+          "device_one_time_keys_count": {"signed_curve25519": 50},
+          "device_unused_fallback_key_types": ["signed_curve25519"]
+        },
+        "account_data": {
+          "global": [{"type": "m.direct", "content": {}}],
+          "rooms": {"!joined:example.org": [{"type": "m.tag", "content": {"tags": {}}}]}
+        },
+        "receipts": {
+          "rooms": {
+            "!joined:example.org": {
+              "type": "m.receipt",
+              "content": {"$msg": {"m.read": {"@bob:example.org": {"ts": 1}}}}
+            }
+          }
+        },
+        "typing": {
+          "rooms": {
+            "!joined:example.org": {
+              "type": "m.typing",
+              "content": {"user_ids": ["@bob:example.org"]}
+            }
+          }
+        }
+      }
+    })"_json;
+
+    auto sync = data.get<SlidingSync>();
+    EXPECT_EQ(sync.pos, "5");
+    EXPECT_EQ(sync.lists.at("all").count, 1337);
+    ASSERT_EQ(sync.rooms.size(), 3);
+
+    const auto &room = sync.rooms.at("!joined:example.org");
+    EXPECT_EQ(room.name, "Test");
+    EXPECT_TRUE(room.initial);
+    ASSERT_EQ(room.heroes.size(), 1);
+    EXPECT_EQ(room.heroes[0].displayname, "Bob");
+    ASSERT_EQ(room.required_state.size(), 1);
+    EXPECT_TRUE(std::holds_alternative<StateEvent<state::Name>>(room.required_state[0]));
+    ASSERT_EQ(room.timeline.size(), 1);
+    EXPECT_EQ(std::get<RoomEvent<msg::Text>>(room.timeline[0]).content.body, "hi");
+    EXPECT_EQ(room.prev_batch, "p1");
+    EXPECT_TRUE(room.limited);
+    EXPECT_EQ(room.num_live, 1);
+    EXPECT_EQ(room.bump_stamp, 42);
+    EXPECT_EQ(room.joined_count, 2);
+    EXPECT_FALSE(room.invited_count);
+    EXPECT_EQ(room.unread_notifications.notification_count, 3);
+    EXPECT_EQ(room.unread_notifications.highlight_count, 1);
+
+    const auto &invite = sync.rooms.at("!invite:example.org");
+    ASSERT_EQ(invite.invite_state.size(), 2);
+    EXPECT_EQ(std::get<StrippedEvent<state::Name>>(invite.invite_state[0]).content.name, "Invite");
+    EXPECT_EQ(std::get<StrippedEvent<state::Member>>(invite.invite_state[1]).state_key,
+              "@alice:example.org");
+    EXPECT_TRUE(invite.timeline.empty());
+
+    const auto &old_invite = sync.rooms.at("!old_invite:example.org");
+    ASSERT_EQ(old_invite.invite_state.size(), 1);
+    EXPECT_EQ(std::get<StrippedEvent<state::Name>>(old_invite.invite_state[0]).content.name,
+              "Old invite");
+
+    const auto &ext = sync.extensions;
+    EXPECT_EQ(ext.to_device_next_batch, "td2");
+    EXPECT_EQ(ext.to_device.events.size(), 1);
+    EXPECT_EQ(ext.device_lists.changed, std::vector<std::string>{"@bob:example.org"});
+    EXPECT_EQ(ext.device_one_time_keys_count.at("signed_curve25519"), 50);
+    ASSERT_TRUE(ext.device_unused_fallback_key_types);
+    EXPECT_EQ(ext.account_data.events.size(), 1);
+    EXPECT_EQ(ext.room_account_data.at("!joined:example.org").events.size(), 1);
+    EXPECT_EQ(ext.ephemeral.at("!joined:example.org").events.size(), 2);
+}
+
+TEST(Responses, Rooms)
+{
+    json data = R"({
+      "join": {
+        "!b:example.org": {},
+        "!a:example.org": {},
+        "!c:example.org": {}
+      },
+      "invite": {
+        "!d:example.org": {}
+      },
+      "leave": {
+        "!e:example.org": {}
+      }
+    })"_json;
+
+    Rooms rooms = data.get<Rooms>();
+
+    EXPECT_EQ(rooms.join.size(), 3);
+    EXPECT_EQ(rooms.invite.size(), 1);
+    EXPECT_EQ(rooms.leave.size(), 1);
+    EXPECT_EQ(rooms.knock.size(), 0);
+    EXPECT_EQ(rooms.join.count("!a:example.org"), 1);
+    EXPECT_EQ(rooms.join.count("!d:example.org"), 0);
+    EXPECT_EQ(rooms.invite.count("!d:example.org"), 1);
+    EXPECT_EQ(rooms.leave.count("!e:example.org"), 1);
+
+    // The iteration order depends on the map type selected at build time.
+    std::vector<std::string> ids;
+    for (const auto &[id, room] : rooms.join)
+        ids.push_back(id);
+    std::ranges::sort(ids);
+    EXPECT_EQ(ids,
+              (std::vector<std::string>{"!a:example.org", "!b:example.org", "!c:example.org"}));
+
+    json power_levels = R"({
+      "users": {"@alice:example.org": 100, "@bob:example.org": 50},
+      "events": {"m.room.name": 75}
+    })"_json;
+    auto levels = power_levels.get<mtx::events::state::PowerLevels>();
+    EXPECT_EQ(levels.users.count(std::string_view("@alice:example.org")), 1);
+    EXPECT_EQ(levels.event_level("m.room.name"), 75);
+    EXPECT_EQ(levels.event_level("m.room.topic"), levels.events_default);
+    EXPECT_EQ(levels.state_level("m.room.topic"), levels.state_default);
+}
 
 TEST(Responses, Members)
 {
@@ -1530,7 +1709,7 @@ TEST(Responses, Notifications)
 
     mtx::responses::Notifications notif = data.get<mtx::responses::Notifications>();
 
-    // EXPECT_EQ(notif.next_token, "abcdef");
+    EXPECT_EQ(notif.next_token, "abcdef");
     EXPECT_EQ(notif.notifications.size(), 1);
     EXPECT_EQ(notif.notifications.at(0).profile_tag, "");
     EXPECT_EQ(notif.notifications.at(0).read, true);
@@ -0,0 +1,311 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <mtxclient/http/scheduler.hpp>
+
+#include "test_helpers.hpp"
+
+using namespace mtx::http;
+using namespace std::chrono_literals;
+
+TEST(Scheduler, EndpointClass)
+{
+    EXPECT_EQ(endpoint_class("/client/v3/rooms/%21abc%3Aexample.com/send/m.room.message/txn1"),
+              "rooms/send");
+    EXPECT_EQ(endpoint_class("/client/v3/rooms/!abc:example.com/messages?dir=b"), "rooms/messages");
+    EXPECT_EQ(endpoint_class("/client/v3/sync?timeout=30000"), "sync");
+    EXPECT_EQ(endpoint_class("/client/v3/keys/query"), "keys/query");
+    EXPECT_EQ(endpoint_class("/client/v3/profile/%40alice%3Aexample.com/displayname"),
+              "profile/displayname");
+    EXPECT_EQ(endpoint_class("/client/v1/media/download/example.com/abc"), "media/download");
+    EXPECT_EQ(endpoint_class("/media/v3/upload?filename=a.png"), "media/upload");
+    EXPECT_EQ(endpoint_class("/client/versions"), "versions");
+    EXPECT_EQ(endpoint_class("/client/unstable/org.matrix.simplified_msc3575/sync?pos=1"), "sync");
+    EXPECT_EQ(endpoint_class("/client/unstable/im.nheko.summary/rooms/%21a%3Ab/summary"),
+              "rooms/summary");
+}
+
+TEST(Scheduler, RetryAfterHeader)
+{
+    EXPECT_EQ(parse_retry_after("120"), std::chrono::milliseconds(120'000));
+    EXPECT_EQ(parse_retry_after(" 5 "), std::chrono::milliseconds(5'000));
+    EXPECT_EQ(parse_retry_after("Wed, 21 Oct 2015 07:28:00 GMT"), std::nullopt);
+    EXPECT_EQ(parse_retry_after(""), std::nullopt);
+}
+
+TEST(Scheduler, RetriesRateLimitedRequests)
+{
+    SchedulerOpts opts;
+    opts.default_limit.requests_per_second = 0;
+    opts.max_retries                       = 3;
+    RequestScheduler scheduler(opts);
+
+    std::atomic<int> attempts = 0;
+    std::atomic<bool> done    = false;
+    int delivered_status      = 0;
+
+    scheduler.enqueue("rooms/send", [&](RequestScheduler::Attempt attempt) {
+        // Fail twice, then succeed.
+        int status = ++attempts < 3 ? 429 : 200;
+        if (attempt.finish(status, 10ms)) {
+            delivered_status = status;
+            done             = true;
+        }
+    });
+
+    WAIT_UNTIL(done)
+
+    EXPECT_EQ(attempts, 3);
+    EXPECT_EQ(delivered_status, 200);
+
+    auto stats = scheduler.stats();
+    EXPECT_EQ(stats.classes.at("rooms/send").dispatched, 3);
+    EXPECT_EQ(stats.classes.at("rooms/send").rate_limited, 2);
+    EXPECT_EQ(stats.classes.at("rooms/send").retried, 2);
+    EXPECT_EQ(stats.classes.at("rooms/send").in_flight, 0);
+    EXPECT_EQ(stats.queued(), 0);
+}
+
+TEST(Scheduler, GivesUpAfterMaxRetries)
+{
+    SchedulerOpts opts;
+    opts.default_limit.requests_per_second = 0;
+    opts.max_retries                       = 2;
+    opts.initial_backoff                   = 1ms;
+    RequestScheduler scheduler(opts);
+
+    std::atomic<int> attempts = 0;
+    std::atomic<bool> done    = false;
+
+    scheduler.enqueue("rooms/send", [&](RequestScheduler::Attempt attempt) {
+        attempts++;
+        if (attempt.finish(429, std::nullopt))
+            done = true;
+    });
+
+    WAIT_UNTIL(done)
+
+    EXPECT_EQ(attempts, 3);
+    EXPECT_EQ(scheduler.stats().classes.at("rooms/send").rate_limited, 3);
+}
+
+TEST(Scheduler, PacesRequests)
+{
+    SchedulerOpts opts;
+    opts.default_limit = RateLimit{.requests_per_second = 50, .burst = 2};
+    RequestScheduler scheduler(opts);
+
+    std::atomic<int> completed = 0;
+    auto start                 = std::chrono::steady_clock::now();
+    for (int i = 0; i < 7; i++)
+        scheduler.enqueue("keys/query", [&](RequestScheduler::Attempt attempt) {
+            attempt.finish(200, std::nullopt);
+            completed++;
+        });
+
+    WAIT_UNTIL(completed == 7)
+
+    // Two requests fit into the burst, the other five are paced at 20ms each.
+    EXPECT_GE(std::chrono::steady_clock::now() - start, 90ms);
+    EXPECT_EQ(scheduler.stats().classes.at("keys/query").dispatched, 7);
+}
+
+TEST(Scheduler, RateLimitPausesTheWholeClass)
+{
+    SchedulerOpts opts;
+    opts.default_limit.requests_per_second = 0;
+    RequestScheduler scheduler(opts);
+
+    std::mutex mtx;
+    std::vector<std::string> order;
+    std::atomic<int> completed = 0;
+    std::atomic<bool> limited  = false;
+
+    auto job = [&](std::string name) {
+        return [&, name](RequestScheduler::Attempt attempt) {
+            int status = (name == "first" && !limited.exchange(true)) ? 429 : 200;
+            if (attempt.finish(status, 500ms)) {
+                std::lock_guard lock(mtx);
+                order.push_back(name);
+                completed++;
+            }
+        };
+    };
+
+    scheduler.enqueue("rooms/send", job("first"));
+    WAIT_UNTIL(limited)
+    scheduler.enqueue("rooms/send", job("second"));
+    scheduler.enqueue("sync", job("other class"));
+
+    WAIT_UNTIL(completed == 3)
+
+    // The other class is not blocked, the retry keeps its place in front of the queue.
+    EXPECT_EQ(order, (std::vector<std::string>{"other class", "first", "second"}));
+}
+
+TEST(Scheduler, AttemptsOutliveTheScheduler)
+{
+    RequestScheduler::Attempt kept;
+    std::atomic<bool> started = false;
+    {
+        RequestScheduler scheduler;
+        scheduler.enqueue("sync", [&](RequestScheduler::Attempt attempt) {
+            kept    = std::move(attempt);
+            started = true;
+        });
+        WAIT_UNTIL(started)
+    }
+
+    EXPECT_TRUE(kept.finish(429, std::nullopt));
+}
+
+TEST(Scheduler, UnfinishedAttemptsFreeTheirSlot)
+{
+    SchedulerOpts opts;
+    opts.default_limit.requests_per_second = 0;
+    opts.max_in_flight                     = {0, 0, 1, 1};
+    RequestScheduler scheduler(opts);
+
+    std::mutex mtx;
+    std::optional<RequestScheduler::Attempt> kept;
+    std::atomic<int> started = 0;
+    for (int i = 0; i < 2; i++)
+        scheduler.enqueue("rooms/messages", [&](RequestScheduler::Attempt attempt) {
+            std::lock_guard lock(mtx);
+            kept = std::move(attempt);
+            started++;
+        });
+
+    WAIT_UNTIL(started == 1)
+    EXPECT_EQ(scheduler.stats().queued(RequestPriority::Background), 1);
+
+    // Dropping the request without reporting a result lets the next one start.
+    {
+        std::lock_guard lock(mtx);
+        kept.reset();
+    }
+    WAIT_UNTIL(started == 2)
+    EXPECT_EQ(scheduler.stats().in_flight(RequestPriority::Background), 1);
+    EXPECT_EQ(scheduler.stats().queued(RequestPriority::Background), 0);
+}
+
+TEST(Scheduler, DroppedRequestsAreReported)
+{
+    SchedulerOpts opts;
+    opts.default_limit.requests_per_second = 0;
+    opts.max_in_flight                     = {0, 0, 1, 1};
+    // Practically never sent.
+    opts.class_limits["rooms/messages"] = RateLimit{.requests_per_second = 0.001, .burst = 0};
+
+    std::atomic<int> started = 0, dropped = 0;
+    std::vector<RequestScheduler::Attempt> attempts;
+    {
+        RequestScheduler scheduler(opts);
+        for (int i = 0; i < 3; i++)
+            scheduler.enqueue(
+              "media/download",
+              [&](RequestScheduler::Attempt attempt) {
+                  attempts.push_back(std::move(attempt));
+                  started++;
+              },
+              [&] { dropped++; });
+        WAIT_UNTIL(started == 1)
+
+        scheduler.clear();
+        EXPECT_EQ(dropped, 2);
+
+        scheduler.enqueue(
+          "rooms/messages", [&](RequestScheduler::Attempt) {}, [&] { dropped++; });
+        scheduler.enqueue(
+          "rooms/messages", [&](RequestScheduler::Attempt) {}, [&] { dropped++; });
+    }
+
+    // The destructor drops whatever is still queued.
+    EXPECT_EQ(started, 1);
+    EXPECT_EQ(dropped, 4);
+}
+
+TEST(Scheduler, DefaultPriorities)
+{
+    EXPECT_EQ(default_priority("sync"), RequestPriority::Sync);
+    EXPECT_EQ(default_priority("rooms/send"), RequestPriority::Interactive);
+    EXPECT_EQ(default_priority("rooms/messages"), RequestPriority::Background);
+    EXPECT_EQ(default_priority("room_keys/keys"), RequestPriority::Background);
+    EXPECT_EQ(default_priority("media/thumbnail"), RequestPriority::BulkMedia);
+}
+
+TEST(Scheduler, InteractiveRequestsDontWaitForBackground)
+{
+    SchedulerOpts opts;
+    opts.default_limit.requests_per_second = 0;
+    opts.max_in_flight                     = {0, 0, 2, 1};
+    RequestScheduler scheduler(opts);
+
+    std::mutex mtx;
+    std::vector<RequestScheduler::Attempt> background, media;
+    std::atomic<int> started = 0;
+    for (int i = 0; i < 10; i++) {
+        scheduler.enqueue("rooms/messages", [&](RequestScheduler::Attempt attempt) {
+            std::lock_guard lock(mtx);
+            background.push_back(std::move(attempt));
+            started++;
+        });
+        scheduler.enqueue("media/download", [&](RequestScheduler::Attempt attempt) {
+            std::lock_guard lock(mtx);
+            media.push_back(std::move(attempt));
+            started++;
+        });
+    }
+
+    WAIT_UNTIL(started == 3)
+
+    auto stats = scheduler.stats();
+    EXPECT_EQ(stats.in_flight(RequestPriority::Background), 2);
+    EXPECT_EQ(stats.in_flight(RequestPriority::BulkMedia), 1);
+    EXPECT_EQ(stats.queued(RequestPriority::Background), 8);
+    EXPECT_EQ(stats.queued(RequestPriority::BulkMedia), 9);
+
+    // The caps don't apply to interactive requests, so they are sent right away.
+    auto enqueued = std::chrono::steady_clock::now();
+    std::atomic<bool> sent = false;
+    std::chrono::steady_clock::duration latency{};
+    scheduler.enqueue("rooms/send", [&](RequestScheduler::Attempt attempt) {
+        latency = std::chrono::steady_clock::now() - enqueued;
+        attempt.finish(200, std::nullopt);
+        sent = true;
+    });
+    WAIT_UNTIL(sent)
+    EXPECT_LT(latency, 50ms);
+
+    // Completing a background request frees a slot for the next one.
+    {
+        std::lock_guard lock(mtx);
+        background.front().finish(200, std::nullopt);
+    }
+    WAIT_UNTIL(started == 4)
+    EXPECT_EQ(scheduler.stats().in_flight(RequestPriority::Background), 2);
+    EXPECT_EQ(scheduler.stats().queued(RequestPriority::Background), 7);
+}
+
+TEST(Scheduler, ConfiguredPriorities)
+{
+    SchedulerOpts opts;
+    opts.class_priorities["rooms/send"] = RequestPriority::Background;
+    RequestScheduler scheduler(opts);
+
+    std::atomic<bool> done = false;
+    scheduler.enqueue("rooms/send", [&](RequestScheduler::Attempt attempt) {
+        attempt.finish(200, std::nullopt);
+        done = true;
+    });
+    WAIT_UNTIL(done)
+
+    EXPECT_EQ(scheduler.stats().classes.at("rooms/send").priority, RequestPriority::Background);
+}
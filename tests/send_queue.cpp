@@ -0,0 +1,323 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <mtx/events/collections.hpp>
+#include <mtx/responses/common.hpp>
+#include <mtxclient/http/send_queue.hpp>
+
+#include "test_helpers.hpp"
+
+using namespace mtx::http;
+using namespace std::chrono_literals;
+
+namespace {
+//! Records the sent messages and lets the test decide, when they complete.
+struct FakeServer
+{
+    struct Request
+    {
+        PendingMessage msg;
+        Callback<mtx::responses::EventId> cb;
+    };
+
+    SendQueue::Sender sender()
+    {
+        return [this](const PendingMessage &msg, Callback<mtx::responses::EventId> cb) {
+            std::lock_guard lock(mtx);
+            requests.push_back({msg, std::move(cb)});
+        };
+    }
+
+    //! Completes the oldest request, that is still in flight.
+    void complete(int status_code = 200)
+    {
+        Request req;
+        {
+            std::lock_guard lock(mtx);
+            req = std::move(requests.front());
+            requests.erase(requests.begin());
+        }
+
+        if (status_code == 200) {
+            mtx::responses::EventId id;
+            id.event_id = mtx::identifiers::parse<mtx::identifiers::Event>("$" + req.msg.txn_id);
+            req.cb(id, std::nullopt);
+        } else {
+            ClientError err{};
+            err.status_code = status_code;
+            req.cb({}, err);
+        }
+    }
+
+    std::vector<std::string> in_flight()
+    {
+        std::lock_guard lock(mtx);
+        std::vector<std::string> ids;
+        for (const auto &req : requests)
+            ids.push_back(req.msg.room_id + "/" + req.msg.content.at("body").get<std::string>());
+        return ids;
+    }
+
+    std::mutex mtx;
+    std::vector<Request> requests;
+};
+
+mtx::events::msg::Text
+text(const std::string &body)
+{
+    mtx::events::msg::Text t;
+    t.body = body;
+    return t;
+}
+}
+
+TEST(SendQueue, KeepsOrderPerRoom)
+{
+    FakeServer server;
+    std::vector<std::string> sent;
+    auto on_sent = [&sent](const PendingMessage &msg, const mtx::responses::EventId &, RequestErr) {
+        sent.push_back(msg.room_id + "/" + msg.content.at("body").get<std::string>());
+    };
+    SendQueue queue(server.sender(), {}, on_sent);
+
+    queue.enqueue("!a:example.org", text("1"));
+    queue.enqueue("!a:example.org", text("2"));
+    queue.enqueue("!b:example.org", text("1"));
+    queue.enqueue("!a:example.org", text("3"));
+
+    // One message per room is in flight.
+    EXPECT_EQ(server.in_flight(),
+              (std::vector<std::string>{"!a:example.org/1", "!b:example.org/1"}));
+    EXPECT_EQ(queue.stats().pending, 4);
+    EXPECT_EQ(queue.stats().in_flight, 2);
+
+    server.complete();
+    EXPECT_EQ(server.in_flight(),
+              (std::vector<std::string>{"!b:example.org/1", "!a:example.org/2"}));
+    server.complete();
+    server.complete();
+    server.complete();
+
+    EXPECT_EQ(sent,
+              (std::vector<std::string>{
+                "!a:example.org/1", "!b:example.org/1", "!a:example.org/2", "!a:example.org/3"}));
+    EXPECT_EQ(queue.stats().sent, 4);
+    EXPECT_EQ(queue.stats().pending, 0);
+}
+
+TEST(SendQueue, LimitsRoomsInFlight)
+{
+    FakeServer server;
+    SendQueueOpts opts;
+    opts.max_rooms_in_flight = 1;
+    SendQueue queue(server.sender(), opts);
+
+    queue.enqueue("!a:example.org", text("1"));
+    queue.enqueue("!b:example.org", text("1"));
+    EXPECT_EQ(server.in_flight(), (std::vector<std::string>{"!a:example.org/1"}));
+
+    server.complete();
+    EXPECT_EQ(server.in_flight(), (std::vector<std::string>{"!b:example.org/1"}));
+}
+
+TEST(SendQueue, SharesSlotsBetweenRooms)
+{
+    FakeServer server;
+    SendQueueOpts opts;
+    opts.max_rooms_in_flight = 2;
+    SendQueue queue(server.sender(), opts);
+
+    // The rooms sorting first always have more messages queued.
+    for (const auto *room : {"!a:example.org", "!b:example.org", "!c:example.org"})
+        for (int i = 0; i < 3; i++)
+            queue.enqueue(room, text(std::to_string(i)));
+    EXPECT_EQ(server.in_flight(),
+              (std::vector<std::string>{"!a:example.org/0", "!b:example.org/0"}));
+
+    server.complete();
+    EXPECT_EQ(server.in_flight(),
+              (std::vector<std::string>{"!b:example.org/0", "!c:example.org/0"}));
+    server.complete();
+    EXPECT_EQ(server.in_flight(),
+              (std::vector<std::string>{"!c:example.org/0", "!a:example.org/1"}));
+}
+
+TEST(SendQueue, RetriesTransientErrorsWithTheSameTxnId)
+{
+    FakeServer server;
+    SendQueueOpts opts;
+    opts.initial_backoff = 10ms;
+    SendQueue queue(server.sender(), opts);
+
+    auto txn_id = queue.enqueue("!a:example.org", text("1"));
+    queue.enqueue("!a:example.org", text("2"));
+
+    server.complete(503);
+    EXPECT_EQ(queue.stats().retries, 1);
+
+    WAIT_UNTIL(!server.in_flight().empty())
+    {
+        std::lock_guard lock(server.mtx);
+        EXPECT_EQ(server.requests.front().msg.txn_id, txn_id);
+    }
+    EXPECT_EQ(server.in_flight(), (std::vector<std::string>{"!a:example.org/1"}));
+
+    server.complete();
+    server.complete();
+    EXPECT_EQ(queue.stats().sent, 2);
+}
+
+TEST(SendQueue, DropsMessagesOnPermanentErrors)
+{
+    FakeServer server;
+    std::vector<int> results;
+    auto on_sent =
+      [&results](const PendingMessage &, const mtx::responses::EventId &, RequestErr err) {
+          results.push_back(err ? err->status_code : 200);
+      };
+    SendQueue queue(server.sender(), {}, on_sent);
+
+    queue.enqueue("!a:example.org", text("1"));
+    queue.enqueue("!a:example.org", text("2"));
+
+    server.complete(403);
+    server.complete();
+
+    EXPECT_EQ(results, (std::vector<int>{403, 200}));
+    EXPECT_EQ(queue.stats().failed, 1);
+    EXPECT_EQ(queue.stats().sent, 1);
+}
+
+TEST(SendQueue, ResendsPersistedMessages)
+{
+    auto path = std::filesystem::temp_directory_path() /
+                ("mtxclient_send_queue_" + std::to_string(random_number()) + ".json");
+
+    std::vector<std::string> txn_ids;
+    {
+        FakeServer server;
+        SendQueueOpts opts;
+        opts.store = std::make_shared<FileSendQueueStore>(path);
+        SendQueue queue(server.sender(), opts);
+
+        txn_ids.push_back(queue.enqueue("!a:example.org", text("1")));
+        txn_ids.push_back(queue.enqueue("!a:example.org", text("2")));
+        // Never completed, as if the application was closed.
+    }
+
+    FileSendQueueStore store(path);
+    ASSERT_EQ(store.load().size(), 2);
+
+    FakeServer server;
+    SendQueueOpts opts;
+    opts.store = std::make_shared<FileSendQueueStore>(path);
+    SendQueue queue(server.sender(), opts);
+
+    ASSERT_EQ(queue.pending().size(), 2);
+    EXPECT_EQ(queue.pending()[0].txn_id, txn_ids[0]);
+    EXPECT_EQ(queue.pending()[1].txn_id, txn_ids[1]);
+    EXPECT_EQ(server.in_flight(), (std::vector<std::string>{"!a:example.org/1"}));
+
+    server.complete();
+    server.complete();
+    EXPECT_EQ(queue.stats().sent, 2);
+    EXPECT_TRUE(FileSendQueueStore(path).load().empty());
+
+    std::filesystem::remove(path);
+}
+
+TEST(SendQueue, FileStoreAppendsAndCompacts)
+{
+    auto path = std::filesystem::temp_directory_path() /
+                ("mtxclient_send_queue_" + std::to_string(random_number()) + ".json");
+    auto lines = [&path] {
+        std::ifstream file(path);
+        std::string line;
+        std::size_t count = 0;
+        while (std::getline(file, line))
+            count++;
+        return count;
+    };
+    auto message = [](int i) {
+        return PendingMessage{.room_id = "!a:example.org",
+                              .txn_id  = std::to_string(i),
+                              .type    = "m.room.message",
+                              .content = {{"body", std::to_string(i)}}};
+    };
+
+    {
+        FileSendQueueStore store(path);
+        for (int i = 0; i < 3; i++)
+            store.add(message(i));
+        store.remove("!a:example.org", "1");
+        // One line per change.
+        EXPECT_EQ(lines(), 4);
+    }
+
+    {
+        FileSendQueueStore store(path);
+        auto loaded = store.load();
+        ASSERT_EQ(loaded.size(), 2);
+        EXPECT_EQ(loaded[0].txn_id, "0");
+        EXPECT_EQ(loaded[1].txn_id, "2");
+        EXPECT_EQ(loaded[1].content["body"], "2");
+        // Loading drops the obsolete lines.
+        EXPECT_EQ(lines(), 2);
+
+        // The log is compacted, once most of it is obsolete.
+        for (int i = 3; i < 200; i++) {
+            store.add(message(i));
+            store.remove("!a:example.org", std::to_string(i));
+        }
+        EXPECT_LT(lines(), 150);
+        EXPECT_EQ(store.load().size(), 2);
+    }
+
+    // A line cut off by a crash is skipped.
+    {
+        std::ofstream file(path, std::ios::app);
+        file << R"({"add":{"room_id":"!a:exa)";
+    }
+    EXPECT_EQ(FileSendQueueStore(path).load().size(), 2);
+
+    // The format of older versions is still read.
+    {
+        std::ofstream file(path, std::ios::trunc);
+        file << nlohmann::json(std::vector<PendingMessage>{message(7)}).dump();
+    }
+    {
+        FileSendQueueStore store(path);
+        ASSERT_EQ(store.load().size(), 1);
+        EXPECT_EQ(store.load()[0].txn_id, "7");
+        store.add(message(8));
+    }
+    EXPECT_EQ(FileSendQueueStore(path).load().size(), 2);
+
+    std::filesystem::remove(path);
+}
+
+TEST(SendQueue, Throughput)
+{
+    std::atomic<int> sent = 0;
+    SendQueue queue(
+      [](const PendingMessage &msg, Callback<mtx::responses::EventId> cb) {
+          mtx::responses::EventId id;
+          id.event_id = mtx::identifiers::parse<mtx::identifiers::Event>("$" + msg.txn_id);
+          cb(id, std::nullopt);
+      },
+      {},
+      [&sent](const PendingMessage &, const mtx::responses::EventId &, RequestErr) { sent++; });
+
+    for (int i = 0; i < 1000; i++)
+        queue.enqueue("!" + std::to_string(i % 10) + ":example.org", text(std::to_string(i)));
+
+    EXPECT_EQ(sent, 1000);
+    EXPECT_EQ(queue.stats().sent, 1000);
+    EXPECT_GT(queue.stats().messages_per_second(), 0);
+}
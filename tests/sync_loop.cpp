@@ -0,0 +1,254 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <mtxclient/http/sync_loop.hpp>
+
+#include "test_helpers.hpp"
+
+using namespace mtx::http;
+using namespace std::chrono_literals;
+
+namespace {
+//! Records the sync requests and lets the test decide, when and how they complete.
+struct FakeServer
+{
+    struct Request
+    {
+        std::string since;
+        Callback<std::string> cb;
+    };
+
+    SyncLoop::Syncer syncer()
+    {
+        return [this](const SyncOpts &opts, Callback<std::string> cb) {
+            std::lock_guard lock(mtx);
+            requests.push_back({opts.since, std::move(cb)});
+            total++;
+        };
+    }
+
+    //! Completes the request in flight with a response carrying the given token.
+    void respond(const std::string &next_batch)
+    {
+        respond_raw(R"({"next_batch":")" + next_batch + R"(","rooms":{}})");
+    }
+
+    void respond_raw(const std::string &body) { take().cb(body, std::nullopt); }
+
+    void fail(int status_code)
+    {
+        ClientError err{};
+        err.status_code = status_code;
+        take().cb("", err);
+    }
+
+    Request take()
+    {
+        WAIT_UNTIL(pending() > 0)
+        std::lock_guard lock(mtx);
+        auto req = std::move(requests.front());
+        requests.erase(requests.begin());
+        return req;
+    }
+
+    std::size_t pending()
+    {
+        std::lock_guard lock(mtx);
+        return requests.size();
+    }
+
+    std::string since()
+    {
+        WAIT_UNTIL(pending() > 0)
+        std::lock_guard lock(mtx);
+        return requests.front().since;
+    }
+
+    std::mutex mtx;
+    std::vector<Request> requests;
+    std::atomic<int> total = 0;
+};
+
+//! Blocks the sync callback until released.
+struct Gate
+{
+    void wait()
+    {
+        std::unique_lock lock(mtx);
+        cv.wait(lock, [this] { return open; });
+    }
+    void release()
+    {
+        std::lock_guard lock(mtx);
+        open = true;
+        cv.notify_all();
+    }
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool open = false;
+};
+}
+
+TEST(SyncLoop, FindNextBatch)
+{
+    EXPECT_EQ(find_next_batch(R"({"next_batch": "s72595_4483_1934"})"), "s72595_4483_1934");
+    EXPECT_EQ(find_next_batch(R"({"rooms":{"join":{}},"next_batch" :"abc"})"), "abc");
+    // Nested keys and values, that look like the key, are ignored.
+    EXPECT_EQ(find_next_batch(
+                R"({"rooms":{"next_batch":"wrong"},"x":["next_batch"],"next_batch":"right"})"),
+              "right");
+    EXPECT_EQ(find_next_batch(R"({"a":"next_batch","next_batch":"right"})"), "right");
+    // Escaped quotes don't end a string.
+    EXPECT_EQ(find_next_batch(R"({"a":"\"next_batch\":\"wrong\"","next_batch":"right"})"), "right");
+    EXPECT_EQ(find_next_batch(R"({"next_batch":"a\"b\\c"})"), "a\"b\\c");
+    EXPECT_EQ(find_next_batch(R"({"rooms":{}})"), std::nullopt);
+    EXPECT_EQ(find_next_batch(R"({"next_batch":5})"), std::nullopt);
+    EXPECT_EQ(find_next_batch(R"({"next_batch":"unterminated)"), std::nullopt);
+    EXPECT_EQ(find_next_batch(""), std::nullopt);
+}
+
+TEST(SyncLoop, StartsTheNextSyncBeforeHandlingTheResponse)
+{
+    FakeServer server;
+    Gate gate;
+    std::mutex mtx;
+    std::vector<std::string> handled;
+
+    SyncLoopOpts opts;
+    opts.sync.since = "s0";
+    SyncLoop loop(server.syncer(), opts, [&](const mtx::responses::Sync &res) {
+        gate.wait();
+        std::lock_guard lock(mtx);
+        handled.push_back(res.next_batch);
+    });
+    loop.start();
+
+    EXPECT_EQ(server.since(), "s0");
+    server.respond("s1");
+    // The callback is blocked, but the next sync is already in flight.
+    EXPECT_EQ(server.since(), "s1");
+    server.respond("s2");
+    EXPECT_EQ(server.since(), "s2");
+
+    gate.release();
+    WAIT_UNTIL(loop.stats().syncs == 2)
+
+    {
+        std::lock_guard lock(mtx);
+        EXPECT_EQ(handled, (std::vector<std::string>{"s1", "s2"}));
+    }
+    EXPECT_EQ(loop.next_batch(), "s2");
+    EXPECT_GE(loop.stats().pipelined, 1);
+}
+
+TEST(SyncLoop, LimitsQueuedResponses)
+{
+    FakeServer server;
+    Gate gate;
+
+    SyncLoopOpts opts;
+    opts.max_queued_batches = 1;
+    SyncLoop loop(server.syncer(), opts, [&](const mtx::responses::Sync &) { gate.wait(); });
+    loop.start();
+
+    server.respond("s1"); // handled, blocks the worker
+    WAIT_UNTIL(loop.stats().queued == 0)
+    server.respond("s2"); // queued
+    WAIT_UNTIL(loop.stats().queued == 1)
+
+    std::this_thread::sleep_for(100ms);
+    EXPECT_EQ(server.pending(), 0);
+    EXPECT_EQ(server.total, 2);
+
+    gate.release();
+    EXPECT_EQ(server.since(), "s2");
+}
+
+TEST(SyncLoop, RetriesWithBackoff)
+{
+    FakeServer server;
+    std::atomic<int> errors = 0;
+
+    SyncLoopOpts opts;
+    opts.sync.since     = "s0";
+    opts.initial_backoff = 10ms;
+    SyncLoop loop(
+      server.syncer(),
+      opts,
+      [](const mtx::responses::Sync &) {},
+      [&](RequestErr, const std::string &body) {
+          EXPECT_TRUE(body.empty());
+          errors++;
+      });
+    loop.start();
+
+    server.fail(502);
+    EXPECT_EQ(server.since(), "s0");
+    server.fail(0);
+    EXPECT_EQ(server.since(), "s0");
+    server.respond("s1");
+    EXPECT_EQ(server.since(), "s1");
+
+    EXPECT_EQ(errors, 2);
+    EXPECT_EQ(loop.stats().errors, 2);
+}
+
+TEST(SyncLoop, SkipsUnparsableResponses)
+{
+    const std::string truncated = R"({"next_batch":"s1","rooms":{"join")";
+    FakeServer server;
+    std::atomic<int> errors = 0;
+    std::atomic<int> syncs  = 0;
+
+    SyncLoop loop(
+      server.syncer(),
+      {},
+      [&](const mtx::responses::Sync &) { syncs++; },
+      [&](RequestErr err, const std::string &body) {
+          EXPECT_FALSE(err->parse_error.empty());
+          // The application gets the batch, that is skipped.
+          EXPECT_EQ(body, truncated);
+          errors++;
+      });
+    loop.start();
+
+    // The token can be found, but the rest is cut off.
+    server.respond_raw(truncated);
+    EXPECT_EQ(server.since(), "s1");
+    server.respond("s2");
+
+    WAIT_UNTIL(syncs == 1)
+    EXPECT_EQ(errors, 1);
+    EXPECT_EQ(loop.next_batch(), "s2");
+}
+
+TEST(SyncLoop, StopIgnoresTheRequestInFlight)
+{
+    FakeServer server;
+    std::atomic<int> syncs = 0;
+
+    SyncLoopOpts opts;
+    opts.sync.since = "s0";
+    SyncLoop loop(server.syncer(), opts, [&](const mtx::responses::Sync &) { syncs++; });
+    loop.start();
+
+    server.respond("s1");
+    WAIT_UNTIL(syncs == 1)
+
+    loop.stop();
+    server.respond("s2");
+    std::this_thread::sleep_for(100ms);
+    EXPECT_EQ(syncs, 1);
+    EXPECT_EQ(server.pending(), 0);
+
+    // Restarting continues after the last handled response.
+    loop.start();
+    EXPECT_EQ(server.since(), "s1");
+}